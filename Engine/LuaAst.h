@@ -0,0 +1,420 @@
+﻿#pragma once
+
+#include "LuaState.h"
+
+namespace Engine
+{
+    // 语法树。全部节点从编译期 arena 分配，编译结束后整体回收；
+    // 同一列表中的表达式与语句通过 next 串联，不需要额外的容器
+
+    struct FunctionNode;
+
+    // 局部变量（包括函数参数与 for 循环变量），作用域解析在语法分析时完成
+    struct LocalVar
+    {
+        static constexpr uint32_t NoVreg = UINT32_MAX;
+
+        String* name;
+        FunctionNode* function;                 // 所属函数；内联展开期间临时改为展开处所在的函数
+        LocalVar* next = nullptr;               // 同一条声明（或参数表）中的下一个变量
+        FunctionNode* functionValue = nullptr;  // 初值为函数且之后从不赋值时指向该函数
+        Value constant;                         // hasConstant 为真时为折叠后的常量值
+        int line = 0;
+        uint32_t references = 0;                // 被引用的次数
+        uint32_t escapes = 0;                   // 除直接调用以外被引用的次数
+        int32_t pinned = -1;                    // 流式执行时顶层局部变量固定使用的寄存器
+        uint32_t scope = 0;                     // 声明时在可见变量中的位置（外层函数的变量也计入），goto 据此判断离开了哪些变量的作用域
+        uint32_t vreg = NoVreg;                 // 降级时分配的虚拟寄存器
+        bool assigned = false;                  // 声明之后是否被重新赋值
+        bool hasConstant = false;
+        bool captured = false;                  // 被内层函数引用（语法分析时确定，常量传播与内联后可能不再需要上值）
+        bool isConst = false;                   // <const> 变量，不能赋值
+        bool toClose = false;                   // <close> 变量，离开作用域时调用其值的 __close 元方法
+        bool inlineCandidate = false;           // 延迟编译时初值为保留了语法树的可内联函数，引用它的函数体不延迟编译
+    };
+
+    enum class ExprKind : uint8_t
+    {
+        Constant,   // nil、布尔、数字与字符串字面量
+        Local,      // 局部变量或上值
+        Global,
+        Index,      // t[k] 与 t.k
+        Call,
+        Method,     // t:m(...)
+        Function,
+        Table,
+        Binary,
+        Unary,
+        Vararg,     // ...
+    };
+
+    struct Expr
+    {
+        ExprKind kind;
+        int line;
+        Expr* next = nullptr;
+        bool parenthesized = false;     // 写在括号中，多个值截断为一个
+
+        Expr(ExprKind kind, int line)
+            : kind(kind), line(line)
+        { }
+    };
+
+    struct ConstantExpr : Expr
+    {
+        Value value;
+
+        ConstantExpr(int line, Value value)
+            : Expr(ExprKind::Constant, line), value(value)
+        { }
+    };
+
+    struct LocalExpr : Expr
+    {
+        LocalVar* var;
+
+        LocalExpr(int line, LocalVar* var)
+            : Expr(ExprKind::Local, line), var(var)
+        { }
+    };
+
+    struct GlobalExpr : Expr
+    {
+        String* name;
+
+        GlobalExpr(int line, String* name)
+            : Expr(ExprKind::Global, line), name(name)
+        { }
+    };
+
+    struct IndexExpr : Expr
+    {
+        Expr* object;
+        Expr* key;
+
+        IndexExpr(int line, Expr* object, Expr* key)
+            : Expr(ExprKind::Index, line), object(object), key(key)
+        { }
+    };
+
+    struct CallExpr : Expr
+    {
+        Expr* function;
+        Expr* args;
+        uint32_t argCount;
+
+        CallExpr(int line, Expr* function, Expr* args, uint32_t argCount)
+            : Expr(ExprKind::Call, line), function(function), args(args), argCount(argCount)
+        { }
+    };
+
+    struct MethodExpr : Expr
+    {
+        Expr* object;
+        String* name;
+        Expr* args;
+        uint32_t argCount;
+
+        MethodExpr(int line, Expr* object, String* name, Expr* args, uint32_t argCount)
+            : Expr(ExprKind::Method, line), object(object), name(name), args(args), argCount(argCount)
+        { }
+    };
+
+    struct VarargExpr : Expr
+    {
+        explicit VarargExpr(int line)
+            : Expr(ExprKind::Vararg, line)
+        { }
+    };
+
+    // 产生多个值的表达式：调用与 ...（不在括号中）。
+    // 位于表达式列表（实参、返回值、赋值与表构造器）末尾时展开为全部的值，其他位置只取第一个值
+    inline bool IsMultiValue(const Expr* expr)
+    {
+        return !expr->parenthesized &&
+            (expr->kind == ExprKind::Call || expr->kind == ExprKind::Method || expr->kind == ExprKind::Vararg);
+    }
+
+    struct FunctionExpr : Expr
+    {
+        FunctionNode* function;
+
+        FunctionExpr(int line, FunctionNode* function)
+            : Expr(ExprKind::Function, line), function(function)
+        { }
+    };
+
+    // 表构造器中的一项，key 为 nullptr 表示按位置排列的数组项
+    struct TableItem
+    {
+        Expr* key;
+        Expr* value;
+        TableItem* next = nullptr;
+    };
+
+    struct TableExpr : Expr
+    {
+        TableItem* items;
+        uint32_t arrayCount;
+        uint32_t hashCount;
+
+        TableExpr(int line, TableItem* items, uint32_t arrayCount, uint32_t hashCount)
+            : Expr(ExprKind::Table, line), items(items), arrayCount(arrayCount), hashCount(hashCount)
+        { }
+    };
+
+    enum class BinaryOp : uint8_t
+    {
+        Add, Sub, Mul, Div, Mod, Pow, Idiv,
+        BAnd, BOr, BXor, Shl, Shr,
+        Concat,
+        Eq, Ne, Lt, Le, Gt, Ge,
+        And, Or,    // 短路求值，降级为条件跳转
+    };
+
+    struct BinaryExpr : Expr
+    {
+        BinaryOp op;
+        Expr* left;
+        Expr* right;
+
+        BinaryExpr(int line, BinaryOp op, Expr* left, Expr* right)
+            : Expr(ExprKind::Binary, line), op(op), left(left), right(right)
+        { }
+    };
+
+    enum class UnaryOp : uint8_t
+    {
+        Minus, Not, Len, BNot,
+    };
+
+    struct UnaryExpr : Expr
+    {
+        UnaryOp op;
+        Expr* operand;
+
+        UnaryExpr(int line, UnaryOp op, Expr* operand)
+            : Expr(ExprKind::Unary, line), op(op), operand(operand)
+        { }
+    };
+
+    enum class StatKind : uint8_t
+    {
+        Local,
+        LocalFunction,
+        Assign,
+        Call,
+        Do,
+        While,
+        NumericFor,
+        GenericFor,
+        Return,
+        If,
+        Repeat,
+        Break,
+        Goto,
+        Label,
+    };
+
+    struct Stat
+    {
+        StatKind kind;
+        int line;
+        Stat* next = nullptr;
+
+        Stat(StatKind kind, int line)
+            : kind(kind), line(line)
+        { }
+    };
+
+    struct LocalStat : Stat
+    {
+        LocalVar* vars;
+        Expr* values;
+        uint32_t valueCount;
+
+        LocalStat(int line, LocalVar* vars, Expr* values, uint32_t valueCount)
+            : Stat(StatKind::Local, line), vars(vars), values(values), valueCount(valueCount)
+        { }
+    };
+
+    struct LocalFunctionStat : Stat
+    {
+        LocalVar* var;
+        FunctionNode* function;
+
+        LocalFunctionStat(int line, LocalVar* var, FunctionNode* function)
+            : Stat(StatKind::LocalFunction, line), var(var), function(function)
+        { }
+    };
+
+    // 赋值语句；function t.a:b() 等函数定义语句也表示为赋值
+    struct AssignStat : Stat
+    {
+        Expr* targets;
+        uint32_t targetCount;
+        Expr* values;
+        uint32_t valueCount;
+
+        AssignStat(int line, Expr* targets, uint32_t targetCount, Expr* values, uint32_t valueCount)
+            : Stat(StatKind::Assign, line), targets(targets), targetCount(targetCount), values(values), valueCount(valueCount)
+        { }
+    };
+
+    struct CallStat : Stat
+    {
+        Expr* call;
+
+        CallStat(int line, Expr* call)
+            : Stat(StatKind::Call, line), call(call)
+        { }
+    };
+
+    struct DoStat : Stat
+    {
+        Stat* body;
+
+        DoStat(int line, Stat* body)
+            : Stat(StatKind::Do, line), body(body)
+        { }
+    };
+
+    struct WhileStat : Stat
+    {
+        Expr* condition;
+        Stat* body;
+        int endLine;
+
+        WhileStat(int line, Expr* condition, Stat* body, int endLine)
+            : Stat(StatKind::While, line), condition(condition), body(body), endLine(endLine)
+        { }
+    };
+
+    struct NumericForStat : Stat
+    {
+        LocalVar* var;
+        Expr* start;
+        Expr* limit;
+        Expr* step;     // 省略时为 nullptr
+        Stat* body;
+
+        NumericForStat(int line, LocalVar* var, Expr* start, Expr* limit, Expr* step, Stat* body)
+            : Stat(StatKind::NumericFor, line), var(var), start(start), limit(limit), step(step), body(body)
+        { }
+    };
+
+    // for v1, ..., vn in explist do body end：explist 调整为迭代函数、状态与控制变量三个值
+    struct GenericForStat : Stat
+    {
+        LocalVar* vars;
+        uint32_t varCount;
+        Expr* values;
+        uint32_t valueCount;
+        Stat* body;
+
+        GenericForStat(int line, LocalVar* vars, uint32_t varCount, Expr* values, uint32_t valueCount, Stat* body)
+            : Stat(StatKind::GenericFor, line), vars(vars), varCount(varCount), values(values), valueCount(valueCount), body(body)
+        { }
+    };
+
+    struct ReturnStat : Stat
+    {
+        Expr* values;   // 不返回值时为 nullptr
+        uint32_t valueCount;
+
+        ReturnStat(int line, Expr* values, uint32_t valueCount)
+            : Stat(StatKind::Return, line), values(values), valueCount(valueCount)
+        { }
+    };
+
+    // if 语句的一个分支（if 或 elseif）
+    struct IfClause
+    {
+        Expr* condition;
+        Stat* body;
+        IfClause* next = nullptr;
+    };
+
+    struct IfStat : Stat
+    {
+        IfClause* clauses;
+        Stat* elseBody;     // 没有 else 分支时为 nullptr
+
+        IfStat(int line, IfClause* clauses, Stat* elseBody)
+            : Stat(StatKind::If, line), clauses(clauses), elseBody(elseBody)
+        { }
+    };
+
+    // until 的条件属于循环体的作用域，可以引用循环体中声明的变量
+    struct RepeatStat : Stat
+    {
+        Stat* body;
+        Expr* condition;
+
+        RepeatStat(int line, Stat* body, Expr* condition)
+            : Stat(StatKind::Repeat, line), body(body), condition(condition)
+        { }
+    };
+
+    struct BreakStat : Stat
+    {
+        explicit BreakStat(int line)
+            : Stat(StatKind::Break, line)
+        { }
+    };
+
+    struct LabelStat : Stat
+    {
+        static constexpr uint32_t NoLabel = UINT32_MAX;
+
+        String* name;
+        uint32_t active;                // 标签处可见的局部变量个数；代码块末尾的标签为块开始时的个数
+        uint32_t irLabel = NoLabel;     // 降级时分配的标签编号
+
+        LabelStat(int line, String* name, uint32_t active)
+            : Stat(StatKind::Label, line), name(name), active(active)
+        { }
+    };
+
+    struct GotoStat : Stat
+    {
+        String* name;
+        LabelStat* target = nullptr;    // 语法分析时解析
+
+        GotoStat(int line, String* name)
+            : Stat(StatKind::Goto, line), name(name)
+        { }
+    };
+
+    // 延迟编译的函数：语法分析时只预扫描了函数体（检查语法、解析变量引用），语法树随即丢弃，
+    // 记下函数体在源码中的位置与引用的外层变量，首次调用时再从源码编译
+    struct LazyFunction
+    {
+        String* text;           // 整段源码
+        uint32_t begin;         // 参数表 '(' 的字节偏移
+        uint32_t end;           // 函数体 end 之后的字节偏移
+        int line;               // '(' 的行列号
+        int column;
+        bool method;            // 方法，隐含参数 self
+        uint32_t innerFunctions;    // 函数体中定义的函数个数（含多层嵌套的）
+        LocalVar** freeVars;    // 函数体（含其中定义的函数）引用的外层变量，按首次引用的顺序
+        uint32_t freeCount;
+    };
+
+    struct FunctionNode
+    {
+        FunctionNode* parent;
+        String* name = nullptr;     // function a.b:c 与 local function 定义的函数名
+        LocalVar* params = nullptr;
+        uint32_t paramCount = 0;
+        bool vararg = false;        // 参数表以 ... 结尾；主代码块也是可变参数函数
+        Stat* body = nullptr;
+        int line = 0;               // 定义所在行，主代码块为 0
+        int endLine = 0;
+        uint32_t nodeCount = 0;     // 函数体内的节点个数，用于判断是否适合内联
+        bool hasFunctions = false;  // 函数体内是否定义了其他函数
+        bool inlinable = false;     // 由常量折叠阶段判定
+        uint32_t reservedRegisters = 0; // 流式执行的主函数中，顶层局部变量固定占用的寄存器个数
+        LazyFunction* lazy = nullptr;   // 延迟编译时不为 nullptr，此时 params 与 body 为空
+    };
+}
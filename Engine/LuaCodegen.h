@@ -0,0 +1,524 @@
+﻿#pragma once
+
+#include "LuaState.h"
+#include "LuaMemory.h"
+#include "LuaIR.h"
+#include "LuaFunction.h"
+
+#include <algorithm>
+#include <bit>
+#include <vector>
+
+namespace Engine
+{
+    // 后端：跳转优化、活跃变量分析、线性扫描寄存器分配，以及从 IR 生成字节码。
+    // 每个虚拟寄存器（窗口作为一个整体）的活跃范围取为一个区间：
+    // 第 i 条 IR 指令读取操作数的位置为 2i、写入结果的位置为 2i + 1，
+    // 区间由基本块上的活跃变量数据流分析得到（循环中跨越回边的值覆盖整个循环）
+    class CodeGenerator
+    {
+    public:
+        static constexpr uint32_t MaxRegisters = 65535;
+
+        // allocate 为假时每个虚拟寄存器独占一个实际寄存器（不复用、不合并），用于对比寄存器分配的效果
+        CodeGenerator(Arena& arena, bool allocate)
+            : arena(arena), allocate(allocate)
+        { }
+
+        // 将 ir 生成为 proto 的字节码；ir 中子函数原型的上值描述同时被改写为实际寄存器。
+        // 中间数据从 arena 分配，由调用方在整个函数编译完成后一并回收
+        void Generate(IrFunction& ir, Proto& proto)
+        {
+            ThreadJumps(ir);
+            ComputeIntervals(ir);
+            AllocateRegisters(ir);
+            Emit(ir, proto);
+        }
+
+    private:
+        template <typename T>
+        using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+        static constexpr uint32_t None = UINT32_MAX;
+
+        struct BasicBlock
+        {
+            uint32_t first;     // 第一条 IR 指令
+            uint32_t last;      // 最后一条 IR 指令（含）
+            uint32_t successors[2];
+        };
+
+        Arena& arena;
+        bool allocate;
+
+        ArenaVector<uint32_t> start{ arena };     // 各虚拟寄存器活跃区间的起止位置
+        ArenaVector<uint32_t> end{ arena };
+        ArenaVector<uint32_t> phys{ arena };      // 各虚拟寄存器的实际寄存器
+        uint32_t registerCount = 0;
+
+        static bool EndsBlock(const IrInstr& instr)
+        {
+            if (instr.kind != IrKind::Op)
+                return false;
+            switch (instr.op)
+            {
+            case OpCode::Jmp:
+            case OpCode::Test:
+            case OpCode::ForPrep:
+            case OpCode::ForLoop:
+            case OpCode::TForLoop:
+            case OpCode::MetaTest:
+            case OpCode::Return:
+                return true;
+            default:
+                return IsCompareJump(instr.op);
+            }
+        }
+
+        // 不生成代码、跳转时可以越过的标记
+        static bool Transparent(const IrInstr& instr)
+        {
+            return instr.kind != IrKind::Op && instr.kind != IrKind::Keep;
+        }
+
+        // 跳转优化：目标标签处紧接着一条 Jmp 时直接跳到它的目标（沿跳转链取终点），
+        // 如 break 跳到的循环出口后面是外层 if 的 Jmp；跳到紧随其后的标签的 Jmp 删除
+        void ThreadJumps(IrFunction& ir)
+        {
+            const uint32_t count = static_cast<uint32_t>(ir.code.size());
+            ArenaVector<uint32_t> labelAt(ir.labelCount, None, arena);
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                if (ir.code[i].kind == IrKind::Label)
+                    labelAt[ir.code[i].a] = i;
+            }
+
+            // 标签之后的第一条指令；跳转链成环时（goto 构成的死循环）在绕回之前停下
+            auto finalLabel = [&](uint32_t label) {
+                for (uint32_t hops = 0; hops < ir.labelCount; ++hops)
+                {
+                    uint32_t i = labelAt[label];
+                    while (i < count && Transparent(ir.code[i]))
+                        ++i;
+                    if (i >= count || ir.code[i].kind != IrKind::Op || ir.code[i].op != OpCode::Jmp || ir.code[i].a == label)
+                        break;
+                    label = ir.code[i].a;
+                }
+                return label;
+            };
+
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                IrInstr& instr = ir.code[i];
+                if (instr.kind != IrKind::Op)
+                    continue;
+                if (uint32_t* target = JumpTarget(instr))
+                    *target = finalLabel(*target);
+                if (instr.op != OpCode::Jmp)
+                    continue;
+                for (uint32_t j = i + 1; j < count && Transparent(ir.code[j]); ++j)
+                {
+                    if (ir.code[j].kind == IrKind::Label && ir.code[j].a == instr.a)
+                    {
+                        instr.kind = IrKind::Nop;
+                        break;
+                    }
+                }
+            }
+        }
+
+        void ComputeIntervals(IrFunction& ir)
+        {
+            const uint32_t vregCount = static_cast<uint32_t>(ir.vregs.size());
+            const uint32_t count = static_cast<uint32_t>(ir.code.size());
+            start.assign(vregCount, None);
+            end.assign(vregCount, 0);
+
+            // 划分基本块
+            ArenaVector<BasicBlock> blocks(arena);
+            ArenaVector<uint32_t> labelBlock(ir.labelCount, None, arena);
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                const IrInstr& instr = ir.code[i];
+                bool leader = blocks.empty() || instr.kind == IrKind::Label || EndsBlock(ir.code[i - 1]);
+                if (leader)
+                {
+                    if (!blocks.empty())
+                        blocks.back().last = i - 1;
+                    blocks.push_back({ i, i, { None, None } });
+                }
+                if (instr.kind == IrKind::Label)
+                    labelBlock[instr.a] = static_cast<uint32_t>(blocks.size() - 1);
+            }
+            if (blocks.empty())
+                return;
+            blocks.back().last = count - 1;
+
+            for (uint32_t b = 0; b < blocks.size(); ++b)
+            {
+                IrInstr& last = ir.code[blocks[b].last];
+                uint32_t next = b + 1 < blocks.size() ? b + 1 : None;
+                uint32_t* target = last.kind == IrKind::Op ? JumpTarget(last) : nullptr;
+                if (last.kind == IrKind::Op && last.op == OpCode::Return)
+                    next = None;
+                else if (last.kind == IrKind::Op && last.op == OpCode::Jmp)
+                    next = None;
+                blocks[b].successors[0] = next;
+                blocks[b].successors[1] = target ? labelBlock[*target] : None;
+            }
+
+            // 各块的 gen（先读后写）与 kill（写入）集合，以及块间的活跃变量数据流
+            const size_t words = (vregCount + 63) / 64;
+            ArenaVector<uint64_t> gen(blocks.size() * words, 0, arena);
+            ArenaVector<uint64_t> kill(blocks.size() * words, 0, arena);
+            ArenaVector<uint64_t> liveIn(blocks.size() * words, 0, arena);
+            ArenaVector<uint64_t> liveOut(blocks.size() * words, 0, arena);
+            auto test = [](const ArenaVector<uint64_t>& set, size_t base, uint32_t v) {
+                return (set[base + v / 64] >> (v % 64)) & 1;
+            };
+            auto put = [](ArenaVector<uint64_t>& set, size_t base, uint32_t v) {
+                set[base + v / 64] |= uint64_t(1) << (v % 64);
+            };
+
+            for (uint32_t b = 0; b < blocks.size(); ++b)
+            {
+                size_t base = b * words;
+                for (uint32_t i = blocks[b].first; i <= blocks[b].last; ++i)
+                {
+                    ForEachOperand(ir.code[i],
+                        [&](uint32_t v) { if (!test(kill, base, v)) put(gen, base, v); Extend(v, 2 * i); },
+                        [&](uint32_t v) { put(kill, base, v); Extend(v, 2 * i + 1); });
+                }
+            }
+
+            bool changed = true;
+            while (changed)
+            {
+                changed = false;
+                for (size_t b = blocks.size(); b-- > 0;)
+                {
+                    size_t base = b * words;
+                    for (size_t w = 0; w < words; ++w)
+                    {
+                        uint64_t out = 0;
+                        for (uint32_t s : blocks[b].successors)
+                        {
+                            if (s != None)
+                                out |= liveIn[s * words + w];
+                        }
+                        uint64_t in = gen[base + w] | (out & ~kill[base + w]);
+                        if (out != liveOut[base + w] || in != liveIn[base + w])
+                        {
+                            liveOut[base + w] = out;
+                            liveIn[base + w] = in;
+                            changed = true;
+                        }
+                    }
+                }
+            }
+
+            // 在块入口活跃的值从块首开始存活，在块出口活跃的值一直存活到块尾
+            for (uint32_t b = 0; b < blocks.size(); ++b)
+            {
+                size_t base = b * words;
+                for (size_t w = 0; w < words; ++w)
+                {
+                    for (uint64_t bits = liveIn[base + w]; bits != 0; bits &= bits - 1)
+                        Extend(static_cast<uint32_t>(w * 64 + std::countr_zero(bits)), 2 * blocks[b].first);
+                    for (uint64_t bits = liveOut[base + w]; bits != 0; bits &= bits - 1)
+                        Extend(static_cast<uint32_t>(w * 64 + std::countr_zero(bits)), 2 * blocks[b].last + 1);
+                }
+            }
+        }
+
+        void Extend(uint32_t v, uint32_t position)
+        {
+            if (start[v] == None || position < start[v])
+                start[v] = position;
+            if (position > end[v])
+                end[v] = position;
+        }
+
+        struct Unit
+        {
+            uint32_t vreg;
+            uint32_t width;
+            uint32_t start;
+            uint32_t end;
+        };
+
+        void AllocateRegisters(IrFunction& ir)
+        {
+            const uint32_t vregCount = static_cast<uint32_t>(ir.vregs.size());
+            phys.assign(vregCount, None);
+            registerCount = ir.fixedRegisters;
+
+            // 窗口作为一个整体分配，区间取各成员区间的并
+            ArenaVector<Unit> units(arena);
+            for (uint32_t v = 0; v < vregCount; ++v)
+            {
+                const VregInfo& info = ir.vregs[v];
+                if (info.fixed >= 0)
+                {
+                    phys[v] = static_cast<uint32_t>(info.fixed);
+                    continue;
+                }
+                if (info.window != VregInfo::NoWindow && info.window != v)
+                    continue;
+                uint32_t width = info.window == v ? info.windowSize : 1;
+                Unit unit{ v, width, None, 0 };
+                for (uint32_t m = v; m < v + width; ++m)
+                {
+                    if (start[m] == None)
+                        continue;
+                    unit.start = std::min(unit.start, start[m]);
+                    unit.end = std::max(unit.end, end[m]);
+                }
+                if (unit.start != None)
+                    units.push_back(unit);
+            }
+            std::stable_sort(units.begin(), units.end(), [](const Unit& x, const Unit& y) { return x.start < y.start; });
+
+            if (!allocate)
+            {
+                for (const Unit& unit : units)
+                {
+                    Assign(unit, registerCount);
+                }
+                return;
+            }
+
+            // 被调函数的帧从调用窗口的第二个寄存器开始，覆盖其上的全部寄存器，
+            // 因此调用窗口必须位于调用时仍然活跃的所有寄存器之上；
+            // 个数不固定的返回值与多余参数同样写到窗口之外直到 top，所在的窗口（如 Return、SetList 的窗口）也是如此
+            ArenaVector<uint8_t> callBase(vregCount, 0, arena);
+            for (const IrInstr& instr : ir.code)
+            {
+                if (instr.kind == IrKind::Op &&
+                    (instr.op == OpCode::Call || (instr.op == OpCode::VarArg && instr.b == MultipleValues)))
+                {
+                    uint32_t window = ir.vregs[instr.a].window;
+                    callBase[window != VregInfo::NoWindow ? window : instr.a] = 1;
+                }
+            }
+
+            ArenaVector<uint8_t> busy(arena);
+            ArenaVector<Unit> active(arena);
+            for (const Unit& unit : units)
+            {
+                // 释放在本区间开始前已经结束的区间占用的寄存器
+                for (size_t i = 0; i < active.size();)
+                {
+                    if (active[i].end < unit.start)
+                    {
+                        uint32_t reg = phys[active[i].vreg];
+                        std::fill(busy.begin() + reg, busy.begin() + reg + active[i].width, 0);
+                        active[i] = active.back();
+                        active.pop_back();
+                    }
+                    else
+                    {
+                        ++i;
+                    }
+                }
+
+                uint32_t reg;
+                if (callBase[unit.vreg])
+                {
+                    reg = ir.fixedRegisters;
+                    for (const Unit& other : active)
+                        reg = std::max(reg, phys[other.vreg] + other.width);
+                }
+                else
+                {
+                    reg = Hint(ir, unit, busy);
+                    if (reg == None)
+                        reg = FindFree(busy, unit.width, ir.fixedRegisters);
+                }
+                if (busy.size() < reg + unit.width)
+                    busy.resize(reg + unit.width, 0);
+                std::fill(busy.begin() + reg, busy.begin() + reg + unit.width, 1);
+                Assign(unit, reg);
+                active.push_back(unit);
+            }
+        }
+
+        void Assign(const Unit& unit, uint32_t reg)
+        {
+            if (reg + unit.width > MaxRegisters)
+                throw std::runtime_error("函数需要的寄存器超过上限");
+            for (uint32_t i = 0; i < unit.width; ++i)
+                phys[unit.vreg + i] = reg + i;
+            registerCount = std::max(registerCount, reg + unit.width);
+        }
+
+        // 区间起点是一条 Move 且源寄存器恰好在此结束时，沿用源寄存器，使 Move 成为可删除的空操作
+        uint32_t Hint(const IrFunction& ir, const Unit& unit, const ArenaVector<uint8_t>& busy) const
+        {
+            if (unit.width != 1 || unit.start % 2 == 0)
+                return None;
+            const IrInstr& instr = ir.code[unit.start / 2];
+            if (instr.kind != IrKind::Op || instr.op != OpCode::Move || instr.a != unit.vreg)
+                return None;
+            uint32_t source = instr.b;
+            uint32_t reg = phys[source];
+            if (reg == None || end[source] != unit.start - 1 || ir.vregs[source].fixed >= 0)
+                return None;
+            if (reg < busy.size() && busy[reg])
+                return None;
+            return reg;
+        }
+
+        static uint32_t FindFree(const ArenaVector<uint8_t>& busy, uint32_t width, uint32_t first)
+        {
+            uint32_t reg = first;
+            while (true)
+            {
+                uint32_t i = 0;
+                while (i < width && reg + i < busy.size() && !busy[reg + i])
+                    ++i;
+                if (i == width || reg + i >= busy.size())
+                    return reg;
+                reg += i + 1;
+            }
+        }
+
+        uint32_t Map(uint32_t operand) const
+        {
+            return IsConstant(operand) ? operand : phys[operand];
+        }
+
+        void Emit(IrFunction& ir, Proto& proto)
+        {
+            const uint32_t count = static_cast<uint32_t>(ir.code.size());
+            ArenaVector<uint32_t> labelPc(ir.labelCount, 0, arena);
+            ArenaVector<uint32_t> pcAt(count + 1, 0, arena);
+            ArenaVector<uint32_t> inlineStart(ir.inlines.size(), 0, arena);
+            ArenaVector<uint32_t> inlineEnd(ir.inlines.size(), 0, arena);
+            const uint32_t first = static_cast<uint32_t>(proto.code.size());
+
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                IrInstr& instr = ir.code[i];
+                uint32_t pc = static_cast<uint32_t>(proto.code.size());
+                pcAt[i] = pc;
+                switch (instr.kind)
+                {
+                case IrKind::Label:
+                    labelPc[instr.a] = pc;
+                    break;
+                case IrKind::Op:
+                    EmitOp(instr, proto);
+                    break;
+                case IrKind::InlineBegin:
+                    inlineStart[instr.a] = pc;
+                    break;
+                case IrKind::InlineEnd:
+                    inlineEnd[instr.a] = pc;
+                    break;
+                default:
+                    break;
+                }
+            }
+            pcAt[count] = static_cast<uint32_t>(proto.code.size());
+
+            // 内联展开的范围按 InlineBegin 的顺序记录，嵌套时外层在前；没有生成指令的展开不会出错，不必记录
+            for (size_t i = 0; i < ir.inlines.size(); ++i)
+            {
+                const IrInline& expansion = ir.inlines[i];
+                if (inlineStart[i] < inlineEnd[i])
+                    proto.inlines.push_back({ expansion.name, inlineStart[i], inlineEnd[i], expansion.line, expansion.upvalue });
+            }
+
+            // 标签编号替换为指令位置
+            for (size_t pc = first; pc < proto.code.size(); ++pc)
+            {
+                Operation& op = proto.code[pc];
+                switch (op.opCode)
+                {
+                case OpCode::Jmp:
+                    op.args[0] = labelPc[op.args[0]];
+                    break;
+                case OpCode::Test:
+                case OpCode::ForPrep:
+                case OpCode::ForLoop:
+                case OpCode::TForLoop:
+                case OpCode::MetaTest:
+                    op.args[1] = labelPc[op.args[1]];
+                    break;
+                default:
+                    if (IsCompareJump(op.opCode))
+                        op.args[2] = labelPc[op.args[2]];
+                    break;
+                }
+            }
+
+            // 局部变量的调试信息：范围截止到变量最后一次被使用，之后寄存器可能已被复用。
+            // VarName 没有作用域，以所在的最内层内联展开的结束处为界
+            ArenaVector<uint32_t> expansions(arena);
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                const IrInstr& instr = ir.code[i];
+                if (instr.kind == IrKind::InlineBegin)
+                    expansions.push_back(instr.a);
+                else if (instr.kind == IrKind::InlineEnd)
+                    expansions.pop_back();
+                if (instr.kind != IrKind::VarBegin && instr.kind != IrKind::VarName)
+                    continue;
+                uint32_t v = instr.a;
+                uint32_t scopePc;
+                if (instr.kind == IrKind::VarName)
+                {
+                    scopePc = expansions.empty() ? pcAt[count] : inlineEnd[expansions.back()];
+                }
+                else
+                {
+                    uint32_t scopeEnd = i;
+                    while (scopeEnd < count && !(ir.code[scopeEnd].kind == IrKind::VarEnd && ir.code[scopeEnd].a == v))
+                        ++scopeEnd;
+                    scopePc = pcAt[scopeEnd];
+                }
+                if (start[v] == None || phys[v] == None)
+                    continue;
+                uint32_t lastUse = end[v] / 2;
+                uint32_t startPc = pcAt[i];
+                uint32_t endPc = std::min(scopePc, lastUse < count ? pcAt[lastUse] + 1 : pcAt[count]);
+                if (startPc < endPc)
+                    proto.locals.push_back({ ir.vars[instr.b]->name, startPc, endPc, phys[v] });
+            }
+
+            proto.maxStack = std::max(registerCount, ir.fixedRegisters);
+        }
+
+        void EmitOp(const IrInstr& instr, Proto& proto)
+        {
+            RegisterFields fields = RegisterFieldsOf(instr.op);
+            uint32_t a = instr.a, b = instr.b, c = instr.c;
+            if (instr.op == OpCode::Return && b == 0)
+                fields.a = false;
+            if (fields.a)
+                a = Map(a);
+            if (fields.b)
+                b = Map(b);
+            if (fields.c)
+                c = Map(c);
+
+            // 寄存器合并后源与目标相同的 Move 不再需要
+            if (instr.op == OpCode::Move && a == b)
+                return;
+
+            // 子函数按实际寄存器引用本函数的局部变量
+            if (instr.op == OpCode::Closure)
+            {
+                for (UpvalueDesc& desc : proto.protos[instr.b]->upvalues)
+                {
+                    if (desc.inStack)
+                        desc.index = phys[desc.index];
+                }
+            }
+
+            proto.code.push_back(Operation(instr.op, a, b, c));
+            proto.lineInfo.Add(instr.line);
+        }
+    };
+}
@@ -0,0 +1,1398 @@
+﻿#pragma once
+
+#include "LuaState.h"
+#include "LuaHeap.h"
+#include "LuaAst.h"
+#include "LuaIR.h"
+#include "LuaOptimizer.h"
+#include "LuaCodegen.h"
+
+#include <bit>
+#include <span>
+#include <vector>
+
+namespace Engine
+{
+    // 编译驱动：语法树先做常量折叠与常量传播，再逐个函数降级为 IR（可内联的调用在此时展开），
+    // 然后做循环不变量外提，最后经寄存器分配生成字节码。
+    // IR 从编译期 arena 分配，整个代码块编译完毕后一并回收；子函数在父函数降级的过程中编译，
+    // 期间父函数的 IR 仍可能增长（新的上值、流式执行的顶层变量），因此不能按函数回收。
+    // 寄存器分配的中间数据只在生成一个函数的字节码时使用，生成完即回收。
+    // 延迟编译的函数在父函数中只确定上值，首次调用时再由 CompileLazy 单独编译
+    class Compiler
+    {
+    public:
+        Compiler(Heap& heap, const CompileOptions& options)
+            : heap(heap), arena(heap.CompileArena()), options(options)
+        { }
+
+        // 将主函数 main 编译到 target（原有内容被清空，已分配的容量保留）
+        void Compile(FunctionNode* main, Proto& target, String* source)
+        {
+            Arena::Scope scope(arena);
+            ConstantFolder(heap, arena, options).FoldFunction(main);
+            target.Clear();
+            this->source = source;
+            LowerFunction(main, target);
+        }
+
+        // 编译延迟编译的函数 node 到 target。target 的上值在创建闭包时已经确定，
+        // upvalues[i] 为函数体中代表第 i 个上值的变量
+        void CompileLazy(FunctionNode* node, Proto& target, String* source, std::span<LocalVar* const> upvalues)
+        {
+            Arena::Scope scope(arena);
+            ConstantFolder(heap, arena, options).FoldFunction(node);
+            this->source = source;
+            LowerFunction(node, target, upvalues);
+        }
+
+    private:
+        template <typename T>
+        using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+        static constexpr uint32_t NoTarget = UINT32_MAX;   // 只求值、丢弃结果
+        static constexpr uint32_t FieldsPerFlush = 50;     // 表构造器每条 SetList 写入的数组项数
+
+        // break 的目标：循环出口的标签，以及循环开始时 active 的大小
+        struct LoopExit
+        {
+            uint32_t label;
+            size_t active;
+        };
+
+        // 正在降级的函数
+        struct FunctionState
+        {
+            FunctionState(FunctionNode* node, FunctionState* parent, Proto& proto, Arena& arena)
+                : node(node), parent(parent), proto(proto), ir(arena), upvalues(arena), active(arena), loops(arena), labels(arena)
+            { }
+
+            FunctionNode* node;
+            FunctionState* parent;
+            Proto& proto;
+            IrFunction ir;
+            ArenaVector<LocalVar*> upvalues;    // 第 i 个上值引用的变量
+            ArenaVector<LocalVar*> active;      // 当前可见、占用寄存器的局部变量
+            ArenaVector<LoopExit> loops;        // 正在降级的循环，内层在后
+            ArenaVector<LabelStat*> labels;     // 已分配标签编号的 goto 标签
+            uint32_t expanding = 0;             // 正在展开的内联调用的层数
+        };
+
+        // 多重赋值中一个赋值目标已求值的部分
+        struct PendingStore
+        {
+            Expr* target;
+            uint32_t object;
+            uint32_t key;
+            uint32_t value;
+        };
+
+        Heap& heap;
+        Arena& arena;
+        const CompileOptions& options;
+        String* source = nullptr;
+        FunctionState* fs = nullptr;
+
+        void LowerFunction(FunctionNode* node, Proto& proto, std::span<LocalVar* const> upvalues = {})
+        {
+            FunctionState state(node, fs, proto, arena);
+            state.upvalues.assign(upvalues.begin(), upvalues.end());
+            fs = &state;
+
+            proto.source = source;
+            proto.name = node->name;
+            proto.lineDefined = node->line;
+            proto.numParams = node->paramCount;
+            proto.vararg = node->vararg;
+            state.ir.fixedRegisters = std::max(node->paramCount, node->reservedRegisters);
+
+            int32_t index = 0;
+            for (LocalVar* param = node->params; param != nullptr; param = param->next)
+            {
+                param->vreg = state.ir.NewVreg();
+                state.ir.vregs[param->vreg].fixed = index++;
+                Activate(param);
+            }
+
+            LowerStats(node->body);
+            // 被捕获的变量一直存活到函数返回，由 Return 关闭其上值
+            EndScope(0, true);
+            Emit(OpCode::Return, 0, 0, 0, node->endLine);
+
+            // 同一个函数可能被降级不止一次（while 的条件中的函数），标签编号只在这一次中有效
+            for (LabelStat* label : state.labels)
+                label->irLabel = LabelStat::NoLabel;
+
+            if (options.hoisting)
+                LoopInvariantHoister(arena).Run(state.ir);
+            {
+                Arena::Scope scope(arena);
+                CodeGenerator(arena, options.registerAllocation).Generate(state.ir, proto);
+            }
+
+            fs = state.parent;
+        }
+
+        uint32_t LowerChild(FunctionNode* node)
+        {
+            Proto* child = heap.NewProto();
+            uint32_t index = static_cast<uint32_t>(fs->proto.protos.size());
+            fs->proto.protos.push_back(child);
+            if (node->lazy != nullptr)
+                DeferFunction(node, *child);
+            else
+                LowerFunction(node, *child);
+            return index;
+        }
+
+        // 延迟编译的函数此时只确定上值：函数体引用的外层变量与立即编译时一样建立上值，
+        // 被常量传播的变量改为记下常量，编译时代入
+        void DeferFunction(FunctionNode* node, Proto& proto)
+        {
+            const LazyFunction& lazy = *node->lazy;
+            proto.source = source;
+            proto.name = node->name;
+            proto.lineDefined = node->line;
+            proto.numParams = node->paramCount;
+            proto.vararg = node->vararg;
+            proto.lazy = { lazy.text, lazy.begin, lazy.end, lazy.line, lazy.column, lazy.method, true, lazy.innerFunctions, true };
+            for (uint32_t i = 0; i < lazy.freeCount; ++i)
+            {
+                LocalVar* var = lazy.freeVars[i];
+                if (var->hasConstant)
+                    proto.lazyConstants.push_back({ var->name, var->constant });
+                else
+                    proto.upvalues.push_back(Capture(*fs, var));
+            }
+        }
+
+        void Emit(OpCode op, uint32_t a, uint32_t b, uint32_t c, int line)
+        {
+            fs->ir.code.push_back({ IrKind::Op, op, a, b, c, line });
+        }
+
+        void Mark(IrKind kind, uint32_t a, uint32_t b = 0)
+        {
+            fs->ir.code.push_back({ kind, OpCode::Move, a, b, 0, 0 });
+        }
+
+        // 变量进入作用域
+        void Activate(LocalVar* var)
+        {
+            fs->active.push_back(var);
+            fs->ir.vars.push_back(var);
+            Mark(IrKind::VarBegin, var->vreg, static_cast<uint32_t>(fs->ir.vars.size() - 1));
+        }
+
+        // 寄存器 vreg 此后保存变量 var 的值，但 var 并不占用它（见 IrKind::VarName）
+        void Name(uint32_t vreg, LocalVar* var)
+        {
+            fs->ir.vars.push_back(var);
+            Mark(IrKind::VarName, vreg, static_cast<uint32_t>(fs->ir.vars.size() - 1));
+        }
+
+        // 离开作用域：被捕获的变量与待关闭变量在块尾关闭（函数最外层改为保持存活到返回）
+        void EndScope(size_t mark, bool functionScope)
+        {
+            while (fs->active.size() > mark)
+            {
+                LocalVar* var = fs->active.back();
+                fs->active.pop_back();
+                // 流式执行的顶层变量在各批之间保持打开，由虚拟机在整个输入执行完后关闭
+                if (fs->ir.vregs[var->vreg].captured && var->pinned < 0)
+                {
+                    if (functionScope)
+                        Mark(IrKind::Keep, var->vreg);
+                    else
+                        Emit(OpCode::Close, var->vreg, 0, 0, var->line);
+                }
+                Mark(IrKind::VarEnd, var->vreg);
+            }
+        }
+
+        // 为新声明的变量分配虚拟寄存器
+        uint32_t NewVarVreg(FunctionState& state, LocalVar* var)
+        {
+            var->vreg = state.ir.NewVreg();
+            if (var->pinned >= 0)
+                state.ir.vregs[var->vreg].fixed = var->pinned;
+            return var->vreg;
+        }
+
+        // 流式执行中，之前各批声明的顶层变量在本批首次被引用时才分配（固定的）虚拟寄存器
+        uint32_t VregOf(FunctionState& state, LocalVar* var)
+        {
+            if (var->vreg == LocalVar::NoVreg)
+                return NewVarVreg(state, var);
+            return var->vreg;
+        }
+
+        bool IsLocal(const LocalVar* var) const
+        {
+            return var->function == fs->node;
+        }
+
+        // 变量在 state 对应函数中的上值下标，沿外层函数逐级建立上值
+        uint32_t UpvalueIndex(FunctionState& state, LocalVar* var)
+        {
+            for (size_t i = 0; i < state.upvalues.size(); ++i)
+            {
+                if (state.upvalues[i] == var)
+                    return static_cast<uint32_t>(i);
+            }
+
+            state.proto.upvalues.push_back(Capture(*state.parent, var));
+            state.upvalues.push_back(var);
+            return static_cast<uint32_t>(state.upvalues.size() - 1);
+        }
+
+        // parent 的子函数引用变量 var 时的上值描述
+        UpvalueDesc Capture(FunctionState& parent, LocalVar* var)
+        {
+            UpvalueDesc desc{ var->name, false, 0 };
+            if (var->function == parent.node)
+            {
+                // 暂存外层函数的虚拟寄存器，外层函数生成字节码时改写为实际寄存器
+                desc.inStack = true;
+                desc.index = VregOf(parent, var);
+                parent.ir.vregs[desc.index].captured = true;
+            }
+            else
+            {
+                desc.index = UpvalueIndex(parent, var);
+            }
+            return desc;
+        }
+
+        // 常量表中的下标；数字按位比较，0.0 与 -0.0 是不同的常量
+        uint32_t AddConstant(const Value& value)
+        {
+            auto& constants = fs->proto.constants;
+            for (size_t i = 0; i < constants.size(); ++i)
+            {
+                const Value& k = constants[i];
+                if (k.IsNumber() && value.IsNumber()
+                    ? std::bit_cast<uint64_t>(*std::get_if<double>(&k.value)) == std::bit_cast<uint64_t>(*std::get_if<double>(&value.value))
+                    : k == value)
+                {
+                    return static_cast<uint32_t>(i);
+                }
+            }
+            if (constants.size() >= ConstantBit)
+                throw std::runtime_error("常量表溢出");
+            constants.push_back(value);
+            return static_cast<uint32_t>(constants.size() - 1);
+        }
+
+        void LoadConstant(const Value& value, uint32_t target, int line)
+        {
+            switch (value.Type())
+            {
+            case ValueType::Nil:
+                Emit(OpCode::LoadNil, target, 0, 0, line);
+                break;
+            case ValueType::Boolean:
+                Emit(OpCode::LoadBool, target, std::get<bool>(value.value) ? 1 : 0, 0, line);
+                break;
+            default:
+                Emit(OpCode::LoadK, target, AddConstant(value), 0, line);
+                break;
+            }
+        }
+
+        // 被直接调用且可内联的局部函数，其余情况返回 nullptr
+        FunctionNode* InlineTarget(const CallExpr* call) const
+        {
+            if (!options.inlining || call->function->kind != ExprKind::Local)
+                return nullptr;
+            FunctionNode* function = static_cast<LocalExpr*>(call->function)->var->functionValue;
+            return function != nullptr && function->inlinable ? function : nullptr;
+        }
+
+        // 全部调用都已内联、没有其他引用的局部函数不需要创建闭包
+        bool ClosureUnneeded(const LocalVar* var, const FunctionNode* function) const
+        {
+            return options.inlining && function->inlinable && var->functionValue == function && var->escapes == 0;
+        }
+
+        static bool IsFieldKey(const Expr* key)
+        {
+            return key->kind == ExprKind::Constant && std::holds_alternative<String*>(static_cast<const ConstantExpr*>(key)->value.value);
+        }
+
+        // 表达式的值求到指定的寄存器中
+        void ExprToReg(Expr* expr, uint32_t target)
+        {
+            switch (expr->kind)
+            {
+            case ExprKind::Constant:
+                LoadConstant(static_cast<ConstantExpr*>(expr)->value, target, expr->line);
+                break;
+            case ExprKind::Local:
+            {
+                LocalVar* var = static_cast<LocalExpr*>(expr)->var;
+                if (var->hasConstant)
+                    LoadConstant(var->constant, target, expr->line);
+                else if (IsLocal(var))
+                    Emit(OpCode::Move, target, VregOf(*fs, var), 0, expr->line);
+                else
+                    Emit(OpCode::GetUpval, target, UpvalueIndex(*fs, var), 0, expr->line);
+                break;
+            }
+            case ExprKind::Global:
+                Emit(OpCode::GetGlobal, target, AddConstant(static_cast<GlobalExpr*>(expr)->name), 0, expr->line);
+                break;
+            case ExprKind::Index:
+            {
+                auto* index = static_cast<IndexExpr*>(expr);
+                uint32_t object = ExprToAnyReg(index->object);
+                if (IsFieldKey(index->key))
+                    Emit(OpCode::GetField, target, object, AddConstant(static_cast<ConstantExpr*>(index->key)->value), expr->line);
+                else
+                    Emit(OpCode::GetIndex, target, object, ExprToRK(index->key), expr->line);
+                break;
+            }
+            case ExprKind::Call:
+                if (FunctionNode* function = InlineTarget(static_cast<CallExpr*>(expr)))
+                {
+                    InlineCall(static_cast<CallExpr*>(expr), function, target);
+                    break;
+                }
+                [[fallthrough]];
+            case ExprKind::Method:
+                Emit(OpCode::Move, target, LowerCall(expr, 1), 0, expr->line);
+                break;
+            case ExprKind::Function:
+                Emit(OpCode::Closure, target, LowerChild(static_cast<FunctionExpr*>(expr)->function), 0, expr->line);
+                break;
+            case ExprKind::Table:
+                Emit(OpCode::Move, target, LowerTable(static_cast<TableExpr*>(expr)), 0, expr->line);
+                break;
+            case ExprKind::Binary:
+                LowerBinary(static_cast<BinaryExpr*>(expr), target);
+                break;
+            case ExprKind::Unary:
+            {
+                static constexpr OpCode ops[] = { OpCode::Unm, OpCode::Not, OpCode::Len, OpCode::BNot };
+                auto* unary = static_cast<UnaryExpr*>(expr);
+                uint32_t operand = ExprToAnyReg(unary->operand);
+                Emit(ops[static_cast<int>(unary->op)], target, operand, 0, expr->line);
+                break;
+            }
+            case ExprKind::Vararg:
+                Emit(OpCode::VarArg, target, 1, 0, expr->line);
+                break;
+            }
+        }
+
+        // 求值到任意寄存器：本函数的局部变量直接使用其寄存器，其余求值到新的临时寄存器
+        uint32_t ExprToAnyReg(Expr* expr)
+        {
+            if (expr->kind == ExprKind::Local)
+            {
+                LocalVar* var = static_cast<LocalExpr*>(expr)->var;
+                if (!var->hasConstant && IsLocal(var))
+                    return VregOf(*fs, var);
+            }
+            uint32_t temp = fs->ir.NewVreg();
+            ExprToReg(expr, temp);
+            // 绑定到常量实参的内联形参没有寄存器，求到临时寄存器时记下名字，出错时仍能说出变量名
+            if (expr->kind == ExprKind::Local && static_cast<LocalExpr*>(expr)->var->hasConstant)
+                Name(temp, static_cast<LocalExpr*>(expr)->var);
+            return temp;
+        }
+
+        // 求值为 RK 操作数：常量直接引用常量表
+        uint32_t ExprToRK(Expr* expr)
+        {
+            if (expr->kind == ExprKind::Constant)
+                return AddConstant(static_cast<ConstantExpr*>(expr)->value) | ConstantBit;
+            if (expr->kind == ExprKind::Local && static_cast<LocalExpr*>(expr)->var->hasConstant)
+                return AddConstant(static_cast<LocalExpr*>(expr)->var->constant) | ConstantBit;
+            return ExprToAnyReg(expr);
+        }
+
+        // 只为副作用求值
+        void Discard(Expr* expr)
+        {
+            if (expr->kind == ExprKind::Constant || expr->kind == ExprKind::Local || expr->kind == ExprKind::Vararg)
+                return;
+            if (expr->kind == ExprKind::Call)
+            {
+                if (FunctionNode* function = InlineTarget(static_cast<CallExpr*>(expr)))
+                {
+                    InlineCall(static_cast<CallExpr*>(expr), function, NoTarget);
+                    return;
+                }
+            }
+            if (expr->kind == ExprKind::Call || expr->kind == ExprKind::Method)
+            {
+                LowerCall(expr, 0);
+                return;
+            }
+            ExprToAnyReg(expr);
+        }
+
+        void LowerBinary(BinaryExpr* binary, uint32_t target)
+        {
+            if (binary->op == BinaryOp::And || binary->op == BinaryOp::Or)
+            {
+                LowerLogical(binary, target);
+                return;
+            }
+            uint32_t left = ExprToRK(binary->left);
+            uint32_t right = ExprToRK(binary->right);
+            int line = binary->line;
+            switch (binary->op)
+            {
+            case BinaryOp::Ne:
+                Emit(OpCode::Eq, target, left, right, line);
+                Emit(OpCode::Not, target, target, 0, line);
+                break;
+            case BinaryOp::Gt:
+                Emit(OpCode::Lt, target, right, left, line);
+                break;
+            case BinaryOp::Ge:
+                Emit(OpCode::Le, target, right, left, line);
+                break;
+            default:
+            {
+                // BinaryOp 中 Add 到 Le（除 Ne 外）与 OpCode 中 Add 到 Le 顺序一致
+                static constexpr OpCode ops[] = {
+                    OpCode::Add, OpCode::Sub, OpCode::Mul, OpCode::Div, OpCode::Mod, OpCode::Pow, OpCode::Idiv,
+                    OpCode::BAnd, OpCode::BOr, OpCode::BXor, OpCode::Shl, OpCode::Shr,
+                    OpCode::Concat,
+                    OpCode::Eq, OpCode::Eq, OpCode::Lt, OpCode::Le,
+                };
+                Emit(ops[static_cast<int>(binary->op)], target, left, right, line);
+                break;
+            }
+            }
+        }
+
+        // 取值的 and / or：左操作数决定结果时跳过右操作数。
+        // 先求到临时寄存器再复制到 target，target 可能是右操作数引用的局部变量
+        void LowerLogical(BinaryExpr* binary, uint32_t target)
+        {
+            uint32_t temp = fs->ir.NewVreg();
+            uint32_t end = fs->ir.NewLabel();
+            ExprToReg(binary->left, temp);
+            Emit(OpCode::Test, temp, end, binary->op == BinaryOp::Or ? 1 : 0, binary->line);
+            ExprToReg(binary->right, temp);
+            Mark(IrKind::Label, end);
+            Emit(OpCode::Move, target, temp, 0, binary->line);
+        }
+
+        // 位于列表末尾时展开为多个值的表达式；内联展开的调用只产生一个值
+        bool Expands(const Expr* expr) const
+        {
+            return IsMultiValue(expr) && !(expr->kind == ExprKind::Call && InlineTarget(static_cast<const CallExpr*>(expr)));
+        }
+
+        static Expr* LastOf(Expr* list)
+        {
+            while (list != nullptr && list->next != nullptr)
+                list = list->next;
+            return list;
+        }
+
+        // 以 next 串联的 count 个表达式依次求值到窗口中所需的寄存器个数：
+        // 末尾展开的调用的被调函数与参数也放在这个窗口中，从它所在的位置开始
+        uint32_t ListWindowSize(Expr* list, uint32_t count) const
+        {
+            Expr* last = LastOf(list);
+            if (last == nullptr || !Expands(last))
+                return count;
+            return count - 1 + MultiWindowSize(last);
+        }
+
+        // 展开为多个值的表达式（调用或 ...）在窗口中占用的寄存器个数
+        uint32_t MultiWindowSize(Expr* expr) const
+        {
+            if (expr->kind == ExprKind::Method)
+            {
+                auto* method = static_cast<MethodExpr*>(expr);
+                return 2 + ListWindowSize(method->args, method->argCount);
+            }
+            if (expr->kind == ExprKind::Call)
+            {
+                auto* call = static_cast<CallExpr*>(expr);
+                return 1 + ListWindowSize(call->args, call->argCount);
+            }
+            return 1;
+        }
+
+        // 表达式列表依次求值到从 reg 开始的寄存器中。末尾的表达式展开时在其位置取得全部的值，
+        // 返回值带 MultipleValues 标志（个数延续到 top）；低位为固定部分的个数，含末尾表达式所在的寄存器
+        uint32_t ListToRegs(Expr* list, uint32_t reg)
+        {
+            uint32_t count = 0;
+            for (Expr* expr = list; expr != nullptr; expr = expr->next, ++count)
+            {
+                if (expr->next == nullptr && Expands(expr))
+                {
+                    MultiToRegs(expr, reg + count, MultipleValues);
+                    return (count + 1) | MultipleValues;
+                }
+                ExprToReg(expr, reg + count);
+            }
+            return count;
+        }
+
+        // 调用或 ... 的前 count 个值（为 MultipleValues 时为全部的值）求到从 target 开始的寄存器中，
+        // target 开始的 MultiWindowSize 个寄存器位于同一个窗口中
+        void MultiToRegs(Expr* expr, uint32_t target, uint32_t count)
+        {
+            if (expr->kind == ExprKind::Vararg)
+                Emit(OpCode::VarArg, target, count, 0, expr->line);
+            else
+                LowerCallAt(expr, target, count);
+        }
+
+        // 调用：被调函数与参数依次求值到一个连续的窗口中，返回窗口的第一个寄存器（返回值所在位置）。
+        // results 为需要的返回值个数，窗口至少能容纳这些返回值
+        uint32_t LowerCall(Expr* expr, uint32_t results)
+        {
+            uint32_t size = MultiWindowSize(expr);
+            if (results != MultipleValues)
+                size = std::max(size, results);
+            uint32_t window = fs->ir.NewWindow(size);
+            LowerCallAt(expr, window, results);
+            return window;
+        }
+
+        // 在已分配的窗口中从 window 开始生成调用
+        void LowerCallAt(Expr* expr, uint32_t window, uint32_t results)
+        {
+            if (expr->kind == ExprKind::Method)
+            {
+                auto* method = static_cast<MethodExpr*>(expr);
+                uint32_t object = ExprToAnyReg(method->object);
+                Emit(OpCode::Self, window, object, AddConstant(method->name) | ConstantBit, expr->line);
+                uint32_t args = ListToRegs(method->args, window + 2);
+                Emit(OpCode::Call, window, args + 1, results, expr->line);
+                return;
+            }
+
+            auto* call = static_cast<CallExpr*>(expr);
+            ExprToReg(call->function, window);
+            uint32_t args = ListToRegs(call->args, window + 1);
+            Emit(OpCode::Call, window, args, results, expr->line);
+        }
+
+        // 调用或 ... 的前 count 个值求到一个新窗口中，返回窗口的第一个寄存器
+        uint32_t MultiToWindow(Expr* expr, uint32_t count)
+        {
+            if (expr->kind != ExprKind::Vararg)
+                return LowerCall(expr, count);
+            uint32_t window = fs->ir.NewWindow(count);
+            Emit(OpCode::VarArg, window, count, 0, expr->line);
+            return window;
+        }
+
+        // 在调用处展开函数体：实参求值后绑定到形参（未被捕获的局部变量直接共用寄存器，
+        // 常量实参作为常量传播），缺少的形参为 nil，多余的实参只求值；
+        // 函数体的 local 声明照常降级，最后把返回值求到 target。
+        // 函数体的范围与调用处记入调试信息，出错时回溯仍显示被内联的调用层
+        void InlineCall(CallExpr* call, FunctionNode* function, uint32_t target)
+        {
+            struct Binding
+            {
+                uint32_t reg;
+                bool constant;
+                Value value;
+            };
+            ArenaVector<Binding> bindings(arena);
+            uint32_t index = 0;
+            for (Expr* arg = call->args; arg != nullptr; arg = arg->next, ++index)
+            {
+                if (index >= function->paramCount)
+                {
+                    Discard(arg);
+                    continue;
+                }
+                if (arg->next == nullptr && index + 1 < function->paramCount && Expands(arg))
+                {
+                    // 末尾的调用或 ... 展开后依次绑定到其余的形参
+                    uint32_t count = function->paramCount - index;
+                    uint32_t window = MultiToWindow(arg, count);
+                    for (uint32_t i = 0; i < count; ++i)
+                        bindings.push_back({ window + i, false, Value() });
+                    break;
+                }
+                if (arg->kind == ExprKind::Constant)
+                {
+                    bindings.push_back({ 0, true, static_cast<ConstantExpr*>(arg)->value });
+                    continue;
+                }
+                if (arg->kind == ExprKind::Local)
+                {
+                    LocalVar* var = static_cast<LocalExpr*>(arg)->var;
+                    if (var->hasConstant)
+                    {
+                        bindings.push_back({ 0, true, var->constant });
+                        continue;
+                    }
+                    if (IsLocal(var) && !var->captured)
+                    {
+                        bindings.push_back({ VregOf(*fs, var), false, Value() });
+                        continue;
+                    }
+                }
+                uint32_t reg = fs->ir.NewVreg();
+                ExprToReg(arg, reg);
+                bindings.push_back({ reg, false, Value() });
+            }
+
+            LocalVar* callee = static_cast<LocalExpr*>(call->function)->var;
+            const uint32_t expansion = static_cast<uint32_t>(fs->ir.inlines.size());
+            // 被内联的函数体不含函数定义，展开中的调用只能引用外层的函数，未内联时是上值
+            fs->ir.inlines.push_back({ callee->name, call->line, fs->expanding > 0 || !IsLocal(callee) });
+            Mark(IrKind::InlineBegin, expansion);
+            fs->expanding++;
+
+            FunctionNode* owner = fs->node;
+            index = 0;
+            for (LocalVar* param = function->params; param != nullptr; param = param->next, ++index)
+            {
+                param->function = owner;
+                param->hasConstant = index >= bindings.size() || bindings[index].constant;
+                param->constant = index < bindings.size() ? bindings[index].value : Value();
+                param->vreg = index < bindings.size() ? bindings[index].reg : LocalVar::NoVreg;
+                if (!param->hasConstant)
+                    Name(param->vreg, param);
+            }
+
+            Expr* result = nullptr;
+            for (Stat* stat = function->body; stat != nullptr; stat = stat->next)
+            {
+                if (stat->kind == StatKind::Return)
+                {
+                    result = static_cast<ReturnStat*>(stat)->values;
+                    break;
+                }
+                for (LocalVar* var = static_cast<LocalStat*>(stat)->vars; var != nullptr; var = var->next)
+                    var->function = owner;
+                LowerLocal(static_cast<LocalStat*>(stat), false);
+            }
+            if (target == NoTarget)
+                Discard(result);
+            else
+                ExprToReg(result, target);
+            fs->expanding--;
+            Mark(IrKind::InlineEnd, expansion);
+
+            for (LocalVar* param = function->params; param != nullptr; param = param->next)
+            {
+                param->function = function;
+                param->hasConstant = false;
+                param->vreg = LocalVar::NoVreg;
+            }
+            for (Stat* stat = function->body; stat->kind != StatKind::Return; stat = stat->next)
+            {
+                for (LocalVar* var = static_cast<LocalStat*>(stat)->vars; var != nullptr; var = var->next)
+                {
+                    var->function = function;
+                    var->vreg = LocalVar::NoVreg;
+                }
+            }
+        }
+
+        // 表构造器：数组项求值到窗口中，每 FieldsPerFlush 项用一条 SetList 写入；返回保存新表的寄存器。
+        // 最后一项是展开的调用或 ... 时，它的全部值由最后一条 SetList 一并写入
+        uint32_t LowerTable(TableExpr* table)
+        {
+            uint32_t size = 1 + std::min(table->arrayCount, FieldsPerFlush);
+            TableItem* last = table->items;
+            while (last != nullptr && last->next != nullptr)
+                last = last->next;
+            const bool expands = last != nullptr && last->key == nullptr && Expands(last->value);
+            if (expands)
+                size = std::max(size, 1 + (table->arrayCount - 1) % FieldsPerFlush + MultiWindowSize(last->value));
+            uint32_t window = fs->ir.NewWindow(size);
+            Emit(OpCode::NewTable, window, table->arrayCount, table->hashCount, table->line);
+
+            uint32_t pending = 0, flushed = 0;
+            for (TableItem* item = table->items; item != nullptr; item = item->next)
+            {
+                if (item == last && expands)
+                {
+                    MultiToRegs(item->value, window + 1 + pending, MultipleValues);
+                    Emit(OpCode::SetList, window, (pending + 1) | MultipleValues, flushed, table->line);
+                    pending = 0;
+                }
+                else if (item->key == nullptr)
+                {
+                    ExprToReg(item->value, window + 1 + pending);
+                    if (++pending == FieldsPerFlush)
+                    {
+                        Emit(OpCode::SetList, window, pending, flushed, table->line);
+                        flushed += pending;
+                        pending = 0;
+                    }
+                }
+                else if (IsFieldKey(item->key))
+                {
+                    uint32_t key = AddConstant(static_cast<ConstantExpr*>(item->key)->value);
+                    Emit(OpCode::SetField, window, key, ExprToRK(item->value), item->value->line);
+                }
+                else
+                {
+                    uint32_t key = ExprToRK(item->key);
+                    Emit(OpCode::SetIndex, window, key, ExprToRK(item->value), item->value->line);
+                }
+            }
+            if (pending > 0)
+                Emit(OpCode::SetList, window, pending, flushed, table->line);
+            return window;
+        }
+
+        void LowerStats(Stat* stat)
+        {
+            for (; stat != nullptr; stat = stat->next)
+            {
+                LowerStat(stat);
+            }
+        }
+
+        void LowerBlock(Stat* body)
+        {
+            size_t mark = fs->active.size();
+            LowerStats(body);
+            EndScope(mark, false);
+        }
+
+        void LowerStat(Stat* stat)
+        {
+            switch (stat->kind)
+            {
+            case StatKind::Local:
+                LowerLocal(static_cast<LocalStat*>(stat), true);
+                break;
+            case StatKind::LocalFunction:
+            {
+                auto* local = static_cast<LocalFunctionStat*>(stat);
+                if (ClosureUnneeded(local->var, local->function))
+                    break;
+                uint32_t reg = NewVarVreg(*fs, local->var);
+                // 先进入作用域，函数体可以递归引用自身
+                Activate(local->var);
+                Emit(OpCode::Closure, reg, LowerChild(local->function), 0, stat->line);
+                break;
+            }
+            case StatKind::Assign:
+                LowerAssign(static_cast<AssignStat*>(stat));
+                break;
+            case StatKind::Call:
+                Discard(static_cast<CallStat*>(stat)->call);
+                break;
+            case StatKind::Do:
+                LowerBlock(static_cast<DoStat*>(stat)->body);
+                break;
+            case StatKind::While:
+                LowerWhile(static_cast<WhileStat*>(stat));
+                break;
+            case StatKind::NumericFor:
+                LowerNumericFor(static_cast<NumericForStat*>(stat));
+                break;
+            case StatKind::GenericFor:
+                LowerGenericFor(static_cast<GenericForStat*>(stat));
+                break;
+            case StatKind::Return:
+            {
+                auto* ret = static_cast<ReturnStat*>(stat);
+                if (ret->values == nullptr)
+                {
+                    Emit(OpCode::Return, 0, 0, 0, stat->line);
+                }
+                else if (ret->valueCount == 1 && !Expands(ret->values))
+                {
+                    Emit(OpCode::Return, ExprToAnyReg(ret->values), 1, 0, stat->line);
+                }
+                else
+                {
+                    // 多个返回值依次求值到窗口中
+                    uint32_t window = fs->ir.NewWindow(ListWindowSize(ret->values, ret->valueCount));
+                    Emit(OpCode::Return, window, ListToRegs(ret->values, window), 0, stat->line);
+                }
+                break;
+            }
+            case StatKind::If:
+                LowerIf(static_cast<IfStat*>(stat));
+                break;
+            case StatKind::Repeat:
+                LowerRepeat(static_cast<RepeatStat*>(stat));
+                break;
+            case StatKind::Break:
+            case StatKind::Goto:
+            {
+                size_t mark = JumpScope(stat);
+                CloseFrom(mark, stat->line);
+                Emit(OpCode::Jmp, JumpLabel(stat), 0, 0, stat->line);
+                break;
+            }
+            case StatKind::Label:
+                Mark(IrKind::Label, LabelOf(static_cast<LabelStat*>(stat)));
+                break;
+            }
+        }
+
+        uint32_t LabelOf(LabelStat* label)
+        {
+            if (label->irLabel == LabelStat::NoLabel)
+            {
+                label->irLabel = fs->ir.NewLabel();
+                fs->labels.push_back(label);
+            }
+            return label->irLabel;
+        }
+
+        // break 与 goto 跳转的目标
+        uint32_t JumpLabel(Stat* stat)
+        {
+            if (stat->kind == StatKind::Break)
+                return fs->loops.back().label;
+            return LabelOf(static_cast<GotoStat*>(stat)->target);
+        }
+
+        // break 与 goto 离开作用域的变量：active 中从返回的位置开始的部分
+        size_t JumpScope(Stat* stat) const
+        {
+            if (stat->kind == StatKind::Break)
+                return fs->loops.back().active;
+            const uint32_t visible = static_cast<GotoStat*>(stat)->target->active;
+            size_t mark = fs->active.size();
+            while (mark > 0 && fs->active[mark - 1]->scope >= visible)
+                --mark;
+            return mark;
+        }
+
+        // 跳出作用域的变量中需要关闭的：被捕获的变量与待关闭变量。
+        // 捕获它的函数可能在跳转之后才降级，这里按语法分析的结果判断
+        static bool NeedsClose(const LocalVar* var)
+        {
+            return (var->captured || var->toClose) && var->pinned < 0;
+        }
+
+        bool NeedsClose(size_t mark) const
+        {
+            for (size_t i = mark; i < fs->active.size(); ++i)
+            {
+                if (NeedsClose(fs->active[i]))
+                    return true;
+            }
+            return false;
+        }
+
+        // 跳出 active 中从 mark 开始的变量的作用域之前由内向外关闭它们（变量仍留在 active 中）
+        void CloseFrom(size_t mark, int line)
+        {
+            for (size_t i = fs->active.size(); i-- > mark;)
+            {
+                if (NeedsClose(fs->active[i]))
+                    Emit(OpCode::Close, fs->active[i]->vreg, 0, 0, line);
+            }
+        }
+
+        // 代码块以无条件跳转结束，之后的代码不会执行到
+        static bool EndsWithJump(const Stat* body)
+        {
+            if (body == nullptr)
+                return false;
+            while (body->next != nullptr)
+                body = body->next;
+            return body->kind == StatKind::Return || body->kind == StatKind::Break || body->kind == StatKind::Goto;
+        }
+
+        // 条件为常量的分支在编译时选定；只有一条 break 或 goto 的分支（不需要关闭变量时）
+        // 直接生成跳到其目标的条件跳转
+        void LowerIf(IfStat* branch)
+        {
+            uint32_t end = fs->ir.NewLabel();
+            for (IfClause* clause = branch->clauses; clause != nullptr; clause = clause->next)
+            {
+                Expr* condition = clause->condition;
+                if (condition->kind == ExprKind::Constant)
+                {
+                    if (static_cast<ConstantExpr*>(condition)->value.IsFalsy())
+                        continue;
+                    LowerBlock(clause->body);
+                    Mark(IrKind::Label, end);
+                    return;
+                }
+                Stat* body = clause->body;
+                if (body != nullptr && body->next == nullptr &&
+                    (body->kind == StatKind::Break || body->kind == StatKind::Goto) && !NeedsClose(JumpScope(body)))
+                {
+                    JumpIf(condition, true, JumpLabel(body));
+                    continue;
+                }
+
+                uint32_t next = fs->ir.NewLabel();
+                JumpIf(condition, false, next);
+                LowerBlock(body);
+                if ((clause->next != nullptr || branch->elseBody != nullptr) && !EndsWithJump(body))
+                    Emit(OpCode::Jmp, end, 0, 0, branch->line);
+                Mark(IrKind::Label, next);
+            }
+            LowerBlock(branch->elseBody);
+            Mark(IrKind::Label, end);
+        }
+
+        // 循环体之后判断条件，成立时退出；循环体中有需要关闭的变量时，继续循环前先关闭它们
+        void LowerRepeat(RepeatStat* loop)
+        {
+            uint32_t body = fs->ir.NewLabel();
+            uint32_t exit = fs->ir.NewLabel();
+            uint32_t id = fs->ir.loopCount++;
+            Mark(IrKind::Preheader, id);
+            Mark(IrKind::LoopBegin, id);
+            Mark(IrKind::Label, body);
+            size_t mark = fs->active.size();
+            fs->loops.push_back({ exit, mark });
+            LowerStats(loop->body);
+            fs->loops.pop_back();
+
+            if (!NeedsClose(mark))
+            {
+                JumpIf(loop->condition, false, body);
+                Mark(IrKind::LoopEnd, id);
+            }
+            else
+            {
+                uint32_t leave = fs->ir.NewLabel();
+                JumpIf(loop->condition, true, leave);
+                CloseFrom(mark, loop->line);
+                Emit(OpCode::Jmp, body, 0, 0, loop->line);
+                Mark(IrKind::LoopEnd, id);
+                Mark(IrKind::Label, leave);
+            }
+            EndScope(mark, false);
+            Mark(IrKind::Label, exit);
+        }
+
+        // 初值直接求到新变量的寄存器中；全部初值求值完毕后变量才进入作用域。
+        // 最后一个初值展开为其余全部变量的值时，这些变量就是调用窗口中的寄存器
+        void LowerLocal(LocalStat* local, bool activate)
+        {
+            Expr* value = local->values;
+            for (LocalVar* var = local->vars; var != nullptr; var = var->next)
+            {
+                Expr* init = value;
+                if (value != nullptr)
+                    value = value->next;
+
+                if (init != nullptr && init->next == nullptr && var->next != nullptr && Expands(init))
+                {
+                    uint32_t count = 0;
+                    for (LocalVar* rest = var; rest != nullptr; rest = rest->next)
+                        count++;
+                    uint32_t window = MultiToWindow(init, count);
+                    for (uint32_t i = 0; var != nullptr; var = var->next, ++i)
+                    {
+                        // 固定寄存器的变量（流式执行的顶层变量）不能放在窗口中
+                        if (var->pinned >= 0)
+                            Emit(OpCode::Move, NewVarVreg(*fs, var), window + i, 0, local->line);
+                        else
+                            var->vreg = window + i;
+                    }
+                    break;
+                }
+
+                // 常量初值没有副作用，变量的引用已被替换为常量
+                if (var->hasConstant)
+                    continue;
+                if (init != nullptr && init->kind == ExprKind::Function &&
+                    ClosureUnneeded(var, static_cast<FunctionExpr*>(init)->function))
+                {
+                    continue;
+                }
+                uint32_t reg = NewVarVreg(*fs, var);
+                if (init != nullptr)
+                    ExprToReg(init, reg);
+                else
+                    Emit(OpCode::LoadNil, reg, 0, 0, local->line);
+            }
+            for (; value != nullptr; value = value->next)
+                Discard(value);
+
+            if (!activate)
+                return;
+            for (LocalVar* var = local->vars; var != nullptr; var = var->next)
+            {
+                if (var->vreg == LocalVar::NoVreg)
+                    continue;
+                Activate(var);
+                // 待关闭变量与被捕获的变量一样占住寄存器直到离开作用域，由块尾的 Close（或 Return）调用 __close
+                if (var->toClose)
+                {
+                    fs->ir.vregs[var->vreg].captured = true;
+                    Emit(OpCode::Tbc, var->vreg, 0, 0, local->line);
+                }
+            }
+        }
+
+        void LowerAssign(AssignStat* assign)
+        {
+            if (assign->targetCount == 1 && assign->valueCount == 1)
+            {
+                Expr* target = assign->targets;
+                if (target->kind == ExprKind::Local && IsLocal(static_cast<LocalExpr*>(target)->var))
+                {
+                    ExprToReg(assign->values, VregOf(*fs, static_cast<LocalExpr*>(target)->var));
+                    return;
+                }
+                PendingStore store = PrepareTarget(target, nullptr);
+                store.value = ExprToRK(assign->values);
+                Store(store, assign->line);
+                return;
+            }
+
+            // 先求出全部目标的表与键以及全部右值，再从右向左赋值
+            ArenaVector<PendingStore> stores(arena);
+            for (Expr* target = assign->targets; target != nullptr; target = target->next)
+                stores.push_back(PrepareTarget(target, assign->targets));
+
+            Expr* value = assign->values;
+            for (size_t i = 0; i < stores.size(); ++i)
+            {
+                PendingStore& store = stores[i];
+                if (value == nullptr)
+                {
+                    store.value = AddConstant(Value()) | ConstantBit;
+                    continue;
+                }
+                if (value->next == nullptr && i + 1 < stores.size() && Expands(value))
+                {
+                    // 最后一个右值展开为其余全部目标的值
+                    uint32_t count = static_cast<uint32_t>(stores.size() - i);
+                    uint32_t window = MultiToWindow(value, count);
+                    for (uint32_t j = 0; j < count; ++j)
+                        stores[i + j].value = window + j;
+                    value = nullptr;
+                    break;
+                }
+                if (value->kind == ExprKind::Constant)
+                {
+                    store.value = ExprToRK(value);
+                }
+                else
+                {
+                    store.value = fs->ir.NewVreg();
+                    ExprToReg(value, store.value);
+                }
+                value = value->next;
+            }
+            for (; value != nullptr; value = value->next)
+                Discard(value);
+
+            for (size_t i = stores.size(); i-- > 0;)
+                Store(stores[i], assign->line);
+        }
+
+        // 求出赋值目标中的表与键。targets 非空时为多重赋值的全部目标：
+        // 表或键是同一语句中被赋值的局部变量时先复制一份，保证使用赋值前的值
+        PendingStore PrepareTarget(Expr* target, Expr* targets)
+        {
+            PendingStore store{ target, 0, 0, 0 };
+            if (target->kind != ExprKind::Index)
+                return store;
+
+            auto* index = static_cast<IndexExpr*>(target);
+            store.object = Protect(ExprToAnyReg(index->object), targets);
+            if (IsFieldKey(index->key))
+                store.key = AddConstant(static_cast<ConstantExpr*>(index->key)->value);
+            else
+                store.key = ExprToRK(index->key);
+            if (!IsConstant(store.key) && !IsFieldKey(index->key))
+                store.key = Protect(store.key, targets);
+            return store;
+        }
+
+        uint32_t Protect(uint32_t reg, Expr* targets)
+        {
+            for (Expr* target = targets; target != nullptr; target = target->next)
+            {
+                if (target->kind != ExprKind::Local)
+                    continue;
+                LocalVar* var = static_cast<LocalExpr*>(target)->var;
+                if (IsLocal(var) && var->vreg == reg)
+                {
+                    uint32_t copy = fs->ir.NewVreg();
+                    Emit(OpCode::Move, copy, reg, 0, target->line);
+                    return copy;
+                }
+            }
+            return reg;
+        }
+
+        void Store(const PendingStore& store, int line)
+        {
+            Expr* target = store.target;
+            switch (target->kind)
+            {
+            case ExprKind::Local:
+            {
+                LocalVar* var = static_cast<LocalExpr*>(target)->var;
+                if (!IsLocal(var))
+                    Emit(OpCode::SetUpval, UpvalueIndex(*fs, var), store.value, 0, line);
+                else if (IsConstant(store.value))
+                    LoadConstant(fs->proto.constants[store.value & ~ConstantBit], VregOf(*fs, var), line);
+                else
+                    Emit(OpCode::Move, VregOf(*fs, var), store.value, 0, line);
+                break;
+            }
+            case ExprKind::Global:
+                Emit(OpCode::SetGlobal, AddConstant(static_cast<GlobalExpr*>(target)->name), store.value, 0, line);
+                break;
+            case ExprKind::Index:
+                if (IsFieldKey(static_cast<IndexExpr*>(target)->key))
+                    Emit(OpCode::SetField, store.object, store.key, store.value, line);
+                else
+                    Emit(OpCode::SetIndex, store.object, store.key, store.value, line);
+                break;
+            default:
+                break;
+            }
+        }
+
+        // while 循环按条件前置的形式生成：先判断一次，循环体末尾再判断并跳回循环体开头，
+        // 每次迭代只执行一条条件跳转
+        void LowerWhile(WhileStat* loop)
+        {
+            Expr* condition = loop->condition;
+            bool constant = condition->kind == ExprKind::Constant;
+            if (constant && static_cast<ConstantExpr*>(condition)->value.IsFalsy())
+                return;
+
+            uint32_t body = fs->ir.NewLabel();
+            uint32_t exit = fs->ir.NewLabel();
+            if (!constant)
+                JumpIf(condition, false, exit);
+
+            uint32_t id = fs->ir.loopCount++;
+            Mark(IrKind::Preheader, id);
+            Mark(IrKind::LoopBegin, id);
+            Mark(IrKind::Label, body);
+            fs->loops.push_back({ exit, fs->active.size() });
+            LowerBlock(loop->body);
+            fs->loops.pop_back();
+            if (constant)
+                Emit(OpCode::Jmp, body, 0, 0, loop->endLine);
+            else
+                JumpIf(condition, true, body);
+            Mark(IrKind::LoopEnd, id);
+            Mark(IrKind::Label, exit);
+        }
+
+        // 条件的值为 when 时跳到 label，否则继续执行。and / or 按短路求值直接生成跳转，
+        // 比较生成比较并跳转指令，都不把中间结果写入寄存器
+        void JumpIf(Expr* condition, bool when, uint32_t label)
+        {
+            if (const Value* value = ConstantOf(condition))
+            {
+                if (value->IsFalsy() != when)
+                    Emit(OpCode::Jmp, label, 0, 0, condition->line);
+                return;
+            }
+            if (condition->kind == ExprKind::Unary && static_cast<UnaryExpr*>(condition)->op == UnaryOp::Not)
+            {
+                JumpIf(static_cast<UnaryExpr*>(condition)->operand, !when, label);
+                return;
+            }
+            if (condition->kind == ExprKind::Binary)
+            {
+                auto* binary = static_cast<BinaryExpr*>(condition);
+                if (binary->op == BinaryOp::And || binary->op == BinaryOp::Or)
+                {
+                    // and 为假、or 为真：任一操作数满足即跳转；否则左操作数不满足时结果已定，跳过右操作数
+                    if ((binary->op == BinaryOp::And) != when)
+                    {
+                        JumpIf(binary->left, when, label);
+                        JumpIf(binary->right, when, label);
+                    }
+                    else
+                    {
+                        uint32_t skip = fs->ir.NewLabel();
+                        JumpIf(binary->left, !when, skip);
+                        JumpIf(binary->right, when, label);
+                        Mark(IrKind::Label, skip);
+                    }
+                    return;
+                }
+                if (binary->op >= BinaryOp::Eq && binary->op <= BinaryOp::Ge)
+                {
+                    JumpCompare(binary, when, label);
+                    return;
+                }
+            }
+            uint32_t reg = ExprToAnyReg(condition);
+            Emit(OpCode::Test, reg, label, when ? 1 : 0, condition->line);
+        }
+
+        // 常量表达式（含内联时绑定为常量的形参）的值，其他表达式返回 nullptr
+        static const Value* ConstantOf(const Expr* expr)
+        {
+            if (expr->kind == ExprKind::Constant)
+                return &static_cast<const ConstantExpr*>(expr)->value;
+            if (expr->kind == ExprKind::Local && static_cast<const LocalExpr*>(expr)->var->hasConstant)
+                return &static_cast<const LocalExpr*>(expr)->var->constant;
+            return nullptr;
+        }
+
+        // 可以作为比较并跳转指令立即数的常量：int32 范围内的整数
+        static bool ImmediateOf(const Expr* expr, int32_t& immediate)
+        {
+            const Value* value = ConstantOf(expr);
+            if (value == nullptr || !value->IsNumber())
+                return false;
+            double d = *std::get_if<double>(&value->value);
+            if (!(d >= INT32_MIN && d <= INT32_MAX) || d != static_cast<double>(static_cast<int32_t>(d)))
+                return false;
+            immediate = static_cast<int32_t>(d);
+            return true;
+        }
+
+        // 比较并跳转。一侧是整数常量、另一侧不是常量时用立即数形式；
+        // 每种比较有条件成立时跳转与不成立时跳转两条指令（not (a < b) 与 a >= b 对 NaN 不同）
+        void JumpCompare(BinaryExpr* binary, bool when, uint32_t label)
+        {
+            // 按 Eq、Ne、Lt、Le、Gt、Ge 排列，每项为 { 成立时跳转, 不成立时跳转 }
+            static constexpr OpCode immediateOps[][2] = {
+                { OpCode::EqJmpI, OpCode::NeJmpI }, { OpCode::NeJmpI, OpCode::EqJmpI },
+                { OpCode::LtJmpI, OpCode::NotLtJmpI }, { OpCode::LeJmpI, OpCode::NotLeJmpI },
+                { OpCode::GtJmpI, OpCode::NotGtJmpI }, { OpCode::GeJmpI, OpCode::NotGeJmpI },
+            };
+            // 常量在左侧时交换操作数后的比较
+            static constexpr BinaryOp mirrored[] = {
+                BinaryOp::Eq, BinaryOp::Ne, BinaryOp::Gt, BinaryOp::Ge, BinaryOp::Lt, BinaryOp::Le,
+            };
+            static constexpr OpCode registerOps[][2] = {
+                { OpCode::EqJmp, OpCode::NeJmp }, { OpCode::NeJmp, OpCode::EqJmp },
+                { OpCode::LtJmp, OpCode::NotLtJmp }, { OpCode::LeJmp, OpCode::NotLeJmp },
+            };
+
+            const int column = when ? 0 : 1;
+            BinaryOp op = binary->op;
+            int32_t immediate;
+            if (ConstantOf(binary->left) == nullptr && ImmediateOf(binary->right, immediate))
+            {
+                uint32_t reg = ExprToAnyReg(binary->left);
+                Emit(immediateOps[static_cast<int>(op) - static_cast<int>(BinaryOp::Eq)][column], reg,
+                    std::bit_cast<uint32_t>(immediate), label, binary->line);
+                return;
+            }
+            if (ConstantOf(binary->right) == nullptr && ImmediateOf(binary->left, immediate))
+            {
+                uint32_t reg = ExprToAnyReg(binary->right);
+                op = mirrored[static_cast<int>(op) - static_cast<int>(BinaryOp::Eq)];
+                Emit(immediateOps[static_cast<int>(op) - static_cast<int>(BinaryOp::Eq)][column], reg,
+                    std::bit_cast<uint32_t>(immediate), label, binary->line);
+                return;
+            }
+
+            uint32_t left = ExprToRK(binary->left);
+            uint32_t right = ExprToRK(binary->right);
+            if (op == BinaryOp::Gt || op == BinaryOp::Ge)
+            {
+                std::swap(left, right);
+                op = op == BinaryOp::Gt ? BinaryOp::Lt : BinaryOp::Le;
+            }
+            Emit(registerOps[static_cast<int>(op) - static_cast<int>(BinaryOp::Eq)][column], left, right, label, binary->line);
+        }
+
+        // 初值、终值、步长与循环变量占用一个 4 个寄存器的窗口
+        void LowerNumericFor(NumericForStat* loop)
+        {
+            uint32_t window = fs->ir.NewWindow(4);
+            ExprToReg(loop->start, window);
+            ExprToReg(loop->limit, window + 1);
+            if (loop->step != nullptr)
+                ExprToReg(loop->step, window + 2);
+            else
+                LoadConstant(Value(1), window + 2, loop->line);
+
+            uint32_t body = fs->ir.NewLabel();
+            uint32_t exit = fs->ir.NewLabel();
+            Emit(OpCode::ForPrep, window, exit, 0, loop->line);
+
+            uint32_t id = fs->ir.loopCount++;
+            Mark(IrKind::Preheader, id);
+            Mark(IrKind::LoopBegin, id);
+            Mark(IrKind::Label, body);
+            size_t mark = fs->active.size();
+            loop->var->vreg = window + 3;
+            Activate(loop->var);
+            fs->loops.push_back({ exit, mark });
+            LowerStats(loop->body);
+            fs->loops.pop_back();
+            EndScope(mark, false);
+            Emit(OpCode::ForLoop, window, body, 0, loop->line);
+            Mark(IrKind::LoopEnd, id);
+            Mark(IrKind::Label, exit);
+        }
+
+        // 迭代函数、状态与控制变量占窗口的前 3 个寄存器，其后是调用迭代函数的窗口，返回值即循环变量。
+        // 检查放在循环体之后：每一轮复制迭代函数与参数、调用，TForLoop 在第一个返回值不为 nil 时跳回循环体
+        void LowerGenericFor(GenericForStat* loop)
+        {
+            static constexpr uint32_t ControlCount = 3;
+            uint32_t size = ControlCount + std::max(loop->varCount, ControlCount);
+            uint32_t index = 0;
+            for (Expr* expr = loop->values; expr != nullptr && index < ControlCount; expr = expr->next, ++index)
+            {
+                if (expr->next == nullptr && index + 1 < ControlCount && Expands(expr))
+                    size = std::max(size, index + MultiWindowSize(expr));
+            }
+            uint32_t window = fs->ir.NewWindow(size);
+
+            // explist 调整为 3 个值：末尾的调用或 ... 展开补足，多出的表达式只求值
+            index = 0;
+            for (Expr* expr = loop->values; expr != nullptr; expr = expr->next)
+            {
+                if (index == ControlCount)
+                {
+                    Discard(expr);
+                    continue;
+                }
+                if (expr->next == nullptr && index + 1 < ControlCount && Expands(expr))
+                {
+                    MultiToRegs(expr, window + index, ControlCount - index);
+                    index = ControlCount;
+                    break;
+                }
+                ExprToReg(expr, window + index++);
+            }
+            for (; index < ControlCount; ++index)
+                Emit(OpCode::LoadNil, window + index, 0, 0, loop->line);
+
+            uint32_t body = fs->ir.NewLabel();
+            uint32_t check = fs->ir.NewLabel();
+            uint32_t exit = fs->ir.NewLabel();
+            uint32_t id = fs->ir.loopCount++;
+            Mark(IrKind::Preheader, id);
+            Emit(OpCode::Jmp, check, 0, 0, loop->line);
+            Mark(IrKind::LoopBegin, id);
+            Mark(IrKind::Label, body);
+            size_t mark = fs->active.size();
+            uint32_t i = 0;
+            for (LocalVar* var = loop->vars; var != nullptr; var = var->next)
+            {
+                var->vreg = window + ControlCount + i++;
+                Activate(var);
+            }
+            fs->loops.push_back({ exit, mark });
+            LowerStats(loop->body);
+            fs->loops.pop_back();
+            EndScope(mark, false);
+
+            Mark(IrKind::Label, check);
+            for (i = 0; i < ControlCount; ++i)
+                Emit(OpCode::Move, window + ControlCount + i, window + i, 0, loop->line);
+            Emit(OpCode::Call, window + ControlCount, 2, loop->varCount, loop->line);
+            Emit(OpCode::TForLoop, window, body, 0, loop->line);
+            Mark(IrKind::LoopEnd, id);
+            Mark(IrKind::Label, exit);
+        }
+    };
+}
@@ -0,0 +1,1302 @@
+﻿#pragma once
+
+#include "LuaLibrary.h"
+#include "LuaTable.h"
+
+#include <bit>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+#include <dlfcn.h>
+#endif
+
+namespace Engine
+{
+    // 直接按调用约定调用 C 函数：x86-64 System V 与 AArch64 上整数（含指针）参数与浮点参数
+    // 各自依次占用寄存器，互不影响，因此任何不超过寄存器个数的签名都可以用同一个
+    // "6 个整数 + 8 个浮点数" 的函数指针类型调用，多出的寄存器被被调函数忽略
+#if (defined(__x86_64__) && !defined(_WIN32)) || (defined(__aarch64__) && !defined(_WIN32))
+    inline constexpr bool NativeCallsSupported = true;
+#else
+    inline constexpr bool NativeCallsSupported = false;
+#endif
+
+    enum class CKind : uint8_t
+    {
+        Void, Bool, Int, Float, Pointer, Array, Struct,
+    };
+
+    struct CType;
+
+    struct CField
+    {
+        std::string name;
+        const CType* type;
+        size_t offset;
+    };
+
+    // C 类型。基本类型、结构体与 typedef 的名字登记在 CTypes 中，指针与数组类型按需创建并复用
+    struct CType
+    {
+        CKind kind = CKind::Void;
+        size_t size = 0;
+        size_t align = 1;
+        bool isSigned = false;          // Int
+        bool isChar = false;            // char、signed char、unsigned char：可以接收 Lua 字符串，ffi.string 按字节读取
+        bool complete = true;           // 只有前置声明的结构体为 false
+        const CType* target = nullptr;  // Pointer 所指、Array 元素的类型
+        size_t count = 0;               // Array 元素个数，0 表示由 ffi.new 的参数决定（T[?]）
+        std::string name;               // 用于错误信息
+        std::vector<CField> fields;     // Struct
+
+        const CField* Field(std::string_view fieldName) const
+        {
+            for (const CField& field : fields)
+            {
+                if (field.name == fieldName)
+                    return &field;
+            }
+            return nullptr;
+        }
+    };
+
+    struct CFunction
+    {
+        std::string name;
+        const CType* result;
+        std::vector<const CType*> params;
+        bool variadic = false;      // 参数表以 ... 结尾，可以声明但不能调用
+    };
+
+    // C 声明的子集：基本整数与浮点类型（含 stdint.h 与 size_t 等）、指针、定长数组、结构体、typedef 与函数声明。
+    // 不支持位域、联合体、枚举、函数指针与按值传递的结构体；可变参数函数（如 snprintf）可以声明，调用时报错
+    class CTypes
+    {
+    public:
+        CTypes()
+        {
+            AddInt("bool", sizeof(bool), false)->kind = CKind::Bool;
+            AddInt("_Bool", sizeof(bool), false)->kind = CKind::Bool;
+            AddInt("int8_t", 1, true);
+            AddInt("uint8_t", 1, false);
+            AddInt("int16_t", 2, true);
+            AddInt("uint16_t", 2, false);
+            AddInt("int32_t", 4, true);
+            AddInt("uint32_t", 4, false);
+            AddInt("int64_t", 8, true);
+            AddInt("uint64_t", 8, false);
+            AddInt("size_t", sizeof(size_t), false);
+            AddInt("ssize_t", sizeof(size_t), true);
+            AddInt("ptrdiff_t", sizeof(ptrdiff_t), true);
+            AddInt("intptr_t", sizeof(intptr_t), true);
+            AddInt("uintptr_t", sizeof(uintptr_t), false);
+            AddFloat("float", sizeof(float));
+            AddFloat("double", sizeof(double));
+            CType& v = NewType(CKind::Void, "void");
+            v.complete = false;
+            names["void"] = &v;
+
+            chars[0] = AddInt("char", 1, std::is_signed_v<char>);
+            chars[1] = AddInt("signed char", 1, true);
+            chars[2] = AddInt("unsigned char", 1, false);
+            for (CType* c : chars)
+                c->isChar = true;
+        }
+
+        CTypes(const CTypes&) = delete;
+        CTypes& operator=(const CTypes&) = delete;
+
+        // 解析一段声明（ffi.cdef）。重复声明同一个函数或 typedef 时以后者为准，
+        // 同名结构体的重复定义必须与之前的布局一致
+        void Declare(std::string_view source)
+        {
+            Start(source);
+            while (!AtEnd())
+            {
+                if (Accept(";"))
+                    continue;
+                bool isTypedef = Accept("typedef");
+                const CType* base = ParseSpecifiers();
+                if (Accept(";"))
+                    continue;   // 只定义结构体
+                do
+                {
+                    std::string name;
+                    const CType* type = ParseDeclarator(base, name);
+                    if (name.empty())
+                        Error("缺少名字");
+                    if (isTypedef)
+                    {
+                        names[name] = type;
+                    }
+                    else if (Accept("("))
+                    {
+                        CFunction function{ name, type, {} };
+                        ParseParams(function);
+                        functions[name] = std::move(function);
+                    }
+                    else
+                    {
+                        Error("不支持声明变量 '" + name + "'");
+                    }
+                } while (Accept(","));
+                Expect(";");
+            }
+        }
+
+        // 解析类型名（ffi.new、ffi.cast、ffi.sizeof 的参数），如 "int[?]"、"struct point *"、"uint8_t[16]"
+        const CType* ParseTypeName(std::string_view text)
+        {
+            Start(text);
+            const CType* base = ParseSpecifiers();
+            std::string name;
+            const CType* type = ParseDeclarator(base, name);
+            if (!name.empty() || !AtEnd())
+                Error("类型名无效");
+            return type;
+        }
+
+        const CFunction* Function(std::string_view name) const
+        {
+            auto found = functions.find(std::string(name));
+            return found == functions.end() ? nullptr : &found->second;
+        }
+
+        const CType* PointerTo(const CType* target)
+        {
+            auto [slot, inserted] = pointers.try_emplace(target, nullptr);
+            if (inserted)
+            {
+                CType& type = NewType(CKind::Pointer, target->name + "*");
+                type.size = type.align = sizeof(void*);
+                type.target = target;
+                slot->second = &type;
+            }
+            return slot->second;
+        }
+
+        const CType* ArrayOf(const CType* element, size_t count)
+        {
+            if (element->kind == CKind::Void || !element->complete)
+                Error("数组元素的类型不完整：" + element->name);
+            if (count != 0 && element->size > SIZE_MAX / count)
+                Error("数组过大");
+            auto [slot, inserted] = arrays.try_emplace({ element, count }, nullptr);
+            if (inserted)
+            {
+                CType& type = NewType(CKind::Array, element->name + "[" + (count == 0 ? "?" : std::to_string(count)) + "]");
+                type.size = element->size * count;
+                type.align = element->align;
+                type.target = element;
+                type.count = count;
+                slot->second = &type;
+            }
+            return slot->second;
+        }
+
+    private:
+        std::deque<CType> types;    // 地址保持不变
+        std::unordered_map<std::string, const CType*> names;   // 基本类型、typedef 与 "struct 名字"
+        std::unordered_map<std::string, CFunction> functions;
+        std::unordered_map<const CType*, const CType*> pointers;
+        std::map<std::pair<const CType*, size_t>, const CType*> arrays;
+        CType* chars[3] = {};       // char、signed char、unsigned char
+
+        std::string_view source;
+        size_t pos = 0;
+        std::string_view token;     // 当前记号，到达末尾时为空
+
+        CType& NewType(CKind kind, std::string name)
+        {
+            CType& type = types.emplace_back();
+            type.kind = kind;
+            type.name = std::move(name);
+            return type;
+        }
+
+        CType* AddInt(const char* name, size_t size, bool isSigned)
+        {
+            CType& type = NewType(CKind::Int, name);
+            type.size = type.align = size;
+            type.isSigned = isSigned;
+            names[name] = &type;
+            return &type;
+        }
+
+        void AddFloat(const char* name, size_t size)
+        {
+            CType& type = NewType(CKind::Float, name);
+            type.size = type.align = size;
+            names[name] = &type;
+        }
+
+        const CType* Named(const std::string& name) const
+        {
+            auto found = names.find(name);
+            return found == names.end() ? nullptr : found->second;
+        }
+
+        [[noreturn]] void Error(const std::string& message) const
+        {
+            throw std::runtime_error("C 声明错误：" + message + (token.empty() ? "" : "（在 '" + std::string(token) + "' 处）"));
+        }
+
+        // 记号：标识符、十进制数、"..." 与单个标点；跳过空白、注释与预处理行
+        void Start(std::string_view text)
+        {
+            source = text;
+            pos = 0;
+            Advance();
+        }
+
+        void Advance()
+        {
+            for (;;)
+            {
+                while (pos < source.size() && std::isspace(static_cast<unsigned char>(source[pos])))
+                    ++pos;
+                if (source.substr(pos, 2) == "//" || (pos < source.size() && source[pos] == '#'))
+                {
+                    while (pos < source.size() && source[pos] != '\n')
+                        ++pos;
+                }
+                else if (source.substr(pos, 2) == "/*")
+                {
+                    size_t end = source.find("*/", pos + 2);
+                    pos = end == std::string_view::npos ? source.size() : end + 2;
+                }
+                else
+                {
+                    break;
+                }
+            }
+            size_t start = pos;
+            if (pos >= source.size())
+            {
+                token = {};
+                return;
+            }
+            auto isWord = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; };
+            if (isWord(source[pos]))
+            {
+                while (pos < source.size() && isWord(source[pos]))
+                    ++pos;
+            }
+            else if (source.substr(pos, 3) == "...")
+            {
+                pos += 3;
+            }
+            else
+            {
+                ++pos;
+            }
+            token = source.substr(start, pos - start);
+        }
+
+        bool AtEnd() const { return token.empty(); }
+
+        bool Accept(std::string_view text)
+        {
+            if (token != text)
+                return false;
+            Advance();
+            return true;
+        }
+
+        void Expect(std::string_view text)
+        {
+            if (!Accept(text))
+                Error("预期 '" + std::string(text) + "'");
+        }
+
+        bool IsIdentifier() const
+        {
+            return !token.empty() && (std::isalpha(static_cast<unsigned char>(token[0])) || token[0] == '_');
+        }
+
+        std::string ExpectIdentifier()
+        {
+            if (!IsIdentifier())
+                Error("预期标识符");
+            std::string name(token);
+            Advance();
+            return name;
+        }
+
+        // 类型说明符：限定符被忽略，整数类型由 signed/unsigned/short/long/char/int 的组合决定
+        const CType* ParseSpecifiers()
+        {
+            const CType* named = nullptr;
+            bool isUnsigned = false, isSigned = false, isShort = false, isChar = false, isInt = false;
+            int longs = 0;
+            for (;;)
+            {
+                if (token == "const" || token == "volatile" || token == "extern" || token == "static" ||
+                    token == "inline" || token == "restrict" || token == "__restrict")
+                {
+                    Advance();
+                }
+                else if (token == "unsigned") { isUnsigned = true; Advance(); }
+                else if (token == "signed") { isSigned = true; Advance(); }
+                else if (token == "short") { isShort = true; Advance(); }
+                else if (token == "long") { ++longs; Advance(); }
+                else if (token == "char") { isChar = true; Advance(); }
+                else if (token == "int") { isInt = true; Advance(); }
+                else if (token == "struct")
+                {
+                    Advance();
+                    named = ParseStruct();
+                }
+                else if (token == "union" || token == "enum")
+                {
+                    Error("不支持 " + std::string(token));
+                }
+                else if (named == nullptr && !isUnsigned && !isSigned && !isShort && !isChar && !isInt && longs == 0 &&
+                    IsIdentifier() && Named(std::string(token)) != nullptr)
+                {
+                    named = Named(std::string(token));
+                    Advance();
+                }
+                else
+                {
+                    break;
+                }
+            }
+
+            bool modified = isUnsigned || isSigned || isShort || isChar || isInt || longs > 0;
+            if (named != nullptr)
+            {
+                if (modified)
+                    Error("类型说明符冲突");
+                return named;
+            }
+            if (!modified)
+                Error("缺少类型");
+            if (isChar)
+                return chars[isUnsigned ? 2 : isSigned ? 1 : 0];
+            const char* name;
+            if (isShort)
+                name = isUnsigned ? "uint16_t" : "int16_t";
+            else if (longs >= 2)
+                name = isUnsigned ? "uint64_t" : "int64_t";
+            else if (longs == 1)
+                name = sizeof(long) == 8 ? (isUnsigned ? "uint64_t" : "int64_t") : (isUnsigned ? "uint32_t" : "int32_t");
+            else
+                name = isUnsigned ? "uint32_t" : "int32_t";
+            return Named(name);
+        }
+
+        // struct 名字 [{ 成员 }]，成员按 C 的对齐规则布局
+        const CType* ParseStruct()
+        {
+            std::string tag = IsIdentifier() ? ExpectIdentifier() : std::string();
+            std::string key = "struct " + tag;
+            CType* type = nullptr;
+            if (!tag.empty())
+            {
+                if (const CType* existing = Named(key))
+                    type = const_cast<CType*>(existing);
+            }
+            if (type == nullptr)
+            {
+                type = &NewType(CKind::Struct, tag.empty() ? "struct" : key);
+                type->complete = false;
+                if (!tag.empty())
+                    names[key] = type;
+            }
+            if (!Accept("{"))
+            {
+                if (tag.empty())
+                    Error("匿名结构体缺少成员");
+                return type;
+            }
+
+            std::vector<CField> fields;
+            size_t size = 0, align = 1;
+            while (!Accept("}"))
+            {
+                const CType* base = ParseSpecifiers();
+                do
+                {
+                    std::string name;
+                    const CType* fieldType = ParseDeclarator(base, name);
+                    if (token == ":")
+                        Error("不支持位域");
+                    if (!fieldType->complete || fieldType->kind == CKind::Void || (fieldType->kind == CKind::Array && fieldType->count == 0))
+                        Error("成员 '" + name + "' 的类型不完整");
+                    size = (size + fieldType->align - 1) / fieldType->align * fieldType->align;
+                    fields.push_back({ name, fieldType, size });
+                    size += fieldType->size;
+                    align = std::max(align, fieldType->align);
+                } while (Accept(","));
+                Expect(";");
+            }
+            size = (size + align - 1) / align * align;
+
+            if (type->complete)
+            {
+                bool same = type->size == size && type->fields.size() == fields.size();
+                for (size_t i = 0; same && i < fields.size(); ++i)
+                    same = type->fields[i].name == fields[i].name && type->fields[i].type == fields[i].type;
+                if (!same)
+                    Error("结构体 '" + tag + "' 重复定义且布局不同");
+                return type;
+            }
+            type->fields = std::move(fields);
+            type->size = size;
+            type->align = align;
+            type->complete = true;
+            return type;
+        }
+
+        // 声明符：若干 '*'（可带 const）、可选的名字、若干 [N] 或一个 [?]
+        const CType* ParseDeclarator(const CType* base, std::string& name)
+        {
+            const CType* type = base;
+            while (Accept("*"))
+            {
+                type = PointerTo(type);
+                while (Accept("const") || Accept("volatile") || Accept("restrict") || Accept("__restrict"))
+                { }
+            }
+            if (IsIdentifier())
+                name = ExpectIdentifier();
+            std::vector<size_t> dims;
+            while (Accept("["))
+            {
+                if (Accept("?"))
+                {
+                    if (!dims.empty())
+                        Error("只有最外层维度可以为 ?");
+                    dims.push_back(0);
+                }
+                else
+                {
+                    if (token.empty() || !std::isdigit(static_cast<unsigned char>(token[0])))
+                        Error("数组长度必须是整数常量");
+                    size_t count = 0;
+                    for (char c : token)
+                    {
+                        if (!std::isdigit(static_cast<unsigned char>(c)) || count > SIZE_MAX / 10)
+                            Error("数组长度无效");
+                        count = count * 10 + static_cast<size_t>(c - '0');
+                    }
+                    if (count == 0)
+                        Error("数组长度必须大于 0");
+                    Advance();
+                    dims.push_back(count);
+                }
+                Expect("]");
+            }
+            // int a[2][3] 是 3 个 int 组成的数组再组成 2 个
+            for (size_t i = dims.size(); i-- > 0;)
+                type = ArrayOf(type, dims[i]);
+            return type;
+        }
+
+        void ParseParams(CFunction& function)
+        {
+            if (function.result->kind == CKind::Struct || function.result->kind == CKind::Array)
+                Error("不支持返回结构体或数组的函数 '" + function.name + "'");
+            if (token == "void")
+            {
+                // f(void) 没有参数；void* 等仍按参数解析
+                size_t saved = pos;
+                Advance();
+                if (Accept(")"))
+                    return;
+                pos = saved;
+                token = "void";
+            }
+            if (Accept(")"))
+                return;
+            do
+            {
+                if (Accept("..."))
+                {
+                    // 头文件中常与其他函数一起声明，因此只记下来，调用时再报错
+                    function.variadic = true;
+                    break;
+                }
+                const CType* base = ParseSpecifiers();
+                std::string name;
+                const CType* param = ParseDeclarator(base, name);
+                if (param->kind == CKind::Array)
+                    param = PointerTo(param->target);   // 数组参数退化为指针
+                if (param->kind == CKind::Struct || param->kind == CKind::Void)
+                    Error("不支持按值传递结构体或 void 参数（函数 '" + function.name + "'）");
+                function.params.push_back(param);
+            } while (Accept(","));
+            Expect(")");
+        }
+    };
+
+    // ffi 库：脚本用 ffi.cdef 声明 C 类型与函数，通过 ffi.C（进程中已加载的符号）或 ffi.load 打开的共享库
+    // 直接调用 C 函数，参数从 VM 的寄存器直接转换到调用约定要求的寄存器，不经过中间容器。
+    // cdata（ffi.new 分配的数组与结构体、C 函数返回的指针）表示为带专用元表的表，索引读写直接访问原始内存；
+    // ffi.new 分配的内存计入 VM 的内存统计，对象被回收时释放。
+    // 指针不做任何检查，脚本可以读写进程中的任意内存，只应对受信任的脚本开放（VM::OpenFFI）
+    class FFILibrary : public NativeLibrary
+    {
+    public:
+        static constexpr size_t MaxIntArgs = 6;     // 整数与指针参数的寄存器个数
+        static constexpr size_t MaxFloatArgs = 8;   // 浮点参数的寄存器个数
+
+        FFILibrary(Heap& heap, Caller call)
+            : NativeLibrary(heap, std::move(call))
+        { }
+
+        ~FFILibrary()
+        {
+            for (auto& [table, data] : cdata)
+            {
+                if (data.owned != 0)
+                    heap.GetMemory().Free(data.address, data.owned);
+            }
+#ifndef _WIN32
+            for (auto& [table, handle] : namespaces)
+            {
+                if (handle != nullptr && handle != processHandle)
+                    dlclose(handle);
+            }
+#endif
+        }
+
+        // 创建 ffi 库表
+        Table* Open()
+        {
+            Memory& memory = heap.GetMemory();
+            meta = heap.NewTable(0, 8);
+            auto setMeta = [&](Table* table, const char* name, Value::function fn) {
+                table->SetStr(memory, heap.NewString(name), Value(heap.NewFunction(std::move(fn))));
+            };
+            setMeta(meta, "__index", [this](std::span<const Value> args) { return Index(args); });
+            setMeta(meta, "__newindex", [this](std::span<const Value> args) { return NewIndex(args); });
+            setMeta(meta, "__len", [this](std::span<const Value> args) { return Length(args); });
+            setMeta(meta, "__eq", [this](std::span<const Value> args) { return Equal(args); });
+            setMeta(meta, "__gc", [this](std::span<const Value> args) { return Release(args); });
+            meta->SetStr(memory, heap.NewString("__metatable"), Value(heap.NewString("ffi")));
+
+            namespaceMeta = heap.NewTable(0, 2);
+            setMeta(namespaceMeta, "__index", [this](std::span<const Value> args) { return Resolve(args); });
+            namespaceMeta->SetStr(memory, heap.NewString("__metatable"), Value(heap.NewString("ffi")));
+
+            Table* lib = heap.NewTable(0, 12);
+            auto add = [&](std::string_view name, Value::function fn) { AddFunction(lib, name, std::move(fn)); };
+            add("cdef", [this](std::span<const Value> args) { return Cdef(args); });
+            add("load", [this](std::span<const Value> args) { return Load(args); });
+            add("new", [this](std::span<const Value> args) { return New(args); });
+            add("cast", [this](std::span<const Value> args) { return Cast(args); });
+            add("sizeof", [this](std::span<const Value> args) { return Sizeof(args); });
+            add("string", [this](std::span<const Value> args) { return ToString(args); });
+            add("copy", [this](std::span<const Value> args) { return Copy(args); });
+            add("fill", [this](std::span<const Value> args) { return Fill(args); });
+#ifndef _WIN32
+            processHandle = dlopen(nullptr, RTLD_NOW);
+#endif
+            lib->SetStr(memory, heap.NewString("C"), Value(NewNamespace(processHandle)));
+            return lib;
+        }
+
+        // 库持有的元表不一定能从全局变量到达（脚本可以把 ffi 置为 nil），由 VM 作为根标记
+        void MarkRoots(Heap& target) const
+        {
+            target.Mark(meta);
+            target.Mark(namespaceMeta);
+            for (const auto& [name, type] : parsed)
+                target.Mark(name);
+        }
+
+    private:
+        // 一个 cdata 对象：指针的 address 为指针的值；数组、结构体与装箱的标量为其内存的起始地址。
+        // owned 不为 0 时内存由本对象分配，回收时释放；否则为指针，或指向其他 cdata 内存的视图
+        // （视图所在的表以 meta 为键引用其所有者，使所有者不先于视图被回收）
+        struct CData
+        {
+            const CType* type;
+            uint8_t* address;
+            size_t count;       // 数组的元素个数
+            size_t owned;
+        };
+
+        CTypes types;
+        Table* meta = nullptr;
+        Table* namespaceMeta = nullptr;
+        std::unordered_map<const Table*, CData> cdata;
+        std::unordered_map<const Table*, void*> namespaces;     // ffi.C 与 ffi.load 的结果，值为库句柄
+        std::unordered_map<String*, const CType*> parsed;   // 类型名的解析结果，键作为根保持可达，地址不会被复用
+        void* processHandle = nullptr;
+
+        // C 函数：按 "6 个整数 + 8 个浮点数" 的签名调用，R 决定从哪个寄存器取返回值
+        template <typename R>
+        static R Invoke(void* fn, const uint64_t (&i)[MaxIntArgs], const double (&d)[MaxFloatArgs])
+        {
+            using Signature = R(*)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t,
+                double, double, double, double, double, double, double, double);
+            return reinterpret_cast<Signature>(fn)(i[0], i[1], i[2], i[3], i[4], i[5],
+                d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7]);
+        }
+
+        Table* NewNamespace(void* handle)
+        {
+            Table* table = heap.NewTable();
+            table->metatable = namespaceMeta;
+            namespaces[table] = handle;
+            return table;
+        }
+
+        // 新建 cdata 对象；anchor 为视图的所有者
+        Value NewCData(const CType* type, uint8_t* address, size_t count, size_t owned, Table* anchor = nullptr)
+        {
+            Table* table = heap.NewTable(0, anchor != nullptr ? 1 : 0);
+            if (anchor != nullptr)
+                table->Set(heap.GetMemory(), Value(meta), Value(anchor));
+            table->metatable = meta;
+            heap.RegisterFinalizer(table);
+            cdata[table] = { type, address, count, owned };
+            return Value(table);
+        }
+
+        Value NewPointer(const CType* pointer, void* address)
+        {
+            if (address == nullptr)
+                return Value();
+            return NewCData(pointer, static_cast<uint8_t*>(address), 0, 0);
+        }
+
+        CData* FindCData(const Value& value)
+        {
+            auto* table = std::get_if<Table*>(&value.value);
+            if (table == nullptr || (*table)->metatable != meta)
+                return nullptr;
+            auto found = cdata.find(*table);
+            return found == cdata.end() ? nullptr : &found->second;
+        }
+
+        CData& CheckCData(std::span<const Value> args, size_t arg, const char* name)
+        {
+            CData* data = arg < args.size() ? FindCData(args[arg]) : nullptr;
+            if (data == nullptr)
+                TypeError(args, arg, name, "cdata");
+            return *data;
+        }
+
+        // 类型名参数，解析结果按字符串缓存；也可以传入 cdata，取其类型
+        const CType* CheckType(std::span<const Value> args, size_t arg, const char* name)
+        {
+            if (arg < args.size())
+            {
+                if (auto* str = std::get_if<String*>(&args[arg].value))
+                {
+                    auto [slot, inserted] = parsed.try_emplace(*str, nullptr);
+                    if (inserted)
+                    {
+                        try
+                        {
+                            slot->second = types.ParseTypeName((*str)->View());
+                        }
+                        catch (...)
+                        {
+                            parsed.erase(slot);
+                            throw;
+                        }
+                    }
+                    return slot->second;
+                }
+                if (CData* data = FindCData(args[arg]))
+                    return data->type;
+            }
+            TypeError(args, arg, name, "C 类型名");
+        }
+
+        // 视图的所有者：自身拥有内存时为自身，否则沿用自身的所有者（指针没有所有者）
+        Table* AnchorOf(const Value& value, const CData& data)
+        {
+            Table* table = std::get<Table*>(value.value);
+            if (data.owned != 0)
+                return table;
+            const Value& owner = table->Get(Value(meta));
+            auto* anchor = std::get_if<Table*>(&owner.value);
+            return anchor != nullptr ? *anchor : nullptr;
+        }
+
+        // 对象的起始地址，数组退化为指针
+        static void* AddressOf(const CData& data)
+        {
+            return data.address;
+        }
+
+        // ---- 内存读写 ----
+
+        static int64_t ReadInt(const uint8_t* p, const CType* type)
+        {
+            switch (type->size)
+            {
+            case 1: return type->isSigned ? static_cast<int64_t>(static_cast<int8_t>(*p)) : static_cast<int64_t>(*p);
+            case 2: { uint16_t v; std::memcpy(&v, p, 2); return type->isSigned ? static_cast<int16_t>(v) : static_cast<int64_t>(v); }
+            case 4: { uint32_t v; std::memcpy(&v, p, 4); return type->isSigned ? static_cast<int32_t>(v) : static_cast<int64_t>(v); }
+            default: { int64_t v; std::memcpy(&v, p, 8); return v; }
+            }
+        }
+
+        static void WriteInt(uint8_t* p, const CType* type, int64_t value)
+        {
+            switch (type->size)
+            {
+            case 1: *p = static_cast<uint8_t>(value); break;
+            case 2: { auto v = static_cast<uint16_t>(value); std::memcpy(p, &v, 2); break; }
+            case 4: { auto v = static_cast<uint32_t>(value); std::memcpy(p, &v, 4); break; }
+            default: std::memcpy(p, &value, 8); break;
+            }
+        }
+
+        // 整数截断到 type 的宽度后按有无符号扩展，与 C 的整数转换相同
+        static double IntToNumber(uint64_t bits, const CType* type)
+        {
+            uint8_t bytes[8];
+            std::memcpy(bytes, &bits, 8);
+            int64_t value = ReadInt(bytes, type);
+            if (!type->isSigned && type->size == 8)
+                return static_cast<double>(static_cast<uint64_t>(value));
+            return static_cast<double>(value);
+        }
+
+        Value Read(const CType* type, uint8_t* p, Table* anchor)
+        {
+            switch (type->kind)
+            {
+            case CKind::Bool:
+                return Value(*p != 0);
+            case CKind::Int:
+            {
+                int64_t value = ReadInt(p, type);
+                if (!type->isSigned && type->size == 8)
+                    return Value(static_cast<double>(static_cast<uint64_t>(value)));
+                return Value(static_cast<double>(value));
+            }
+            case CKind::Float:
+                if (type->size == sizeof(float))
+                {
+                    float f;
+                    std::memcpy(&f, p, sizeof(f));
+                    return Value(static_cast<double>(f));
+                }
+                else
+                {
+                    double d;
+                    std::memcpy(&d, p, sizeof(d));
+                    return Value(d);
+                }
+            case CKind::Pointer:
+            {
+                void* address;
+                std::memcpy(&address, p, sizeof(address));
+                return NewPointer(type, address);
+            }
+            case CKind::Array:
+                return NewCData(type, p, type->count, 0, anchor);
+            case CKind::Struct:
+                return NewCData(type, p, 0, 0, anchor);
+            default:
+                throw std::runtime_error("无法读取 " + type->name + " 类型的值");
+            }
+        }
+
+        // 整数参数：数字须有整数表示，布尔值按 0 / 1
+        static int64_t ToInteger(const Value& value, const CType* type)
+        {
+            if (const bool* b = std::get_if<bool>(&value.value))
+                return *b ? 1 : 0;
+            double d;
+            int64_t result;
+            if (const double* number = std::get_if<double>(&value.value))
+                d = *number;
+            else
+                throw std::runtime_error("无法将 " + std::string(value.TypeName()) + " 转换为 " + type->name);
+            // 大于 int64 的无符号数按位转换
+            if (!type->isSigned && d >= 9223372036854775808.0 && d < 18446744073709551616.0)
+                return static_cast<int64_t>(static_cast<uint64_t>(d));
+            if (!NumberToInteger(d, result))
+                throw std::runtime_error("数字没有整数表示，无法转换为 " + type->name);
+            return result;
+        }
+
+        static double ToDouble(const Value& value, const CType* type)
+        {
+            if (const double* number = std::get_if<double>(&value.value))
+                return *number;
+            throw std::runtime_error("无法将 " + std::string(value.TypeName()) + " 转换为 " + type->name);
+        }
+
+        // 指针参数：nil 为空指针，cdata 取其地址；字符串只能传给 char* 与 void*（C 函数不应修改其内容），
+        // 参数以外的场合（allowString 为 false）不接受字符串，避免保存已被回收的字符串的地址
+        void* ToPointer(const Value& value, const CType* type, bool allowString)
+        {
+            if (value.IsNil())
+                return nullptr;
+            if (CData* data = FindCData(value))
+                return AddressOf(*data);
+            if (auto* str = std::get_if<String*>(&value.value))
+            {
+                const CType* target = type->target;
+                if (allowString && (target->isChar || target->kind == CKind::Void))
+                    return const_cast<char*>((*str)->Data());
+            }
+            throw std::runtime_error("无法将 " + std::string(value.TypeName()) + " 转换为 " + type->name);
+        }
+
+        void Write(const CType* type, uint8_t* p, const Value& value)
+        {
+            switch (type->kind)
+            {
+            case CKind::Bool:
+                *p = !value.IsFalsy() ? 1 : 0;
+                break;
+            case CKind::Int:
+                WriteInt(p, type, ToInteger(value, type));
+                break;
+            case CKind::Float:
+                if (type->size == sizeof(float))
+                {
+                    auto f = static_cast<float>(ToDouble(value, type));
+                    std::memcpy(p, &f, sizeof(f));
+                }
+                else
+                {
+                    double d = ToDouble(value, type);
+                    std::memcpy(p, &d, sizeof(d));
+                }
+                break;
+            case CKind::Pointer:
+            {
+                void* address = ToPointer(value, type, false);
+                std::memcpy(p, &address, sizeof(address));
+                break;
+            }
+            case CKind::Struct:
+            {
+                CData* data = FindCData(value);
+                if (data == nullptr || data->type != type)
+                    throw std::runtime_error("无法将 " + std::string(value.TypeName()) + " 赋值给 " + type->name);
+                std::memmove(p, data->address, type->size);
+                break;
+            }
+            default:
+                throw std::runtime_error("无法对 " + type->name + " 类型赋值");
+            }
+        }
+
+        // 用表（数组按顺序、结构体按成员名）或单个值初始化
+        void Initialize(const CType* type, uint8_t* p, size_t count, const Value& init)
+        {
+            if (init.IsNil())
+                return;
+            auto* table = std::get_if<Table*>(&init.value);
+            if (type->kind == CKind::Array)
+            {
+                const CType* element = type->target;
+                if (table == nullptr || FindCData(init) != nullptr)
+                {
+                    for (size_t i = 0; i < count; ++i)
+                        Write(element, p + i * element->size, init);
+                    return;
+                }
+                for (size_t i = 0; i < count; ++i)
+                {
+                    const Value& item = (*table)->GetInt(static_cast<int64_t>(i) + 1);
+                    if (item.IsNil())
+                        break;
+                    Initialize(element, p + i * element->size, element->count, item);
+                }
+            }
+            else if (type->kind == CKind::Struct && table != nullptr && FindCData(init) == nullptr)
+            {
+                Value key, value;
+                while ((*table)->Next(key, value))
+                {
+                    auto* name = std::get_if<String*>(&key.value);
+                    const CField* field = name != nullptr ? type->Field((*name)->View()) : nullptr;
+                    if (field == nullptr)
+                        throw std::runtime_error(type->name + " 没有成员 '" + key.ToString() + "'");
+                    Initialize(field->type, p + field->offset, field->type->count, value);
+                }
+            }
+            else
+            {
+                Write(type, p, init);
+            }
+        }
+
+        // ---- 元方法 ----
+
+        // 元素或成员的地址与类型；指向结构体的指针可以直接用 p.x 访问成员
+        uint8_t* Locate(CData& data, const Value& key, const CType*& type)
+        {
+            const CType* t = data.type;
+            if (t->kind == CKind::Pointer && t->target->kind == CKind::Struct && std::holds_alternative<String*>(key.value))
+                t = t->target;
+            if (t->kind == CKind::Struct)
+            {
+                auto* name = std::get_if<String*>(&key.value);
+                const CField* field = name != nullptr ? t->Field((*name)->View()) : nullptr;
+                if (field == nullptr)
+                    throw std::runtime_error(t->name + " 没有成员 '" + key.ToString() + "'");
+                type = field->type;
+                return data.address + field->offset;
+            }
+            if (t->kind != CKind::Pointer && t->kind != CKind::Array)
+                throw std::runtime_error("无法索引 " + t->name + " 类型的 cdata");
+            const double* number = std::get_if<double>(&key.value);
+            int64_t index;
+            if (number == nullptr || !NumberToInteger(*number, index))
+                throw std::runtime_error(t->name + " 的下标必须是整数");
+            type = t->target;
+            if (type->kind == CKind::Void || !type->complete)
+                throw std::runtime_error("无法通过 " + t->name + " 访问元素");
+            if (t->kind == CKind::Array && static_cast<uint64_t>(index) >= data.count)
+                throw std::runtime_error("下标 " + std::to_string(index) + " 超出 " + t->name + " 的范围（元素个数 " + std::to_string(data.count) + "）");
+            return data.address + index * static_cast<ptrdiff_t>(type->size);
+        }
+
+        Value Index(std::span<const Value> args)
+        {
+            CData& data = CheckCData(args, 0, "__index");
+            const CType* type;
+            uint8_t* p = Locate(data, args.size() > 1 ? args[1] : Value(), type);
+            return Read(type, p, AnchorOf(args[0], data));
+        }
+
+        Value NewIndex(std::span<const Value> args)
+        {
+            CData& data = CheckCData(args, 0, "__newindex");
+            const CType* type;
+            uint8_t* p = Locate(data, args.size() > 1 ? args[1] : Value(), type);
+            Write(type, p, args.size() > 2 ? args[2] : Value());
+            return Value();
+        }
+
+        Value Length(std::span<const Value> args)
+        {
+            CData& data = CheckCData(args, 0, "__len");
+            if (data.type->kind != CKind::Array)
+                throw std::runtime_error("无法获取 " + data.type->name + " 的长度");
+            return Value(static_cast<double>(data.count));
+        }
+
+        Value Equal(std::span<const Value> args)
+        {
+            CData* x = args.size() > 0 ? FindCData(args[0]) : nullptr;
+            CData* y = args.size() > 1 ? FindCData(args[1]) : nullptr;
+            return Value(x != nullptr && y != nullptr && x->address == y->address);
+        }
+
+        Value Release(std::span<const Value> args)
+        {
+            auto* table = args.empty() ? nullptr : std::get_if<Table*>(&args[0].value);
+            if (table == nullptr)
+                return Value();
+            auto found = cdata.find(*table);
+            if (found != cdata.end())
+            {
+                if (found->second.owned != 0)
+                    heap.GetMemory().Free(found->second.address, found->second.owned);
+                cdata.erase(found);
+            }
+            return Value();
+        }
+
+        // 命名空间中的函数在第一次访问时解析符号，之后直接从表中取得
+        Value Resolve(std::span<const Value> args)
+        {
+            auto* table = args.empty() ? nullptr : std::get_if<Table*>(&args[0].value);
+            auto* name = args.size() > 1 ? std::get_if<String*>(&args[1].value) : nullptr;
+            if (table == nullptr || name == nullptr)
+                return Value();
+            auto handle = namespaces.find(*table);
+            if (handle == namespaces.end())
+                return Value();
+            const CFunction* function = types.Function((*name)->View());
+            if (function == nullptr)
+                throw std::runtime_error("C 函数 '" + std::string((*name)->View()) + "' 未声明（先用 ffi.cdef 声明）");
+            if (!NativeCallsSupported)
+                throw std::runtime_error("当前平台不支持调用 C 函数");
+            if (function->variadic)
+            {
+                Value value(heap.NewFunction([function](std::span<const Value>) -> Value {
+                    throw std::runtime_error("不支持调用可变参数的 C 函数 '" + function->name + "'");
+                    }));
+                (*table)->SetStr(heap.GetMemory(), *name, value);
+                return value;
+            }
+            size_t ints = 0, floats = 0;
+            for (const CType* param : function->params)
+                (param->kind == CKind::Float ? floats : ints)++;
+            if (ints > MaxIntArgs || floats > MaxFloatArgs)
+                throw std::runtime_error("C 函数 '" + function->name + "' 的参数过多（至多 " + std::to_string(MaxIntArgs) +
+                    " 个整数或指针参数、" + std::to_string(MaxFloatArgs) + " 个浮点参数）");
+            void* fn = Symbol(handle->second, function->name);
+
+            Value value(heap.NewFunction([this, function, fn](std::span<const Value> callArgs) {
+                return CallC(*function, fn, callArgs);
+                }));
+            (*table)->SetStr(heap.GetMemory(), *name, value);
+            return value;
+        }
+
+        static void* Symbol(void* handle, const std::string& name)
+        {
+#ifndef _WIN32
+            if (handle != nullptr)
+            {
+                if (void* address = dlsym(handle, name.c_str()))
+                    return address;
+            }
+#else
+            (void)handle;
+#endif
+            throw std::runtime_error("找不到符号 '" + name + "'");
+        }
+
+        // 调用 C 函数：参数逐个从 VM 寄存器转换到整数与浮点寄存器数组
+        Value CallC(const CFunction& function, void* fn, std::span<const Value> args)
+        {
+            if (args.size() != function.params.size())
+                throw std::runtime_error("C 函数 '" + function.name + "' 需要 " + std::to_string(function.params.size()) +
+                    " 个参数，实际为 " + std::to_string(args.size()) + " 个");
+            uint64_t ints[MaxIntArgs] = {};
+            double floats[MaxFloatArgs] = {};
+            size_t ni = 0, nf = 0;
+            for (size_t i = 0; i < args.size(); ++i)
+            {
+                const CType* param = function.params[i];
+                switch (param->kind)
+                {
+                case CKind::Float:
+                    if (param->size == sizeof(float))
+                    {
+                        // float 参数占浮点寄存器的低 32 位
+                        auto f = static_cast<float>(ToDouble(args[i], param));
+                        floats[nf++] = std::bit_cast<double>(static_cast<uint64_t>(std::bit_cast<uint32_t>(f)));
+                    }
+                    else
+                    {
+                        floats[nf++] = ToDouble(args[i], param);
+                    }
+                    break;
+                case CKind::Pointer:
+                    ints[ni++] = reinterpret_cast<uintptr_t>(ToPointer(args[i], param, true));
+                    break;
+                default:
+                {
+                    // 窄整数按声明的类型截断后扩展到 64 位
+                    uint8_t bytes[8];
+                    WriteInt(bytes, param, ToInteger(args[i], param));
+                    ints[ni++] = static_cast<uint64_t>(ReadInt(bytes, param));
+                    break;
+                }
+                }
+            }
+
+            const CType* result = function.result;
+            switch (result->kind)
+            {
+            case CKind::Void:
+                Invoke<uint64_t>(fn, ints, floats);
+                return Value();
+            case CKind::Float:
+                if (result->size == sizeof(float))
+                    return Value(static_cast<double>(Invoke<float>(fn, ints, floats)));
+                return Value(Invoke<double>(fn, ints, floats));
+            case CKind::Pointer:
+                return NewPointer(result, reinterpret_cast<void*>(static_cast<uintptr_t>(Invoke<uint64_t>(fn, ints, floats))));
+            case CKind::Bool:
+                return Value((Invoke<uint64_t>(fn, ints, floats) & 0xff) != 0);
+            default:
+                return Value(IntToNumber(Invoke<uint64_t>(fn, ints, floats), result));
+            }
+        }
+
+        // ---- 库函数 ----
+
+        // ffi.cdef(声明)
+        Value Cdef(std::span<const Value> args)
+        {
+            char scratch[NumberBufferSize];
+            types.Declare(CheckString(args, 0, "cdef", scratch));
+            return Value();
+        }
+
+        // ffi.load(路径或库名)：打开共享库，返回其命名空间
+        Value Load(std::span<const Value> args)
+        {
+            char scratch[NumberBufferSize];
+            std::string path(CheckString(args, 0, "load", scratch));
+#ifndef _WIN32
+            void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+            if (handle == nullptr)
+            {
+                const char* message = dlerror();
+                throw std::runtime_error("无法加载共享库 '" + path + "'：" + (message != nullptr ? message : "未知错误"));
+            }
+            return Value(NewNamespace(handle));
+#else
+            throw std::runtime_error("当前平台不支持 ffi.load");
+#endif
+        }
+
+        // ffi.new(类型[, 元素个数][, 初值])：分配并清零。T[?] 的元素个数由第二个参数给出；
+        // 标量类型装箱为只有一个元素的数组，用 [0] 访问
+        Value New(std::span<const Value> args)
+        {
+            const CType* type = CheckType(args, 0, "new");
+            size_t init = 1;
+            size_t count = 0;
+            if (type->kind == CKind::Array && type->count == 0)
+            {
+                int64_t n = CheckInteger(args, 1, "new");
+                if (n < 0 || (type->target->size != 0 && static_cast<uint64_t>(n) > SIZE_MAX / type->target->size))
+                    ArgError(1, "new", "元素个数无效");
+                count = static_cast<size_t>(n);
+                init = 2;
+            }
+            else if (type->kind == CKind::Array)
+            {
+                count = type->count;
+            }
+            else if (type->kind == CKind::Void || !type->complete)
+            {
+                ArgError(0, "new", "类型不完整：" + type->name);
+            }
+            else if (type->kind != CKind::Struct)
+            {
+                type = types.ArrayOf(type, 1);
+                count = 1;
+            }
+
+            size_t bytes = type->kind == CKind::Array ? count * type->target->size : type->size;
+            size_t owned = std::max<size_t>(bytes, 1);
+            auto* address = static_cast<uint8_t*>(heap.GetMemory().Allocate(owned));
+            std::memset(address, 0, owned);
+            Value result;
+            try
+            {
+                result = NewCData(type, address, count, owned);
+            }
+            catch (...)
+            {
+                heap.GetMemory().Free(address, owned);
+                throw;
+            }
+            if (init < args.size())
+                Initialize(type, address, count, args[init]);
+            return result;
+        }
+
+        // ffi.cast(类型, 值)：转换为指针（数字为地址，cdata 取其地址）或数字
+        Value Cast(std::span<const Value> args)
+        {
+            const CType* type = CheckType(args, 0, "cast");
+            const Value value = args.size() > 1 ? args[1] : Value();
+            switch (type->kind)
+            {
+            case CKind::Pointer:
+                if (const double* number = std::get_if<double>(&value.value))
+                    return NewPointer(type, reinterpret_cast<void*>(static_cast<uintptr_t>(ToInteger(Value(*number), type))));
+                return NewPointer(type, ToPointer(value, type, false));
+            case CKind::Int:
+            case CKind::Bool:
+                if (CData* data = FindCData(value))
+                    return Value(IntToNumber(reinterpret_cast<uintptr_t>(AddressOf(*data)), type));
+                return Value(IntToNumber(static_cast<uint64_t>(ToInteger(value, type)), type));
+            case CKind::Float:
+                return Value(type->size == sizeof(float) ? static_cast<double>(static_cast<float>(ToDouble(value, type))) : ToDouble(value, type));
+            default:
+                ArgError(0, "cast", "无法转换为 " + type->name);
+            }
+        }
+
+        // ffi.sizeof(类型或 cdata)
+        Value Sizeof(std::span<const Value> args)
+        {
+            if (CData* data = args.empty() ? nullptr : FindCData(args[0]))
+            {
+                if (data->type->kind == CKind::Array)
+                    return Value(static_cast<double>(data->count * data->type->target->size));
+                return Value(static_cast<double>(data->type->size));
+            }
+            const CType* type = CheckType(args, 0, "sizeof");
+            if (!type->complete || (type->kind == CKind::Array && type->count == 0))
+                return Value();
+            return Value(static_cast<double>(type->size));
+        }
+
+        // ffi.string(指针或数组[, 长度])：没有长度时读到第一个 '\0'（数组最多读到末尾）
+        Value ToString(std::span<const Value> args)
+        {
+            if (!args.empty() && std::holds_alternative<String*>(args[0].value))
+                return args[0];
+            CData& data = CheckCData(args, 0, "string");
+            const auto* p = reinterpret_cast<const char*>(AddressOf(data));
+            size_t length;
+            if (args.size() > 1 && !args[1].IsNil())
+            {
+                int64_t n = CheckInteger(args, 1, "string");
+                if (n < 0)
+                    ArgError(1, "string", "长度不能为负");
+                length = static_cast<size_t>(n);
+            }
+            else if (data.type->kind == CKind::Array)
+            {
+                size_t limit = data.count * data.type->target->size;
+                const void* end = std::memchr(p, 0, limit);
+                length = end != nullptr ? static_cast<size_t>(static_cast<const char*>(end) - p) : limit;
+            }
+            else
+            {
+                length = std::strlen(p);
+            }
+            return Value(heap.NewString(std::string_view(p, length)));
+        }
+
+        // ffi.copy(目标, 源[, 长度])：源为字符串且没有长度时连同末尾的 '\0' 一起复制
+        Value Copy(std::span<const Value> args)
+        {
+            CData& target = CheckCData(args, 0, "copy");
+            const void* source;
+            size_t length;
+            if (args.size() > 1 && std::holds_alternative<String*>(args[1].value))
+            {
+                const String* str = std::get<String*>(args[1].value);
+                source = str->Data();
+                length = args.size() > 2 ? static_cast<size_t>(CheckInteger(args, 2, "copy")) : str->length + 1;
+                if (length > str->length + 1)
+                    ArgError(2, "copy", "长度超出字符串");
+            }
+            else
+            {
+                source = AddressOf(CheckCData(args, 1, "copy"));
+                length = static_cast<size_t>(CheckInteger(args, 2, "copy"));
+            }
+            std::memmove(AddressOf(target), source, length);
+            return Value();
+        }
+
+        // ffi.fill(目标, 长度[, 字节])
+        Value Fill(std::span<const Value> args)
+        {
+            CData& target = CheckCData(args, 0, "fill");
+            int64_t length = CheckInteger(args, 1, "fill");
+            int64_t byte = OptInteger(args, 2, "fill", 0);
+            if (length < 0)
+                ArgError(1, "fill", "长度不能为负");
+            std::memset(AddressOf(target), static_cast<int>(byte & 0xff), static_cast<size_t>(length));
+            return Value();
+        }
+    };
+}
@@ -0,0 +1,160 @@
+﻿#pragma once
+
+#include "LuaState.h"
+#include "LuaMemory.h"
+#include "LuaTable.h"
+
+#include <vector>
+
+namespace Engine
+{
+    // 上值描述：inStack 为真时引用外层函数的第 index 个寄存器，否则引用外层闭包的第 index 个上值
+    struct UpvalueDesc
+    {
+        String* name;
+        bool inStack;
+        uint32_t index;
+    };
+
+    // 局部变量的调试信息：在 [startPc, endPc) 范围内变量 name 存放于寄存器 reg
+    struct LocalVarInfo
+    {
+        String* name;
+        uint32_t startPc;
+        uint32_t endPc;
+        uint32_t reg;
+    };
+
+    // 内联展开的调试信息：[startPc, endPc) 是在第 line 行内联调用的函数 name 的函数体，
+    // 错误回溯据此补出被内联的调用层。展开可以嵌套，外层的在前
+    struct InlineInfo
+    {
+        String* name;
+        uint32_t startPc;
+        uint32_t endPc;
+        int line;
+        bool upvalue;       // 函数在调用处是上值
+    };
+
+    // __index 链的内联缓存：元表为 metatable 的值，键不在自身中时取 holder 哈希部分第 slot 个位置的值。
+    // 链上的表被修改或发生回收后 epoch 与虚拟机的不再一致，缓存须重新解析
+    struct IndexCache
+    {
+        Table* metatable;
+        Table* holder;
+        uint32_t slot;
+        uint64_t epoch;
+    };
+
+    // 延迟编译的函数体在源码中的位置，首次调用时从 text 的 [begin, end)（参数表的 '(' 到函数体的 end）编译。
+    // 编译后仍然保留，热重载按它比较函数体的源码，源码相同的函数不必重新编译
+    struct LazyBody
+    {
+        String* text = nullptr;     // 整段源码，为 nullptr 表示位置未知（立即编译或从快照加载的函数）
+        uint32_t begin = 0;
+        uint32_t end = 0;
+        int line = 0;               // begin 处的行列号
+        int column = 0;
+        bool method = false;        // 方法，隐含参数 self
+        bool deferred = false;      // 加载时延迟了编译，编译后仍为 true
+        uint32_t innerFunctions = 0;    // 函数体中定义的函数个数（含多层嵌套的），编译后各自有原型
+        bool pending = false;       // 还没有编译
+    };
+
+    // 延迟编译的函数体引用的外层常量：被常量传播的外层变量不占上值，按名字记下其值（编译后同样保留）
+    struct LazyConstant
+    {
+        String* name;
+        Value value;
+    };
+
+    // 函数原型：一个函数编译后的指令、常量、子函数与调试信息，由同一函数的全部闭包共享。
+    // 延迟编译的原型在编译前只有名字、参数个数（含是否可变参数）与上值描述
+    struct Proto : GCObject
+    {
+        explicit Proto(Memory& memory)
+            : code(memory), constants(memory), protos(memory), upvalues(memory), locals(memory), inlines(memory), lineInfo(memory),
+            indexCaches(memory), freeIndexCaches(memory), lazyConstants(memory)
+        { }
+
+        std::vector<Operation, HeapAllocator<Operation>> code;
+        std::vector<Value, HeapAllocator<Value>> constants;
+        std::vector<Proto*, HeapAllocator<Proto*>> protos;
+        std::vector<UpvalueDesc, HeapAllocator<UpvalueDesc>> upvalues;
+        std::vector<LocalVarInfo, HeapAllocator<LocalVarInfo>> locals;
+        std::vector<InlineInfo, HeapAllocator<InlineInfo>> inlines;
+        LineTable lineInfo;
+        std::vector<IndexCache, HeapAllocator<IndexCache>> indexCaches;     // GetFieldMeta / SelfMeta 指令的缓存，由 Operation::cache 引用
+        std::vector<uint16_t, HeapAllocator<uint16_t>> freeIndexCaches;     // 指令改写回泛型指令后空出的缓存
+        std::vector<LazyConstant, HeapAllocator<LazyConstant>> lazyConstants;
+        LazyBody lazy;
+        String* source = nullptr;   // 所在代码块的名字
+        String* name = nullptr;     // function a.b:c 与 local function 定义的函数名，其他函数为 nullptr
+        uint32_t numParams = 0;
+        bool vararg = false;        // 参数表以 ... 结尾（主代码块也是），多余的参数保存在帧的寄存器之下
+        uint32_t maxStack = 0;      // 需要的寄存器个数
+        int lineDefined = 0;        // 0 表示主代码块
+        GCObject* gclist = nullptr;
+
+        // 清空编译结果，保留各缓冲区已分配的容量
+        void Clear()
+        {
+            code.clear();
+            constants.clear();
+            protos.clear();
+            upvalues.clear();
+            locals.clear();
+            inlines.clear();
+            lineInfo.Clear();
+            indexCaches.clear();
+            freeIndexCaches.clear();
+            lazyConstants.clear();
+            lazy = {};
+            name = nullptr;
+            numParams = 0;
+            vararg = false;
+            maxStack = 0;
+            lineDefined = 0;
+        }
+
+        // 还没有编译的延迟编译函数
+        bool Pending() const { return lazy.pending; }
+
+        // 第 pc 条指令处存放于寄存器 reg 的局部变量名，没有时返回 nullptr；
+        // 内联展开的形参与调用处的变量共用寄存器时范围重叠，取起点最靠后（最内层）的，起点相同时取后记录的
+        String* LocalName(uint32_t reg, uint32_t pc) const
+        {
+            const LocalVarInfo* found = nullptr;
+            for (const LocalVarInfo& info : locals)
+            {
+                if (info.reg == reg && info.startPc <= pc && pc < info.endPc && (found == nullptr || info.startPc >= found->startPc))
+                    found = &info;
+            }
+            return found != nullptr ? found->name : nullptr;
+        }
+    };
+
+    // 上值：打开时 v 指向外层函数仍在栈上的寄存器，外层函数的变量离开作用域后关闭，
+    // 值被复制到 closed 中，v 改为指向 closed
+    struct Upvalue : GCObject
+    {
+        Value* v;
+        Value closed;
+        size_t level = 0;               // 打开时所引用的栈槽下标
+        Upvalue* openNext = nullptr;    // 打开的上值按 level 从高到低组成的链表
+        GCObject* gclist = nullptr;
+
+        bool IsOpen() const { return v != &closed; }
+    };
+
+    // 脚本函数的闭包：原型加上值数组，上值指针紧跟在对象之后
+    struct Closure : GCObject
+    {
+        Proto* proto;
+        uint32_t upvalueCount;
+        GCObject* gclist = nullptr;
+
+        Upvalue** Upvalues() { return reinterpret_cast<Upvalue**>(this + 1); }
+        Upvalue* const* Upvalues() const { return reinterpret_cast<Upvalue* const*>(this + 1); }
+    };
+}
@@ -0,0 +1,574 @@
+﻿#pragma once
+
+#include "LuaState.h"
+#include "LuaMemory.h"
+#include "LuaTable.h"
+#include "LuaFunction.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <string_view>
+
+namespace Engine
+{
+    // 回收与字符串驻留的统计
+    struct HeapStats
+    {
+        size_t collections = 0;
+        uint64_t pauseNanos = 0;        // 全部回收的停顿时间之和（含标记与清除）
+        uint64_t maxPauseNanos = 0;     // 单次回收的最长停顿
+        uint64_t internHits = 0;        // NewString 时内容相同的字符串已驻留
+        uint64_t internMisses = 0;      // NewString 时新建了字符串
+    };
+
+    // 每个 VM 一个的对象堆：字符串、函数、表、原型、闭包与上值经由 Memory 分配，采用标记-清除回收。
+    // 回收只在 VM 的安全点进行（由 VM 提供根集合），编译期间新建的对象不会被回收。
+    // 标记阶段使用灰色链表（各对象的 gclist 字段）逐个遍历，不需要额外分配内存，也不会递归。
+    // 带 __gc 元方法的表在不可达时先连同其引用的对象一起复活，由 VM 调用终结器后才在之后的回收中释放。
+    class Heap
+    {
+    public:
+        static constexpr size_t MinStringTableSize = 128;
+        static constexpr size_t MinThreshold = 256 * 1024;   // 第一次回收前允许占用的字节数
+
+        explicit Heap(AllocFunction alloc = DefaultAlloc, void* userData = nullptr)
+            : memory(alloc, userData), arena(memory),
+            seed(static_cast<size_t>(std::chrono::steady_clock::now().time_since_epoch().count()) ^
+                reinterpret_cast<uintptr_t>(this))
+        {
+            ResizeStringTable(MinStringTableSize);
+
+            // 保留字预先驻留并固定，词法分析只需一次查表即可识别关键字
+            static constexpr const char* reservedWords[] = {
+                "and", "break", "do", "else", "elseif", "end",
+                "false", "for", "function", "goto", "if", "in",
+                "local", "nil", "not", "or", "repeat", "return",
+                "then", "true", "until", "while",
+            };
+            for (size_t i = 0; i < std::size(reservedWords); ++i)
+            {
+                String* word = NewString(reservedWords[i]);
+                word->reserved = static_cast<uint8_t>(i + 1);
+                word->fixed = true;
+            }
+        }
+
+        Heap(const Heap&) = delete;
+        Heap& operator=(const Heap&) = delete;
+
+        ~Heap()
+        {
+            while (objects != nullptr)
+            {
+                GCObject* next = objects->next;
+                FreeObject(objects);
+                objects = next;
+            }
+            memory.Free(strings, stringTableSize * sizeof(String*));
+        }
+
+        Memory& GetMemory() { return memory; }
+        const Memory& GetMemory() const { return memory; }
+
+        // 设置内存占用上限（字节），0 表示不限制；超出时分配抛出 MemoryError
+        void SetLimit(size_t bytes)
+        {
+            memory.SetLimit(bytes);
+            UpdateThreshold();
+        }
+
+        // 编译期临时数据使用的线性分配器
+        Arena& CompileArena() { return arena; }
+
+        // 取得内容为 text 的字符串对象，已存在时直接返回驻留的那一份
+        String* NewString(std::string_view text)
+        {
+            if (text.size() > UINT32_MAX)
+                throw MemoryError("字符串过长");
+
+            size_t hash = Hash(text);
+            size_t bucket = hash & (stringTableSize - 1);
+            for (String* str = strings[bucket]; str != nullptr; str = str->hashNext)
+            {
+                if (str->hash == hash && str->View() == text)
+                {
+                    stats.internHits++;
+                    return str;
+                }
+            }
+            stats.internMisses++;
+
+            if (stringCount >= stringTableSize)
+            {
+                ResizeStringTable(stringTableSize * 2);
+                bucket = hash & (stringTableSize - 1);
+            }
+
+            auto* str = new (memory.Allocate(sizeof(String) + text.size() + 1)) String();
+            str->type = ObjectType::String;
+            str->hash = hash;
+            str->length = static_cast<uint32_t>(text.size());
+            str->reserved = 0;
+            char* data = reinterpret_cast<char*>(str + 1);
+            std::memcpy(data, text.data(), text.size());
+            data[text.size()] = '\0';
+            Link(str);
+
+            str->hashNext = strings[bucket];
+            strings[bucket] = str;
+            stringCount++;
+            return str;
+        }
+
+        // 预留驻留表的空间，随后再创建 count 个字符串不会触发驻留表扩容（加载快照时使用）
+        void ReserveStrings(size_t count)
+        {
+            size_t size = stringTableSize;
+            while (size < stringCount + count)
+                size *= 2;
+            if (size != stringTableSize)
+                ResizeStringTable(size);
+        }
+
+        // 创建原生函数对象。func 捕获的状态超出 std::function 内联存储时
+        // 由 std::function 自行分配，这部分不计入统计
+        Function* NewFunction(Value::function func)
+        {
+            auto* fn = new (memory.Allocate(sizeof(Function))) Function();
+            fn->native = std::move(func);
+            fn->type = ObjectType::Function;
+            Link(fn);
+            return fn;
+        }
+
+        // 创建返回多个值的原生函数对象
+        Function* NewFunction(Value::multiFunction func)
+        {
+            auto* fn = new (memory.Allocate(sizeof(Function))) Function();
+            fn->multiple = std::move(func);
+            fn->type = ObjectType::Function;
+            Link(fn);
+            return fn;
+        }
+
+        // 创建表，并为数组部分与哈希部分预留空间
+        Table* NewTable(uint32_t arrayCount = 0, uint32_t hashCount = 0)
+        {
+            auto* table = new (memory.Allocate(sizeof(Table))) Table();
+            table->type = ObjectType::Table;
+            Link(table);
+            if (arrayCount > 0 || hashCount > 0)
+                table->Reserve(memory, arrayCount, hashCount);
+            return table;
+        }
+
+        Proto* NewProto()
+        {
+            auto* proto = new (memory.Allocate(sizeof(Proto))) Proto(memory);
+            proto->type = ObjectType::Proto;
+            Link(proto);
+            return proto;
+        }
+
+        // 创建闭包，上值由调用方随后填入
+        Closure* NewClosure(Proto* proto, uint32_t upvalueCount)
+        {
+            auto* closure = new (memory.Allocate(sizeof(Closure) + upvalueCount * sizeof(Upvalue*))) Closure();
+            closure->type = ObjectType::Closure;
+            closure->proto = proto;
+            closure->upvalueCount = upvalueCount;
+            std::fill(closure->Upvalues(), closure->Upvalues() + upvalueCount, nullptr);
+            Link(closure);
+            return closure;
+        }
+
+        // 创建引用栈槽 slot（下标为 level）的打开的上值
+        Upvalue* NewUpvalue(Value* slot, size_t level)
+        {
+            auto* upvalue = new (memory.Allocate(sizeof(Upvalue))) Upvalue();
+            upvalue->type = ObjectType::Upvalue;
+            upvalue->v = slot;
+            upvalue->level = level;
+            Link(upvalue);
+            return upvalue;
+        }
+
+        // 标记对象可达；含有引用的对象放入灰色链表，由 Collect 稍后遍历
+        void Mark(GCObject* object)
+        {
+            if (object == nullptr || object->marked)
+                return;
+            object->marked = true;
+            switch (object->type)
+            {
+            case ObjectType::Table:
+                static_cast<Table*>(object)->gclist = gray;
+                gray = object;
+                break;
+            case ObjectType::Closure:
+                static_cast<Closure*>(object)->gclist = gray;
+                gray = object;
+                break;
+            case ObjectType::Proto:
+                static_cast<Proto*>(object)->gclist = gray;
+                gray = object;
+                break;
+            case ObjectType::Upvalue:
+                static_cast<Upvalue*>(object)->gclist = gray;
+                gray = object;
+                break;
+            case ObjectType::Function:
+                static_cast<Function*>(object)->gclist = gray;
+                gray = object;
+                break;
+            default:
+                break;
+            }
+        }
+
+        void Mark(const Value& value)
+        {
+            switch (value.value.index())
+            {
+            case 3: // String*
+                Mark(*std::get_if<String*>(&value.value));
+                break;
+            case 4: // Function*
+                Mark(*std::get_if<Function*>(&value.value));
+                break;
+            case 5: // Closure*
+                Mark(*std::get_if<Closure*>(&value.value));
+                break;
+            case 6: // Table*
+                Mark(*std::get_if<Table*>(&value.value));
+                break;
+            default:
+                break;
+            }
+        }
+
+        // 占用达到阈值时应在下一个安全点回收
+        bool NeedsCollection() const
+        {
+            return memory.Stats().live >= threshold;
+        }
+
+        // 完整回收一次：markRoots 负责对全部根调用 Mark，之后未被标记的对象全部释放
+        template <typename MarkRoots>
+        void Collect(MarkRoots&& markRoots)
+        {
+            auto began = std::chrono::steady_clock::now();
+            markRoots();
+            // 已不可达但终结器尚未执行的对象继续存活
+            for (size_t i = pendingStart; i < finalizers.size(); ++i)
+                Mark(finalizers[i]);
+            Propagate();
+
+            // 登记过的对象中本次不可达的移入待终结区（不分配内存，只在原数组中划分）
+            auto live = std::partition(finalizers.begin(), finalizers.begin() + static_cast<ptrdiff_t>(pendingStart),
+                [](const Table* table) { return table->marked; });
+            size_t start = static_cast<size_t>(live - finalizers.begin());
+            for (size_t i = start; i < pendingStart; ++i)
+                Mark(finalizers[i]);
+            pendingStart = start;
+            Propagate();
+
+            Sweep();
+            UpdateThreshold();
+            auto pause = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - began).count());
+            stats.collections++;
+            stats.pauseNanos += pause;
+            stats.maxPauseNanos = std::max(stats.maxPauseNanos, pause);
+        }
+
+        size_t Collections() const { return stats.collections; }
+
+        // 依次访问堆中的全部对象（尚未被回收的不可达对象也包括在内）
+        template <typename Visit>
+        void ForEachObject(Visit&& visit)
+        {
+            for (GCObject* object = objects; object != nullptr; object = object->next)
+                visit(object);
+        }
+
+        const HeapStats& Stats() const { return stats; }
+
+        // 统计清零，并重新开始统计内存的累计分配量与峰值
+        void ResetStats()
+        {
+            stats = {};
+            memory.ResetCounters();
+        }
+
+        // 登记设置了带 __gc 元方法的元表的表（与 Lua 相同，设置元表之后才加入的 __gc 不起作用）
+        void RegisterFinalizer(Table* table)
+        {
+            if (table->finalize)
+                return;
+            finalizers.push_back(table);
+            std::swap(finalizers[pendingStart], finalizers.back());
+            pendingStart++;
+            table->finalize = true;
+        }
+
+        // 取出一个等待执行终结器的对象，没有时返回 nullptr。取出后对象恢复为普通对象，
+        // 终结器执行完后不再可达即在下一次回收中释放
+        Table* NextFinalizer()
+        {
+            if (pendingStart == finalizers.size())
+                return nullptr;
+            Table* table = finalizers.back();
+            finalizers.pop_back();
+            table->finalize = false;
+            return table;
+        }
+
+        // 把全部登记过的对象都标为等待终结（VM 析构时调用，依次执行剩余的终结器）
+        void FinalizeAll()
+        {
+            pendingStart = 0;
+        }
+
+    private:
+        // 与 Lua 的 luaS_hash 相同的字符串哈希，种子随堆随机，避免可预测的哈希冲突
+        size_t Hash(std::string_view text) const
+        {
+            size_t h = seed ^ text.size();
+            for (size_t i = text.size(); i > 0; --i)
+            {
+                h ^= (h << 5) + (h >> 2) + static_cast<unsigned char>(text[i - 1]);
+            }
+            return h;
+        }
+
+        // 遍历灰色链表，标记其中对象引用的全部对象
+        void Propagate()
+        {
+            while (gray != nullptr)
+            {
+                GCObject* object = gray;
+                switch (object->type)
+                {
+                case ObjectType::Table:
+                {
+                    auto* table = static_cast<Table*>(object);
+                    gray = table->gclist;
+                    Mark(table->metatable);
+                    for (uint32_t i = 0; i < table->arraySize; ++i)
+                        Mark(table->array[i]);
+                    for (uint32_t i = 0; i < table->nodeCapacity; ++i)
+                    {
+                        // 死键不标记，其引用的对象可以被回收，死键只作为探测链上的占位
+                        const Table::Node& node = table->nodes[i];
+                        if (!node.value.IsNil())
+                        {
+                            Mark(node.key);
+                            Mark(node.value);
+                        }
+                    }
+                    break;
+                }
+                case ObjectType::Closure:
+                {
+                    auto* closure = static_cast<Closure*>(object);
+                    gray = closure->gclist;
+                    Mark(closure->proto);
+                    for (uint32_t i = 0; i < closure->upvalueCount; ++i)
+                        Mark(closure->Upvalues()[i]);
+                    break;
+                }
+                case ObjectType::Proto:
+                {
+                    auto* proto = static_cast<Proto*>(object);
+                    gray = proto->gclist;
+                    Mark(proto->source);
+                    Mark(proto->name);
+                    for (const Value& constant : proto->constants)
+                        Mark(constant);
+                    for (Proto* child : proto->protos)
+                        Mark(child);
+                    for (const UpvalueDesc& desc : proto->upvalues)
+                        Mark(desc.name);
+                    for (const LocalVarInfo& info : proto->locals)
+                        Mark(info.name);
+                    for (const InlineInfo& info : proto->inlines)
+                        Mark(info.name);
+                    Mark(proto->lazy.text);
+                    for (const LazyConstant& constant : proto->lazyConstants)
+                    {
+                        Mark(constant.name);
+                        Mark(constant.value);
+                    }
+                    break;
+                }
+                case ObjectType::Upvalue:
+                {
+                    auto* upvalue = static_cast<Upvalue*>(object);
+                    gray = upvalue->gclist;
+                    Mark(*upvalue->v);
+                    break;
+                }
+                case ObjectType::Function:
+                {
+                    auto* fn = static_cast<Function*>(object);
+                    gray = fn->gclist;
+                    for (const Value& upvalue : fn->upvalues)
+                        Mark(upvalue);
+                    break;
+                }
+                default:
+                    gray = nullptr;
+                    break;
+                }
+            }
+        }
+
+        void Link(GCObject* object)
+        {
+            object->marked = false;
+            object->fixed = false;
+            object->next = objects;
+            objects = object;
+        }
+
+        void ResizeStringTable(size_t size)
+        {
+            auto* table = static_cast<String**>(memory.Allocate(size * sizeof(String*)));
+            std::fill(table, table + size, nullptr);
+            for (size_t i = 0; i < stringTableSize; ++i)
+            {
+                String* str = strings[i];
+                while (str != nullptr)
+                {
+                    String* next = str->hashNext;
+                    size_t bucket = str->hash & (size - 1);
+                    str->hashNext = table[bucket];
+                    table[bucket] = str;
+                    str = next;
+                }
+            }
+            memory.Free(strings, stringTableSize * sizeof(String*));
+            strings = table;
+            stringTableSize = size;
+        }
+
+        void Sweep()
+        {
+            // 先从驻留表摘除将被释放的字符串，再统一释放对象
+            for (size_t i = 0; i < stringTableSize; ++i)
+            {
+                String** link = &strings[i];
+                while (*link != nullptr)
+                {
+                    String* str = *link;
+                    if (!str->marked && !str->fixed)
+                    {
+                        *link = str->hashNext;
+                        stringCount--;
+                    }
+                    else
+                    {
+                        link = &str->hashNext;
+                    }
+                }
+            }
+
+            GCObject** link = &objects;
+            while (*link != nullptr)
+            {
+                GCObject* object = *link;
+                if (!object->marked && !object->fixed)
+                {
+                    *link = object->next;
+                    FreeObject(object);
+                }
+                else
+                {
+                    object->marked = false;
+                    link = &object->next;
+                }
+            }
+        }
+
+        // 下一次回收的阈值为本次回收后占用的两倍；设置了上限时，
+        // 剩余空间用掉一半就回收，尽量在触及上限之前回收掉垃圾
+        void UpdateThreshold()
+        {
+            const MemoryStats& stats = memory.Stats();
+            threshold = std::max(stats.live * 2, MinThreshold);
+            if (stats.limit != 0 && stats.live < stats.limit)
+            {
+                threshold = std::min(threshold, stats.live + (stats.limit - stats.live) / 2);
+            }
+        }
+
+        void FreeObject(GCObject* object)
+        {
+            switch (object->type)
+            {
+            case ObjectType::String:
+            {
+                auto* str = static_cast<String*>(object);
+                memory.Free(str, sizeof(String) + str->length + 1);
+                break;
+            }
+            case ObjectType::Function:
+            {
+                auto* fn = static_cast<Function*>(object);
+                fn->~Function();
+                memory.Free(fn, sizeof(Function));
+                break;
+            }
+            case ObjectType::Table:
+            {
+                auto* table = static_cast<Table*>(object);
+                table->Free(memory);
+                table->~Table();
+                memory.Free(table, sizeof(Table));
+                break;
+            }
+            case ObjectType::Proto:
+            {
+                auto* proto = static_cast<Proto*>(object);
+                proto->~Proto();
+                memory.Free(proto, sizeof(Proto));
+                break;
+            }
+            case ObjectType::Closure:
+            {
+                auto* closure = static_cast<Closure*>(object);
+                size_t size = sizeof(Closure) + closure->upvalueCount * sizeof(Upvalue*);
+                closure->~Closure();
+                memory.Free(closure, size);
+                break;
+            }
+            case ObjectType::Upvalue:
+            {
+                auto* upvalue = static_cast<Upvalue*>(object);
+                upvalue->~Upvalue();
+                memory.Free(upvalue, sizeof(Upvalue));
+                break;
+            }
+            }
+        }
+
+        Memory memory;
+        Arena arena;
+        size_t seed;
+
+        GCObject* objects = nullptr;    // 全部对象
+        GCObject* gray = nullptr;       // 已标记、其引用尚未遍历的对象
+        String** strings = nullptr;     // 字符串驻留表，大小为 2 的幂
+        size_t stringTableSize = 0;
+        size_t stringCount = 0;
+
+        size_t threshold = MinThreshold;
+        HeapStats stats;
+
+        // 带 __gc 的表：[0, pendingStart) 仍可达，[pendingStart, size) 已不可达、等待执行终结器
+        std::vector<Table*, HeapAllocator<Table*>> finalizers{ memory };
+        size_t pendingStart = 0;
+    };
+}
@@ -0,0 +1,301 @@
+﻿#pragma once
+
+#include "LuaState.h"
+#include "LuaMemory.h"
+#include "LuaAst.h"
+
+#include <vector>
+
+namespace Engine
+{
+    // 中间表示：每个函数一段线性的指令序列，操作码与字节码相同，
+    // 但寄存器操作数是不限个数的虚拟寄存器，跳转目标是标签编号。
+    // 虚拟寄存器由寄存器分配映射到实际寄存器后生成字节码（见 LuaCodegen.h）
+
+    enum class IrKind : uint8_t
+    {
+        Op,         // 一条指令
+        Label,      // a = 标签编号
+        Preheader,  // a = 循环编号；循环不变量外提的守卫在此处初始化（循环至少执行一次时才会经过）
+        LoopBegin,  // a = 循环编号；循环体（回边的目标）从此开始
+        LoopEnd,    // a = 循环编号
+        VarBegin,   // a = 虚拟寄存器，b = 局部变量下标；变量从此处起可见
+        VarEnd,     // a = 虚拟寄存器；变量离开作用域
+        VarName,    // a = 虚拟寄存器，b = 局部变量下标；不占作用域的变量名（内联展开的形参），
+                    // 从此处起到该虚拟寄存器最后一次被使用，在内联展开之中时以展开结束处为界
+        InlineBegin, // a = 内联展开下标；被内联的函数体从此开始
+        InlineEnd,  // a = 内联展开下标
+        Keep,       // a = 虚拟寄存器；不生成代码，使其一直存活到此处（被捕获的变量）
+        Nop,        // 已删除
+    };
+
+    struct IrInstr
+    {
+        IrKind kind;
+        OpCode op;
+        uint32_t a;
+        uint32_t b;
+        uint32_t c;
+        int line;
+    };
+
+    // 虚拟寄存器的属性
+    struct VregInfo
+    {
+        static constexpr uint32_t NoWindow = UINT32_MAX;
+
+        uint32_t window = NoWindow; // 所属窗口的第一个虚拟寄存器
+        uint32_t windowSize = 0;    // 窗口大小（只在窗口的第一个虚拟寄存器上有效）
+        int32_t fixed = -1;         // 固定的实际寄存器（参数与流式执行的顶层局部变量）
+        bool captured = false;      // 被闭包捕获，寄存器在变量关闭前不能复用
+    };
+
+    // 一次内联展开：调用处的函数名与行号，错误回溯据此还原被内联的调用层
+    struct IrInline
+    {
+        String* name;
+        int line;
+        bool upvalue;       // 函数在调用处是上值（未内联时回溯显示为 upvalue）
+    };
+
+    struct IrFunction
+    {
+        explicit IrFunction(Arena& arena)
+            : code(arena), vregs(arena), vars(arena), inlines(arena)
+        { }
+
+        std::vector<IrInstr, ArenaAllocator<IrInstr>> code;
+        std::vector<VregInfo, ArenaAllocator<VregInfo>> vregs;
+        std::vector<LocalVar*, ArenaAllocator<LocalVar*>> vars;  // VarBegin 与 VarName 引用的局部变量
+        std::vector<IrInline, ArenaAllocator<IrInline>> inlines; // InlineBegin 引用的内联展开
+        uint32_t labelCount = 0;
+        uint32_t loopCount = 0;
+        uint32_t fixedRegisters = 0;    // [0, fixedRegisters) 保留给固定寄存器
+
+        uint32_t NewVreg()
+        {
+            vregs.push_back({});
+            return static_cast<uint32_t>(vregs.size() - 1);
+        }
+
+        // 分配 size 个连续的虚拟寄存器，它们总是被映射到连续的实际寄存器
+        // （调用的函数与参数、for 循环的控制变量等）
+        uint32_t NewWindow(uint32_t size)
+        {
+            uint32_t base = static_cast<uint32_t>(vregs.size());
+            for (uint32_t i = 0; i < size; ++i)
+            {
+                VregInfo info;
+                info.window = base;
+                vregs.push_back(info);
+            }
+            vregs[base].windowSize = size;
+            return base;
+        }
+
+        uint32_t NewLabel() { return labelCount++; }
+    };
+
+    inline bool IsConstant(uint32_t operand)
+    {
+        return (operand & ConstantBit) != 0;
+    }
+
+    // 跳转指令中保存标签编号的操作数；不是跳转指令时返回 nullptr
+    inline uint32_t* JumpTarget(IrInstr& instr)
+    {
+        switch (instr.op)
+        {
+        case OpCode::Jmp:
+            return &instr.a;
+        case OpCode::Test:
+        case OpCode::ForPrep:
+        case OpCode::ForLoop:
+        case OpCode::TForLoop:
+        case OpCode::MetaTest:
+            return &instr.b;
+        default:
+            return IsCompareJump(instr.op) ? &instr.c : nullptr;
+        }
+    }
+
+    // 枚举一条指令读取（use）与写入（def）的虚拟寄存器；
+    // 窗口式指令（Call、Return、SetList、Self、VarArg、for 循环）展开为窗口中的各个寄存器。
+    // 个数不固定（MultipleValues）的部分只计入固定部分，之后延续到 top 的栈槽不是虚拟寄存器
+    template <typename Use, typename Def>
+    void ForEachOperand(const IrInstr& instr, Use&& use, Def&& def)
+    {
+        if (instr.kind == IrKind::Keep)
+        {
+            use(instr.a);
+            return;
+        }
+        if (instr.kind != IrKind::Op)
+            return;
+
+        auto useRK = [&](uint32_t operand) {
+            if (!IsConstant(operand))
+                use(operand);
+        };
+
+        switch (instr.op)
+        {
+        case OpCode::Move:
+        case OpCode::Unm:
+        case OpCode::Not:
+        case OpCode::Len:
+        case OpCode::BNot:
+            use(instr.b);
+            def(instr.a);
+            break;
+        case OpCode::LoadK:
+        case OpCode::LoadNil:
+        case OpCode::LoadBool:
+        case OpCode::GetUpval:
+        case OpCode::GetGlobal:
+        case OpCode::NewTable:
+        case OpCode::Closure:
+            def(instr.a);
+            break;
+        case OpCode::SetUpval:
+        case OpCode::SetGlobal:
+            useRK(instr.b);
+            break;
+        case OpCode::GetField:
+            use(instr.b);
+            def(instr.a);
+            break;
+        case OpCode::SetField:
+            use(instr.a);
+            useRK(instr.c);
+            break;
+        case OpCode::GetIndex:
+            use(instr.b);
+            useRK(instr.c);
+            def(instr.a);
+            break;
+        case OpCode::SetIndex:
+            use(instr.a);
+            useRK(instr.b);
+            useRK(instr.c);
+            break;
+        case OpCode::SetList:
+            for (uint32_t i = 0; i <= (instr.b & ~MultipleValues); ++i)
+                use(instr.a + i);
+            break;
+        case OpCode::Self:
+            use(instr.b);
+            useRK(instr.c);
+            def(instr.a);
+            def(instr.a + 1);
+            break;
+        case OpCode::Add: case OpCode::Sub: case OpCode::Mul: case OpCode::Div:
+        case OpCode::Mod: case OpCode::Pow: case OpCode::Idiv:
+        case OpCode::BAnd: case OpCode::BOr: case OpCode::BXor: case OpCode::Shl: case OpCode::Shr:
+        case OpCode::Concat:
+        case OpCode::Eq: case OpCode::Lt: case OpCode::Le:
+            useRK(instr.b);
+            useRK(instr.c);
+            def(instr.a);
+            break;
+        case OpCode::Jmp:
+            break;
+        case OpCode::Test:
+        case OpCode::MetaTest:
+            use(instr.a);
+            break;
+        case OpCode::MetaMark:
+            def(instr.a);
+            break;
+        case OpCode::Call:
+            for (uint32_t i = 0; i <= (instr.b & ~MultipleValues); ++i)
+                use(instr.a + i);
+            if (instr.c == MultipleValues)
+                def(instr.a);
+            for (uint32_t i = 0; i < instr.c && instr.c != MultipleValues; ++i)
+                def(instr.a + i);
+            break;
+        case OpCode::Return:
+            for (uint32_t i = 0; i < (instr.b & ~MultipleValues); ++i)
+                use(instr.a + i);
+            break;
+        case OpCode::VarArg:
+            if (instr.b == MultipleValues)
+                def(instr.a);
+            for (uint32_t i = 0; i < instr.b && instr.b != MultipleValues; ++i)
+                def(instr.a + i);
+            break;
+        case OpCode::ForPrep:
+            use(instr.a);
+            use(instr.a + 1);
+            use(instr.a + 2);
+            def(instr.a + 3);
+            break;
+        case OpCode::ForLoop:
+            use(instr.a);
+            use(instr.a + 1);
+            use(instr.a + 2);
+            def(instr.a);
+            def(instr.a + 3);
+            break;
+        case OpCode::TForLoop:
+            use(instr.a + 3);
+            def(instr.a + 2);
+            break;
+        case OpCode::Close:
+        case OpCode::Tbc:
+            use(instr.a);
+            break;
+        default:
+            if (IsImmediateJump(instr.op))
+            {
+                use(instr.a);
+            }
+            else if (IsCompareJump(instr.op))
+            {
+                useRK(instr.a);
+                useRK(instr.b);
+            }
+            break;
+        }
+    }
+
+    // 指令中作为寄存器（或 RK）的操作数，生成字节码时据此替换为实际寄存器
+    struct RegisterFields
+    {
+        bool a, b, c;
+    };
+
+    inline RegisterFields RegisterFieldsOf(OpCode op)
+    {
+        switch (op)
+        {
+        case OpCode::Move:
+        case OpCode::Unm: case OpCode::Not: case OpCode::Len: case OpCode::BNot:
+            return { true, true, false };
+        case OpCode::LoadK: case OpCode::LoadNil: case OpCode::LoadBool:
+        case OpCode::GetUpval: case OpCode::GetGlobal: case OpCode::NewTable: case OpCode::Closure:
+        case OpCode::SetList: case OpCode::Call: case OpCode::Return: case OpCode::VarArg:
+        case OpCode::ForPrep: case OpCode::ForLoop: case OpCode::TForLoop: case OpCode::Close: case OpCode::Tbc: case OpCode::Test:
+        case OpCode::MetaMark: case OpCode::MetaTest:
+            return { true, false, false };
+        case OpCode::SetUpval: case OpCode::SetGlobal:
+            return { false, true, false };
+        case OpCode::GetField:
+            return { true, true, false };
+        case OpCode::SetField:
+            return { true, false, true };
+        case OpCode::Jmp:
+            return { false, false, false };
+        case OpCode::EqJmp: case OpCode::NeJmp: case OpCode::LtJmp: case OpCode::NotLtJmp:
+        case OpCode::LeJmp: case OpCode::NotLeJmp:
+            return { true, true, false };
+        case OpCode::EqJmpI: case OpCode::NeJmpI: case OpCode::LtJmpI: case OpCode::NotLtJmpI:
+        case OpCode::LeJmpI: case OpCode::NotLeJmpI: case OpCode::GtJmpI: case OpCode::NotGtJmpI:
+        case OpCode::GeJmpI: case OpCode::NotGeJmpI:
+            return { true, false, false };
+        default:    // GetIndex、SetIndex、Self 与二元运算
+            return { true, true, true };
+        }
+    }
+}
@@ -1,24 +1,73 @@
 ﻿#pragma once
 
 #include "LuaState.h"
-#include <fstream>
+#include "LuaHeap.h"
+
+#include <charconv>
+#include <istream>
+#include <streambuf>
+#include <string_view>
 
 namespace Engine
 {
+    // 只读内存源码的 streambuf：直接引用调用方的内存构造输入流，不复制源码
+    class MemoryBuffer : public std::streambuf
+    {
+    public:
+        explicit MemoryBuffer(std::string_view source)
+        {
+            char* begin = const_cast<char*>(source.data());
+            setg(begin, begin, begin + source.size());
+        }
+    };
+
     class Lex
     {
     public:
-        Lex(std::ifstream& inputStream)
-            : input(inputStream), current(input.get())
+        // 标识符与字符串常量驻留到 heap 中。token 文本的暂存区同样从 heap 分配并在整个输入期间复用；
+        // 它不放在编译期 arena 中，因为语法分析器会按批次回收 arena
+        Lex(std::istream& inputStream, Heap& heap, std::string_view chunk = "?")
+            : input(inputStream.rdbuf()), heap(heap),
+            chunkName(heap.NewString(chunk)), current(EOF), scratch(heap.GetMemory())
         {
-            if (!input)
+            if (!inputStream || !input)
                 throw std::runtime_error("无效的输入流");
+            current = input->sbumpc();
+            SkipByteOrderMark();
         }
 
+        // 读取下一个 token，并记录其起始行列号
         Token NextToken()
+        {
+            return ScanToken();
+        }
+
+        String* ChunkName() const { return chunkName; }
+
+        // 输入从源码中间开始时（延迟编译的函数体），设置输入开头在整段源码中的行列号与字节偏移。
+        // 须在读取第一个 token 之前调用
+        void SetPosition(int startLine, int startColumn, uint32_t startOffset)
+        {
+            line = startLine;
+            column = startColumn;
+            offset = startOffset;
+        }
+
+    private:
+        // 以正在扫描的 token 的起始位置构造 token
+        Token MakeToken(TokenType type, Value value = Value()) const
+        {
+            return Token(type, value, tokenLine, tokenColumn, tokenOffset);
+        }
+
+        Token ScanToken()
         {
             while (current != EOF)
             {
+                tokenLine = line;
+                tokenColumn = column;
+                tokenOffset = offset;
+
                 // 空白字符（空格、制表符、换行、回车）
                 if (isspace(static_cast<unsigned char>(current)))
                 {
@@ -32,12 +81,23 @@ namespace Engine
                     return ReadIdentifier();
                 }
 
-                // 字符串（双引号包裹）
-                if (current == '"')
+                // 字符串（双引号或单引号包裹）
+                if (current == '"' || current == '\'')
                 {
                     return ReadString();
                 }
 
+                // 长字符串 [[ ]] / [==[ ]==]，内容原样保留、不处理转义
+                if (current == '[' && (PeekNext() == '[' || PeekNext() == '='))
+                {
+                    int level = ReadLongBracketLevel();
+                    if (level < 0)
+                        throw Error("无效的长字符串分隔符");
+                    scratch.clear();
+                    ReadLongBracket(level, true);
+                    return MakeToken(TokenType::String, heap.NewString(Scratch()));
+                }
+
                 // 数字（数字、小数点）
                 if (isdigit(static_cast<unsigned char>(current)) ||
                     (current == '.' && isdigit(static_cast<unsigned char>(PeekNext()))))
@@ -48,293 +108,422 @@ namespace Engine
                 // 算术运算符
                 if (current == '+')
                 {
-                    current = input.get();
-                    return { TokenType::Add, "+" };
+                    current = Read();
+                    return MakeToken(TokenType::Add);
                 }
                 if (current == '-')
                 {
-                    current = input.get();
-                    return { TokenType::Sub, "-" };
+                    current = Read();
+                    // -- 单行注释 / --[[ ]] 长注释
+                    if (current == '-')
+                    {
+                        SkipComment();
+                        continue;
+                    }
+                    return MakeToken(TokenType::Sub);
                 }
                 if (current == '*')
                 {
-                    current = input.get();
-                    return { TokenType::Mul, "*" };
+                    current = Read();
+                    return MakeToken(TokenType::Mul);
                 }
                 if (current == '/')
                 {
-                    current = input.get();
+                    current = Read();
                     // 检查是否为 //
                     if (current == '/')
                     {
-                        current = input.get();
-                        return { TokenType::Idiv, "//" };
+                        current = Read();
+                        return MakeToken(TokenType::Idiv);
                     }
-                    return { TokenType::Div, "/" };
+                    return MakeToken(TokenType::Div);
                 }
                 if (current == '%')
                 {
-                    current = input.get();
-                    return { TokenType::Mod, "%" };
+                    current = Read();
+                    return MakeToken(TokenType::Mod);
                 }
                 if (current == '^')
                 {
-                    current = input.get();
-                    return { TokenType::Pow, "^" };
+                    current = Read();
+                    return MakeToken(TokenType::Pow);
                 }
                 if (current == '#')
                 {
-                    current = input.get();
-                    return { TokenType::Len, "#" };
+                    current = Read();
+                    return MakeToken(TokenType::Len);
                 }
 
                 // 位运算符
                 if (current == '&')
                 {
-                    current = input.get();
-                    return { TokenType::BitAnd, "&" };
+                    current = Read();
+                    return MakeToken(TokenType::BitAnd);
                 }
                 if (current == '~')
                 {
-                    current = input.get();
+                    current = Read();
                     if (current == '=')
                     {
-                        current = input.get();
-                        return { TokenType::NotEq, "~=" };
+                        current = Read();
+                        return MakeToken(TokenType::NotEq);
                     }
-                    return { TokenType::BitXor, "~" };
+                    return MakeToken(TokenType::BitXor);
                 }
                 if (current == '|')
                 {
-                    current = input.get();
-                    return { TokenType::BitOr, "|" };
+                    current = Read();
+                    return MakeToken(TokenType::BitOr);
                 }
 
                 // 比较运算符
                 if (current == '=')
                 {
-                    current = input.get();
+                    current = Read();
                     if (current == '=')
                     {
-                        current = input.get();
-                        return { TokenType::Equal, "==" };
+                        current = Read();
+                        return MakeToken(TokenType::Equal);
                     }
-                    return { TokenType::Assign, "=" };
+                    return MakeToken(TokenType::Assign);
                 }
                 if (current == '<')
                 {
-                    current = input.get();
+                    current = Read();
                     if (current == '=')
                     {
-                        current = input.get();
-                        return { TokenType::LesEq, "<=" };
+                        current = Read();
+                        return MakeToken(TokenType::LesEq);
                     }
                     if (current == '<')
                     {
-                        current = input.get();
-                        return { TokenType::ShiftL, "<<" };
+                        current = Read();
+                        return MakeToken(TokenType::ShiftL);
                     }
-                    return { TokenType::Less, "<" };
+                    return MakeToken(TokenType::Less);
                 }
                 if (current == '>')
                 {
-                    current = input.get();
+                    current = Read();
                     if (current == '=')
                     {
-                        current = input.get();
-                        return { TokenType::GreEq, ">=" };
+                        current = Read();
+                        return MakeToken(TokenType::GreEq);
                     }
                     if (current == '>')
                     {
-                        current = input.get();
-                        return { TokenType::ShiftR, ">>" };
+                        current = Read();
+                        return MakeToken(TokenType::ShiftR);
                     }
-                    return { TokenType::Greater, ">" };
+                    return MakeToken(TokenType::Greater);
                 }
 
                 // 分隔符和括号
                 if (current == '(')
                 {
-                    current = input.get();
-                    return { TokenType::ParL, "(" };
+                    current = Read();
+                    return MakeToken(TokenType::ParL);
                 }
                 if (current == ')')
                 {
-                    current = input.get();
-                    return { TokenType::ParR, ")" };
+                    current = Read();
+                    return MakeToken(TokenType::ParR);
                 }
                 if (current == '{')
                 {
-                    current = input.get();
-                    return { TokenType::CurlyL, "{" };
+                    current = Read();
+                    return MakeToken(TokenType::CurlyL);
                 }
                 if (current == '}')
                 {
-                    current = input.get();
-                    return { TokenType::CurlyR, "}" };
+                    current = Read();
+                    return MakeToken(TokenType::CurlyR);
                 }
                 if (current == '[')
                 {
-                    current = input.get();
-                    return { TokenType::SqurL, "[" };
+                    current = Read();
+                    return MakeToken(TokenType::SqurL);
                 }
                 if (current == ']')
                 {
-                    current = input.get();
-                    return { TokenType::SqurR, "]" };
+                    current = Read();
+                    return MakeToken(TokenType::SqurR);
                 }
                 if (current == ';')
                 {
-                    current = input.get();
-                    return { TokenType::SemiColon, ";" };
+                    current = Read();
+                    return MakeToken(TokenType::SemiColon);
                 }
                 if (current == ':')
                 {
-                    current = input.get();
+                    current = Read();
                     if (current == ':')
                     {
-                        current = input.get();
-                        return { TokenType::DoubColon, "::" };
+                        current = Read();
+                        return MakeToken(TokenType::DoubColon);
                     }
-                    return { TokenType::Colon, ":" };
+                    return MakeToken(TokenType::Colon);
                 }
                 if (current == ',')
                 {
-                    current = input.get();
-                    return { TokenType::Comma, "," };
+                    current = Read();
+                    return MakeToken(TokenType::Comma);
                 }
                 if (current == '.')
                 {
-                    current = input.get();
+                    current = Read();
                     if (current == '.')
                     {
-                        current = input.get();
+                        current = Read();
                         if (current == '.')
                         {
-                            current = input.get();
-                            return { TokenType::Dots, "..." };
+                            current = Read();
+                            return MakeToken(TokenType::Dots);
                         }
-                        return { TokenType::Concat, ".." };
+                        return MakeToken(TokenType::Concat);
                     }
-                    return { TokenType::Dot, "." };
+                    return MakeToken(TokenType::Dot);
                 }
 
                 // 未知字符
-                throw std::runtime_error("未知字符: " + std::string(1, static_cast<char>(current)));
+                throw Error("未知字符: " + std::string(1, static_cast<char>(current)));
             }
 
-            return { TokenType::Eof };
+            tokenLine = line;
+            tokenColumn = column;
+            tokenOffset = offset;
+            return MakeToken(TokenType::Eof);
         }
 
-    private:
-        std::ifstream& input;
+        std::streambuf* input;  // 直接按字符读取 streambuf，省去 istream 每次读取的 sentry 开销
+        Heap& heap;
+        String* chunkName;
         int current;
+        int line = 1;           // current 所在的行列号
+        int column = 1;
+        int tokenLine = 1;      // 正在扫描的 token 起始行列号
+        int tokenColumn = 1;
+        uint32_t offset = 0;        // current 的字节偏移
+        uint32_t tokenOffset = 0;   // 正在扫描的 token 的起始字节偏移
+
+        HeapString scratch;         // 正在扫描的 token 文本
+
+        // 读取下一个字符，同时推进当前字符的行列号
+        int Read()
+        {
+            if (current == EOF)
+                return EOF;
+            if (current == '\n')
+            {
+                ++line;
+                column = 1;
+            }
+            else
+            {
+                ++column;
+            }
+            ++offset;
+            return input->sbumpc();
+        }
+
+        // 生成带 chunk:行:列 前缀的词法错误
+        SyntaxError Error(const std::string& message) const
+        {
+            return SyntaxError(std::string(chunkName->View()) + ":" + std::to_string(tokenLine) + ":" +
+                std::to_string(tokenColumn) + ": " + message, current == EOF);
+        }
+
+        void Append(int c)
+        {
+            scratch.push_back(static_cast<char>(c));
+        }
+
+        std::string_view Scratch() const
+        {
+            return std::string_view(scratch.data(), scratch.size());
+        }
+
+        // 与 luaL_loadfile 一致，跳过开头的 UTF-8 BOM
+        void SkipByteOrderMark()
+        {
+            if (current != 0xEF)
+                return;
+            if (input->sgetc() != 0xBB)
+                return;
+            input->sbumpc();
+            if (input->sbumpc() != 0xBF)
+                throw Error("无效的 UTF-8 BOM");
+            current = input->sbumpc();
+            offset = 3;
+        }
 
         // 查看下一个字符但不移动指针
         int PeekNext()
         {
-            if (input.eof())
-                return EOF;
-            return input.peek();
+            return input->sgetc();
+        }
+
+        // 跳过注释，进入时 current 为第二个 '-'
+        void SkipComment()
+        {
+            current = Read();
+            if (current == '[')
+            {
+                int level = ReadLongBracketLevel();
+                if (level >= 0)
+                {
+                    ReadLongBracket(level, false);
+                    return;
+                }
+            }
+            while (current != EOF && current != '\n')
+            {
+                current = Read();
+            }
+        }
+
+        // 读取长括号 [==[ 的级别（等号个数），不是长括号时返回 -1
+        int ReadLongBracketLevel()
+        {
+            current = Read(); // 跳过 [
+            int level = 0;
+            while (current == '=')
+            {
+                ++level;
+                current = Read();
+            }
+            if (current != '[')
+                return -1;
+            current = Read();
+            return level;
+        }
+
+        // 读取到与 level 匹配的 ]==] 为止；text 为真时是长字符串，内容追加到 scratch
+        // （与 Lua 相同，紧跟开头长括号的一个换行不计入），否则是长注释，直接跳过
+        void ReadLongBracket(int level, bool text)
+        {
+            if (text && current == '\r')
+                current = Read();
+            if (text && current == '\n')
+                current = Read();
+            while (true)
+            {
+                if (current == EOF)
+                    throw Error(text ? "未闭合的长字符串" : "未闭合的长注释");
+                if (current != ']')
+                {
+                    if (text)
+                        Append(current);
+                    current = Read();
+                    continue;
+                }
+                current = Read();
+                int closing = 0;
+                while (current == '=')
+                {
+                    ++closing;
+                    current = Read();
+                }
+                if (closing == level && current == ']')
+                {
+                    current = Read();
+                    return;
+                }
+                if (text)
+                {
+                    Append(']');
+                    for (int i = 0; i < closing; ++i)
+                        Append('=');
+                }
+            }
         }
 
         void SkipWhitespace()
         {
             while (current != EOF && isspace(static_cast<unsigned char>(current)))
             {
-                current = input.get();
+                current = Read();
             }
         }
 
         Token ReadIdentifier()
         {
-            std::string id;
+            scratch.clear();
             while (current != EOF &&
                 (isalnum(static_cast<unsigned char>(current)) || current == '_'))
             {
-                id += static_cast<char>(current);
-                current = input.get();
+                Append(current);
+                current = Read();
             }
 
-            // 检查是否为关键字
-            if (id == "and") return { TokenType::And, id };
-            if (id == "break") return { TokenType::Break, id };
-            if (id == "do") return { TokenType::Do, id };
-            if (id == "else") return { TokenType::Else, id };
-            if (id == "elseif") return { TokenType::Elseif, id };
-            if (id == "end") return { TokenType::End, id };
-            if (id == "false") return { TokenType::False, false };
-            if (id == "for") return { TokenType::For, id };
-            if (id == "function") return { TokenType::Function, id };
-            if (id == "goto") return { TokenType::Goto, id };
-            if (id == "if") return { TokenType::If, id };
-            if (id == "in") return { TokenType::In, id };
-            if (id == "local") return { TokenType::Local, id };
-            if (id == "nil") return { TokenType::Nil, std::monostate{} };
-            if (id == "not") return { TokenType::Not, id };
-            if (id == "or") return { TokenType::Or, id };
-            if (id == "repeat") return { TokenType::Repeat, id };
-            if (id == "return") return { TokenType::Return, id };
-            if (id == "then") return { TokenType::Then, id };
-            if (id == "true") return { TokenType::True, true };
-            if (id == "until") return { TokenType::Until, id };
-            if (id == "while") return { TokenType::While, id };
-
-            return { TokenType::Identifier, id };
+            // 保留字在堆创建时已驻留并带有序号，驻留后直接据此识别关键字
+            String* id = heap.NewString(Scratch());
+            if (id->reserved == 0)
+                return MakeToken(TokenType::Identifier, id);
+
+            auto type = static_cast<TokenType>(static_cast<int>(TokenType::And) + id->reserved - 1);
+            switch (type)
+            {
+            case TokenType::False: return MakeToken(type, false);
+            case TokenType::True:  return MakeToken(type, true);
+            case TokenType::Nil:   return MakeToken(type, std::monostate{});
+            default:               return MakeToken(type, id);
+            }
         }
 
         Token ReadString()
         {
-            std::string str;
-            current = input.get();
+            scratch.clear();
+            int delimiter = current;
+            current = Read();
 
-            while (current != EOF && current != '"')
+            while (current != EOF && current != delimiter)
             {
                 // 处理转义字符
                 if (current == '\\')
                 {
-                    current = input.get();
+                    current = Read();
                     switch (current)
                     {
-                    case 'a':  str += '\a'; break;
-                    case 'b':  str += '\b'; break;
-                    case 'f':  str += '\f'; break;
-                    case 'n':  str += '\n'; break;
-                    case 'r':  str += '\r'; break;
-                    case 't':  str += '\t'; break;
-                    case 'v':  str += '\v'; break;
-                    case '\\': str += '\\'; break;
-                    case '\"': str += '\"'; break;
-                    case '\'': str += '\''; break;
+                    case 'a':  Append('\a'); break;
+                    case 'b':  Append('\b'); break;
+                    case 'f':  Append('\f'); break;
+                    case 'n':  Append('\n'); break;
+                    case 'r':  Append('\r'); break;
+                    case 't':  Append('\t'); break;
+                    case 'v':  Append('\v'); break;
+                    case '\\': Append('\\'); break;
+                    case '\"': Append('\"'); break;
+                    case '\'': Append('\''); break;
                     case '\n': break; // 忽略换行符继续字符串
                     case EOF:
-                        throw std::runtime_error("字符串转义序列不完整");
+                        throw Error("字符串转义序列不完整");
                     default:
                         // 未知的转义字符，保留原样
-                        str += '\\';
-                        str += static_cast<char>(current);
+                        Append('\\');
+                        Append(current);
                         break;
                     }
                 }
                 else
                 {
-                    str += static_cast<char>(current);
+                    Append(current);
                 }
-                current = input.get();
+                current = Read();
             }
 
-            if (current != '"')
+            if (current != delimiter)
             {
-                throw std::runtime_error("未闭合的字符串");
+                throw Error("未闭合的字符串");
             }
 
-            current = input.get();
-            return { TokenType::String, str };
+            current = Read();
+            return MakeToken(TokenType::String, heap.NewString(Scratch()));
         }
 
         Token ReadNumber()
         {
-            std::string numStr;
+            scratch.clear();
             bool hasDecimal = false;
 
             // 读取数字部分
@@ -342,14 +531,14 @@ namespace Engine
             {
                 if (isdigit(static_cast<unsigned char>(current)))
                 {
-                    numStr += static_cast<char>(current);
-                    current = input.get();
+                    Append(current);
+                    current = Read();
                 }
                 else if (current == '.' && !hasDecimal)
                 {
                     hasDecimal = true;
-                    numStr += static_cast<char>(current);
-                    current = input.get();
+                    Append(current);
+                    current = Read();
                 }
                 else
                 {
@@ -360,36 +549,38 @@ namespace Engine
             // 检查科学计数法
             if (current == 'e' || current == 'E')
             {
-                numStr += static_cast<char>(current);
-                current = input.get();
+                Append(current);
+                current = Read();
 
                 if (current == '+' || current == '-')
                 {
-                    numStr += static_cast<char>(current);
-                    current = input.get();
+                    Append(current);
+                    current = Read();
                 }
 
                 bool hasExpDigit = false;
                 while (current != EOF && isdigit(static_cast<unsigned char>(current)))
                 {
-                    numStr += static_cast<char>(current);
-                    current = input.get();
+                    Append(current);
+                    current = Read();
                     hasExpDigit = true;
                 }
 
                 if (!hasExpDigit)
                 {
-                    throw std::runtime_error("科学计数法需要指数部分");
+                    throw Error("科学计数法需要指数部分");
                 }
             }
 
-            if (numStr.empty() || numStr == "." || numStr == "e" || numStr == "E")
+            double value = 0;
+            const char* first = scratch.data();
+            const char* last = first + scratch.size();
+            auto [end, ec] = std::from_chars(first, last, value);
+            if (ec != std::errc() || end != last)
             {
-                throw std::runtime_error("无效的数字格式");
+                throw Error("无效的数字格式");
             }
-
-            double value = std::stod(numStr);
-            return { TokenType::Number, value };
+            return MakeToken(TokenType::Number, value);
         }
     };
 }
\ No newline at end of file
@@ -0,0 +1,111 @@
+﻿#pragma once
+
+#include "LuaState.h"
+#include "LuaHeap.h"
+
+#include <functional>
+#include <span>
+#include <string>
+
+namespace Engine
+{
+    // 原生库的公共部分：库函数共用的参数检查，以及回调脚本函数的入口
+    class NativeLibrary
+    {
+    public:
+        // 调用脚本函数或原生函数（如 gsub 的替换函数、sort 的比较函数），由 VM 提供
+        using Caller = std::function<Value(const Value&, std::span<const Value>)>;
+
+        NativeLibrary(Heap& heap, Caller call)
+            : heap(heap), call(std::move(call)), buffer(HeapAllocator<char>(heap.GetMemory()))
+        { }
+
+        NativeLibrary(const NativeLibrary&) = delete;
+        NativeLibrary& operator=(const NativeLibrary&) = delete;
+
+    protected:
+        Heap& heap;
+        Caller call;
+        HeapString buffer;  // 不回调脚本的函数共用的结果缓冲区
+
+        void AddFunction(Table* lib, std::string_view name, Value::function fn)
+        {
+            lib->SetStr(heap.GetMemory(), heap.NewString(name), Value(heap.NewFunction(std::move(fn))));
+        }
+
+        void AddFunction(Table* lib, std::string_view name, Value::multiFunction fn)
+        {
+            lib->SetStr(heap.GetMemory(), heap.NewString(name), Value(heap.NewFunction(std::move(fn))));
+        }
+
+    public:
+        // 参数检查（VM 直接注册的内置函数也使用），错误信息形如 "'rep' 的第 2 个参数错误（需要 number，实际为 nil）"
+        [[noreturn]] static void ArgError(size_t arg, const char* name, const std::string& message)
+        {
+            throw std::runtime_error("'" + std::string(name) + "' 的第 " + std::to_string(arg + 1) + " 个参数错误（" + message + "）");
+        }
+
+        [[noreturn]] static void TypeError(std::span<const Value> args, size_t arg, const char* name, const char* expected)
+        {
+            ArgError(arg, name, std::string("需要 ") + expected + "，实际为 " + (arg < args.size() ? args[arg].TypeName() : "空"));
+        }
+
+        // 字符串参数；数字按 tostring 的规则转换（结果存放在 scratch 中）
+        static std::string_view CheckString(std::span<const Value> args, size_t arg, const char* name, char (&scratch)[NumberBufferSize])
+        {
+            if (arg < args.size())
+            {
+                if (auto* str = std::get_if<String*>(&args[arg].value))
+                    return (*str)->View();
+                if (args[arg].IsNumber())
+                    return args[arg].ToStringView(scratch);
+            }
+            TypeError(args, arg, name, "string");
+        }
+
+        static int64_t CheckInteger(std::span<const Value> args, size_t arg, const char* name)
+        {
+            double d;
+            if (arg < args.size())
+            {
+                if (const double* number = std::get_if<double>(&args[arg].value))
+                    d = *number;
+                else if (auto* str = std::get_if<String*>(&args[arg].value); str == nullptr || !StringToNumber((*str)->View(), d))
+                    TypeError(args, arg, name, "number");
+                int64_t result;
+                if (!NumberToInteger(d, result))
+                    ArgError(arg, name, "数字没有整数表示");
+                return result;
+            }
+            TypeError(args, arg, name, "number");
+        }
+
+        static int64_t OptInteger(std::span<const Value> args, size_t arg, const char* name, int64_t defaultValue)
+        {
+            return arg < args.size() && !args[arg].IsNil() ? CheckInteger(args, arg, name) : defaultValue;
+        }
+
+        static Table* CheckTable(std::span<const Value> args, size_t arg, const char* name)
+        {
+            if (arg < args.size())
+            {
+                if (auto* table = std::get_if<Table*>(&args[arg].value))
+                    return *table;
+            }
+            TypeError(args, arg, name, "table");
+        }
+
+        static double CheckNumber(std::span<const Value> args, size_t arg, const char* name)
+        {
+            if (arg < args.size())
+            {
+                if (const double* number = std::get_if<double>(&args[arg].value))
+                    return *number;
+                double d;
+                if (auto* str = std::get_if<String*>(&args[arg].value); str != nullptr && StringToNumber((*str)->View(), d))
+                    return d;
+            }
+            TypeError(args, arg, name, "number");
+        }
+    };
+}
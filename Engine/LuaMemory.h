@@ -0,0 +1,318 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace Engine
+{
+    // 与 lua_Alloc 约定相同的分配函数：
+    //   nsize == 0 时释放 ptr（osize 为其原大小）并返回 nullptr；
+    //   否则将 ptr（为 nullptr 时表示新分配）调整为 nsize 字节，失败时返回 nullptr 且不释放 ptr
+    using AllocFunction = void* (*)(void* userData, void* ptr, size_t osize, size_t nsize);
+
+    // 默认分配函数，基于 realloc / free
+    inline void* DefaultAlloc(void*, void* ptr, size_t, size_t nsize)
+    {
+        if (nsize == 0)
+        {
+            std::free(ptr);
+            return nullptr;
+        }
+        return std::realloc(ptr, nsize);
+    }
+
+    // 超出内存上限或分配函数失败时抛出，由 VM 转换为带位置信息的脚本错误
+    class MemoryError : public std::runtime_error
+    {
+    public:
+        explicit MemoryError(const std::string& message)
+            : std::runtime_error(message)
+        { }
+    };
+
+    struct MemoryStats
+    {
+        size_t live = 0;            // 当前占用字节数
+        size_t peak = 0;            // 占用峰值
+        size_t totalAllocated = 0;  // 累计分配字节数
+        size_t allocations = 0;     // 累计分配次数
+        size_t limit = 0;           // 占用上限，0 表示不限制
+    };
+
+    // 每个 VM 一个的内存分配器：所有分配都经过宿主提供的 AllocFunction，
+    // 同时统计占用并执行上限检查
+    class Memory
+    {
+    public:
+        explicit Memory(AllocFunction alloc = DefaultAlloc, void* userData = nullptr)
+            : alloc(alloc ? alloc : DefaultAlloc), userData(userData)
+        { }
+
+        Memory(const Memory&) = delete;
+        Memory& operator=(const Memory&) = delete;
+
+        void* Allocate(size_t size)
+        {
+            return Reallocate(nullptr, 0, size);
+        }
+
+        void* Reallocate(void* ptr, size_t osize, size_t nsize)
+        {
+            if (nsize > osize && stats.limit != 0 && stats.live - osize + nsize > stats.limit)
+            {
+                throw MemoryError("内存不足（超出上限 " + std::to_string(stats.limit) + " 字节）");
+            }
+
+            void* result = alloc(userData, ptr, osize, nsize);
+            if (result == nullptr)
+                throw MemoryError("内存不足");
+
+            stats.live = stats.live - osize + nsize;
+            if (nsize > osize)
+            {
+                stats.totalAllocated += nsize - osize;
+                stats.allocations++;
+                if (stats.live > stats.peak)
+                    stats.peak = stats.live;
+            }
+            return result;
+        }
+
+        void Free(void* ptr, size_t size) noexcept
+        {
+            if (ptr == nullptr)
+                return;
+            alloc(userData, ptr, size, 0);
+            stats.live -= size;
+        }
+
+        // 设置占用上限（字节），0 表示不限制
+        void SetLimit(size_t bytes) { stats.limit = bytes; }
+
+        const MemoryStats& Stats() const { return stats; }
+
+        // 累计分配量与次数清零，峰值从当前占用重新开始统计
+        void ResetCounters()
+        {
+            stats.totalAllocated = 0;
+            stats.allocations = 0;
+            stats.peak = stats.live;
+        }
+
+    private:
+        AllocFunction alloc;
+        void* userData;
+        MemoryStats stats;
+    };
+
+    // 将标准容器的分配转到 Memory 上
+    template <typename T>
+    class HeapAllocator
+    {
+    public:
+        using value_type = T;
+
+        HeapAllocator(Memory& memory) noexcept
+            : memory(&memory)
+        { }
+
+        template <typename U>
+        HeapAllocator(const HeapAllocator<U>& other) noexcept
+            : memory(other.memory)
+        { }
+
+        T* allocate(size_t n)
+        {
+            return static_cast<T*>(memory->Allocate(n * sizeof(T)));
+        }
+
+        void deallocate(T* ptr, size_t n) noexcept
+        {
+            memory->Free(ptr, n * sizeof(T));
+        }
+
+        template <typename U>
+        bool operator==(const HeapAllocator<U>& other) const noexcept { return memory == other.memory; }
+
+        Memory* memory;
+    };
+
+    // 从 Memory 分配的可增长字符串，用作 VM 内的各种文本缓冲区
+    using HeapString = std::basic_string<char, std::char_traits<char>, HeapAllocator<char>>;
+
+    // 编译期数据使用的线性（bump）分配器：只能整体回收。
+    // Reset 后已申请的内存块全部保留，下次编译直接复用，不再向分配函数申请
+    class Arena
+    {
+        struct Block;
+
+    public:
+        static constexpr size_t BlockSize = 16 * 1024;
+
+        explicit Arena(Memory& memory)
+            : memory(memory)
+        { }
+
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        ~Arena()
+        {
+            Release();
+        }
+
+        void* Allocate(size_t size, size_t align = alignof(std::max_align_t))
+        {
+            while (true)
+            {
+                if (current != nullptr)
+                {
+                    uintptr_t base = reinterpret_cast<uintptr_t>(current->Data());
+                    size_t offset = (base + used + align - 1) / align * align - base;
+                    if (offset + size <= current->capacity)
+                    {
+                        used = offset + size;
+                        return current->Data() + offset;
+                    }
+                }
+                NextBlock(size + align);
+            }
+        }
+
+        template <typename T, typename... Args>
+        T* New(Args&&... args)
+        {
+            return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        }
+
+        // 作用域结束时回收其间的全部分配（按后进先出的顺序嵌套使用）
+        class Scope
+        {
+        public:
+            explicit Scope(Arena& arena)
+                : arena(arena), block(arena.current), used(arena.used)
+            { }
+
+            Scope(const Scope&) = delete;
+            Scope& operator=(const Scope&) = delete;
+
+            ~Scope()
+            {
+                arena.current = block;
+                arena.used = used;
+            }
+
+            // 保留此前在作用域中的分配，析构时只回收之后的分配
+            void Keep()
+            {
+                block = arena.current;
+                used = arena.used;
+            }
+
+        private:
+            Arena& arena;
+            Block* block;
+            size_t used;
+        };
+
+        // 回收全部分配，保留内存块
+        void Reset()
+        {
+            current = blocks;
+            used = 0;
+        }
+
+        // 归还全部内存块
+        void Release()
+        {
+            while (blocks != nullptr)
+            {
+                Block* next = blocks->next;
+                memory.Free(blocks, sizeof(Block) + blocks->capacity);
+                blocks = next;
+            }
+            current = nullptr;
+            used = 0;
+        }
+
+    private:
+        struct alignas(std::max_align_t) Block
+        {
+            Block* next;
+            size_t capacity;
+
+            char* Data() { return reinterpret_cast<char*>(this + 1); }
+        };
+
+        // 切换到下一个能容纳 size 字节的块：优先复用 Reset 前留下的块
+        void NextBlock(size_t size)
+        {
+            Block* candidate = current ? current->next : blocks;
+            while (candidate != nullptr && candidate->capacity < size)
+            {
+                candidate = candidate->next;
+            }
+            if (candidate == nullptr)
+            {
+                size_t capacity = size > BlockSize ? size : BlockSize;
+                candidate = static_cast<Block*>(memory.Allocate(sizeof(Block) + capacity));
+                candidate->capacity = capacity;
+                candidate->next = nullptr;
+                // 追加到链表末尾，保持 Reset 后的复用顺序
+                if (blocks == nullptr)
+                {
+                    blocks = candidate;
+                }
+                else
+                {
+                    Block* tail = blocks;
+                    while (tail->next != nullptr)
+                        tail = tail->next;
+                    tail->next = candidate;
+                }
+            }
+            current = candidate;
+            used = 0;
+        }
+
+        Memory& memory;
+        Block* blocks = nullptr;    // 全部内存块
+        Block* current = nullptr;   // 当前分配所在的块
+        size_t used = 0;            // 当前块已用字节数
+    };
+
+    // 从 Arena 分配的标准容器分配器：释放为空操作，内存随 Arena 整体回收
+    template <typename T>
+    class ArenaAllocator
+    {
+    public:
+        using value_type = T;
+
+        ArenaAllocator(Arena& arena) noexcept
+            : arena(&arena)
+        { }
+
+        template <typename U>
+        ArenaAllocator(const ArenaAllocator<U>& other) noexcept
+            : arena(other.arena)
+        { }
+
+        T* allocate(size_t n)
+        {
+            return static_cast<T*>(arena->Allocate(n * sizeof(T), alignof(T)));
+        }
+
+        void deallocate(T*, size_t) noexcept { }
+
+        template <typename U>
+        bool operator==(const ArenaAllocator<U>& other) const noexcept { return arena == other.arena; }
+
+        Arena* arena;
+    };
+}
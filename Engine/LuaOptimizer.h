@@ -0,0 +1,658 @@
+﻿#pragma once
+
+#include "LuaState.h"
+#include "LuaHeap.h"
+#include "LuaAst.h"
+#include "LuaIR.h"
+
+#include <bit>
+#include <vector>
+
+namespace Engine
+{
+    // 编译选项：各项优化可以单独关闭，用于衡量每一项的效果
+    struct CompileOptions
+    {
+        bool constantPropagation = true;    // 常量折叠，以及从不重新赋值的局部常量跨语句传播
+        bool inlining = true;               // 在调用处展开小的局部函数
+        bool hoisting = true;               // 循环中不变的全局变量、上值与字段读取只在没有调用过元方法时沿用上次的值
+        bool registerAllocation = true;     // 寄存器复用与 Move 合并；关闭时每个虚拟寄存器独占一个寄存器
+        bool lazyCompilation = false;       // 加载时只预扫描函数体，首次调用时才编译（只对 VM::LoadBuffer / DoString 有效）
+
+        bool operator==(const CompileOptions&) const = default;
+    };
+
+    // 语法树上的常量折叠与常量传播，同时收集内联所需的信息：
+    //   从不重新赋值、初值为常量的局部变量，其引用被替换为常量，
+    //   于是该变量既不占寄存器，也不再作为上值被内层函数捕获；
+    //   初值为函数的局部变量记录其函数，函数体足够小时标记为可内联，
+    //   并统计除直接调用以外的引用次数，没有其他引用时降级阶段不再创建该闭包
+    class ConstantFolder
+    {
+    public:
+        static constexpr uint32_t MaxInlineNodes = 40;
+
+        ConstantFolder(Heap& heap, Arena& arena, const CompileOptions& options)
+            : heap(heap), arena(arena), options(options)
+        { }
+
+        void FoldFunction(FunctionNode* function)
+        {
+            if (function->lazy != nullptr)
+            {
+                // 函数体要到首次调用时才编译，按它引用的每个外层变量计一次引用：
+                // 这些变量的闭包不能省去，被常量传播的变量由编译时的常量代替
+                for (uint32_t i = 0; i < function->lazy->freeCount; ++i)
+                {
+                    LocalVar* var = function->lazy->freeVars[i];
+                    var->references++;
+                    if (!var->hasConstant)
+                        var->escapes++;
+                }
+                function->inlinable = false;
+                return;
+            }
+            FoldBlock(function->body);
+            function->inlinable = options.inlining && IsInlinable(function);
+        }
+
+        // 可内联的函数：函数体只有若干 local 声明（不含待关闭变量）加最后一条返回单个值的 return
+        // （不是调用或 ...，那样的返回值个数不确定），不是可变参数函数，不定义其他函数，节点数不超过 MaxInlineNodes
+        static bool IsInlinable(const FunctionNode* function)
+        {
+            if (function->hasFunctions || function->vararg || function->nodeCount > MaxInlineNodes)
+                return false;
+            for (const Stat* stat = function->body; stat != nullptr; stat = stat->next)
+            {
+                if (stat->kind == StatKind::Return)
+                {
+                    const auto* ret = static_cast<const ReturnStat*>(stat);
+                    return stat->next == nullptr && ret->valueCount == 1 && !IsMultiValue(ret->values);
+                }
+                if (stat->kind != StatKind::Local)
+                    return false;
+                for (const LocalVar* var = static_cast<const LocalStat*>(stat)->vars; var != nullptr; var = var->next)
+                {
+                    if (var->toClose)
+                        return false;
+                }
+            }
+            return false;
+        }
+
+    private:
+        Heap& heap;
+        Arena& arena;
+        const CompileOptions& options;
+
+        void FoldBlock(Stat* stat)
+        {
+            for (; stat != nullptr; stat = stat->next)
+            {
+                FoldStat(stat);
+            }
+        }
+
+        void FoldStat(Stat* stat)
+        {
+            switch (stat->kind)
+            {
+            case StatKind::Local:
+            {
+                auto* local = static_cast<LocalStat*>(stat);
+                FoldList(local->values);
+                Expr* value = local->values;
+                bool expanded = false;  // 已越过末尾展开为多个值的初值，之后的变量在运行时才有值
+                for (LocalVar* var = local->vars; var != nullptr; var = var->next)
+                {
+                    // 待关闭变量的初值须在运行时检查有没有 __close，不做常量传播
+                    if (!var->assigned && var->pinned < 0 && !var->toClose)
+                    {
+                        if (value == nullptr && !expanded && options.constantPropagation)
+                        {
+                            var->hasConstant = true;
+                            var->constant = Value();
+                        }
+                        else if (value != nullptr && value->kind == ExprKind::Constant && options.constantPropagation)
+                        {
+                            var->hasConstant = true;
+                            var->constant = static_cast<ConstantExpr*>(value)->value;
+                        }
+                        else if (value != nullptr && value->kind == ExprKind::Function)
+                        {
+                            var->functionValue = static_cast<FunctionExpr*>(value)->function;
+                        }
+                    }
+                    if (value != nullptr)
+                    {
+                        expanded = value->next == nullptr && IsMultiValue(value);
+                        value = value->next;
+                    }
+                }
+                break;
+            }
+            case StatKind::LocalFunction:
+            {
+                auto* local = static_cast<LocalFunctionStat*>(stat);
+                uint32_t references = local->var->references;
+                FoldFunction(local->function);
+                // 递归函数不内联
+                if (local->var->references != references)
+                    local->function->inlinable = false;
+                if (!local->var->assigned && local->var->pinned < 0)
+                    local->var->functionValue = local->function;
+                break;
+            }
+            case StatKind::Assign:
+            {
+                auto* assign = static_cast<AssignStat*>(stat);
+                for (Expr* target = assign->targets; target != nullptr; target = target->next)
+                {
+                    if (target->kind == ExprKind::Index)
+                    {
+                        auto* index = static_cast<IndexExpr*>(target);
+                        index->object = FoldExpr(index->object);
+                        index->key = FoldExpr(index->key);
+                    }
+                }
+                FoldList(assign->values);
+                break;
+            }
+            case StatKind::Call:
+            {
+                auto* call = static_cast<CallStat*>(stat);
+                call->call = FoldExpr(call->call);
+                break;
+            }
+            case StatKind::Do:
+                FoldBlock(static_cast<DoStat*>(stat)->body);
+                break;
+            case StatKind::While:
+            {
+                auto* loop = static_cast<WhileStat*>(stat);
+                loop->condition = FoldExpr(loop->condition);
+                FoldBlock(loop->body);
+                break;
+            }
+            case StatKind::NumericFor:
+            {
+                auto* loop = static_cast<NumericForStat*>(stat);
+                loop->start = FoldExpr(loop->start);
+                loop->limit = FoldExpr(loop->limit);
+                if (loop->step != nullptr)
+                    loop->step = FoldExpr(loop->step);
+                FoldBlock(loop->body);
+                break;
+            }
+            case StatKind::GenericFor:
+            {
+                auto* loop = static_cast<GenericForStat*>(stat);
+                FoldList(loop->values);
+                FoldBlock(loop->body);
+                break;
+            }
+            case StatKind::Return:
+            {
+                FoldList(static_cast<ReturnStat*>(stat)->values);
+                break;
+            }
+            case StatKind::If:
+            {
+                auto* branch = static_cast<IfStat*>(stat);
+                for (IfClause* clause = branch->clauses; clause != nullptr; clause = clause->next)
+                {
+                    clause->condition = FoldExpr(clause->condition);
+                    FoldBlock(clause->body);
+                }
+                FoldBlock(branch->elseBody);
+                break;
+            }
+            case StatKind::Repeat:
+            {
+                auto* loop = static_cast<RepeatStat*>(stat);
+                FoldBlock(loop->body);
+                loop->condition = FoldExpr(loop->condition);
+                break;
+            }
+            case StatKind::Break:
+            case StatKind::Goto:
+            case StatKind::Label:
+                break;
+            }
+        }
+
+        // 折叠以 next 串联的表达式列表
+        void FoldList(Expr*& head)
+        {
+            for (Expr** link = &head; *link != nullptr; link = &(*link)->next)
+            {
+                *link = FoldExpr(*link);
+            }
+        }
+
+        // 返回折叠后的表达式，被替换时新节点接管原节点在列表中的位置
+        Expr* FoldExpr(Expr* expr)
+        {
+            switch (expr->kind)
+            {
+            case ExprKind::Local:
+            {
+                LocalVar* var = static_cast<LocalExpr*>(expr)->var;
+                var->references++;
+                if (var->hasConstant)
+                    return Replace(expr, var->constant);
+                var->escapes++;
+                return expr;
+            }
+            case ExprKind::Index:
+            {
+                auto* index = static_cast<IndexExpr*>(expr);
+                index->object = FoldExpr(index->object);
+                index->key = FoldExpr(index->key);
+                return expr;
+            }
+            case ExprKind::Call:
+            {
+                auto* call = static_cast<CallExpr*>(expr);
+                if (call->function->kind == ExprKind::Local && !static_cast<LocalExpr*>(call->function)->var->hasConstant)
+                {
+                    // 直接调用不算作逃逸，内联后不再需要闭包
+                    static_cast<LocalExpr*>(call->function)->var->references++;
+                }
+                else
+                {
+                    call->function = FoldExpr(call->function);
+                }
+                FoldList(call->args);
+                return expr;
+            }
+            case ExprKind::Method:
+            {
+                auto* method = static_cast<MethodExpr*>(expr);
+                method->object = FoldExpr(method->object);
+                FoldList(method->args);
+                return expr;
+            }
+            case ExprKind::Function:
+                FoldFunction(static_cast<FunctionExpr*>(expr)->function);
+                return expr;
+            case ExprKind::Table:
+                for (TableItem* item = static_cast<TableExpr*>(expr)->items; item != nullptr; item = item->next)
+                {
+                    if (item->key != nullptr)
+                        item->key = FoldExpr(item->key);
+                    item->value = FoldExpr(item->value);
+                }
+                return expr;
+            case ExprKind::Binary:
+            {
+                auto* binary = static_cast<BinaryExpr*>(expr);
+                binary->left = FoldExpr(binary->left);
+                if (binary->op == BinaryOp::And || binary->op == BinaryOp::Or)
+                    return FoldLogical(binary);
+                binary->right = FoldExpr(binary->right);
+                Value result;
+                if (options.constantPropagation &&
+                    binary->left->kind == ExprKind::Constant && binary->right->kind == ExprKind::Constant &&
+                    FoldBinary(binary->op, static_cast<ConstantExpr*>(binary->left)->value,
+                        static_cast<ConstantExpr*>(binary->right)->value, result))
+                {
+                    return Replace(expr, result);
+                }
+                return expr;
+            }
+            case ExprKind::Unary:
+            {
+                auto* unary = static_cast<UnaryExpr*>(expr);
+                unary->operand = FoldExpr(unary->operand);
+                Value result;
+                if (options.constantPropagation && unary->operand->kind == ExprKind::Constant &&
+                    FoldUnary(unary->op, static_cast<ConstantExpr*>(unary->operand)->value, result))
+                {
+                    return Replace(expr, result);
+                }
+                return expr;
+            }
+            default:
+                return expr;
+            }
+        }
+
+        // 左操作数为常量的 and / or 直接取其结果：决定结果的是左操作数时右操作数不再求值（也不再折叠）
+        Expr* FoldLogical(BinaryExpr* binary)
+        {
+            if (!options.constantPropagation || binary->left->kind != ExprKind::Constant)
+            {
+                binary->right = FoldExpr(binary->right);
+                return binary;
+            }
+            const Value& left = static_cast<ConstantExpr*>(binary->left)->value;
+            if (left.IsFalsy() == (binary->op == BinaryOp::And))
+                return Replace(binary, left);
+            Expr* right = FoldExpr(binary->right);
+            right->next = binary->next;
+            right->parenthesized = true;    // 与 and / or 的结果一样只取一个值
+            return right;
+        }
+
+        Expr* Replace(Expr* expr, const Value& value)
+        {
+            auto* constant = arena.New<ConstantExpr>(expr->line, value);
+            constant->next = expr->next;
+            return constant;
+        }
+
+        // 只折叠结果确定且不会出错的运算，其余留到运行时（并在那里报错）
+        bool FoldBinary(BinaryOp op, const Value& left, const Value& right, Value& result)
+        {
+            if (left.IsNumber() && right.IsNumber())
+            {
+                double a = *std::get_if<double>(&left.value);
+                double b = *std::get_if<double>(&right.value);
+                int64_t x, y;
+                switch (op)
+                {
+                case BinaryOp::Add: result = a + b; return true;
+                case BinaryOp::Sub: result = a - b; return true;
+                case BinaryOp::Mul: result = a * b; return true;
+                case BinaryOp::Div: result = a / b; return true;
+                case BinaryOp::Mod: result = NumberMod(a, b); return true;
+                case BinaryOp::Pow: result = std::pow(a, b); return true;
+                case BinaryOp::Idiv: result = NumberIdiv(a, b); return true;
+                case BinaryOp::Lt: result = a < b; return true;
+                case BinaryOp::Le: result = a <= b; return true;
+                case BinaryOp::Gt: result = a > b; return true;
+                case BinaryOp::Ge: result = a >= b; return true;
+                default:
+                    break;
+                }
+                if (NumberToInteger(a, x) && NumberToInteger(b, y))
+                {
+                    switch (op)
+                    {
+                    case BinaryOp::BAnd: result = static_cast<double>(x & y); return true;
+                    case BinaryOp::BOr: result = static_cast<double>(x | y); return true;
+                    case BinaryOp::BXor: result = static_cast<double>(x ^ y); return true;
+                    case BinaryOp::Shl: result = static_cast<double>(ShiftLeft(x, y)); return true;
+                    case BinaryOp::Shr: result = static_cast<double>(ShiftLeft(x, y == INT64_MIN ? 64 : -y)); return true;
+                    default:
+                        break;
+                    }
+                }
+            }
+
+            bool leftString = std::holds_alternative<String*>(left.value);
+            bool rightString = std::holds_alternative<String*>(right.value);
+            if (op == BinaryOp::Concat && (leftString || left.IsNumber()) && (rightString || right.IsNumber()))
+            {
+                char leftScratch[NumberBufferSize], rightScratch[NumberBufferSize];
+                std::string text(left.ToStringView(leftScratch));
+                text += right.ToStringView(rightScratch);
+                result = Value(heap.NewString(text));
+                return true;
+            }
+            if (leftString && rightString)
+            {
+                std::string_view a = std::get<String*>(left.value)->View();
+                std::string_view b = std::get<String*>(right.value)->View();
+                switch (op)
+                {
+                case BinaryOp::Lt: result = a < b; return true;
+                case BinaryOp::Le: result = a <= b; return true;
+                case BinaryOp::Gt: result = a > b; return true;
+                case BinaryOp::Ge: result = a >= b; return true;
+                default:
+                    break;
+                }
+            }
+            if (op == BinaryOp::Eq)
+            {
+                result = left == right;
+                return true;
+            }
+            if (op == BinaryOp::Ne)
+            {
+                result = left != right;
+                return true;
+            }
+            return false;
+        }
+
+        static bool FoldUnary(UnaryOp op, const Value& operand, Value& result)
+        {
+            switch (op)
+            {
+            case UnaryOp::Not:
+                result = operand.IsFalsy();
+                return true;
+            case UnaryOp::Minus:
+                if (!operand.IsNumber())
+                    return false;
+                result = -*std::get_if<double>(&operand.value);
+                return true;
+            case UnaryOp::Len:
+                if (!std::holds_alternative<String*>(operand.value))
+                    return false;
+                result = static_cast<double>(std::get<String*>(operand.value)->length);
+                return true;
+            case UnaryOp::BNot:
+            {
+                int64_t i;
+                if (!operand.IsNumber() || !NumberToInteger(*std::get_if<double>(&operand.value), i))
+                    return false;
+                result = static_cast<double>(~i);
+                return true;
+            }
+            }
+            return false;
+        }
+    };
+
+    // 循环不变量外提：循环中的 GetGlobal、GetUpval 与 GetField 在满足以下条件时只在第一次经过时读取，
+    // 之后的迭代沿用读到的值：
+    //   循环中没有函数调用与待关闭变量（被调函数、__close 可能修改任何全局变量、上值或表）；
+    //   GetGlobal 的名字、GetUpval 的上值在循环中没有被赋值；
+    //   GetGlobal 与 GetField 所在的循环中没有任何表写入与全局变量赋值（全局变量表也可以作为普通的表写入），
+    //   GetField 的表在循环中不变，或者是之前一条受守卫的读取的结果（如 config.scale 中的 config）；
+    //   指令位于循环体的顶层（不在内层循环中），目标寄存器在整个函数中只被写入一次。
+    // 循环中的运算与索引可能调用元方法（__index、__add 等，包括这条读取自身），元方法可以修改任何值，
+    // 因此读取不移出循环，而是受守卫：
+    //   MetaTest mark, L；MetaMark mark；读取；L:
+    // mark 在 Preheader 处置为 nil，第一次经过时读取并记下此前调用元方法的次数；
+    // 之后没有调用过元方法时跳过读取，调用过（包括读取自身调用了 __index）则重新读取，与不外提时相同。
+    // 重新读取的结果是其他受守卫的 GetField 的表时，同时把它们的 mark 置为 nil，使它们也重新读取。
+    // 读取留在原处，出错的位置与次序不变
+    class LoopInvariantHoister
+    {
+    public:
+        explicit LoopInvariantHoister(Arena& arena)
+            : arena(arena)
+        { }
+
+        void Run(IrFunction& ir)
+        {
+            defCount.assign(ir.vregs.size(), 0);
+            for (const IrInstr& instr : ir.code)
+            {
+                ForEachOperand(instr, [](uint32_t) {}, [&](uint32_t v) { defCount[v]++; });
+            }
+
+            ArenaVector<uint32_t> loops(arena);
+            for (const IrInstr& instr : ir.code)
+            {
+                if (instr.kind == IrKind::LoopEnd)
+                    loops.push_back(instr.a);
+            }
+            for (uint32_t loop : loops)
+            {
+                HoistLoop(ir, loop);
+            }
+        }
+
+    private:
+        template <typename T>
+        using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+        static constexpr size_t None = SIZE_MAX;
+
+        Arena& arena;
+        ArenaVector<uint32_t> defCount{ arena };
+
+        void HoistLoop(IrFunction& ir, uint32_t loop)
+        {
+            size_t preheader = 0, begin = 0, end = 0;
+            for (size_t i = 0; i < ir.code.size(); ++i)
+            {
+                const IrInstr& instr = ir.code[i];
+                if (instr.a != loop)
+                    continue;
+                if (instr.kind == IrKind::Preheader)
+                    preheader = i;
+                else if (instr.kind == IrKind::LoopBegin)
+                    begin = i;
+                else if (instr.kind == IrKind::LoopEnd)
+                    end = i;
+            }
+
+            // 循环中的副作用
+            ArenaVector<uint32_t> loopDefs(ir.vregs.size(), 0, arena);
+            ArenaVector<uint32_t> globalsWritten(arena);
+            ArenaVector<uint32_t> upvaluesWritten(arena);
+            bool tablesWritten = false;
+            for (size_t i = begin + 1; i < end; ++i)
+            {
+                const IrInstr& instr = ir.code[i];
+                if (instr.kind != IrKind::Op)
+                    continue;
+                switch (instr.op)
+                {
+                case OpCode::Call:
+                case OpCode::Tbc:
+                    return;
+                case OpCode::SetGlobal:
+                    globalsWritten.push_back(instr.a);
+                    break;
+                case OpCode::SetUpval:
+                    upvaluesWritten.push_back(instr.a);
+                    break;
+                case OpCode::SetField:
+                case OpCode::SetIndex:
+                case OpCode::SetList:
+                    tablesWritten = true;
+                    break;
+                default:
+                    break;
+                }
+                ForEachOperand(instr, [](uint32_t) {}, [&](uint32_t v) { loopDefs[v]++; });
+            }
+
+            auto contains = [](const ArenaVector<uint32_t>& list, uint32_t value) {
+                return std::find(list.begin(), list.end(), value) != list.end();
+            };
+
+            ArenaVector<size_t> cached(arena);      // 受守卫的读取的位置
+            ArenaVector<size_t> receivers(arena);   // GetField 的表是第几条受守卫的读取的结果，None 表示在循环中不变
+            int depth = 0;
+            for (size_t i = begin + 1; i < end; ++i)
+            {
+                const IrInstr& instr = ir.code[i];
+                switch (instr.kind)
+                {
+                case IrKind::LoopBegin:
+                    depth++;
+                    continue;
+                case IrKind::LoopEnd:
+                    depth--;
+                    continue;
+                case IrKind::Op:
+                    break;
+                default:
+                    continue;
+                }
+                if (depth > 0)
+                    continue;
+
+                bool invariant = false;
+                size_t receiver = None;
+                switch (instr.op)
+                {
+                case OpCode::GetGlobal:
+                    invariant = !tablesWritten && !contains(globalsWritten, instr.b);
+                    break;
+                case OpCode::GetUpval:
+                    invariant = !contains(upvaluesWritten, instr.b);
+                    break;
+                case OpCode::GetField:
+                    if (tablesWritten || !globalsWritten.empty())
+                        break;
+                    receiver = None;
+                    for (size_t j = 0; j < cached.size() && loopDefs[instr.b] != 0; ++j)
+                    {
+                        if (ir.code[cached[j]].a == instr.b && ir.vregs[instr.b].window == VregInfo::NoWindow)
+                            receiver = j;
+                    }
+                    invariant = loopDefs[instr.b] == 0 || receiver != None;
+                    break;
+                default:
+                    break;
+                }
+                const VregInfo& target = ir.vregs[instr.a];
+                if (invariant && defCount[instr.a] == 1 && target.fixed < 0 && !target.captured)
+                {
+                    cached.push_back(i);
+                    receivers.push_back(receiver);
+                }
+            }
+            if (cached.empty())
+                return;
+
+            // Preheader 处把各守卫的 mark 与保存读取结果的寄存器置为 nil；
+            // 窗口中的寄存器不能提前占用，读到新的临时寄存器中，原处从它 Move
+            ArenaVector<IrInstr> code(arena);
+            code.reserve(ir.code.size() + cached.size() * 6);
+            code.insert(code.end(), ir.code.begin(), ir.code.begin() + preheader + 1);
+            ArenaVector<uint32_t> marks(arena);
+            ArenaVector<uint32_t> values(arena);
+            for (size_t i : cached)
+            {
+                const IrInstr& instr = ir.code[i];
+                uint32_t mark = ir.NewVreg();
+                uint32_t value = ir.vregs[instr.a].window != VregInfo::NoWindow ? ir.NewVreg() : instr.a;
+                marks.push_back(mark);
+                values.push_back(value);
+                code.push_back({ IrKind::Op, OpCode::LoadNil, mark, 0, 0, instr.line });
+                code.push_back({ IrKind::Op, OpCode::LoadNil, value, 0, 0, instr.line });
+            }
+
+            size_t next = 0;
+            for (size_t i = preheader + 1; i < ir.code.size(); ++i)
+            {
+                if (next == cached.size() || cached[next] != i)
+                {
+                    code.push_back(ir.code[i]);
+                    continue;
+                }
+                const IrInstr& instr = ir.code[i];
+                const uint32_t mark = marks[next];
+                const uint32_t value = values[next];
+                next++;
+                uint32_t skip = ir.NewLabel();
+                IrInstr load = instr;
+                load.a = value;
+                code.push_back({ IrKind::Op, OpCode::MetaTest, mark, skip, 0, instr.line });
+                code.push_back({ IrKind::Op, OpCode::MetaMark, mark, 0, 0, instr.line });
+                code.push_back(load);
+                for (size_t j = next; j < cached.size(); ++j)
+                {
+                    if (receivers[j] == next - 1)
+                        code.push_back({ IrKind::Op, OpCode::LoadNil, marks[j], 0, 0, instr.line });
+                }
+                code.push_back({ IrKind::Label, OpCode::Move, skip, 0, 0, 0 });
+                if (value != instr.a)
+                    code.push_back({ IrKind::Op, OpCode::Move, instr.a, value, 0, instr.line });
+            }
+            ir.code.swap(code);
+            defCount.resize(ir.vregs.size(), 0);
+        }
+    };
+}
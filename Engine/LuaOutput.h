@@ -0,0 +1,130 @@
+﻿#pragma once
+
+#include "LuaMemory.h"
+
+#include <ostream>
+#include <string>
+#include <string_view>
+
+namespace Engine
+{
+    // 脚本输出（print 等）的最终去向，由宿主实现
+    class OutputSink
+    {
+    public:
+        virtual ~OutputSink() = default;
+
+        virtual void Write(std::string_view data) = 0;
+        virtual void Flush() { }
+    };
+
+    // 写入 std::ostream，默认使用 std::cout
+    class StreamSink : public OutputSink
+    {
+    public:
+        explicit StreamSink(std::ostream& stream)
+            : stream(stream)
+        { }
+
+        void Write(std::string_view data) override
+        {
+            stream.write(data.data(), static_cast<std::streamsize>(data.size()));
+        }
+
+        void Flush() override
+        {
+            stream.flush();
+        }
+
+    private:
+        std::ostream& stream;
+    };
+
+    // 收集到内存中，适合按请求捕获脚本输出
+    class StringSink : public OutputSink
+    {
+    public:
+        void Write(std::string_view data) override
+        {
+            text.append(data);
+        }
+
+        const std::string& Text() const { return text; }
+        void Clear() { text.clear(); }
+
+    private:
+        std::string text;
+    };
+
+    // 丢弃全部输出
+    class NullSink : public OutputSink
+    {
+    public:
+        void Write(std::string_view) override { }
+    };
+
+    // 每个 VM 持有的输出缓冲区：print 只追加到缓冲区，
+    // 缓冲区写满、显式 Flush 或（开启自动刷新时）每次执行结束才写到 sink，
+    // 避免 std::endl 式的逐行刷新让输出密集的脚本被 I/O 拖慢
+    class OutputBuffer
+    {
+    public:
+        static constexpr size_t DefaultCapacity = 8 * 1024;
+
+        OutputBuffer(OutputSink& sink, Memory& memory, size_t capacity = DefaultCapacity)
+            : sink(&sink), capacity(capacity), buffer(memory)
+        {
+            buffer.reserve(capacity);
+        }
+
+        void Write(std::string_view data)
+        {
+            if (buffer.size() + data.size() > capacity)
+            {
+                Drain();
+                // 超过整个缓冲区的大块数据直接写出
+                if (data.size() >= capacity)
+                {
+                    sink->Write(data);
+                    return;
+                }
+            }
+            buffer.append(data);
+        }
+
+        // 写出缓冲区中的全部内容并刷新 sink
+        void Flush()
+        {
+            Drain();
+            sink->Flush();
+        }
+
+        // 更换输出目标，之前缓冲的内容先写到原来的 sink
+        void SetSink(OutputSink& target)
+        {
+            Flush();
+            sink = &target;
+        }
+
+        // 设置缓冲区容量，0 表示不缓冲（每次写入直接交给 sink）
+        void SetCapacity(size_t size)
+        {
+            Drain();
+            capacity = size;
+            buffer.reserve(capacity);
+        }
+
+    private:
+        void Drain()
+        {
+            if (buffer.empty())
+                return;
+            sink->Write(std::string_view(buffer.data(), buffer.size()));
+            buffer.clear();
+        }
+
+        OutputSink* sink;
+        size_t capacity;
+        std::basic_string<char, std::char_traits<char>, HeapAllocator<char>> buffer;
+    };
+}
@@ -2,299 +2,1274 @@
 
 #include "LuaState.h"
 #include "LuaLex.h"
+#include "LuaHeap.h"
+#include "LuaAst.h"
+#include "LuaCompiler.h"
 
+#include <algorithm>
 #include <iostream>
+#include <span>
+#include <utility>
+#include <vector>
 
 namespace Engine
 {
+    // 递归下降的语法分析器：构造语法树并同时完成作用域解析（变量引用直接指向其声明），
+    // 然后交给 Compiler 生成字节码。语法树从 heap 的编译期 arena 分配，
+    // 每次编译（流式执行时每一批）结束后整体回收
     class Parser
     {
     public:
-        Parser(std::ifstream& inputStream)
-            : lexer(inputStream)
+        // 字符串常量驻留在 heap 中；编译结果写入 target，未指定时新建一个函数原型。
+        // target 原有的指令、常量与子函数会被覆盖，已分配的容量保留
+        Parser(std::istream& inputStream, Heap& heap, std::string_view chunkName = "?",
+            Proto* target = nullptr, const CompileOptions& options = {})
+            : lexer(inputStream, heap, chunkName), heap(heap), arena(heap.CompileArena()), options(options),
+            target(target != nullptr ? target : heap.NewProto()), active(heap.GetMemory()), pinned(heap.GetMemory()),
+            labels(heap.GetMemory()), gotos(heap.GetMemory()), freeVars(heap.GetMemory())
+        { }
+
+        Parser(const Parser&) = delete;
+        Parser& operator=(const Parser&) = delete;
+
+        ~Parser()
+        {
+            if (scratch == nullptr)
+                return;
+            active.clear();
+            labels.clear();
+            gotos.clear();
+            freeVars.clear();
+            active.swap(scratch->active);
+            labels.swap(scratch->labels);
+            gotos.swap(scratch->gotos);
+            freeVars.swap(scratch->freeVars);
+        }
+
+        // 延迟编译函数：函数体只做预扫描，首次调用时再从 source（与输入流内容相同的整段源码）编译。
+        // 函数体很小、可能被内联的函数仍立即编译
+        void DeferFunctions(String* source)
+        {
+            text = source;
+        }
+
+        // 编译延迟编译的函数原型 proto，结果与加载时立即编译的相同；
+        // 其中定义的函数按 options 继续延迟。失败时 proto 保持未编译
+        static void CompileLazy(Heap& heap, Proto& proto, const CompileOptions& options)
+        {
+            const LazyBody lazy = proto.lazy;
+            MemoryBuffer buffer(lazy.text->View().substr(lazy.begin, lazy.end - lazy.begin));
+            std::istream input(&buffer);
+            Parser parser(input, heap, proto.source->View(), &proto, options);
+            parser.lexer.SetPosition(lazy.line, lazy.column, lazy.begin);
+            if (options.lazyCompilation)
+                parser.text = lazy.text;
+            try
+            {
+                parser.ParseLazy(proto);
+            }
+            catch (...)
+            {
+                proto.code.clear();
+                proto.constants.clear();
+                proto.protos.clear();
+                proto.locals.clear();
+                proto.inlines.clear();
+                proto.lineInfo.Clear();
+                throw;
+            }
+            proto.lazy.pending = false;
+        }
+
+        // 编译整个输入，返回主函数的原型
+        Proto* Parse()
         {
-            Value::function print_func = [](const std::vector<Value>& args) -> Value 
+            ParseChunk();
+            return target;
+        }
+
+        void ParseChunk()
+        {
+            Arena::Scope scope(arena);
+            active.clear();
+            labels.clear();
+            gotos.clear();
+            functionLabels = functionGotos = 0;
+            loopDepth = 0;
+            main = function = NewFunctionNode(nullptr, 0);
+            main->vararg = true;
+            main->body = ParseBlock();
+            if (Current().token != TokenType::Eof)
+                throw Error("预期 <eof>，实际得到 " + Current().toString());
+            CheckGotos();
+            main->endLine = Current().line;
+            Compiler(heap, options).Compile(main, *target, lexer.ChunkName());
+        }
+
+        // 流式解析：解析下一批（至多 maxStatements 条）顶层语句并编译到 target 中，结果见 Batch()。
+        // 每批开始前清空上一批的编译结果（保留已分配的容量），因此内存占用只与单批语句的大小有关。
+        // 顶层的 local 变量在各批之间保持可见：它们固定占用主函数的寄存器，执行各批时寄存器中的值保留。
+        // 顶层的 goto 只能跳到同一批中的标签：有等待标签的 goto 时本批延续到标签出现为止，
+        // 之前各批中的标签已不可见。输入已全部解析完时返回 false
+        bool ParseBatch(size_t maxStatements)
+        {
+            target->Clear();
+            if (Current().token == TokenType::Eof)
+                return false;
+
+            Arena::Scope scope(arena);
+            streaming = true;
+            main = function = NewFunctionNode(nullptr, 0);
+            main->vararg = true;
+
+            // 之前各批声明的顶层变量
+            active.clear();
+            labels.clear();
+            gotos.clear();
+            functionLabels = functionGotos = 0;
+            loopDepth = 0;
+            for (const PinnedVar& var : pinned)
+            {
+                LocalVar* local = NewVar(var.name, 0);
+                local->pinned = static_cast<int32_t>(&var - pinned.data());
+                local->captured = true;
+                Declare(local);
+            }
+            blockActive = active.size();
+            blockGotos = 0;
+
+            // 语句数达到上限时立即结束本批，不再读入下一条语句的 token
+            Stat** tail = &main->body;
+            for (size_t count = 0; count < maxStatements || !gotos.empty(); ++count)
+            {
+                if (BlockFollow())
                 {
-                for (size_t i = 0; i < args.size(); ++i) {
-                    try {
-                        std::cout << static_cast<std::string>(args[i]);
-                    }
-                    catch (const std::bad_variant_access&) {
-                        std::cout << "[unknown]";
-                    }
+                    if (Current().token != TokenType::Eof)
+                        throw Error("预期 <eof>，实际得到 " + Current().toString());
+                    break;
                 }
-                std::cout << std::endl;
-                return Value{}; // 返回空值（std::monostate）
-                };
-            context.Globals["print"] = Value(print_func);
+                Stat* stat = Current().token == TokenType::Return ? ParseReturn() : ParseStatement();
+                *tail = stat;
+                while (*tail != nullptr)
+                    tail = &(*tail)->next;
+            }
+            CheckGotos();
+
+            main->endLine = lastLine;
+            main->reservedRegisters = static_cast<uint32_t>(pinned.size());
+            Compiler(heap, options).Compile(main, *target, lexer.ChunkName());
+            active.clear();
+            return true;
         }
 
-        ProgramContext Parse()
+        Proto* Batch() { return target; }
+
+        // 流式执行时已声明的顶层局部变量个数，它们依次占用主函数的寄存器 [0, PinnedCount())
+        size_t PinnedCount() const { return pinned.size(); }
+
+        // 流式执行时回收可能发生在两批之间，预读的 token 与顶层变量名引用的字符串需要保留
+        void MarkRoots(Heap& heap) const
         {
-            current = lexer.NextToken();
-            next = lexer.NextToken();
-            while(current.token != TokenType::Eof)
+            heap.Mark(lexer.ChunkName());
+            heap.Mark(current.value);
+            heap.Mark(next.value);
+            heap.Mark(target);
+            heap.Mark(text);
+            for (const PinnedVar& var : pinned)
             {
-                ParseStatement();
+                heap.Mark(var.name);
             }
+        }
 
-            context.Operations.push_back(OpCode::Exit);
-            return context;
+    private:
+        // 流式执行时的顶层变量，下标即其固定使用的寄存器
+        struct PinnedVar
+        {
+            String* name;
+        };
+
+        // 等待后面出现的标签的 goto
+        struct PendingGoto
+        {
+            GotoStat* stat;
+            size_t active;  // goto 处可见的局部变量个数，离开代码块时截断为块开始时的个数
+        };
+
+    public:
+        // 语法分析期间的临时表。VM 持有一份，反复 LoadBuffer 时借给 Parser，复用上次编译已分配的容量
+        struct Scratch
+        {
+            explicit Scratch(Memory& memory)
+                : active(memory), labels(memory), gotos(memory), freeVars(memory)
+            { }
+
+            std::vector<LocalVar*, HeapAllocator<LocalVar*>> active;
+            std::vector<LabelStat*, HeapAllocator<LabelStat*>> labels;
+            std::vector<PendingGoto, HeapAllocator<PendingGoto>> gotos;
+            std::vector<LocalVar*, HeapAllocator<LocalVar*>> freeVars;
+        };
+
+        // 借用 buffers 中的临时表，析构时清空后归还；须在开始解析之前调用
+        void UseScratch(Scratch& buffers)
+        {
+            scratch = &buffers;
+            active.swap(buffers.active);
+            labels.swap(buffers.labels);
+            gotos.swap(buffers.gotos);
+            freeVars.swap(buffers.freeVars);
         }
 
     private:
-        void ParseStatement()
+        // 二元运算符的左右优先级，与 Lua 5.4 相同；右结合的运算符右优先级较低
+        struct Priority
         {
-            if (current.token == TokenType::Identifier)
+            int left;
+            int right;
+        };
+
+        static constexpr int UnaryPriority = 12;
+
+        Lex lexer;
+        Heap& heap;
+        Arena& arena;
+        CompileOptions options;
+        Proto* target;
+
+        std::vector<LocalVar*, HeapAllocator<LocalVar*>> active;   // 当前可见的局部变量，内层作用域在后
+        std::vector<PinnedVar, HeapAllocator<PinnedVar>> pinned;
+        std::vector<LabelStat*, HeapAllocator<LabelStat*>> labels;     // 可见的标签，内层代码块在后
+        std::vector<PendingGoto, HeapAllocator<PendingGoto>> gotos;
+        std::vector<LocalVar*, HeapAllocator<LocalVar*>> freeVars;     // 正在预扫描的函数体引用的外层变量
+        Scratch* scratch = nullptr;         // 借用的临时表，析构时归还
+        FunctionNode* main = nullptr;
+        FunctionNode* function = nullptr;   // 正在分析的函数
+        int blockDepth = 0;                 // 主函数中嵌套的代码块层数，0 表示顶层
+        int loopDepth = 0;                  // 当前函数中嵌套的循环层数，break 只能出现在循环中
+        size_t blockActive = 0;             // 当前代码块开始时可见的局部变量个数
+        size_t blockGotos = 0;              // gotos 中属于当前代码块（含已离开的内层代码块）的部分的开始位置
+        size_t functionLabels = 0;          // labels 中属于当前函数的部分的开始位置，goto 不能跳出函数
+        size_t functionGotos = 0;
+        bool streaming = false;
+        String* text = nullptr;     // 延迟编译时的整段源码，为 nullptr 时全部立即编译
+        bool scanning = false;      // 正在预扫描延迟编译的函数体，其中定义的函数不再单独延迟
+        bool localValue = false;    // 正在分析的 local 初值以 function 开始，其函数体绑定到局部变量
+        size_t scanActive = 0;      // 预扫描的函数之外可见的局部变量个数
+        uint32_t scannedFunctions = 0;  // 预扫描的函数体中定义的函数个数
+
+        Token current;
+        Token next;
+        int lastLine = 1;   // 最近消耗的 token 所在行
+        bool fetched = false;   // current 已从词法分析器读入；消耗 token 后下一个在用到时才读入
+        bool peeked = false;    // next 已读入
+
+        // 当前 token，消耗之后第一次用到时才从词法分析器读入。流式解析时一批语句结束后不再预读，
+        // 输入暂停时已解析完的语句可以先执行
+        const Token& Current()
+        {
+            if (!fetched)
             {
-                std::string id = static_cast<std::string>(current.value);
+                current = peeked ? next : lexer.NextToken();
+                fetched = true;
+                peeked = false;
+            }
+            return current;
+        }
 
-                if (next.token == TokenType::ParL)
-                {
-                    Advance(); // 跳过函数名
-                    ParseFunctionCall(id);
-                }
-                else if (next.token == TokenType::Assign)
+        // current 之后的一个 token
+        const Token& Peek()
+        {
+            Current();
+            if (!peeked)
+            {
+                next = lexer.NextToken();
+                peeked = true;
+            }
+            return next;
+        }
+
+        void Advance()
+        {
+            LUA_TRACE(Current().toString());
+            lastLine = Current().line;
+            fetched = false;
+        }
+
+        void Expect(TokenType token, const char* text)
+        {
+            if (Current().token != token)
+                throw Error(std::string("预期 '") + text + "'，实际得到 " + Current().toString());
+            Advance();
+        }
+
+        // 与 Expect 相同，配对的符号不在同一行时在错误信息中指出开始的位置
+        void ExpectMatch(TokenType token, const char* text, const char* opening, int line)
+        {
+            if (Current().token == token)
+            {
+                Advance();
+                return;
+            }
+            if (Current().line == line)
+                throw Error(std::string("预期 '") + text + "'，实际得到 " + Current().toString());
+            throw Error(std::string("预期 '") + text + "'（以结束第 " + std::to_string(line) + " 行的 '" + opening +
+                "'），实际得到 " + Current().toString());
+        }
+
+        String* ExpectName()
+        {
+            if (Current().token != TokenType::Identifier)
+                throw Error("预期标识符，实际得到 " + Current().toString());
+            String* name = std::get<String*>(Current().value.value);
+            Advance();
+            return name;
+        }
+
+        // 生成带 chunk:行:列 前缀的语法错误，位置取当前 token
+        SyntaxError Error(const std::string& message)
+        {
+            return SyntaxError(std::string(lexer.ChunkName()->View()) + ":" + std::to_string(Current().line) + ":" +
+                std::to_string(Current().column) + ": 语法错误：" + message, Current().token == TokenType::Eof);
+        }
+
+        // 语法树节点，计入所在函数的节点数
+        template <typename T, typename... Args>
+        T* Node(Args&&... args)
+        {
+            function->nodeCount++;
+            return arena.New<T>(std::forward<Args>(args)...);
+        }
+
+        FunctionNode* NewFunctionNode(FunctionNode* parent, int line)
+        {
+            auto* node = arena.New<FunctionNode>();
+            node->parent = parent;
+            node->line = line;
+            return node;
+        }
+
+        LocalVar* NewVar(String* name, int line)
+        {
+            auto* var = arena.New<LocalVar>();
+            var->name = name;
+            var->function = function;
+            var->line = line;
+            return var;
+        }
+
+        // 声明局部变量；流式执行时主函数顶层的变量固定到下一个保留寄存器
+        LocalVar* NewLocal(String* name, int line)
+        {
+            LocalVar* var = NewVar(name, line);
+            if (streaming && function == main && blockDepth == 0)
+            {
+                var->pinned = static_cast<int32_t>(pinned.size());
+                pinned.push_back({ name });
+            }
+            return var;
+        }
+
+        // 变量进入作用域
+        void Declare(LocalVar* var)
+        {
+            var->scope = static_cast<uint32_t>(active.size());
+            active.push_back(var);
+        }
+
+        // 名字解析：由内向外查找可见的局部变量，找不到时为全局变量
+        Expr* Resolve(String* name, int line)
+        {
+            for (size_t i = active.size(); i-- > 0;)
+            {
+                LocalVar* var = active[i];
+                if (var->name == name)
                 {
-                    Advance(); // 跳过变量名
-                    ParseAssignment(id);
+                    if (var->function != function)
+                        var->captured = true;
+                    if (scanning && i < scanActive && std::find(freeVars.begin(), freeVars.end(), var) == freeVars.end())
+                        freeVars.push_back(var);
+                    return Node<LocalExpr>(line, var);
                 }
-                else
+            }
+            return Node<GlobalExpr>(line, name);
+        }
+
+        bool BlockFollow()
+        {
+            switch (Current().token)
+            {
+            case TokenType::Eof:
+            case TokenType::End:
+            case TokenType::Else:
+            case TokenType::Elseif:
+            case TokenType::Until:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        // 语句序列，直到代码块结束；return 必须是最后一条语句。
+        // 块中的标签只在块内可见，离开代码块时还没有找到标签的 goto 交给外层代码块继续等待
+        Stat* ParseBlock()
+        {
+            const size_t outerActive = blockActive;
+            const size_t outerGotos = blockGotos;
+            const size_t firstLabel = labels.size();
+            blockActive = active.size();
+            blockGotos = gotos.size();
+
+            Stat* head = nullptr;
+            Stat** tail = &head;
+            while (!BlockFollow())
+            {
+                if (Current().token == TokenType::Return)
                 {
-                    throw std::runtime_error("语法错误：标识符后需要括号或赋值符号 " + current.toString());
+                    *tail = ParseReturn();
+                    break;
                 }
+                // 连续的几个标签作为一串语句返回
+                *tail = ParseStatement();
+                while (*tail != nullptr)
+                    tail = &(*tail)->next;
             }
-            else if (current.token == TokenType::Local)
+
+            labels.resize(firstLabel);
+            for (size_t i = blockGotos; i < gotos.size(); ++i)
+                gotos[i].active = std::min(gotos[i].active, blockActive);
+            blockActive = outerActive;
+            blockGotos = outerGotos;
+            return head;
+        }
+
+        // 带独立作用域的代码块
+        Stat* ParseScope()
+        {
+            size_t mark = active.size();
+            blockDepth++;
+            Stat* body = ParseBlock();
+            blockDepth--;
+            active.resize(mark);
+            return body;
+        }
+
+        Stat* ParseReturn()
+        {
+            int line = Current().line;
+            Advance();
+            Expr* values = nullptr;
+            uint32_t count = 0;
+            if (!BlockFollow() && Current().token != TokenType::SemiColon)
+                values = ParseExprList(count);
+            if (Current().token == TokenType::SemiColon)
+                Advance();
+            if (!BlockFollow())
+                throw Error("'return' 必须是代码块的最后一条语句");
+            return Node<ReturnStat>(line, values, count);
+        }
+
+        // 返回 nullptr 表示空语句
+        Stat* ParseStatement()
+        {
+            int line = Current().line;
+            switch (Current().token)
             {
-                ParseLocalDeclaration();
-            }
-            else if (current.token == TokenType::SemiColon)
+            case TokenType::SemiColon:
+                Advance();
+                return nullptr;
+            case TokenType::If:
+                return ParseIf(line);
+            case TokenType::Repeat:
+                return ParseRepeat(line);
+            case TokenType::Break:
+                if (loopDepth == 0)
+                    throw Error("break 不在循环中");
+                Advance();
+                return Node<BreakStat>(line);
+            case TokenType::Goto:
+                return ParseGoto(line);
+            case TokenType::DoubColon:
+                return ParseLabel(line);
+            case TokenType::While:
             {
-                // 空语句，直接跳过
                 Advance();
-                return;
+                Expr* condition = ParseExpr();
+                Expect(TokenType::Do, "do");
+                loopDepth++;
+                Stat* body = ParseScope();
+                loopDepth--;
+                int endLine = Current().line;
+                ExpectMatch(TokenType::End, "end", "while", line);
+                return Node<WhileStat>(line, condition, body, endLine);
             }
-            else
+            case TokenType::Do:
             {
-                throw std::runtime_error("语法错误：不支持的语句开始类型 " + current.toString());
+                Advance();
+                Stat* body = ParseScope();
+                ExpectMatch(TokenType::End, "end", "do", line);
+                return Node<DoStat>(line, body);
+            }
+            case TokenType::For:
+                return ParseFor(line);
+            case TokenType::Function:
+                return ParseFunctionStat(line);
+            case TokenType::Local:
+                Advance();
+                if (Current().token == TokenType::Function)
+                    return ParseLocalFunction(line);
+                return ParseLocal(line);
+            default:
+                return ParseExprStat(line);
             }
+        }
 
-            // 对于非空语句，确保在语句结束后推进到下一个token
-            // 处理可能存在的分号
-            if (current.token == TokenType::SemiColon)
+        Stat* ParseFor(int line)
+        {
+            Advance();
+            String* name = ExpectName();
+            if (Current().token == TokenType::Comma || Current().token == TokenType::In)
+                return ParseGenericFor(line, name);
+            Expect(TokenType::Assign, "=");
+            Expr* start = ParseExpr();
+            Expect(TokenType::Comma, ",");
+            Expr* limit = ParseExpr();
+            Expr* step = nullptr;
+            if (Current().token == TokenType::Comma)
             {
                 Advance();
+                step = ParseExpr();
             }
+            Expect(TokenType::Do, "do");
+
+            // 循环变量属于循环体的作用域
+            size_t mark = active.size();
+            LocalVar* var = NewVar(name, line);
+            Declare(var);
+            blockDepth++;
+            loopDepth++;
+            Stat* body = ParseBlock();
+            loopDepth--;
+            blockDepth--;
+            active.resize(mark);
+            ExpectMatch(TokenType::End, "end", "for", line);
+            return Node<NumericForStat>(line, var, start, limit, step, body);
         }
 
-        void ParseFunctionCall(std::string& functionName)
+        Stat* ParseGenericFor(int line, String* first)
         {
-            // 1. 从全局变量表获得函数名，保存到常量表中
-            // 2. 加载函数名到调用栈上
-            // 3. 参数加入到常量表中
-            // 4. 加载到参数到调用栈上
-            // 5. 调用函数
-            Consume("(");  // 消耗函数名后的左括号
+            LocalVar* vars = NewVar(first, line);
+            LocalVar** tail = &vars->next;
+            uint32_t varCount = 1;
+            while (Current().token == TokenType::Comma)
+            {
+                Advance();
+                *tail = NewVar(ExpectName(), line);
+                tail = &(*tail)->next;
+                varCount++;
+            }
+            Expect(TokenType::In, "in");
+            uint32_t valueCount = 0;
+            Expr* values = ParseExprList(valueCount);
+            Expect(TokenType::Do, "do");
 
-            std::vector<uint16_t> paramIndices;
-            int globalIdx = GetGlobalIndex(functionName);
-            context.Constants.push_back(functionName);
-            context.Operations.push_back({ OpCode::LoadGlobal, context.Constants.size() - 1 });
+            // 循环变量属于循环体的作用域，explist 中引用的同名变量仍是外层的变量
+            size_t mark = active.size();
+            for (LocalVar* var = vars; var != nullptr; var = var->next)
+                Declare(var);
+            blockDepth++;
+            loopDepth++;
+            Stat* body = ParseBlock();
+            loopDepth--;
+            blockDepth--;
+            active.resize(mark);
+            ExpectMatch(TokenType::End, "end", "for", line);
+            return Node<GenericForStat>(line, vars, varCount, values, valueCount, body);
+        }
 
-            ParseExpression(paramIndices);
+        Stat* ParseIf(int line)
+        {
+            IfClause* clauses = nullptr;
+            IfClause** tail = &clauses;
+            do
+            {
+                Advance();  // if 或 elseif
+                auto* clause = arena.New<IfClause>();
+                function->nodeCount++;
+                clause->condition = ParseExpr();
+                Expect(TokenType::Then, "then");
+                clause->body = ParseScope();
+                *tail = clause;
+                tail = &clause->next;
+            } while (Current().token == TokenType::Elseif);
 
-            Consume(")");  // 消耗右括号
+            Stat* elseBody = nullptr;
+            if (Current().token == TokenType::Else)
+            {
+                Advance();
+                elseBody = ParseScope();
+            }
+            ExpectMatch(TokenType::End, "end", "if", line);
+            return Node<IfStat>(line, clauses, elseBody);
+        }
 
-            context.Operations.push_back({OpCode::Call, globalIdx, 1});
+        Stat* ParseRepeat(int line)
+        {
+            Advance();
+            // until 的条件属于循环体的作用域
+            size_t mark = active.size();
+            blockDepth++;
+            loopDepth++;
+            Stat* body = ParseBlock();
+            loopDepth--;
+            ExpectMatch(TokenType::Until, "until", "repeat", line);
+            Expr* condition = ParseExpr();
+            blockDepth--;
+            active.resize(mark);
+            return Node<RepeatStat>(line, body, condition);
         }
 
-        void ParseExpression(std::vector<uint16_t>& paramIndices)
+        // 目标标签已经可见时是向后跳转，直接解析；否则等待后面出现的标签
+        Stat* ParseGoto(int line)
         {
-            // 首先解析左操作数
-            switch (current.token)
+            Advance();
+            auto* stat = Node<GotoStat>(line, ExpectName());
+            for (size_t i = labels.size(); i-- > functionLabels;)
             {
-            case TokenType::String:
-            case TokenType::Number:
-            case TokenType::True:
-            case TokenType::False:
-            case TokenType::Nil:
-                paramIndices.push_back(GetConstantIndex(current.value));
-                context.Operations.emplace_back(OpCode::LoadConst, paramIndices.back());
-                Advance();
-                break;
-            case TokenType::Identifier:
+                if (labels[i]->name == stat->name)
+                {
+                    stat->target = labels[i];
+                    return stat;
+                }
+            }
+            gotos.push_back({ stat, active.size() });
+            return stat;
+        }
+
+        // 连续的标签（之间只有空语句）位于同一位置，一起解析后以 next 串联返回
+        Stat* ParseLabel(int line)
+        {
+            const size_t first = labels.size();
+            while (true)
             {
-                std::string varName = static_cast<std::string>(current.value);
-                paramIndices.push_back(GetConstantIndex(varName));
-                // TODO: 实现变量加载
                 Advance();
-                break;
+                String* name = ExpectName();
+                Expect(TokenType::DoubColon, "::");
+                for (size_t i = functionLabels; i < labels.size(); ++i)
+                {
+                    if (labels[i]->name == name)
+                        throw Error("标签 '" + std::string(name->View()) + "' 已在第 " + std::to_string(labels[i]->line) + " 行定义");
+                }
+                auto* label = Node<LabelStat>(line, name, 0);
+                if (labels.size() > first)
+                    labels.back()->next = label;
+                labels.push_back(label);
+                while (Current().token == TokenType::SemiColon)
+                    Advance();
+                if (Current().token != TokenType::DoubColon)
+                    break;
+                line = Current().line;
             }
-            case TokenType::ParL:
+
+            // 代码块末尾（其后只有空语句）的标签处，块中声明的变量已离开作用域，goto 可以越过这些声明跳到这里；
+            // repeat 循环体的末尾除外，until 的条件仍能看到这些变量
+            const size_t visible = BlockFollow() && Current().token != TokenType::Until ? blockActive : active.size();
+            for (size_t l = first; l < labels.size(); ++l)
             {
-                Advance(); // 跳过 (
-                ParseExpression(paramIndices);
-                Consume(")"); // 消耗 )
-                break;
-            }
-            default:
-                throw std::runtime_error("语法错误：不支持的表达式类型 " + current.toString());
+                LabelStat* label = labels[l];
+                label->active = static_cast<uint32_t>(visible);
+                // 本块中（含内层代码块中）等待这个标签的 goto 是向前跳转，不能跳进局部变量的作用域
+                for (size_t i = blockGotos; i < gotos.size();)
+                {
+                    PendingGoto& pending = gotos[i];
+                    if (pending.stat->name != label->name)
+                    {
+                        ++i;
+                        continue;
+                    }
+                    if (pending.active < visible)
+                    {
+                        throw Error("第 " + std::to_string(pending.stat->line) + " 行的 goto " + std::string(label->name->View()) +
+                            " 跳入了局部变量 '" + std::string(active[pending.active]->name->View()) + "' 的作用域");
+                    }
+                    pending.stat->target = label;
+                    gotos.erase(gotos.begin() + static_cast<ptrdiff_t>(i));
+                }
             }
+            return labels[first];
+        }
 
-            // 检查是否有运算符
-            if (current.token == TokenType::Add || current.token == TokenType::Sub ||
-                current.token == TokenType::Mul || current.token == TokenType::Div) {
-                // 暂时跳过运算符，简单处理为只加载左操作数
-                TokenType op = current.token;
-                Advance(); // 跳过运算符
-                // 递归解析右操作数（目前简化处理）
-                std::vector<uint16_t> rightParam;
-                ParseExpression(rightParam);
-                // TODO: 实现实际的运算操作
+        // 函数结束时仍在等待标签的 goto
+        void CheckGotos()
+        {
+            if (gotos.size() > functionGotos)
+            {
+                GotoStat* stat = gotos[functionGotos].stat;
+                throw Error("第 " + std::to_string(stat->line) + " 行的 goto 找不到可见的标签 '" +
+                    std::string(stat->name->View()) + "'");
             }
         }
 
-        uint16_t ParseExpression()
+        // function a.b.c:m() ... end 表示为对 a.b.c.m 的赋值
+        Stat* ParseFunctionStat(int line)
         {
-            switch (current.token)
+            Advance();
+            String* first = ExpectName();
+            Expr* target = Resolve(first, line);
+            std::string name(first->View());
+            bool method = false;
+            while (Current().token == TokenType::Dot || Current().token == TokenType::Colon)
             {
-            case TokenType::String:
-            case TokenType::Number:
-            case TokenType::True:
-            case TokenType::False:
-            case TokenType::Nil:
+                method = Current().token == TokenType::Colon;
+                Advance();
+                String* field = ExpectName();
+                name += method ? ':' : '.';
+                name += field->View();
+                Expr* key = Node<ConstantExpr>(line, Value(field));
+                target = Node<IndexExpr>(line, target, key);
+                if (method)
+                    break;
+            }
+            if (target->kind == ExprKind::Local)
+                static_cast<LocalExpr*>(target)->var->assigned = true;
+
+            FunctionNode* body = ParseBody(line, method);
+            body->name = heap.NewString(name);
+            Expr* value = Node<FunctionExpr>(line, body);
+            return Node<AssignStat>(line, target, 1, value, 1);
+        }
+
+        Stat* ParseLocalFunction(int line)
+        {
+            Advance();
+            LocalVar* var = NewLocal(ExpectName(), line);
+            // 先声明后分析函数体，函数体中可以递归引用自身
+            Declare(var);
+            FunctionNode* body = ParseBody(line, false, true);
+            body->name = var->name;
+            var->inlineCandidate = IsInlineCandidate(body);
+            return Node<LocalFunctionStat>(line, var, body);
+        }
+
+        Stat* ParseLocal(int line)
+        {
+            LocalVar* vars = nullptr;
+            LocalVar** tail = &vars;
+            bool hasClose = false;
+            while (true)
             {
-                uint16_t constIndex = GetConstantIndex(current.value);
-                context.Operations.emplace_back(OpCode::LoadConst, constIndex);
+                LocalVar* var = NewLocal(ExpectName(), line);
+                if (Current().token == TokenType::Less)
+                {
+                    Advance();
+                    String* attribute = ExpectName();
+                    Expect(TokenType::Greater, ">");
+                    if (attribute->View() == "const")
+                    {
+                        var->isConst = true;
+                    }
+                    else if (attribute->View() == "close")
+                    {
+                        if (hasClose)
+                            throw Error("一条 local 语句中有多个待关闭变量");
+                        hasClose = true;
+                        var->isConst = true;
+                        var->toClose = true;
+                    }
+                    else
+                    {
+                        throw Error("未知的变量属性 '" + std::string(attribute->View()) + "'");
+                    }
+                }
+                *tail = var;
+                tail = &var->next;
+                if (Current().token != TokenType::Comma)
+                    break;
                 Advance();
-                return constIndex;
             }
-            case TokenType::Identifier:
+
+            Expr* values = nullptr;
+            uint32_t valueCount = 0;
+            if (Current().token == TokenType::Assign)
             {
-                std::string varName = static_cast<std::string>(current.value);
-                uint16_t constIndex = GetConstantIndex(varName);
-                // TODO: 实现变量加载
                 Advance();
-                return constIndex;
+                values = ParseExprList(valueCount, true);
             }
-            case TokenType::ParL:
+
+            // 初值中引用的同名变量仍是外层的变量
+            Expr* value = values;
+            for (LocalVar* var = vars; var != nullptr; var = var->next)
+            {
+                if (value != nullptr)
+                {
+                    var->inlineCandidate = value->kind == ExprKind::Function &&
+                        IsInlineCandidate(static_cast<FunctionExpr*>(value)->function);
+                    value = value->next;
+                }
+                Declare(var);
+            }
+            return Node<LocalStat>(line, vars, values, valueCount);
+        }
+
+        // 赋值或函数调用语句
+        Stat* ParseExprStat(int line)
+        {
+            Expr* expr = ParseSuffixedExpr();
+            if (Current().token == TokenType::Assign || Current().token == TokenType::Comma)
+            {
+                Expr* targets = expr;
+                Expr** tail = &expr->next;
+                uint32_t targetCount = 1;
+                CheckAssignable(expr);
+                while (Current().token == TokenType::Comma)
+                {
+                    Advance();
+                    Expr* target = ParseSuffixedExpr();
+                    CheckAssignable(target);
+                    *tail = target;
+                    tail = &target->next;
+                    targetCount++;
+                }
+                Expect(TokenType::Assign, "=");
+                uint32_t valueCount = 0;
+                Expr* values = ParseExprList(valueCount);
+                return Node<AssignStat>(line, targets, targetCount, values, valueCount);
+            }
+            if (expr->kind != ExprKind::Call && expr->kind != ExprKind::Method)
+                throw Error("语句不完整，需要赋值或函数调用，实际得到 " + Current().toString());
+            return Node<CallStat>(line, expr);
+        }
+
+        void CheckAssignable(Expr* expr)
+        {
+            switch (expr->kind)
             {
-                Advance(); // 跳过 (
-                uint16_t result = ParseExpression();
-                Consume(")"); // 消耗 )
-                return result;
+            case ExprKind::Local:
+            {
+                LocalVar* var = static_cast<LocalExpr*>(expr)->var;
+                if (var->isConst)
+                    throw Error("尝试给常量变量 '" + std::string(var->name->View()) + "' 赋值");
+                var->assigned = true;
+                break;
             }
-            // TODO: 添加更多表达式类型（运算符、函数调用等）
+            case ExprKind::Global:
+            case ExprKind::Index:
+                break;
             default:
-                throw std::runtime_error("语法错误：不支持的表达式类型 " + current.toString());
+                throw Error("无法对该表达式赋值");
             }
         }
 
-        void ParseAssignment(const std::string& varName)
+        // 函数的参数表与函数体；方法隐含第一个参数 self。
+        // 延迟编译时照常分析函数体以检查语法、解析变量引用，记下它引用的外层变量与在源码中的位置后丢弃语法树
+        // local：函数绑定到局部变量（local function f 或 local f = function），只有这样的函数可能被内联
+        FunctionNode* ParseBody(int line, bool method, bool local = false)
         {
+            function->hasFunctions = true;
+            function->nodeCount++;
+            FunctionNode* node = NewFunctionNode(function, line);
+            if (text == nullptr || scanning)
+            {
+                if (scanning)
+                    scannedFunctions++;
+                ParseFunction(node, method);
+                return node;
+            }
 
-            Consume("="); // 跳过赋值符号
+            const uint32_t begin = Current().offset;
+            const int beginLine = Current().line;
+            const int beginColumn = Current().column;
+            bool keep;
+            {
+                Arena::Scope scope(arena);
+                scanning = true;
+                scanActive = active.size();
+                scannedFunctions = 0;
+                freeVars.clear();
+                ParseFunction(node, method);
+                scanning = false;
+                // 绑定到局部变量、可内联的小函数保留语法树，照常立即编译；全局函数、方法与匿名函数再小也延迟编译。
+                // 引用了可内联的 local 函数的函数体同样立即编译：延迟编译的函数体中无法内联外层函数，
+                // 编译结果会与不延迟时不同，而热重载依赖于源码相同的函数体编译结果也相同
+                keep = options.inlining &&
+                    ((local && ConstantFolder::IsInlinable(node)) ||
+                     std::any_of(freeVars.begin(), freeVars.end(), [](const LocalVar* var) { return var->inlineCandidate; }));
+                if (keep)
+                    scope.Keep();
+            }
+            if (keep)
+                return node;
 
-            // 解析右侧表达式
-            uint16_t valueIndex = ParseExpression();
+            auto* lazy = arena.New<LazyFunction>();
+            lazy->text = text;
+            lazy->begin = begin;
+            lazy->end = Current().offset;
+            lazy->line = beginLine;
+            lazy->column = beginColumn;
+            lazy->method = method;
+            lazy->innerFunctions = scannedFunctions;
+            lazy->freeCount = static_cast<uint32_t>(freeVars.size());
+            lazy->freeVars = static_cast<LocalVar**>(arena.Allocate(sizeof(LocalVar*) * freeVars.size(), alignof(LocalVar*)));
+            std::copy(freeVars.begin(), freeVars.end(), lazy->freeVars);
+            node->params = nullptr;
+            node->body = nullptr;
+            node->lazy = lazy;
+            return node;
+        }
+
+        // 延迟编译时保留了语法树、可以被内联的函数
+        bool IsInlineCandidate(const FunctionNode* node) const
+        {
+            return text != nullptr && !scanning && node->lazy == nullptr && options.inlining && ConstantFolder::IsInlinable(node);
+        }
+
+        // 延迟编译的函数体：外层函数以替身代替，函数体引用的外层变量声明在其中，
+        // 上值按下标与 proto 已有的上值描述对应，被常量传播的变量带上常量
+        void ParseLazy(Proto& proto)
+        {
+            Arena::Scope scope(arena);
+            main = function = NewFunctionNode(nullptr, 0);
+            const size_t upvalueCount = proto.upvalues.size();
+            auto* upvalues = static_cast<LocalVar**>(arena.Allocate(sizeof(LocalVar*) * upvalueCount, alignof(LocalVar*)));
+            for (size_t i = 0; i < upvalueCount; ++i)
+            {
+                upvalues[i] = NewVar(proto.upvalues[i].name, 0);
+                Declare(upvalues[i]);
+            }
+            for (const LazyConstant& constant : proto.lazyConstants)
+            {
+                LocalVar* var = NewVar(constant.name, 0);
+                var->hasConstant = true;
+                var->constant = constant.value;
+                Declare(var);
+            }
 
-            // TODO: 实现赋值操作码，暂时跳过实现
-            std::cout << "赋值语句: " << varName << " = " << valueIndex << std::endl;
+            FunctionNode* node = NewFunctionNode(function, proto.lineDefined);
+            ParseFunction(node, proto.lazy.method);
+            node->name = proto.name;
+            Compiler(heap, options).CompileLazy(node, proto, lexer.ChunkName(), std::span<LocalVar* const>(upvalues, upvalueCount));
         }
 
-        void ParseLocalDeclaration()
+        // 参数表与函数体，分析结果写入 node
+        void ParseFunction(FunctionNode* node, bool method)
         {
-            Advance(); // 跳过 local 关键字
+            const int line = node->line;
+            FunctionNode* parent = function;
+            function = node;
+            size_t mark = active.size();
+            // 标签与 goto 不跨越函数
+            const size_t outerLabels = functionLabels;
+            const size_t outerGotos = functionGotos;
+            const int outerLoops = loopDepth;
+            functionLabels = labels.size();
+            functionGotos = gotos.size();
+            loopDepth = 0;
 
-            if (current.token != TokenType::Identifier)
+            LocalVar** tail = &node->params;
+            auto addParam = [&](String* name) {
+                LocalVar* param = NewVar(name, line);
+                *tail = param;
+                tail = &param->next;
+                node->paramCount++;
+                Declare(param);
+            };
+            if (method)
+                addParam(heap.NewString("self"));
+
+            Expect(TokenType::ParL, "(");
+            if (Current().token != TokenType::ParR)
             {
-                throw std::runtime_error("语法错误：local 后需要标识符");
+                while (true)
+                {
+                    if (Current().token == TokenType::Dots)
+                    {
+                        // ... 只能是最后一个参数
+                        Advance();
+                        node->vararg = true;
+                        break;
+                    }
+                    addParam(ExpectName());
+                    if (Current().token != TokenType::Comma)
+                        break;
+                    Advance();
+                }
             }
+            Expect(TokenType::ParR, ")");
 
-            std::string varName = static_cast<std::string>(current.value);
-            Advance(); // 跳过变量名
+            node->body = ParseBlock();
+            node->endLine = Current().line;
+            CheckGotos();
+            ExpectMatch(TokenType::End, "end", "function", line);
 
-            if (current.token == TokenType::Assign)
+            active.resize(mark);
+            functionLabels = outerLabels;
+            functionGotos = outerGotos;
+            loopDepth = outerLoops;
+            function = parent;
+        }
+
+        // 以逗号分隔的表达式列表，以 next 串联
+        // localValues：表达式是 local 语句的初值，其中以 function 开始的函数绑定到局部变量（见 ParseBody）
+        Expr* ParseExprList(uint32_t& count, bool localValues = false)
+        {
+            Expr* head = nullptr;
+            Expr** tail = &head;
+            while (true)
             {
-                ParseAssignment(varName);
+                localValue = localValues && Current().token == TokenType::Function;
+                Expr* expr = ParseExpr();
+                localValue = false;
+                *tail = expr;
+                tail = &expr->next;
+                count++;
+                if (Current().token != TokenType::Comma)
+                    return head;
+                Advance();
             }
-            // TODO: 实现局部变量声明，暂时跳过
-            std::cout << "局部变量声明: " << varName << std::endl;
         }
 
-        void Advance()
+        static bool BinaryOperator(TokenType token, BinaryOp& op, Priority& priority)
         {
-            std::cout << current.toString() << std::endl;
-            current = next;
-            next = lexer.NextToken();
+            switch (token)
+            {
+            case TokenType::Add:     op = BinaryOp::Add;    priority = { 10, 10 }; return true;
+            case TokenType::Sub:     op = BinaryOp::Sub;    priority = { 10, 10 }; return true;
+            case TokenType::Mul:     op = BinaryOp::Mul;    priority = { 11, 11 }; return true;
+            case TokenType::Div:     op = BinaryOp::Div;    priority = { 11, 11 }; return true;
+            case TokenType::Idiv:    op = BinaryOp::Idiv;   priority = { 11, 11 }; return true;
+            case TokenType::Mod:     op = BinaryOp::Mod;    priority = { 11, 11 }; return true;
+            case TokenType::Pow:     op = BinaryOp::Pow;    priority = { 14, 13 }; return true;
+            case TokenType::Concat:  op = BinaryOp::Concat; priority = { 9, 8 };   return true;
+            case TokenType::ShiftL:  op = BinaryOp::Shl;    priority = { 7, 7 };   return true;
+            case TokenType::ShiftR:  op = BinaryOp::Shr;    priority = { 7, 7 };   return true;
+            case TokenType::BitAnd:  op = BinaryOp::BAnd;   priority = { 6, 6 };   return true;
+            case TokenType::BitXor:  op = BinaryOp::BXor;   priority = { 5, 5 };   return true;
+            case TokenType::BitOr:   op = BinaryOp::BOr;    priority = { 4, 4 };   return true;
+            case TokenType::Equal:   op = BinaryOp::Eq;     priority = { 3, 3 };   return true;
+            case TokenType::NotEq:   op = BinaryOp::Ne;     priority = { 3, 3 };   return true;
+            case TokenType::Less:    op = BinaryOp::Lt;     priority = { 3, 3 };   return true;
+            case TokenType::LesEq:   op = BinaryOp::Le;     priority = { 3, 3 };   return true;
+            case TokenType::Greater: op = BinaryOp::Gt;     priority = { 3, 3 };   return true;
+            case TokenType::GreEq:   op = BinaryOp::Ge;     priority = { 3, 3 };   return true;
+            case TokenType::And:     op = BinaryOp::And;    priority = { 2, 2 };   return true;
+            case TokenType::Or:      op = BinaryOp::Or;     priority = { 1, 1 };   return true;
+            default:
+                return false;
+            }
         }
 
-        void Consume(const std::string& expectedStr)
+        static bool UnaryOperator(TokenType token, UnaryOp& op)
         {
-            bool matched = false;
-            if (expectedStr == "(" && current.token == TokenType::ParL) {
-                matched = true;
-            } else if (expectedStr == ")" && current.token == TokenType::ParR) {
-                matched = true;
-            } else if (expectedStr == "=" && current.token == TokenType::Assign) {
-                matched = true;
-            } else if (expectedStr == ";" && current.token == TokenType::SemiColon) {
-                matched = true;
-            } else if (static_cast<std::string>(current.value) == expectedStr) {
-                matched = true;
+            switch (token)
+            {
+            case TokenType::Sub:    op = UnaryOp::Minus; return true;
+            case TokenType::Not:    op = UnaryOp::Not;   return true;
+            case TokenType::Len:    op = UnaryOp::Len;   return true;
+            case TokenType::BitXor: op = UnaryOp::BNot;  return true;
+            default:
+                return false;
             }
+        }
 
-            if (matched)
+        // 按优先级爬升：只处理左优先级高于 limit 的二元运算符
+        Expr* ParseExpr(int limit = 0)
+        {
+            Expr* left;
+            UnaryOp unary;
+            if (UnaryOperator(Current().token, unary))
             {
+                int line = Current().line;
                 Advance();
+                Expr* operand = ParseExpr(UnaryPriority);
+                left = Node<UnaryExpr>(line, unary, operand);
             }
             else
             {
-                throw std::runtime_error(
-                    "语法错误：预期 '" + expectedStr + "'，实际得到 " + current.toString()
-                );
+                left = ParseSimpleExpr();
+            }
+
+            while (true)
+            {
+                BinaryOp op;
+                Priority priority;
+                if (!BinaryOperator(Current().token, op, priority) || priority.left <= limit)
+                    return left;
+                int line = Current().line;
+                Advance();
+                Expr* right = ParseExpr(priority.right);
+                left = Node<BinaryExpr>(line, op, left, right);
             }
         }
 
-        uint16_t GetConstantIndex(const Value& val)
+        Expr* ParseSimpleExpr()
         {
-            auto it = std::find(context.Constants.begin(), context.Constants.end(), val);
-            if (it != context.Constants.end())
+            int line = Current().line;
+            switch (Current().token)
+            {
+            case TokenType::Number:
+            case TokenType::String:
             {
-                return static_cast<uint16_t>(std::distance(context.Constants.begin(), it));
+                Value value = Current().value;
+                Advance();
+                return Node<ConstantExpr>(line, value);
             }
+            case TokenType::Nil:
+                Advance();
+                return Node<ConstantExpr>(line, Value());
+            case TokenType::True:
+                Advance();
+                return Node<ConstantExpr>(line, Value(true));
+            case TokenType::False:
+                Advance();
+                return Node<ConstantExpr>(line, Value(false));
+            case TokenType::Dots:
+                if (!function->vararg)
+                    throw Error("不能在可变参数函数之外使用 '...'");
+                Advance();
+                return Node<VarargExpr>(line);
+            case TokenType::Function:
+                Advance();
+                return Node<FunctionExpr>(line, ParseBody(line, false, std::exchange(localValue, false)));
+            case TokenType::CurlyL:
+                return ParseTable();
+            default:
+                return ParseSuffixedExpr();
+            }
+        }
 
-            if (context.Constants.size() >= UINT16_MAX)
-                throw std::runtime_error("常量表溢出");
-            uint16_t idx = static_cast<uint16_t>(context.Constants.size());
-            context.Constants.push_back(val);
-            return idx;
+        Expr* ParsePrimaryExpr()
+        {
+            int line = Current().line;
+            switch (Current().token)
+            {
+            case TokenType::Identifier:
+                return Resolve(ExpectName(), line);
+            case TokenType::ParL:
+            {
+                Advance();
+                Expr* expr = ParseExpr();
+                ExpectMatch(TokenType::ParR, ")", "(", line);
+                expr->parenthesized = true;
+                return expr;
+            }
+            default:
+                throw Error("意外的符号 " + Current().toString());
+            }
         }
 
-        uint32_t GetGlobalIndex(std::string& name)
+        // 变量、字段、下标与调用组成的后缀表达式
+        Expr* ParseSuffixedExpr()
         {
-            uint32_t idx = 0;
-            for(const auto& [ctxName, _] : context.Globals)
+            int line = Current().line;
+            Expr* expr = ParsePrimaryExpr();
+            while (true)
             {
-                if (ctxName == name)
+                switch (Current().token)
+                {
+                case TokenType::Dot:
                 {
-                    return idx;
+                    Advance();
+                    Expr* key = Node<ConstantExpr>(line, Value(ExpectName()));
+                    expr = Node<IndexExpr>(line, expr, key);
+                    break;
+                }
+                case TokenType::SqurL:
+                {
+                    Advance();
+                    Expr* key = ParseExpr();
+                    Expect(TokenType::SqurR, "]");
+                    expr = Node<IndexExpr>(line, expr, key);
+                    break;
+                }
+                case TokenType::Colon:
+                {
+                    Advance();
+                    String* name = ExpectName();
+                    uint32_t count = 0;
+                    Expr* args = ParseArgs(count);
+                    expr = Node<MethodExpr>(line, expr, name, args, count);
+                    break;
+                }
+                case TokenType::ParL:
+                case TokenType::String:
+                case TokenType::CurlyL:
+                {
+                    uint32_t count = 0;
+                    Expr* args = ParseArgs(count);
+                    // 调用的行号记为被调表达式开始的行，与 Lua 一致
+                    expr = Node<CallExpr>(line, expr, args, count);
+                    break;
+                }
+                default:
+                    return expr;
                 }
-                idx++;
             }
+        }
 
-            if (idx == context.Globals.size())
+        // 实参：(表达式列表)、单个字符串字面量或单个表构造器
+        Expr* ParseArgs(uint32_t& count)
+        {
+            int line = Current().line;
+            if (Current().token == TokenType::String)
             {
-                context.Globals[name] = std::monostate{};
+                Value value = Current().value;
+                Advance();
+                count = 1;
+                return Node<ConstantExpr>(line, value);
+            }
+            if (Current().token == TokenType::CurlyL)
+            {
+                count = 1;
+                return ParseTable();
             }
-            return static_cast<uint16_t>(context.Globals.size() - 1);
+            Expect(TokenType::ParL, "(");
+            Expr* args = nullptr;
+            if (Current().token != TokenType::ParR)
+                args = ParseExprList(count);
+            ExpectMatch(TokenType::ParR, ")", "(", line);
+            return args;
         }
 
-    private:
-        Lex lexer;
-        Token current;
-        Token next;
+        Expr* ParseTable()
+        {
+            int line = Current().line;
+            Expect(TokenType::CurlyL, "{");
+            TableItem* items = nullptr;
+            TableItem** tail = &items;
+            uint32_t arrayCount = 0, hashCount = 0;
+            while (Current().token != TokenType::CurlyR)
+            {
+                auto* item = arena.New<TableItem>();
+                function->nodeCount++;
+                if (Current().token == TokenType::SqurL)
+                {
+                    Advance();
+                    item->key = ParseExpr();
+                    Expect(TokenType::SqurR, "]");
+                    Expect(TokenType::Assign, "=");
+                    item->value = ParseExpr();
+                    hashCount++;
+                }
+                else if (Current().token == TokenType::Identifier && Peek().token == TokenType::Assign)
+                {
+                    item->key = Node<ConstantExpr>(Current().line, Value(ExpectName()));
+                    Advance();
+                    item->value = ParseExpr();
+                    hashCount++;
+                }
+                else
+                {
+                    item->key = nullptr;
+                    item->value = ParseExpr();
+                    arrayCount++;
+                }
+                *tail = item;
+                tail = &item->next;
 
-        ProgramContext context;
+                if (Current().token != TokenType::Comma && Current().token != TokenType::SemiColon)
+                    break;
+                Advance();
+            }
+            ExpectMatch(TokenType::CurlyR, "}", "{", line);
+            return Node<TableExpr>(line, items, arrayCount, hashCount);
+        }
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,281 @@
+﻿#pragma once
+
+#include "LuaState.h"
+#include "LuaFunction.h"
+#include "LuaParser.h"
+
+#include <bit>
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Engine
+{
+    // 热重载的结果，函数按原型计数（主代码块也算一个）
+    struct ReloadResult
+    {
+        uint32_t unchanged = 0;         // 编译结果相同、原样保留的函数（已特化的指令与内联缓存一并保留）
+        uint32_t changed = 0;           // 编译结果不同、换成新原型的函数
+        uint32_t added = 0;             // 新源码中多出的函数，创建它们的代码再次执行后才会出现
+        uint32_t removed = 0;           // 新源码中已没有对应的函数，现有闭包继续执行旧代码
+        size_t closuresUpdated = 0;     // 改为执行新原型的闭包
+        size_t closuresSkipped = 0;     // 上值与新原型不一致、继续执行旧代码的闭包
+    };
+
+    // 按函数比较已加载的原型树与新源码的原型树，同一个函数的子函数之间按名字配对。
+    // 新源码的函数体只做了预扫描（延迟编译）：函数体的源码、上值描述与代入的外层常量都与旧原型相同时，
+    // 编译结果必然相同，直接保留旧原型及其全部子函数，不再编译；否则才编译新原型，
+    // 再比较两者的指令（按泛型指令比较）、常量、上值描述与子函数个数，相同时仍保留旧原型，只换上调试信息。
+    // 内联与常量传播会把一个函数的改动带进其调用方：被代入的外层常量按上面的比较识别；
+    // 引用了可内联的 local 函数的函数体不会延迟（见 Parser::ParseBody），总是编译后比较，同样会被识别为已改变。
+    // 改变了的函数改用新原型，并记下新旧原型的对应关系，由调用方更新现有闭包
+    class ProtoDiff
+    {
+    public:
+        // 需要编译的新原型按 options 编译；compareSource 为 false 时（编译选项与加载时不同）不按源码判断
+        ProtoDiff(Heap& heap, const CompileOptions& options, bool compareSource)
+            : heap(heap), options(options), compareSource(compareSource)
+        { }
+
+        // 合并以 old、fresh 为根的两棵树，返回合并后的根（old 或 fresh）。
+        // 合并后 fresh 树中每个原型的子函数都已指向合并结果；旧原型在 Commit 之前保持不变，
+        // 编译新原型失败时抛出异常，已加载的原型树不受影响
+        Proto* Merge(Proto* old, Proto* fresh)
+        {
+            if (fresh->Pending())
+            {
+                if (SameSource(*old, *fresh))
+                {
+                    result.unchanged += CountTree(*old);
+                    adopted.push_back({ old, fresh, true });
+                    return old;
+                }
+                if (!old->Pending())
+                    Parser::CompileLazy(heap, *fresh, options);
+            }
+            if (old->Pending())
+            {
+                // 旧原型从未编译，没有需要保留的指令特化与内联缓存
+                result.changed++;
+                result.added += CountTree(*fresh) - 1;
+                replaced.emplace(old, fresh);
+                return fresh;
+            }
+
+            const size_t oldCount = old->protos.size();
+            const size_t freshCount = fresh->protos.size();
+            std::vector<Proto*> partner(freshCount, nullptr);
+            std::vector<bool> used(oldCount, false);
+
+            // 子函数的配对：有名字（function a.b:c、local function）的按名字配对，
+            // 同名的有多个时先配编译结果相同的，再按先后顺序；匿名函数在同样没有名字的函数中按先后顺序配对。
+            // 改名的函数视为删除了旧函数、新增了新函数
+            auto pair = [&](bool sameCodeOnly) {
+                for (size_t j = 0; j < freshCount; ++j)
+                {
+                    for (size_t i = 0; partner[j] == nullptr && i < oldCount; ++i)
+                    {
+                        const Proto& candidate = *old->protos[i];
+                        if (!used[i] && candidate.name == fresh->protos[j]->name &&
+                            (!sameCodeOnly || Same(candidate, *fresh->protos[j])))
+                        {
+                            partner[j] = old->protos[i];
+                            used[i] = true;
+                        }
+                    }
+                }
+            };
+            pair(true);
+            pair(false);
+            for (size_t i = 0; i < oldCount; ++i)
+            {
+                if (!used[i])
+                    result.removed += CountTree(*old->protos[i]);
+            }
+
+            for (size_t j = 0; j < freshCount; ++j)
+            {
+                if (partner[j] != nullptr)
+                    fresh->protos[j] = Merge(partner[j], fresh->protos[j]);
+                else
+                    result.added += CountTree(*fresh->protos[j]);
+            }
+
+            if (!SameCode(*old, *fresh))
+            {
+                result.changed++;
+                replaced.emplace(old, fresh);
+                return fresh;
+            }
+            result.unchanged++;
+            adopted.push_back({ old, fresh, false });
+            return old;
+        }
+
+        // Merge 成功后把保留下来的旧原型改为新源码中的子函数、调试信息与位置
+        void Commit()
+        {
+            for (const Adoption& adoption : adopted)
+            {
+                Proto& old = *adoption.old;
+                Proto& fresh = *adoption.fresh;
+                if (adoption.sameSource)
+                {
+                    Rebase(old, fresh.lazy.text, fresh.source, static_cast<int64_t>(fresh.lazy.begin) - old.lazy.begin,
+                        fresh.lazy.line - old.lazy.line);
+                    continue;
+                }
+                old.protos.assign(fresh.protos.begin(), fresh.protos.end());
+                std::swap(old.lineInfo, fresh.lineInfo);
+                std::swap(old.locals, fresh.locals);
+                std::swap(old.inlines, fresh.inlines);
+                old.lineDefined = fresh.lineDefined;
+                old.source = fresh.source;
+                // 记下函数体在新源码中的位置，下次热重载时先按源码比较
+                const bool deferred = old.lazy.deferred;
+                old.lazy = fresh.lazy;
+                old.lazy.deferred = deferred;
+                std::swap(old.lazyConstants, fresh.lazyConstants);
+            }
+            adopted.clear();
+        }
+
+        ReloadResult& Result() { return result; }
+
+        // 已改变的函数：旧原型到新原型
+        std::unordered_map<Proto*, Proto*>& Replaced() { return replaced; }
+
+        // 闭包能否改用新原型：上值的个数与名字逐一相同（已捕获的上值对象原样沿用）
+        static bool SameUpvalues(const Proto& a, const Proto& b)
+        {
+            if (a.upvalues.size() != b.upvalues.size())
+                return false;
+            for (size_t i = 0; i < a.upvalues.size(); ++i)
+            {
+                if (a.upvalues[i].name != b.upvalues[i].name)
+                    return false;
+            }
+            return true;
+        }
+
+    private:
+        // 保留下来的旧原型与配对的新原型；sameSource 表示按源码判定未改变，新原型没有编译
+        struct Adoption
+        {
+            Proto* old;
+            Proto* fresh;
+            bool sameSource;
+        };
+
+        Heap& heap;
+        const CompileOptions& options;
+        const bool compareSource;
+        ReloadResult result;
+        std::unordered_map<Proto*, Proto*> replaced;
+        std::vector<Adoption> adopted;
+
+        // 两个原型的编译结果是否相同；新原型还没有编译时按源码判断
+        bool Same(const Proto& old, const Proto& fresh) const
+        {
+            if (fresh.Pending())
+                return SameSource(old, fresh);
+            return !old.Pending() && SameCode(old, fresh);
+        }
+
+        // 函数体的源码相同（可以在源码中移动位置，但起始列不变）、上值描述与代入的外层常量也相同，
+        // 按相同的编译选项编译出的结果必然相同
+        bool SameSource(const Proto& old, const Proto& fresh) const
+        {
+            const LazyBody& a = old.lazy;
+            const LazyBody& b = fresh.lazy;
+            if (!compareSource || a.text == nullptr || b.text == nullptr || a.end - a.begin != b.end - b.begin ||
+                a.column != b.column || a.method != b.method || old.lineDefined - a.line != fresh.lineDefined - b.line ||
+                old.upvalues.size() != fresh.upvalues.size() || old.lazyConstants.size() != fresh.lazyConstants.size())
+                return false;
+            for (size_t i = 0; i < old.upvalues.size(); ++i)
+            {
+                const UpvalueDesc& x = old.upvalues[i];
+                const UpvalueDesc& y = fresh.upvalues[i];
+                if (x.name != y.name || x.inStack != y.inStack || x.index != y.index)
+                    return false;
+            }
+            for (size_t i = 0; i < old.lazyConstants.size(); ++i)
+            {
+                const LazyConstant& x = old.lazyConstants[i];
+                const LazyConstant& y = fresh.lazyConstants[i];
+                if (x.name != y.name || !SameConstant(x.value, y.value))
+                    return false;
+            }
+            return a.text->View().substr(a.begin, a.end - a.begin) == b.text->View().substr(b.begin, b.end - b.begin);
+        }
+
+        // 源码未变的函数整体移动到新源码中的位置：函数体起点移动了 offset 个字节、lines 行
+        static void Rebase(Proto& proto, String* text, String* source, int64_t offset, int lines)
+        {
+            proto.lineInfo.Shift(lines);
+            for (InlineInfo& info : proto.inlines)
+                info.line += lines;
+            if (proto.lineDefined != 0)
+                proto.lineDefined += lines;
+            proto.source = source;
+            if (proto.lazy.text != nullptr)
+            {
+                proto.lazy.text = text;
+                proto.lazy.begin = static_cast<uint32_t>(proto.lazy.begin + offset);
+                proto.lazy.end = static_cast<uint32_t>(proto.lazy.end + offset);
+                proto.lazy.line += lines;
+            }
+            for (Proto* child : proto.protos)
+                Rebase(*child, text, source, offset, lines);
+        }
+
+        static bool SameConstant(const Value& a, const Value& b)
+        {
+            if (a.value.index() != b.value.index())
+                return false;
+            // 按位比较数字，0 与 -0 是不同的常量
+            if (const double* x = std::get_if<double>(&a.value))
+                return std::bit_cast<uint64_t>(*x) == std::bit_cast<uint64_t>(std::get<double>(b.value));
+            return a == b;
+        }
+
+        // 比较函数自身的编译结果（不含子函数的内容与调试信息）；
+        // 执行中特化过的指令按泛型指令比较，特化不改变操作数
+        static bool SameCode(const Proto& a, const Proto& b)
+        {
+            if (a.numParams != b.numParams || a.vararg != b.vararg || a.maxStack != b.maxStack || a.code.size() != b.code.size() ||
+                a.constants.size() != b.constants.size() || a.protos.size() != b.protos.size() ||
+                a.upvalues.size() != b.upvalues.size())
+                return false;
+            for (size_t pc = 0; pc < a.code.size(); ++pc)
+            {
+                const Operation& x = a.code[pc];
+                const Operation& y = b.code[pc];
+                if (GenericOp(x.opCode) != GenericOp(y.opCode) || x.argCount != y.argCount || x.args != y.args)
+                    return false;
+            }
+            for (size_t i = 0; i < a.constants.size(); ++i)
+            {
+                if (!SameConstant(a.constants[i], b.constants[i]))
+                    return false;
+            }
+            for (size_t i = 0; i < a.upvalues.size(); ++i)
+            {
+                const UpvalueDesc& x = a.upvalues[i];
+                const UpvalueDesc& y = b.upvalues[i];
+                if (x.name != y.name || x.inStack != y.inStack || x.index != y.index)
+                    return false;
+            }
+            return true;
+        }
+
+        static uint32_t CountTree(const Proto& proto)
+        {
+            uint32_t count = 1;
+            for (const Proto* child : proto.protos)
+                count += CountTree(*child);
+            return count;
+        }
+    };
+}
@@ -0,0 +1,340 @@
+﻿#pragma once
+
+#include "LuaVM.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Engine
+{
+    // 一个任务的执行结果，由完成回调在工作线程上收到
+    struct TaskResult
+    {
+        bool ok = true;
+        std::string error;                  // ok 为 false 时的错误信息
+        std::chrono::nanoseconds latency{}; // 从提交到执行完毕
+        uint32_t slices = 0;                // 执行的时间片数（未设置时间片时为 1）
+        size_t worker = 0;                  // 最后一个时间片所在的工作线程
+    };
+
+    // 调度器统计，计数自创建或上一次 ResetStats 起累计
+    struct SchedulerStats
+    {
+        uint64_t completed = 0;     // 执行完毕的任务数（含出错的）
+        uint64_t failed = 0;
+        uint64_t slices = 0;        // 执行的时间片总数
+        uint64_t steals = 0;        // 从其他工作线程的队列中取得的任务数
+        double seconds = 0;         // 统计区间的墙钟时间
+        std::chrono::nanoseconds p50{};
+        std::chrono::nanoseconds p99{};
+        std::chrono::nanoseconds p999{};
+        std::chrono::nanoseconds max{};
+
+        double Throughput() const { return seconds > 0 ? static_cast<double>(completed) / seconds : 0.0; }
+    };
+
+    // 在固定数量的工作线程上运行大量相互隔离的脚本。
+    // 每个工作线程有自己的任务队列：提交的任务轮流放入各队列，线程先从自己队列的队首取任务，
+    // 取空后随机挑选其他线程从其队尾窃取。脚本运行时只属于一个线程，VM 本身不需要任何锁。
+    //
+    // 每个线程持有一个空闲 VM，任务在其上 Reset 后加载执行，因此一个任务看不到其他任务留下的全局变量。
+    // 设置了时间片（checkpoints）时，用完时间片的任务带着自己的 VM 挂起并重新排到队尾，
+    // 之后可能在任何线程上继续（包括被窃取）；原线程需要时再创建新的 VM
+    class Scheduler
+    {
+    public:
+        using Setup = std::function<void(VM&)>;                 // 每个新建的 VM 上调用一次（注册宿主函数、设置输出等）
+        using Completion = std::function<void(const TaskResult&)>;  // 在工作线程上调用，不应抛出异常
+
+        // workers 为 0 时使用硬件线程数；timeSlice 为每个时间片的检查点数（见 VM::SetBudget），0 表示不分片
+        explicit Scheduler(size_t workers = 0, uint64_t timeSlice = 0, Setup setup = {})
+            : timeSlice(timeSlice), setup(std::move(setup)), began(Clock::now())
+        {
+            if (workers == 0)
+                workers = std::max(1u, std::thread::hardware_concurrency());
+            this->workers.reserve(workers);
+            for (size_t i = 0; i < workers; ++i)
+                this->workers.push_back(std::make_unique<Worker>(i));
+            for (auto& worker : this->workers)
+                worker->thread = std::thread([this, w = worker.get()] { WorkerLoop(*w); });
+        }
+
+        Scheduler(const Scheduler&) = delete;
+        Scheduler& operator=(const Scheduler&) = delete;
+
+        // 执行完已提交的全部任务后结束工作线程
+        ~Scheduler()
+        {
+            {
+                std::lock_guard lock(sleepMutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& worker : workers)
+                worker->thread.join();
+        }
+
+        size_t WorkerCount() const { return workers.size(); }
+
+        // 提交一段脚本，可以从任意线程（包括工作线程上的完成回调）调用
+        void Submit(std::string source, std::string chunkName = "task", Completion done = {})
+        {
+            auto task = std::make_unique<Task>();
+            task->source = std::move(source);
+            task->chunkName = std::move(chunkName);
+            task->done = std::move(done);
+            task->submitted = Clock::now();
+            outstanding.fetch_add(1, std::memory_order_relaxed);
+            size_t index = next.fetch_add(1, std::memory_order_relaxed) % workers.size();
+            Enqueue(*workers[index], std::move(task));
+        }
+
+        // 等待已提交的任务全部执行完毕
+        void Wait()
+        {
+            std::unique_lock lock(doneMutex);
+            idle.wait(lock, [this] { return outstanding.load(std::memory_order_acquire) == 0; });
+        }
+
+        // 等待已提交的任务全部完成后汇总统计
+        SchedulerStats Stats()
+        {
+            Wait();
+            SchedulerStats stats;
+            std::vector<int64_t> latencies;
+            for (auto& worker : workers)
+            {
+                stats.completed += worker->completed;
+                stats.failed += worker->failed;
+                stats.slices += worker->slices;
+                stats.steals += worker->steals;
+                latencies.insert(latencies.end(), worker->latencies.begin(), worker->latencies.end());
+            }
+            stats.seconds = std::chrono::duration<double>(Clock::now() - began).count();
+            if (!latencies.empty())
+            {
+                std::sort(latencies.begin(), latencies.end());
+                auto at = [&](double q) {
+                    return std::chrono::nanoseconds(latencies[static_cast<size_t>(q * static_cast<double>(latencies.size() - 1))]);
+                };
+                stats.p50 = at(0.5);
+                stats.p99 = at(0.99);
+                stats.p999 = at(0.999);
+                stats.max = std::chrono::nanoseconds(latencies.back());
+            }
+            return stats;
+        }
+
+        // 等待已提交的任务全部完成后清零统计，统计区间从此刻重新开始
+        void ResetStats()
+        {
+            Wait();
+            for (auto& worker : workers)
+            {
+                worker->completed = worker->failed = worker->slices = worker->steals = 0;
+                worker->latencies.clear();
+            }
+            began = Clock::now();
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        struct Task
+        {
+            std::string source;
+            std::string chunkName;
+            Completion done;
+            Clock::time_point submitted;
+            std::unique_ptr<VM> vm;     // 挂起的任务持有自己的 VM，执行完毕后交还给所在线程
+            uint32_t slices = 0;
+        };
+
+        struct Worker
+        {
+            explicit Worker(size_t index)
+                : index(index), seed(static_cast<uint32_t>(index) * 2654435761u + 1)
+            { }
+
+            size_t index;
+            std::thread thread;
+            std::mutex queueMutex;
+            std::deque<std::unique_ptr<Task>> queue;
+            std::unique_ptr<VM> vm;     // 空闲 VM
+            uint32_t seed;              // 挑选窃取对象用的 xorshift 状态
+
+            // 以下只由本线程写入，Stats 在全部任务完成后读取
+            uint64_t completed = 0;
+            uint64_t failed = 0;
+            uint64_t slices = 0;
+            uint64_t steals = 0;
+            std::vector<int64_t> latencies;
+        };
+
+        uint64_t timeSlice;
+        Setup setup;
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::atomic<size_t> next{ 0 };          // 轮流分配提交的任务
+        std::atomic<size_t> queued{ 0 };        // 各队列中的任务总数
+        std::atomic<size_t> outstanding{ 0 };   // 已提交但还没有执行完毕的任务数
+        Clock::time_point began;
+
+        std::mutex sleepMutex;
+        std::condition_variable wake;
+        bool stopping = false;
+
+        std::mutex doneMutex;
+        std::condition_variable idle;
+
+        void Enqueue(Worker& worker, std::unique_ptr<Task> task)
+        {
+            {
+                std::lock_guard lock(worker.queueMutex);
+                worker.queue.push_back(std::move(task));
+            }
+            queued.fetch_add(1, std::memory_order_release);
+            // 先计数，再经过一次 sleepMutex 后通知：等待方在锁内检查计数，不会错过唤醒
+            {
+                std::lock_guard lock(sleepMutex);
+            }
+            wake.notify_one();
+        }
+
+        std::unique_ptr<Task> PopOwn(Worker& worker)
+        {
+            std::lock_guard lock(worker.queueMutex);
+            if (worker.queue.empty())
+                return nullptr;
+            auto task = std::move(worker.queue.front());
+            worker.queue.pop_front();
+            return task;
+        }
+
+        std::unique_ptr<Task> Steal(Worker& thief)
+        {
+            const size_t count = workers.size();
+            if (count == 1)
+                return nullptr;
+            thief.seed ^= thief.seed << 13;
+            thief.seed ^= thief.seed >> 17;
+            thief.seed ^= thief.seed << 5;
+            const size_t start = thief.seed % count;
+            for (size_t i = 0; i < count; ++i)
+            {
+                Worker& victim = *workers[(start + i) % count];
+                if (&victim == &thief)
+                    continue;
+                std::lock_guard lock(victim.queueMutex);
+                if (victim.queue.empty())
+                    continue;
+                auto task = std::move(victim.queue.back());
+                victim.queue.pop_back();
+                ++thief.steals;
+                return task;
+            }
+            return nullptr;
+        }
+
+        void WorkerLoop(Worker& worker)
+        {
+            for (;;)
+            {
+                std::unique_ptr<Task> task = PopOwn(worker);
+                if (!task)
+                    task = Steal(worker);
+                if (task)
+                {
+                    queued.fetch_sub(1, std::memory_order_relaxed);
+                    Run(worker, std::move(task));
+                    continue;
+                }
+                std::unique_lock lock(sleepMutex);
+                wake.wait(lock, [this] { return stopping || queued.load(std::memory_order_acquire) > 0; });
+                if (stopping && queued.load(std::memory_order_acquire) == 0)
+                    return;
+            }
+        }
+
+        VM& AcquireVM(Worker& worker)
+        {
+            if (!worker.vm)
+            {
+                auto vm = std::make_unique<VM>();
+                if (setup)
+                    setup(*vm);
+                if (timeSlice != 0)
+                    vm->SetBudget(timeSlice, BudgetAction::Yield);
+                worker.vm = std::move(vm);
+            }
+            return *worker.vm;
+        }
+
+        void Run(Worker& worker, std::unique_ptr<Task> task)
+        {
+            ++task->slices;
+            ++worker.slices;
+            TaskResult result;
+            ExecuteStatus status = ExecuteStatus::Finished;
+            try
+            {
+                if (task->vm)
+                {
+                    status = task->vm->Resume();
+                }
+                else
+                {
+                    VM& vm = AcquireVM(worker);
+                    vm.Reset();
+                    vm.LoadBuffer(task->source, task->chunkName);
+                    status = vm.Execute();
+                }
+            }
+            catch (const std::exception& e)
+            {
+                result.ok = false;
+                result.error = e.what();
+            }
+
+            if (status == ExecuteStatus::Yielded)
+            {
+                if (!task->vm)
+                    task->vm = std::move(worker.vm);
+                Enqueue(worker, std::move(task));
+                return;
+            }
+
+            // 执行完毕：挂起过的任务把 VM 交还给当前线程（线程已有空闲 VM 时直接释放）
+            if (task->vm)
+            {
+                if (!worker.vm)
+                    worker.vm = std::move(task->vm);
+                task->vm.reset();
+            }
+
+            result.latency = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - task->submitted);
+            result.slices = task->slices;
+            result.worker = worker.index;
+            ++worker.completed;
+            if (!result.ok)
+                ++worker.failed;
+            worker.latencies.push_back(result.latency.count());
+            if (task->done)
+                task->done(result);
+
+            if (outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                std::lock_guard lock(doneMutex);
+                idle.notify_all();
+            }
+        }
+    };
+}
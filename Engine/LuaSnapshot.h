@@ -0,0 +1,789 @@
+﻿#pragma once
+
+#include "LuaState.h"
+#include "LuaHeap.h"
+
+#include <algorithm>
+#include <bit>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Engine
+{
+    // 堆快照的二进制格式。整数均为 LEB128 变长编码，数字为 8 字节小端 IEEE 754，
+    // 对象引用为对象下标 + 1（0 表示空），因此映像与地址无关，可以加载到任意堆中：
+    //   头部        Magic、Version
+    //   对象表      对象个数、其中字符串的个数（加载时预留驻留表），然后依次为各对象的类型与形状：
+    //               字符串（长度、内容）、原生函数（注册名）、表（数组部分大小、哈希部分键数、是否带 __gc）、
+    //               闭包（上值个数）、原型与上值（无）
+    //   对象内容    表、闭包、上值与原型按对象表的顺序依次给出引用的值
+    //   根          全局变量表、Reset 时恢复的全局变量表、字符串的元表
+    //   校验和      之前全部内容的 64 位 FNV-1a，8 字节小端
+    // 加载时先按对象表创建全部对象，再填入内容，引用可以指向任意位置（包括环）。
+    // 字符串的哈希种子随堆随机，表的哈希部分在加载时重建，不保存节点布局。
+    namespace Snapshot
+    {
+        inline constexpr std::string_view Magic = "\x1b" "CLS";
+        inline constexpr uint32_t Version = 5;
+        inline constexpr size_t ChecksumSize = 8;
+
+        inline uint64_t Checksum(std::string_view data)
+        {
+            uint64_t hash = 14695981039346656037ull;
+            for (char c : data)
+            {
+                hash ^= static_cast<uint8_t>(c);
+                hash *= 1099511628211ull;
+            }
+            return hash;
+        }
+
+        // 快照的根对象
+        struct Roots
+        {
+            Table* globals = nullptr;
+            Table* baseline = nullptr;
+            Table* stringMeta = nullptr;
+        };
+    }
+
+    // 保存快照：从根出发遍历全部可达对象（使用工作列表，不递归），编号后写出对象表与内容。
+    // 原生函数按 natives（注册名 -> 原生函数）中的名字保存；遇到未注册的原生函数
+    // （如 gmatch 返回的迭代器）或打开的上值时抛出异常
+    class SnapshotWriter
+    {
+    public:
+        SnapshotWriter(std::ostream& out, const Table* natives)
+            : out(out)
+        {
+            Value key, value;
+            while (natives->Next(key, value))
+            {
+                auto* name = std::get_if<String*>(&key.value);
+                auto* fn = std::get_if<Function*>(&value.value);
+                if (name != nullptr && fn != nullptr)
+                    names.emplace(*fn, *name);
+            }
+        }
+
+        void Write(const Snapshot::Roots& roots)
+        {
+            Discover(roots.globals);
+            Discover(roots.baseline);
+            Discover(roots.stringMeta);
+            for (size_t i = 0; i < objects.size(); ++i)
+                Visit(objects[i]);
+
+            buffer.append(Snapshot::Magic);
+            WriteUnsigned(Snapshot::Version);
+            WriteUnsigned(objects.size());
+            WriteUnsigned(std::count_if(objects.begin(), objects.end(),
+                [](const GCObject* object) { return object->type == ObjectType::String; }));
+            for (const GCObject* object : objects)
+                WriteShape(object);
+            for (const GCObject* object : objects)
+                WriteContents(object);
+            WriteRef(roots.globals);
+            WriteRef(roots.baseline);
+            WriteRef(roots.stringMeta);
+            WriteFixed(Snapshot::Checksum(buffer));
+
+            out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            if (!out)
+                throw std::runtime_error("写入快照失败");
+        }
+
+    private:
+        std::ostream& out;
+        std::unordered_map<const Function*, const String*> names;  // 原生函数的注册名
+        std::string buffer;
+        std::vector<const GCObject*> objects;                   // 按编号排列的全部对象
+        std::unordered_map<const GCObject*, uint32_t> indices;  // 对象的编号
+
+        void Discover(const GCObject* object)
+        {
+            if (object == nullptr || indices.contains(object))
+                return;
+            if (object->type == ObjectType::Function && !names.contains(static_cast<const Function*>(object)))
+                throw std::runtime_error("快照中不能包含未注册的原生函数");
+            if (object->type == ObjectType::Upvalue && static_cast<const Upvalue*>(object)->IsOpen())
+                throw std::runtime_error("快照中不能包含打开的上值");
+            indices.emplace(object, static_cast<uint32_t>(objects.size()));
+            objects.push_back(object);
+        }
+
+        void Discover(const Value& value)
+        {
+            std::visit([this](auto v) {
+                if constexpr (std::is_pointer_v<decltype(v)>)
+                    Discover(static_cast<const GCObject*>(v));
+                }, value.value);
+        }
+
+        // 登记对象引用的全部对象
+        void Visit(const GCObject* object)
+        {
+            switch (object->type)
+            {
+            case ObjectType::Table:
+            {
+                auto* table = static_cast<const Table*>(object);
+                Discover(table->metatable);
+                for (uint32_t i = 0; i < table->arraySize; ++i)
+                    Discover(table->array[i]);
+                for (uint32_t i = 0; i < table->nodeCapacity; ++i)
+                {
+                    if (!table->nodes[i].value.IsNil())
+                    {
+                        Discover(table->nodes[i].key);
+                        Discover(table->nodes[i].value);
+                    }
+                }
+                break;
+            }
+            case ObjectType::Closure:
+            {
+                auto* closure = static_cast<const Closure*>(object);
+                Discover(closure->proto);
+                for (uint32_t i = 0; i < closure->upvalueCount; ++i)
+                    Discover(closure->Upvalues()[i]);
+                break;
+            }
+            case ObjectType::Upvalue:
+                Discover(static_cast<const Upvalue*>(object)->closed);
+                break;
+            case ObjectType::Proto:
+            {
+                auto* proto = static_cast<const Proto*>(object);
+                Discover(proto->source);
+                Discover(proto->name);
+                for (const Value& constant : proto->constants)
+                    Discover(constant);
+                for (const Proto* child : proto->protos)
+                    Discover(child);
+                for (const UpvalueDesc& desc : proto->upvalues)
+                    Discover(desc.name);
+                for (const LocalVarInfo& info : proto->locals)
+                    Discover(info.name);
+                for (const InlineInfo& info : proto->inlines)
+                    Discover(info.name);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+
+        void WriteShape(const GCObject* object)
+        {
+            buffer.push_back(static_cast<char>(object->type));
+            switch (object->type)
+            {
+            case ObjectType::String:
+                WriteString(static_cast<const String*>(object)->View());
+                break;
+            case ObjectType::Function:
+                WriteString(names.at(static_cast<const Function*>(object))->View());
+                break;
+            case ObjectType::Table:
+            {
+                auto* table = static_cast<const Table*>(object);
+                WriteUnsigned(table->arraySize);
+                WriteUnsigned(HashCount(table));
+                buffer.push_back(table->finalize ? 1 : 0);
+                break;
+            }
+            case ObjectType::Closure:
+                WriteUnsigned(static_cast<const Closure*>(object)->upvalueCount);
+                break;
+            default:
+                break;
+            }
+        }
+
+        void WriteContents(const GCObject* object)
+        {
+            switch (object->type)
+            {
+            case ObjectType::Table:
+            {
+                auto* table = static_cast<const Table*>(object);
+                WriteRef(table->metatable);
+                for (uint32_t i = 0; i < table->arraySize; ++i)
+                    WriteValue(table->array[i]);
+                for (uint32_t i = 0; i < table->nodeCapacity; ++i)
+                {
+                    if (!table->nodes[i].value.IsNil())
+                    {
+                        WriteValue(table->nodes[i].key);
+                        WriteValue(table->nodes[i].value);
+                    }
+                }
+                break;
+            }
+            case ObjectType::Closure:
+            {
+                auto* closure = static_cast<const Closure*>(object);
+                WriteRef(closure->proto);
+                for (uint32_t i = 0; i < closure->upvalueCount; ++i)
+                    WriteRef(closure->Upvalues()[i]);
+                break;
+            }
+            case ObjectType::Upvalue:
+                WriteValue(static_cast<const Upvalue*>(object)->closed);
+                break;
+            case ObjectType::Proto:
+                WriteProto(*static_cast<const Proto*>(object));
+                break;
+            default:
+                break;
+            }
+        }
+
+        // 特化指令一律按泛型指令保存，加载后重新观察
+        void WriteProto(const Proto& proto)
+        {
+            WriteRef(proto.source);
+            WriteRef(proto.name);
+            WriteUnsigned(proto.numParams);
+            buffer.push_back(proto.vararg ? 1 : 0);
+            WriteUnsigned(proto.maxStack);
+            WriteSigned(proto.lineDefined);
+
+            WriteUnsigned(proto.code.size());
+            for (const Operation& op : proto.code)
+            {
+                buffer.push_back(static_cast<char>(GenericOp(op.opCode)));
+                WriteUnsigned(op.argCount);
+                for (uint32_t i = 0; i < op.argCount; ++i)
+                    WriteUnsigned(op.args[i]);
+            }
+            WriteUnsigned(proto.lineInfo.Size());
+            int last = 0;
+            proto.lineInfo.ForEachLine([&](int line) {
+                WriteSigned(line - last);
+                last = line;
+                });
+
+            WriteUnsigned(proto.constants.size());
+            for (const Value& constant : proto.constants)
+                WriteValue(constant);
+            WriteUnsigned(proto.protos.size());
+            for (const Proto* child : proto.protos)
+                WriteRef(child);
+            WriteUnsigned(proto.upvalues.size());
+            for (const UpvalueDesc& desc : proto.upvalues)
+            {
+                WriteRef(desc.name);
+                buffer.push_back(desc.inStack ? 1 : 0);
+                WriteUnsigned(desc.index);
+            }
+            WriteUnsigned(proto.locals.size());
+            for (const LocalVarInfo& info : proto.locals)
+            {
+                WriteRef(info.name);
+                WriteUnsigned(info.startPc);
+                WriteUnsigned(info.endPc);
+                WriteUnsigned(info.reg);
+            }
+            WriteUnsigned(proto.inlines.size());
+            for (const InlineInfo& info : proto.inlines)
+            {
+                WriteRef(info.name);
+                WriteUnsigned(info.startPc);
+                WriteUnsigned(info.endPc);
+                WriteSigned(info.line);
+                buffer.push_back(info.upvalue ? 1 : 0);
+            }
+        }
+
+        static uint32_t HashCount(const Table* table)
+        {
+            uint32_t count = 0;
+            for (uint32_t i = 0; i < table->nodeCapacity; ++i)
+            {
+                if (!table->nodes[i].value.IsNil())
+                    count++;
+            }
+            return count;
+        }
+
+        void WriteValue(const Value& value)
+        {
+            buffer.push_back(static_cast<char>(value.Type()));
+            switch (value.Type())
+            {
+            case ValueType::Nil:
+                break;
+            case ValueType::Boolean:
+                buffer.push_back(*std::get_if<bool>(&value.value) ? 1 : 0);
+                break;
+            case ValueType::Number:
+                WriteFixed(std::bit_cast<uint64_t>(*std::get_if<double>(&value.value)));
+                break;
+            default:
+                std::visit([this](auto v) {
+                    if constexpr (std::is_pointer_v<decltype(v)>)
+                        WriteRef(v);
+                    }, value.value);
+                break;
+            }
+        }
+
+        // 8 字节小端
+        void WriteFixed(uint64_t bits)
+        {
+            for (int i = 0; i < 8; ++i)
+                buffer.push_back(static_cast<char>(bits >> (i * 8)));
+        }
+
+        void WriteRef(const GCObject* object)
+        {
+            WriteUnsigned(object == nullptr ? 0 : static_cast<uint64_t>(indices.at(object)) + 1);
+        }
+
+        void WriteString(std::string_view text)
+        {
+            WriteUnsigned(text.size());
+            buffer.append(text);
+        }
+
+        void WriteUnsigned(uint64_t v)
+        {
+            while (v >= 0x80)
+            {
+                buffer.push_back(static_cast<char>((v & 0x7f) | 0x80));
+                v >>= 7;
+            }
+            buffer.push_back(static_cast<char>(v));
+        }
+
+        // zigzag 编码，绝对值小的负数同样只占一个字节
+        void WriteSigned(int64_t v)
+        {
+            WriteUnsigned((static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+        }
+    };
+
+    // 加载快照：按对象表在 heap 中创建对象并填入内容，原生函数按名字从 natives 中取得。映像的校验和与结构
+    // （长度、引用的类型、指令格式）都经过检查，格式错误时抛出异常，已创建的对象留给垃圾回收；
+    // 与 Lua 的预编译代码块相同，不校验字节码的寄存器与跳转范围，不应加载来源不可信的快照
+    class SnapshotReader
+    {
+    public:
+        SnapshotReader(std::string_view image, Heap& heap, const Table* natives)
+            : data(image), heap(heap), natives(natives)
+        { }
+
+        Snapshot::Roots Read()
+        {
+            if (data.size() < Snapshot::Magic.size() + Snapshot::ChecksumSize || data.substr(0, Snapshot::Magic.size()) != Snapshot::Magic)
+                Error("不是快照文件");
+            // 先校验整个映像，损坏（如截断、改写）的快照在创建任何对象之前被拒绝
+            position = data.size() - Snapshot::ChecksumSize;
+            uint64_t checksum = ReadFixed();
+            data.remove_suffix(Snapshot::ChecksumSize);
+            if (checksum != Snapshot::Checksum(data))
+                Error("校验和不匹配");
+            position = Snapshot::Magic.size();
+            if (ReadUnsigned() != Snapshot::Version)
+                Error("版本不匹配");
+
+            uint64_t count = ReadUnsigned();
+            // 每个对象至少占一个字节，据此拒绝伪造的巨大个数
+            if (count > data.size())
+                Error("对象个数无效");
+            uint64_t stringCount = ReadUnsigned();
+            if (stringCount > count)
+                Error("字符串个数无效");
+            objects.reserve(static_cast<size_t>(count));
+            heap.ReserveStrings(static_cast<size_t>(stringCount));
+            for (uint64_t i = 0; i < count; ++i)
+                objects.push_back(ReadShape());
+            for (size_t i = 0; i < objects.size(); ++i)
+                ReadContents(i);
+
+            Snapshot::Roots roots;
+            roots.globals = ReadRef<Table>(ObjectType::Table);
+            roots.baseline = ReadRef<Table>(ObjectType::Table);
+            roots.stringMeta = ReadRef<Table>(ObjectType::Table);
+            if (roots.globals == nullptr || roots.baseline == nullptr || roots.stringMeta == nullptr)
+                Error("缺少根对象");
+            if (position != data.size())
+                Error("末尾有多余的数据");
+
+            for (Table* table : finalized)
+                heap.RegisterFinalizer(table);
+            return roots;
+        }
+
+    private:
+        std::string_view data;
+        size_t position = 0;
+        Heap& heap;
+        const Table* natives;
+        std::vector<GCObject*> objects;
+        std::vector<uint32_t> hashCounts;   // 各表哈希部分的键数，与 objects 对应
+        std::vector<Table*> finalized;      // 保存时已登记 __gc 的表，全部加载成功后再登记
+
+        [[noreturn]] static void Error(const std::string& message)
+        {
+            throw std::runtime_error("快照格式错误：" + message);
+        }
+
+        GCObject* ReadShape()
+        {
+            auto type = static_cast<ObjectType>(ReadByte());
+            hashCounts.push_back(0);
+            switch (type)
+            {
+            case ObjectType::String:
+                return heap.NewString(ReadString());
+            case ObjectType::Function:
+            {
+                String* name = heap.NewString(ReadString());
+                auto* fn = std::get_if<Function*>(&natives->GetStr(name).value);
+                if (fn == nullptr)
+                    Error("原生函数 '" + std::string(name->View()) + "' 未注册");
+                return *fn;
+            }
+            case ObjectType::Table:
+            {
+                uint64_t arraySize = ReadUnsigned();
+                uint64_t hashCount = ReadUnsigned();
+                if (arraySize > data.size() || hashCount > data.size())
+                    Error("表的大小无效");
+                Table* table = heap.NewTable(static_cast<uint32_t>(arraySize), static_cast<uint32_t>(hashCount));
+                hashCounts.back() = static_cast<uint32_t>(hashCount);
+                if (ReadByte() != 0)
+                    finalized.push_back(table);
+                return table;
+            }
+            case ObjectType::Closure:
+            {
+                uint64_t upvalueCount = ReadUnsigned();
+                if (upvalueCount > data.size())
+                    Error("上值个数无效");
+                return heap.NewClosure(nullptr, static_cast<uint32_t>(upvalueCount));
+            }
+            case ObjectType::Proto:
+                return heap.NewProto();
+            case ObjectType::Upvalue:
+            {
+                Upvalue* upvalue = heap.NewUpvalue(nullptr, 0);
+                upvalue->v = &upvalue->closed;
+                return upvalue;
+            }
+            default:
+                Error("未知的对象类型");
+            }
+        }
+
+        void ReadContents(size_t index)
+        {
+            GCObject* object = objects[index];
+            Memory& memory = heap.GetMemory();
+            switch (object->type)
+            {
+            case ObjectType::Table:
+            {
+                auto* table = static_cast<Table*>(object);
+                table->metatable = ReadRef<Table>(ObjectType::Table);
+                uint32_t hashCount = hashCounts[index];
+                for (uint32_t i = 0; i < table->arraySize; ++i)
+                    table->array[i] = ReadValue();
+                for (uint32_t i = 0; i < hashCount; ++i)
+                {
+                    Value key = ReadValue();
+                    Value value = ReadValue();
+                    if (key.IsNil() || (key.IsNumber() && std::isnan(*std::get_if<double>(&key.value))))
+                        Error("表的键无效");
+                    table->Set(memory, key, value);
+                }
+                break;
+            }
+            case ObjectType::Closure:
+            {
+                auto* closure = static_cast<Closure*>(object);
+                closure->proto = ReadRef<Proto>(ObjectType::Proto);
+                if (closure->proto == nullptr)
+                    Error("闭包缺少函数原型");
+                for (uint32_t i = 0; i < closure->upvalueCount; ++i)
+                {
+                    closure->Upvalues()[i] = ReadRef<Upvalue>(ObjectType::Upvalue);
+                    if (closure->Upvalues()[i] == nullptr)
+                        Error("闭包缺少上值");
+                }
+                break;
+            }
+            case ObjectType::Upvalue:
+                static_cast<Upvalue*>(object)->closed = ReadValue();
+                break;
+            case ObjectType::Proto:
+                ReadProto(*static_cast<Proto*>(object));
+                break;
+            default:
+                break;
+            }
+        }
+
+        void ReadProto(Proto& proto)
+        {
+            proto.source = ReadRef<String>(ObjectType::String);
+            proto.name = ReadRef<String>(ObjectType::String);
+            proto.numParams = ReadUint32();
+            proto.vararg = ReadByte() != 0;
+            proto.maxStack = ReadUint32();
+            proto.lineDefined = static_cast<int>(ReadSigned());
+
+            size_t codeSize = ReadCount();
+            proto.code.reserve(codeSize);
+            for (size_t i = 0; i < codeSize; ++i)
+            {
+                auto op = static_cast<OpCode>(ReadByte());
+                if (op > OpCode::MetaTest)
+                    Error("无效的指令");
+                Operation operation(op);
+                operation.argCount = ReadUint32();
+                if (operation.argCount > Operation::MaxArgs)
+                    Error("无效的指令");
+                for (uint32_t j = 0; j < operation.argCount; ++j)
+                    operation.args[j] = ReadUint32();
+                proto.code.push_back(operation);
+            }
+            size_t lineCount = ReadCount();
+            int line = 0;
+            for (size_t i = 0; i < lineCount; ++i)
+            {
+                line += static_cast<int>(ReadSigned());
+                proto.lineInfo.Add(line);
+            }
+
+            size_t constantCount = ReadCount();
+            proto.constants.reserve(constantCount);
+            for (size_t i = 0; i < constantCount; ++i)
+                proto.constants.push_back(ReadValue());
+            size_t protoCount = ReadCount();
+            proto.protos.reserve(protoCount);
+            for (size_t i = 0; i < protoCount; ++i)
+            {
+                Proto* child = ReadRef<Proto>(ObjectType::Proto);
+                if (child == nullptr)
+                    Error("缺少子函数原型");
+                proto.protos.push_back(child);
+            }
+            size_t upvalueCount = ReadCount();
+            proto.upvalues.reserve(upvalueCount);
+            for (size_t i = 0; i < upvalueCount; ++i)
+            {
+                UpvalueDesc desc;
+                desc.name = ReadRef<String>(ObjectType::String);
+                desc.inStack = ReadByte() != 0;
+                desc.index = ReadUint32();
+                proto.upvalues.push_back(desc);
+            }
+            size_t localCount = ReadCount();
+            proto.locals.reserve(localCount);
+            for (size_t i = 0; i < localCount; ++i)
+            {
+                LocalVarInfo info;
+                info.name = ReadRef<String>(ObjectType::String);
+                info.startPc = ReadUint32();
+                info.endPc = ReadUint32();
+                info.reg = ReadUint32();
+                proto.locals.push_back(info);
+            }
+            size_t inlineCount = ReadCount();
+            proto.inlines.reserve(inlineCount);
+            for (size_t i = 0; i < inlineCount; ++i)
+            {
+                InlineInfo info;
+                info.name = ReadRef<String>(ObjectType::String);
+                info.startPc = ReadUint32();
+                info.endPc = ReadUint32();
+                info.line = static_cast<int>(ReadSigned());
+                info.upvalue = ReadByte() != 0;
+                proto.inlines.push_back(info);
+            }
+        }
+
+        Value ReadValue()
+        {
+            auto type = static_cast<ValueType>(ReadByte());
+            switch (type)
+            {
+            case ValueType::Nil:
+                return Value();
+            case ValueType::Boolean:
+                return Value(ReadByte() != 0);
+            case ValueType::Number:
+                return Value(std::bit_cast<double>(ReadFixed()));
+            case ValueType::String:
+                return NonNull(ReadRef<String>(ObjectType::String));
+            case ValueType::Function:
+                return NonNull(ReadRef<Function>(ObjectType::Function));
+            case ValueType::Closure:
+                return NonNull(ReadRef<Closure>(ObjectType::Closure));
+            case ValueType::Table:
+                return NonNull(ReadRef<Table>(ObjectType::Table));
+            default:
+                Error("未知的值类型");
+            }
+        }
+
+        template <typename T>
+        static Value NonNull(T* object)
+        {
+            if (object == nullptr)
+                Error("值引用了空对象");
+            return Value(object);
+        }
+
+        // 读取对象引用并检查其类型，0 表示空
+        template <typename T>
+        T* ReadRef(ObjectType type)
+        {
+            uint64_t ref = ReadUnsigned();
+            if (ref == 0)
+                return nullptr;
+            if (ref > objects.size() || objects[ref - 1]->type != type)
+                Error("对象引用无效");
+            return static_cast<T*>(objects[ref - 1]);
+        }
+
+        uint8_t ReadByte()
+        {
+            if (position >= data.size())
+                Error("数据不完整");
+            return static_cast<uint8_t>(data[position++]);
+        }
+
+        uint64_t ReadFixed()
+        {
+            if (data.size() - position < 8)
+                Error("数据不完整");
+            uint64_t bits = 0;
+            for (int i = 0; i < 8; ++i)
+                bits |= static_cast<uint64_t>(static_cast<uint8_t>(data[position++])) << (i * 8);
+            return bits;
+        }
+
+        uint64_t ReadUnsigned()
+        {
+            uint64_t v = 0;
+            for (int shift = 0; shift < 64; shift += 7)
+            {
+                uint8_t byte = ReadByte();
+                v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0)
+                    return v;
+            }
+            Error("整数过长");
+        }
+
+        int64_t ReadSigned()
+        {
+            uint64_t v = ReadUnsigned();
+            return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+        }
+
+        uint32_t ReadUint32()
+        {
+            uint64_t v = ReadUnsigned();
+            if (v > UINT32_MAX)
+                Error("整数超出范围");
+            return static_cast<uint32_t>(v);
+        }
+
+        // 元素个数：每个元素至少占一个字节，超出剩余数据的个数一定无效
+        size_t ReadCount()
+        {
+            uint64_t count = ReadUnsigned();
+            if (count > data.size() - position)
+                Error("元素个数无效");
+            return static_cast<size_t>(count);
+        }
+
+        std::string_view ReadString()
+        {
+            uint64_t length = ReadUnsigned();
+            if (length > data.size() - position)
+                Error("数据不完整");
+            std::string_view text = data.substr(position, static_cast<size_t>(length));
+            position += static_cast<size_t>(length);
+            return text;
+        }
+    };
+
+    // 只读映射整个文件，加载快照时不复制文件内容；不支持 mmap 的平台上一次读入内存
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const std::string& path)
+        {
+#ifdef _WIN32
+            std::ifstream file(path, std::ios::binary);
+            if (!file.is_open())
+                throw std::runtime_error("无法打开快照文件：" + path);
+            contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            view = contents;
+#else
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw std::runtime_error("无法打开快照文件：" + path);
+            struct stat info;
+            if (::fstat(fd, &info) != 0)
+            {
+                ::close(fd);
+                throw std::runtime_error("无法读取快照文件：" + path);
+            }
+            size = static_cast<size_t>(info.st_size);
+            if (size > 0)
+            {
+                void* address = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (address == MAP_FAILED)
+                {
+                    ::close(fd);
+                    throw std::runtime_error("无法映射快照文件：" + path);
+                }
+                mapping = address;
+                view = std::string_view(static_cast<const char*>(address), size);
+            }
+            ::close(fd);
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile()
+        {
+#ifndef _WIN32
+            if (mapping != nullptr)
+                ::munmap(mapping, size);
+#endif
+        }
+
+        std::string_view View() const { return view; }
+
+    private:
+        std::string_view view;
+#ifdef _WIN32
+        std::string contents;
+#else
+        void* mapping = nullptr;
+        size_t size = 0;
+#endif
+    };
+}
@@ -12,6 +12,19 @@
 #include <type_traits>
 #include <ranges>
 #include <algorithm>
+#include <charconv>
+#include <iostream>
+#include <string_view>
+#include <span>
+
+#include "LuaMemory.h"
+
+// 调试跟踪输出（词法 token、执行的操作码），由 CMake 选项 CPPLUA_TRACE 开启
+#ifdef CPPLUA_TRACE
+#define LUA_TRACE(expr) (std::cout << expr << std::endl)
+#else
+#define LUA_TRACE(expr) ((void)0)
+#endif
 
 namespace Engine
 {
@@ -43,16 +56,144 @@ namespace Engine
         SemiColon, Colon, Comma, Dot, Concat, Dots,
     };
 
+    // 数字格式化所需的缓冲区大小（足以容纳 %.14g 与 64 位整数的最长输出）
+    constexpr size_t NumberBufferSize = 32;
+
+    // 数字转字符串，不分配内存，返回写入 buffer 的长度。
+    // 输出与 Lua 的 "%.14g" 一致（42、3.14、1e+15、9.007199254741e+15、inf、nan）；
+    // 绝对值小于 1e14 的整数值 "%.14g" 不用指数形式、也不舍入，直接按整数输出
+    inline size_t FormatNumber(double value, char* buffer)
+    {
+        char* end = buffer + NumberBufferSize;
+        if (value > -1e14 && value < 1e14 && value == std::floor(value) && !(value == 0 && std::signbit(value)))
+        {
+            return std::to_chars(buffer, end, static_cast<long long>(value)).ptr - buffer;
+        }
+        return std::to_chars(buffer, end, value, std::chars_format::general, 14).ptr - buffer;
+    }
+
+    // 以下为虚拟机与编译期常量折叠共用的数值运算，语义与 Lua 的浮点运算一致
+
+    // 取模：结果与除数同号
+    inline double NumberMod(double a, double b)
+    {
+        double m = std::fmod(a, b);
+        if (m != 0 && (m < 0) != (b < 0))
+            m += b;
+        return m;
+    }
+
+    // 向下取整除法
+    inline double NumberIdiv(double a, double b)
+    {
+        return std::floor(a / b);
+    }
+
+    // 值为整数且在 64 位整数范围内时转换成功（表的整数键、位运算的操作数）
+    inline bool NumberToInteger(double d, int64_t& result)
+    {
+        if (d >= -9223372036854775808.0 && d < 9223372036854775808.0)
+        {
+            auto i = static_cast<int64_t>(d);
+            if (static_cast<double>(i) == d)
+            {
+                result = i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 逻辑左移；位移量不小于 64 时结果为 0，负数表示右移
+    inline int64_t ShiftLeft(int64_t x, int64_t n)
+    {
+        if (n <= -64 || n >= 64)
+            return 0;
+        if (n >= 0)
+            return static_cast<int64_t>(static_cast<uint64_t>(x) << n);
+        return static_cast<int64_t>(static_cast<uint64_t>(x) >> -n);
+    }
+
+    // 算术运算中字符串到数字的自动转换，允许首尾空白
+    inline bool StringToNumber(std::string_view text, double& result)
+    {
+        auto isSpace = [](char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v'; };
+        while (!text.empty() && isSpace(text.front()))
+            text.remove_prefix(1);
+        while (!text.empty() && isSpace(text.back()))
+            text.remove_suffix(1);
+        if (!text.empty() && text.front() == '+')
+            text.remove_prefix(1);
+        if (text.empty())
+            return false;
+        auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), result);
+        return ec == std::errc() && end == text.data() + text.size();
+    }
+
+    enum class ObjectType : uint8_t
+    {
+        String,
+        Function,
+        Closure,
+        Table,
+        Proto,
+        Upvalue,
+    };
+
+    // 由 Heap 分配并参与垃圾回收的对象的公共头部
+    struct GCObject
+    {
+        GCObject* next;     // 堆中全部对象组成的链表
+        ObjectType type;
+        bool marked;        // 标记阶段是否可达
+        bool fixed;         // 永不回收（保留字等）
+    };
+
+    // 字符串对象，内容（以 '\0' 结尾）紧跟在对象之后。
+    // 同一个堆中内容相同的字符串只有一份，比较相等只需比较指针
+    struct String : GCObject
+    {
+        String* hashNext;   // 驻留表同一个桶中的下一个字符串
+        size_t hash;
+        uint32_t length;
+        uint8_t reserved;   // 保留字序号 + 1，非保留字为 0
+
+        const char* Data() const { return reinterpret_cast<const char*>(this + 1); }
+        std::string_view View() const { return std::string_view(Data(), length); }
+    };
+
+    struct Function;
+    struct Closure;
+    struct Table;
+    class Results;
+
+    // 与 Value::type 中各备选类型的下标一一对应
+    enum class ValueType : uint8_t
+    {
+        Nil,
+        Boolean,
+        Number,
+        String,
+        Function,   // 原生函数
+        Closure,    // 脚本函数
+        Table,
+    };
+
     struct Value
     {
         using number = double;
-        using function = std::function<Value(const std::vector<Value>&)>;
+        // 原生函数：参数是调用方操作栈上的一段视图，调用过程不复制参数
+        using function = std::function<Value(std::span<const Value>)>;
+        // 返回多个值的原生函数：结果依次 Push 到 results，直接写入调用方的栈槽，不经过临时容器
+        using multiFunction = std::function<void(std::span<const Value>, Results&)>;
         using type = std::variant<
             std::monostate,
             bool,
             number,
-            std::string,
-            function
+            String*,
+            Function*,
+            Closure*,
+            Table*
             >;
 
         Value()                 : value(std::monostate{}) {}
@@ -64,10 +205,15 @@ namespace Engine
             requires std::is_convertible_v<t, number>
         Value(t v) : value(static_cast<number>(v)) {}
 
-        Value(const char* v) : value(std::string(v)) {}
-        Value(std::string v) : value(std::move(v)) {}
-        
-        Value(function v) : value(std::move(v)) {}
+        Value(String* v)        : value(v) {}
+        Value(Function* v)      : value(v) {}
+        Value(Closure* v)       : value(v) {}
+        Value(Table* v)         : value(v) {}
+
+        // 字符串、函数与表只能通过 Heap 创建，
+        // 禁止字符串字面量被隐式转换为 bool
+        Value(const char*) = delete;
+        Value(const std::string&) = delete;
 
         operator type() const { return value; }
         operator type && () { return std::move(value); }
@@ -88,11 +234,17 @@ namespace Engine
             case 2: // number (double)
                 return std::get<number>(lhs.value) == std::get<number>(rhs.value);
 
-            case 3: // std::string
-                return std::get<std::string>(lhs.value) == std::get<std::string>(rhs.value);
+            case 3: // String*，字符串已驻留，比较指针即可
+                return std::get<String*>(lhs.value) == std::get<String*>(rhs.value);
 
-            case 4: // function (std::function)
-                return false;
+            case 4: // Function*
+                return std::get<Function*>(lhs.value) == std::get<Function*>(rhs.value);
+
+            case 5: // Closure*
+                return std::get<Closure*>(lhs.value) == std::get<Closure*>(rhs.value);
+
+            case 6: // Table*
+                return std::get<Table*>(lhs.value) == std::get<Table*>(rhs.value);
 
             default:
                 return false;
@@ -104,6 +256,26 @@ namespace Engine
             return !(lhs == rhs);
         }
 
+        ValueType Type() const { return static_cast<ValueType>(value.index()); }
+
+        bool IsNil() const { return value.index() == 0; }
+        bool IsNumber() const { return value.index() == 2; }
+
+        // 只有 nil 与 false 为假
+        bool IsFalsy() const
+        {
+            return value.index() == 0 || (value.index() == 1 && !std::get<bool>(value));
+        }
+
+        // Lua 的 type() 名称
+        const char* TypeName() const
+        {
+            static constexpr const char* names[] = {
+                "nil", "boolean", "number", "string", "function", "function", "table",
+            };
+            return names[value.index()];
+        }
+
         explicit operator bool() const
         {
             if (std::holds_alternative<bool>(value))
@@ -122,45 +294,167 @@ namespace Engine
         }
         explicit operator std::string() const 
         {
-            if (std::holds_alternative<std::string>(value)) 
+            if (std::holds_alternative<String*>(value)) 
             {
-                return std::get<std::string>(value);
+                return std::string(std::get<String*>(value)->View());
             }
             if (std::holds_alternative<number>(value)) 
             {
-                return std::to_string(std::get<number>(value));
+                char buffer[NumberBufferSize];
+                return std::string(buffer, FormatNumber(std::get<number>(value), buffer));
             }
             throw std::bad_variant_access();
         }
 
-        Value Call(const std::vector<Value>& args = {})
+        // 按 Lua tostring 的规则取得字符串表示。字符串直接返回其内容的视图，
+        // 数字与函数地址写入调用方提供的 scratch 缓冲区，其余类型返回常量文本，均不分配内存
+        std::string_view ToStringView(char (&scratch)[NumberBufferSize]) const
         {
-            if(!std::holds_alternative<function>(value))
+            switch (value.index())
             {
-                throw std::runtime_error("尝试调用非函数类型的值");
+            case 0: // std::monostate
+                return "nil";
+            case 1: // bool
+                return std::get<bool>(value) ? "true" : "false";
+            case 2: // number
+                return std::string_view(scratch, FormatNumber(std::get<number>(value), scratch));
+            case 3: // String*
+                return std::get<String*>(value)->View();
+            case 4: // Function*
+                return FormatAddress("function: 0x", std::get<Function*>(value), scratch);
+            case 5: // Closure*
+                return FormatAddress("function: 0x", std::get<Closure*>(value), scratch);
+            case 6: // Table*
+                return FormatAddress("table: 0x", std::get<Table*>(value), scratch);
+            default:
+                return "?";
             }
-            const auto& func = std::get<function>(value);
+        }
 
-            if(!func)
-            {
-                throw std::runtime_error("尝试调用空函数");
-            }
-            return func(args);
+        std::string ToString() const
+        {
+            char scratch[NumberBufferSize];
+            return std::string(ToStringView(scratch));
         }
 
-        Value Call()
+        // 只能调用原生函数，返回第一个返回值（没有返回值时为 nil）；调用脚本函数需经由 VM::Call
+        Value Call(std::span<const Value> args = {}) const;
+
+    private:
+        static std::string_view FormatAddress(std::string_view prefix, const void* object, char (&scratch)[NumberBufferSize])
         {
-            return Call({});
+            std::copy(prefix.begin(), prefix.end(), scratch);
+            auto address = reinterpret_cast<uintptr_t>(object);
+            char* end = std::to_chars(scratch + prefix.size(), scratch + NumberBufferSize, address, 16).ptr;
+            return std::string_view(scratch, end - scratch);
         }
 
     public:
         type value;
     };
 
+    // 多返回值原生函数的结果接收者。由虚拟机实现时，值直接写入调用方操作栈上参数之后的栈槽；
+    // 结果个数不超过参数个数时 Push 不会使操作栈扩容，超过后参数视图可能失效，需要的参数应在此之前读出
+    class Results
+    {
+    public:
+        virtual void Push(const Value& value) = 0;
+
+        uint32_t Count() const { return count; }
+
+    protected:
+        ~Results() = default;
+
+        uint32_t count = 0;
+    };
+
+    // 原生函数对象，native 与 multiple 只设置其一
+    struct Function : GCObject
+    {
+        static constexpr size_t MaxUpvalues = 2;
+
+        Value::function native;
+        Value::multiFunction multiple;              // 返回多个值的原生函数
+        std::array<Value, MaxUpvalues> upvalues{};  // 原生函数引用的对象（如 gmatch 迭代的字符串），随函数一起标记
+        GCObject* gclist = nullptr;                 // 回收时的灰色链表
+    };
+
+    inline Value Value::Call(std::span<const Value> args) const
+    {
+        if(!std::holds_alternative<Function*>(value))
+        {
+            throw std::runtime_error("尝试调用非函数类型的值");
+        }
+        const Function* fn = std::get<Function*>(value);
+        if (fn->native)
+        {
+            return fn->native(args);
+        }
+        if (!fn->multiple)
+        {
+            throw std::runtime_error("尝试调用空函数");
+        }
+
+        // 只保留第一个返回值
+        class FirstResult final : public Results
+        {
+        public:
+            void Push(const Value& v) override
+            {
+                if (count++ == 0)
+                    first = v;
+            }
+            Value first;
+        } results;
+        fn->multiple(args, results);
+        return results.first;
+    }
+
+    // 词法/语法错误；Incomplete() 表示错误发生在输入末尾（语句尚未写完），
+    // 交互式解释器据此决定继续读入下一行而不是报错
+    class SyntaxError : public std::runtime_error
+    {
+    public:
+        SyntaxError(const std::string& message, bool incomplete)
+            : std::runtime_error(message), incomplete(incomplete)
+        { }
+
+        bool Incomplete() const { return incomplete; }
+
+    private:
+        bool incomplete;
+    };
+
+    // 脚本运行期错误：Message 为 "chunk:行: 描述"，Traceback 为调用栈回溯
+    class RuntimeError : public std::runtime_error
+    {
+    public:
+        RuntimeError(const std::string& message, const std::string& traceback)
+            : std::runtime_error("执行错误：" + message + "\n" + traceback),
+            message(message), traceback(traceback)
+        { }
+
+        const std::string& Message() const { return message; }
+        const std::string& Traceback() const { return traceback; }
+
+    private:
+        std::string message;
+        std::string traceback;
+    };
+
     struct Token
     {
-        TokenType token;
+        Token() = default;
+
+        Token(TokenType token, const Value& value, int line, int column, uint32_t offset)
+            : token(token), value(value), line(line), column(column), offset(offset)
+        { }
+
+        TokenType token = TokenType::Eof;
         Value value;
+        int line = 0;       // 起始行号（从 1 开始）
+        int column = 0;     // 起始列号（从 1 开始）
+        uint32_t offset = 0;    // 起始字节偏移（从输入开头计）
 
         std::string toString() const
         {
@@ -261,35 +555,24 @@ namespace Engine
             case 2: // number
                 result += "Number, Value: ";
                 {
-                    double num = std::get<Value::number>(value.value);
-                    if (num == static_cast<long long>(num))
-                    {
-                        result += std::to_string(static_cast<long long>(num));
-                    }
-                    else
-                    {
-                        result += std::to_string(num);
-                        result.erase(result.find_last_not_of('0') + 1, std::string::npos);
-                        if (result.back() == '.')
-                        {
-                            result.pop_back();
-                        }
-                    }
+                    char buffer[NumberBufferSize];
+                    result.append(buffer, FormatNumber(std::get<Value::number>(value.value), buffer));
                 }
                 break;
 
-            case 3: // std::string
+            case 3: // String*
                 result += "String, Value: \"";
-                result += std::get<std::string>(value.value);
+                result += std::get<String*>(value.value)->View();
                 result += "\"";
                 break;
 
-            case 4: // function
+            case 4: // Function*
+            case 5: // Closure*
                 result += "Function, Value: <callable>";
-                if (!std::get<Value::function>(value.value))
-                {
-                    result += " (empty)";
-                }
+                break;
+
+            case 6: // Table*
+                result += "Table";
                 break;
 
             default:
@@ -302,19 +585,145 @@ namespace Engine
         }
     };
 
-    enum class OpCode
+    // 操作数带有此标志时表示常量表下标（记作 RK），否则为寄存器
+    constexpr uint32_t ConstantBit = 0x80000000u;
+
+    // Call 的 B、C，Return 与 SetList 的 B，VarArg 的 B 带有此标志时，值的个数不固定：
+    // 值一直延续到栈顶 top（由前一条多返回值的 Call 或 VarArg 设置）。
+    // 其余位是固定部分的个数（含产生多个值的那条指令所在的栈槽），只供寄存器分配使用
+    constexpr uint32_t MultipleValues = 0x40000000u;
+
+    // 寄存器式指令集。R[x] 为当前函数的第 x 个寄存器，K[x] 为常量，U[x] 为上值，
+    // RK(x) 按 ConstantBit 取常量或寄存器；跳转目标均为指令的绝对位置
+    enum class OpCode : uint8_t
     {
-        Exit,
-        Call,
-        LoadConst,
-        LoadGlobal,
-        SetGlobal,
+        Move,       // A B      R[A] = R[B]
+        LoadK,      // A B      R[A] = K[B]
+        LoadNil,    // A        R[A] = nil
+        LoadBool,   // A B      R[A] = (B != 0)
+        GetUpval,   // A B      R[A] = U[B]
+        SetUpval,   // A B      U[A] = RK(B)
+        GetGlobal,  // A B      R[A] = G[K[B]]
+        SetGlobal,  // A B      G[K[A]] = RK(B)
+        GetField,   // A B C    R[A] = R[B][K[C]]，K[C] 为字符串
+        SetField,   // A B C    R[A][K[B]] = RK(C)
+        GetIndex,   // A B C    R[A] = R[B][RK(C)]
+        SetIndex,   // A B C    R[A][RK(B)] = RK(C)
+        NewTable,   // A B C    R[A] = {}，数组部分预留 B 项，哈希部分预留 C 项
+        SetList,    // A B C    R[A][C + i] = R[A + i]，1 <= i <= B（B 带 MultipleValues 时到 top 为止）
+        Self,       // A B C    R[A + 1] = R[B]; R[A] = R[B][RK(C)]
+
+        // A B C    R[A] = RK(B) op RK(C)
+        Add, Sub, Mul, Div, Mod, Pow, Idiv,
+        BAnd, BOr, BXor, Shl, Shr,
+        Concat,
+        Eq, Lt, Le,
+
+        // A B      R[A] = op R[B]
+        Unm, Not, Len, BNot,
+
+        Jmp,        // A        pc = A
+        Test,       // A B C    R[A] 的真假与 C 相同时 pc = B
+        Call,       // A B C    R[A], ..., R[A + C - 1] = R[A](R[A + 1], ..., R[A + B])，返回值不足补 nil；
+                    //          B 带 MultipleValues 时参数到 top 为止，C 为 MultipleValues 时保留全部返回值并设置 top
+        Return,     // A B      返回 R[A], ..., R[A + B - 1]（B 带 MultipleValues 时到 top 为止）
+        ForPrep,    // A B      R[A]、R[A + 1]、R[A + 2] 为初值、终值、步长；循环一次也不执行时 pc = B，否则 R[A + 3] = R[A]
+        ForLoop,    // A B      R[A] += R[A + 2]；未越过终值时 R[A + 3] = R[A]，pc = B
+        Closure,    // A B      R[A] = 由第 B 个子函数原型创建的闭包
+        Close,      // A        关闭引用 R[A] 的上值；R[A] 是待关闭变量时调用其 __close 元方法
+        Tbc,        // A        把 R[A] 登记为待关闭变量（local x <close>）
+        VarArg,     // A B      R[A], ..., R[A + B - 1] = 多余参数（不足补 nil）；B 为 MultipleValues 时取全部并设置 top
+        TForLoop,   // A B      泛型 for：R[A + 3] 不为 nil 时 R[A + 2] = R[A + 3]，pc = B（R[A + 3] 起为 Call 得到的循环变量）
+
+        // 比较并跳转：条件成立时 pc = C，比较结果不写入寄存器。Not 开头的指令在条件不成立时跳转
+        // （not (a < b) 与 a >= b 对 NaN 不同，不能互换）。
+        // A B C    比较 RK(A) 与 RK(B)
+        EqJmp, NeJmp, LtJmp, NotLtJmp, LeJmp, NotLeJmp,
+        // A B C    比较 R[A] 与立即数 B（按 int32 解释的整数）
+        EqJmpI, NeJmpI, LtJmpI, NotLtJmpI, LeJmpI, NotLeJmpI, GtJmpI, NotGtJmpI, GeJmpI, NotGeJmpI,
+
+        // 循环不变量外提的守卫（见 LoopInvariantHoister）
+        MetaMark,   // A        R[A] = 至今调用元方法的次数
+        MetaTest,   // A B      R[A] 等于元方法的调用次数（记下之后没有调用过元方法）时 pc = B；R[A] 为 nil 时不跳转
+
+        // 特化指令：编译器从不生成，由解释器在观察到稳定的操作数类型后原地改写泛型指令得到，
+        // 操作数与对应的泛型指令相同；守卫条件不成立时改写回泛型指令
+        AddNum, SubNum, MulNum, DivNum,     // 两个操作数都是数字
+        LtNum, LeNum,                       // 两个操作数都是数字
+        GetFieldCached,     // 键位于表的哈希部分第 cache 个位置
+        SetFieldCached,     // 同上，键已存在
+        GetGlobalCached,    // 同上，全局变量表
+        CallNative,         // 被调用的是原生函数
+        CallLua,            // 被调用的是脚本函数
+        GetFieldMeta,       // 键不在表中，经 __index 链（全部为表）在某个表的哈希部分找到；cache 为原型中内联缓存的下标
+        SelfMeta,           // 同上，方法调用
     };
 
+    inline constexpr size_t OpCodeCount = static_cast<size_t>(OpCode::SelfMeta) + 1;
+
+    // 特化指令对应的泛型指令；泛型指令返回自身
+    constexpr OpCode GenericOp(OpCode op)
+    {
+        switch (op)
+        {
+        case OpCode::AddNum: return OpCode::Add;
+        case OpCode::SubNum: return OpCode::Sub;
+        case OpCode::MulNum: return OpCode::Mul;
+        case OpCode::DivNum: return OpCode::Div;
+        case OpCode::LtNum: return OpCode::Lt;
+        case OpCode::LeNum: return OpCode::Le;
+        case OpCode::GetFieldCached: return OpCode::GetField;
+        case OpCode::SetFieldCached: return OpCode::SetField;
+        case OpCode::GetGlobalCached: return OpCode::GetGlobal;
+        case OpCode::CallNative:
+        case OpCode::CallLua: return OpCode::Call;
+        case OpCode::GetFieldMeta: return OpCode::GetField;
+        case OpCode::SelfMeta: return OpCode::Self;
+        default: return op;
+        }
+    }
+
+    // 比较并跳转指令（EqJmp 到 NotGeJmpI）
+    constexpr bool IsCompareJump(OpCode op)
+    {
+        return op >= OpCode::EqJmp && op <= OpCode::NotGeJmpI;
+    }
+
+    // 比较并跳转指令中 B 是立即数而不是 RK 操作数
+    constexpr bool IsImmediateJump(OpCode op)
+    {
+        return op >= OpCode::EqJmpI && op <= OpCode::NotGeJmpI;
+    }
+
+    inline const char* OpCodeName(OpCode op)
+    {
+        static constexpr const char* names[OpCodeCount] = {
+            "Move", "LoadK", "LoadNil", "LoadBool", "GetUpval", "SetUpval", "GetGlobal", "SetGlobal",
+            "GetField", "SetField", "GetIndex", "SetIndex", "NewTable", "SetList", "Self",
+            "Add", "Sub", "Mul", "Div", "Mod", "Pow", "Idiv",
+            "BAnd", "BOr", "BXor", "Shl", "Shr",
+            "Concat", "Eq", "Lt", "Le",
+            "Unm", "Not", "Len", "BNot",
+            "Jmp", "Test", "Call", "Return", "ForPrep", "ForLoop", "Closure", "Close", "Tbc", "VarArg", "TForLoop",
+            "EqJmp", "NeJmp", "LtJmp", "NotLtJmp", "LeJmp", "NotLeJmp",
+            "EqJmpI", "NeJmpI", "LtJmpI", "NotLtJmpI", "LeJmpI", "NotLeJmpI", "GtJmpI", "NotGtJmpI", "GeJmpI", "NotGeJmpI",
+            "MetaMark", "MetaTest",
+            "AddNum", "SubNum", "MulNum", "DivNum", "LtNum", "LeNum",
+            "GetFieldCached", "SetFieldCached", "GetGlobalCached", "CallNative", "CallLua",
+            "GetFieldMeta", "SelfMeta",
+        };
+        return names[static_cast<size_t>(op)];
+    }
+
     struct Operation
     {
+        static constexpr size_t MaxArgs = 3;
+
         OpCode opCode;
-        std::vector<uint32_t> args;
+        uint8_t counter = 0;    // 泛型指令连续观察到可特化操作数的次数（指令特化，见 VM::Run）
+        uint16_t cache = 0;     // 内联缓存：字段所在的哈希位置
+        uint32_t argCount = 0;
+        std::array<uint32_t, MaxArgs> args{};  // 操作数直接内联存放，指令流是一块连续内存
         
         Operation() = delete;
 
@@ -326,21 +735,132 @@ namespace Engine
             std::enable_if_t<std::is_constructible_v<std::vector<uint32_t>, Container&&>, int> = 0,
             std::enable_if_t<!std::convertible_to<std::remove_cvref_t<Container>, uint32_t>, int> = 0>
         Operation(OpCode op_code, Container&& container)
-            :opCode(op_code), args(std::forward<Container>(container))
-        { }
+            :opCode(op_code)
+        {
+            for (auto arg : container)
+            {
+                if (argCount == MaxArgs)
+                    throw std::runtime_error("指令操作数过多");
+                args[argCount++] = static_cast<uint32_t>(arg);
+            }
+        }
 
         template<typename... Args,   // 匹配实参
             std::enable_if_t<std::conjunction_v<std::is_convertible<Args, uint32_t>...>, int> = 0>
         Operation(OpCode code, Args... arguments)
-            : opCode(code), args({ static_cast<uint32_t>(arguments)... })
-        { }
+            : opCode(code), argCount(sizeof...(Args)), args{ static_cast<uint32_t>(arguments)... }
+        {
+            static_assert(sizeof...(Args) <= MaxArgs, "指令操作数过多");
+        }
     };
 
-    struct ProgramContext
+    // 指令行号表，采用与 Lua 5.4 lineinfo 相同的压缩方式：
+    // 每条指令只存一个相对上一条指令的 int8 行号差值；差值超出 int8 范围，
+    // 或距上一个锚点已满 MaxWithoutAnchor 条指令时，额外记录一个绝对行号锚点。
+    // 执行期间从不访问，仅在构造错误信息和调用栈回溯时按需解码。
+    class LineTable
     {
-        std::vector<Value> Constants;                   // 常量表
-        std::unordered_map<std::string, Value> Globals; // 全局变量表
-        std::vector<Operation> Operations;              // 字节流
-        std::array<Value, 64> stack;                    // 操作栈，栈大小待定，暂64
+    public:
+        explicit LineTable(Memory& memory)
+            : deltas(memory), anchors(memory)
+        { }
+
+        // 追加下一条指令的行号
+        void Add(int line)
+        {
+            uint32_t pc = static_cast<uint32_t>(deltas.size());
+            int delta = line - lastLine;
+            if (delta < -DeltaLimit || delta > DeltaLimit || sinceAnchor >= MaxWithoutAnchor)
+            {
+                deltas.push_back(AnchorMark);
+                anchors.push_back({ pc, line });
+                sinceAnchor = 0;
+            }
+            else
+            {
+                deltas.push_back(static_cast<int8_t>(delta));
+                sinceAnchor++;
+            }
+            lastLine = line;
+        }
+
+        // 解码第 pc 条指令的行号，未知时返回 0
+        int GetLine(size_t pc) const
+        {
+            if (pc >= deltas.size())
+                return 0;
+
+            // 找到 pc 之前（含）最近的锚点，再累加其后的差值，最多累加 MaxWithoutAnchor 项
+            auto it = std::upper_bound(anchors.begin(), anchors.end(), pc,
+                [](size_t target, const Anchor& anchor) { return target < anchor.pc; });
+            size_t start = 0;
+            int line = 0;
+            if (it != anchors.begin())
+            {
+                --it;
+                start = it->pc + 1;
+                line = it->line;
+            }
+            for (size_t i = start; i <= pc; ++i)
+            {
+                line += deltas[i];
+            }
+            return line;
+        }
+
+        size_t Size() const { return deltas.size(); }
+
+        // 按指令顺序依次解码全部行号（保存快照时使用），总开销与指令数成正比
+        template <typename Visit>
+        void ForEachLine(Visit&& visit) const
+        {
+            int line = 0;
+            size_t anchor = 0;
+            for (int8_t delta : deltas)
+            {
+                if (delta == AnchorMark)
+                    line = anchors[anchor++].line;
+                else
+                    line += delta;
+                visit(line);
+            }
+        }
+
+        // 全部行号加上 offset（热重载时源码未变的函数整体移动了位置），按新行号重新编码
+        void Shift(int offset)
+        {
+            if (offset == 0 || deltas.empty())
+                return;
+            std::vector<int> lines;
+            lines.reserve(deltas.size());
+            ForEachLine([&](int line) { lines.push_back(line + offset); });
+            Clear();
+            for (int line : lines)
+                Add(line);
+        }
+
+        void Clear()
+        {
+            deltas.clear();
+            anchors.clear();
+            lastLine = 0;
+            sinceAnchor = 0;
+        }
+
+    private:
+        struct Anchor
+        {
+            uint32_t pc;
+            int line;
+        };
+
+        static constexpr int8_t AnchorMark = INT8_MIN;  // 该指令的行号记录在锚点中
+        static constexpr int DeltaLimit = INT8_MAX;
+        static constexpr uint32_t MaxWithoutAnchor = 128;
+
+        std::vector<int8_t, HeapAllocator<int8_t>> deltas;
+        std::vector<Anchor, HeapAllocator<Anchor>> anchors;
+        int lastLine = 0;
+        uint32_t sinceAnchor = 0;
     };
 }
\ No newline at end of file
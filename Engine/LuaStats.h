@@ -0,0 +1,187 @@
+﻿#pragma once
+
+#include "LuaState.h"
+#include "LuaMemory.h"
+#include "LuaHeap.h"
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace Engine
+{
+    // 硬件计数器（仅 Linux，经由 perf_event_open），统计 VM::Execute 期间当前线程在用户态的事件
+    struct HardwareCounters
+    {
+        bool available = false;     // 内核不允许（perf_event_paranoid、容器限制）或非 Linux 平台时为 false
+        uint64_t cycles = 0;
+        uint64_t instructions = 0;
+        uint64_t branchMisses = 0;
+        uint64_t cacheMisses = 0;
+    };
+
+    // 执行统计，由 VM::Stats 汇总；计数自 VM 创建或上一次 ResetStats 起累计
+    struct ExecutionStats
+    {
+        std::array<uint64_t, OpCodeCount> instructions{};  // 按操作码（含特化指令）统计的执行次数
+        uint64_t luaCalls = 0;          // 脚本函数调用次数（含主代码块）
+        uint64_t nativeCalls = 0;       // 原生函数调用次数
+        MemoryStats memory;             // live、peak 为当前值，其余为累计值
+        HeapStats heap;                 // 回收次数与停顿时间、字符串驻留的命中次数
+        HardwareCounters hardware;
+
+        uint64_t TotalInstructions() const
+        {
+            uint64_t total = 0;
+            for (uint64_t count : instructions)
+                total += count;
+            return total;
+        }
+
+        // 创建字符串时已驻留（不需分配）的比例
+        double InternHitRate() const
+        {
+            uint64_t total = heap.internHits + heap.internMisses;
+            return total == 0 ? 0.0 : static_cast<double>(heap.internHits) / static_cast<double>(total);
+        }
+
+        // 导出为 JSON 对象，instructions 只列出执行过的操作码
+        std::string ToJson() const
+        {
+            std::string json = "{\n  \"instructions\": {";
+            bool first = true;
+            for (size_t i = 0; i < OpCodeCount; ++i)
+            {
+                if (instructions[i] == 0)
+                    continue;
+                json += first ? "\n" : ",\n";
+                json += "    \"" + std::string(OpCodeName(static_cast<OpCode>(i))) + "\": " + std::to_string(instructions[i]);
+                first = false;
+            }
+            json += first ? "},\n" : "\n  },\n";
+            json += "  \"total_instructions\": " + std::to_string(TotalInstructions()) + ",\n";
+            json += "  \"calls\": { \"lua\": " + std::to_string(luaCalls) + ", \"native\": " + std::to_string(nativeCalls) + " },\n";
+            json += "  \"memory\": { \"live\": " + std::to_string(memory.live) +
+                ", \"peak\": " + std::to_string(memory.peak) +
+                ", \"allocations\": " + std::to_string(memory.allocations) +
+                ", \"bytes_allocated\": " + std::to_string(memory.totalAllocated) + " },\n";
+            json += "  \"gc\": { \"collections\": " + std::to_string(heap.collections) +
+                ", \"pause_ns\": " + std::to_string(heap.pauseNanos) +
+                ", \"max_pause_ns\": " + std::to_string(heap.maxPauseNanos) + " },\n";
+            json += "  \"strings\": { \"intern_hits\": " + std::to_string(heap.internHits) +
+                ", \"intern_misses\": " + std::to_string(heap.internMisses) + " },\n";
+            json += "  \"hardware\": ";
+            if (hardware.available)
+            {
+                json += "{ \"cycles\": " + std::to_string(hardware.cycles) +
+                    ", \"instructions\": " + std::to_string(hardware.instructions) +
+                    ", \"branch_misses\": " + std::to_string(hardware.branchMisses) +
+                    ", \"cache_misses\": " + std::to_string(hardware.cacheMisses) + " }\n";
+            }
+            else
+            {
+                json += "null\n";
+            }
+            json += "}";
+            return json;
+        }
+    };
+
+    // 一组 perf_event_open 计数器（周期数为组长，四个事件同时启停）。打开失败时 Available() 为 false，
+    // Start / Stop 什么也不做
+    class PerfCounters
+    {
+    public:
+        PerfCounters()
+        {
+#ifdef __linux__
+            static constexpr std::pair<uint32_t, uint64_t> events[EventCount] = {
+                { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+                { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+                { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+                { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+            };
+            for (size_t i = 0; i < EventCount; ++i)
+            {
+                perf_event_attr attr{};
+                attr.size = sizeof(attr);
+                attr.type = events[i].first;
+                attr.config = events[i].second;
+                attr.disabled = i == 0;     // 组长关闭时整组都不计数
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                attr.read_format = PERF_FORMAT_GROUP;
+                fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0));
+                if (fds[i] < 0)
+                {
+                    Close();
+                    return;
+                }
+            }
+#endif
+        }
+
+        PerfCounters(const PerfCounters&) = delete;
+        PerfCounters& operator=(const PerfCounters&) = delete;
+
+        ~PerfCounters()
+        {
+            Close();
+        }
+
+        bool Available() const { return fds[0] >= 0; }
+
+        void Start()
+        {
+#ifdef __linux__
+            if (!Available())
+                return;
+            ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+        }
+
+        // 停止计数，把这一段的计数累加到 counters
+        void Stop(HardwareCounters& counters)
+        {
+#ifdef __linux__
+            if (!Available())
+                return;
+            ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+            uint64_t values[1 + EventCount] = {};    // 事件个数，随后依次为各事件的计数
+            if (read(fds[0], values, sizeof(values)) != static_cast<ssize_t>(sizeof(values)) || values[0] != EventCount)
+                return;
+            counters.available = true;
+            counters.cycles += values[1];
+            counters.instructions += values[2];
+            counters.branchMisses += values[3];
+            counters.cacheMisses += values[4];
+#else
+            (void)counters;
+#endif
+        }
+
+    private:
+        static constexpr size_t EventCount = 4;
+        int fds[EventCount] = { -1, -1, -1, -1 };
+
+        void Close()
+        {
+#ifdef __linux__
+            for (int& fd : fds)
+            {
+                if (fd >= 0)
+                    close(fd);
+                fd = -1;
+            }
+#endif
+        }
+    };
+}
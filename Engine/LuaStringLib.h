@@ -0,0 +1,1085 @@
+﻿#pragma once
+
+#include "LuaLibrary.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CPPLUA_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace Engine
+{
+    // 字符串库的底层扫描与转换，支持 SSE2 时每次处理 16 字节，否则逐字节处理
+    namespace StringKernels
+    {
+        constexpr size_t NotFound = std::string_view::npos;
+
+#ifdef CPPLUA_SSE2
+        inline int FirstBit(uint32_t mask)
+        {
+#if defined(_MSC_VER) && !defined(__clang__)
+            unsigned long index;
+            _BitScanForward(&index, mask);
+            return static_cast<int>(index);
+#else
+            return __builtin_ctz(mask);
+#endif
+        }
+#endif
+
+        // 在 text 中查找 needle 第一次出现的位置。
+        // 向量化版本同时比较每个候选位置的首字节与末字节，两者都相同时才逐字节比较中间部分
+        inline size_t Find(std::string_view text, std::string_view needle)
+        {
+            const size_t n = needle.size();
+            if (n == 0)
+                return 0;
+            if (n > text.size())
+                return NotFound;
+            if (n == 1)
+            {
+                const void* hit = std::memchr(text.data(), needle[0], text.size());
+                return hit ? static_cast<const char*>(hit) - text.data() : NotFound;
+            }
+
+            const char* data = text.data();
+            const size_t last = text.size() - n;   // 最后一个候选位置
+            size_t i = 0;
+#ifdef CPPLUA_SSE2
+            const __m128i first = _mm_set1_epi8(needle[0]);
+            const __m128i tail = _mm_set1_epi8(needle[n - 1]);
+            for (; i + 16 <= last + 1; i += 16)
+            {
+                __m128i blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+                __m128i blockLast = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + n - 1));
+                __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(blockFirst, first), _mm_cmpeq_epi8(blockLast, tail));
+                uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(eq));
+                while (mask != 0)
+                {
+                    size_t candidate = i + FirstBit(mask);
+                    if (std::memcmp(data + candidate + 1, needle.data() + 1, n - 2) == 0)
+                        return candidate;
+                    mask &= mask - 1;
+                }
+            }
+#endif
+            for (; i <= last; ++i)
+            {
+                if (data[i] == needle[0] && data[i + n - 1] == needle[n - 1] &&
+                    std::memcmp(data + i + 1, needle.data() + 1, n - 2) == 0)
+                    return i;
+            }
+            return NotFound;
+        }
+
+        // text 中第一个属于 set 的字节的位置（set 最多 16 个字节）
+        inline size_t FindAnyOf(std::string_view text, std::string_view set)
+        {
+            size_t i = 0;
+#ifdef CPPLUA_SSE2
+            __m128i needles[16];
+            for (size_t k = 0; k < set.size(); ++k)
+                needles[k] = _mm_set1_epi8(set[k]);
+            for (; i + 16 <= text.size(); i += 16)
+            {
+                __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + i));
+                __m128i eq = _mm_setzero_si128();
+                for (size_t k = 0; k < set.size(); ++k)
+                    eq = _mm_or_si128(eq, _mm_cmpeq_epi8(block, needles[k]));
+                uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(eq));
+                if (mask != 0)
+                    return i + FirstBit(mask);
+            }
+#endif
+            for (; i < text.size(); ++i)
+            {
+                if (set.find(text[i]) != std::string_view::npos)
+                    return i;
+            }
+            return NotFound;
+        }
+
+        // 将 ASCII 字母 [from, from + 25] 翻转大小写后写到 out（与 C 语言环境下的 toupper / tolower 相同）
+        inline void MapCase(std::string_view text, char* out, char from)
+        {
+            size_t i = 0;
+#ifdef CPPLUA_SSE2
+            const __m128i low = _mm_set1_epi8(static_cast<char>(from - 1));
+            const __m128i high = _mm_set1_epi8(static_cast<char>(from + 26));
+            const __m128i flip = _mm_set1_epi8(0x20);
+            for (; i + 16 <= text.size(); i += 16)
+            {
+                __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + i));
+                // 有符号比较：0x80 以上的字节为负数，不在范围内
+                __m128i inRange = _mm_and_si128(_mm_cmpgt_epi8(block, low), _mm_cmplt_epi8(block, high));
+                block = _mm_xor_si128(block, _mm_and_si128(inRange, flip));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), block);
+            }
+#endif
+            for (; i < text.size(); ++i)
+            {
+                char c = text[i];
+                out[i] = (c >= from && c <= from + 25) ? static_cast<char>(c ^ 0x20) : c;
+            }
+        }
+
+        inline void ToUpper(std::string_view text, char* out)
+        {
+            MapCase(text, out, 'a');
+        }
+
+        inline void ToLower(std::string_view text, char* out)
+        {
+            MapCase(text, out, 'A');
+        }
+    }
+
+    // Lua 模式匹配，语义与 Lua 5.4 相同：字符类 %a %c %d %g %l %p %s %u %w %x 及其大写补集、
+    // 集合 [...]、量词 * + - ?、锚点 ^ $、捕获 ( ) 与位置捕获 ()、%b、%f 与反向引用 %1-%9
+    class PatternMatcher
+    {
+    public:
+        static constexpr int MaxCaptures = 32;
+        static constexpr int MaxRecursion = 200;
+        static constexpr ptrdiff_t CapUnfinished = -1;
+        static constexpr ptrdiff_t CapPosition = -2;
+
+        PatternMatcher(std::string_view source, std::string_view pattern)
+            : srcInit(source.data()), srcEnd(source.data() + source.size()),
+              patternBegin(pattern.data()), patternEnd(pattern.data() + pattern.size())
+        { }
+
+        // 从 s 开始匹配 pattern（不含开头的 '^'），成功时返回匹配的结束位置
+        const char* Match(const char* s, const char* pattern)
+        {
+            level = 0;
+            depth = MaxRecursion;
+            return DoMatch(s, pattern);
+        }
+
+        int Level() const { return level; }
+        const char* Source() const { return srcInit; }
+        const char* SourceEnd() const { return srcEnd; }
+
+        // 第 i 个捕获；模式没有捕获时第 0 个捕获是整个匹配 [s, e)
+        Value Capture(Heap& heap, int i, const char* s, const char* e) const
+        {
+            if (i >= level)
+            {
+                if (i != 0)
+                    throw std::runtime_error("无效的捕获索引 %" + std::to_string(i + 1));
+                return Value(heap.NewString(std::string_view(s, e - s)));
+            }
+            ptrdiff_t length = capture[i].length;
+            if (length == CapUnfinished)
+                throw std::runtime_error("未完成的捕获");
+            if (length == CapPosition)
+                return Value(static_cast<double>(capture[i].init - srcInit + 1));
+            return Value(heap.NewString(std::string_view(capture[i].init, length)));
+        }
+
+        // 第 i 个捕获的文本（位置捕获返回空视图，由调用方另行处理）
+        std::string_view CaptureText(int i, const char* s, const char* e) const
+        {
+            if (i >= level)
+            {
+                if (i != 0)
+                    throw std::runtime_error("无效的捕获索引 %" + std::to_string(i + 1));
+                return std::string_view(s, e - s);
+            }
+            if (capture[i].length == CapUnfinished)
+                throw std::runtime_error("未完成的捕获");
+            return std::string_view(capture[i].init, capture[i].length);
+        }
+
+        bool IsPositionCapture(int i) const
+        {
+            return i < level && capture[i].length == CapPosition;
+        }
+
+    private:
+        struct CaptureInfo
+        {
+            const char* init;
+            ptrdiff_t length;
+        };
+
+        const char* srcInit;
+        const char* srcEnd;
+        const char* patternBegin;
+        const char* patternEnd;
+        int level = 0;
+        int depth = MaxRecursion;
+        CaptureInfo capture[MaxCaptures];
+
+        [[noreturn]] static void Error(const std::string& message)
+        {
+            throw std::runtime_error(message);
+        }
+
+        static bool MatchClass(unsigned char c, unsigned char cl)
+        {
+            bool result;
+            switch (std::tolower(cl))
+            {
+            case 'a': result = std::isalpha(c); break;
+            case 'c': result = std::iscntrl(c); break;
+            case 'd': result = std::isdigit(c); break;
+            case 'g': result = std::isgraph(c); break;
+            case 'l': result = std::islower(c); break;
+            case 'p': result = std::ispunct(c); break;
+            case 's': result = std::isspace(c); break;
+            case 'u': result = std::isupper(c); break;
+            case 'w': result = std::isalnum(c); break;
+            case 'x': result = std::isxdigit(c); break;
+            default: return cl == c;
+            }
+            return std::isupper(cl) ? !result : result;
+        }
+
+        // p 指向 '['，end 指向对应的 ']'
+        static bool MatchClassSet(unsigned char c, const char* p, const char* end)
+        {
+            bool matched = true;
+            if (*(p + 1) == '^')
+            {
+                matched = false;
+                ++p;
+            }
+            while (++p < end)
+            {
+                if (*p == '%')
+                {
+                    ++p;
+                    if (MatchClass(c, static_cast<unsigned char>(*p)))
+                        return matched;
+                }
+                else if (*(p + 1) == '-' && p + 2 < end)
+                {
+                    p += 2;
+                    if (static_cast<unsigned char>(*(p - 2)) <= c && c <= static_cast<unsigned char>(*p))
+                        return matched;
+                }
+                else if (static_cast<unsigned char>(*p) == c)
+                {
+                    return matched;
+                }
+            }
+            return !matched;
+        }
+
+        // 单个字符类的结束位置
+        const char* ClassEnd(const char* p) const
+        {
+            char c = *p++;
+            if (c == '%')
+            {
+                if (p >= patternEnd)
+                    Error("格式错误的模式（以 '%' 结尾）");
+                return p + 1;
+            }
+            if (c == '[')
+            {
+                if (p < patternEnd && *p == '^')
+                    ++p;
+                // 第一个字符即使是 ']' 也属于集合
+                do
+                {
+                    if (p == patternEnd)
+                        Error("格式错误的模式（缺少 ']'）");
+                    if (*(p++) == '%' && p < patternEnd)
+                        ++p;
+                } while (p == patternEnd || *p != ']');
+                return p + 1;
+            }
+            return p;
+        }
+
+        bool SingleMatch(const char* s, const char* p, const char* ep) const
+        {
+            if (s >= srcEnd)
+                return false;
+            unsigned char c = static_cast<unsigned char>(*s);
+            switch (*p)
+            {
+            case '.':
+                return true;
+            case '%':
+                return MatchClass(c, static_cast<unsigned char>(*(p + 1)));
+            case '[':
+                return MatchClassSet(c, p, ep - 1);
+            default:
+                return static_cast<unsigned char>(*p) == c;
+            }
+        }
+
+        const char* MatchBalance(const char* s, const char* p) const
+        {
+            if (p + 1 >= patternEnd)
+                Error("格式错误的模式（缺少 '%b' 的参数）");
+            if (s >= srcEnd || *s != *p)
+                return nullptr;
+            char open = *p;
+            char close = *(p + 1);
+            int count = 1;
+            while (++s < srcEnd)
+            {
+                if (*s == close)
+                {
+                    if (--count == 0)
+                        return s + 1;
+                }
+                else if (*s == open)
+                {
+                    ++count;
+                }
+            }
+            return nullptr;
+        }
+
+        const char* MaxExpand(const char* s, const char* p, const char* ep)
+        {
+            ptrdiff_t i = 0;
+            while (SingleMatch(s + i, p, ep))
+                ++i;
+            // 尽可能多地匹配，再逐个回退
+            while (i >= 0)
+            {
+                const char* result = DoMatch(s + i, ep + 1);
+                if (result != nullptr)
+                    return result;
+                --i;
+            }
+            return nullptr;
+        }
+
+        const char* MinExpand(const char* s, const char* p, const char* ep)
+        {
+            while (true)
+            {
+                const char* result = DoMatch(s, ep + 1);
+                if (result != nullptr)
+                    return result;
+                if (!SingleMatch(s, p, ep))
+                    return nullptr;
+                ++s;
+            }
+        }
+
+        const char* StartCapture(const char* s, const char* p, ptrdiff_t what)
+        {
+            if (level >= MaxCaptures)
+                Error("捕获过多");
+            capture[level].init = s;
+            capture[level].length = what;
+            ++level;
+            const char* result = DoMatch(s, p);
+            if (result == nullptr)
+                --level;
+            return result;
+        }
+
+        const char* EndCapture(const char* s, const char* p)
+        {
+            int l = CaptureToClose();
+            capture[l].length = s - capture[l].init;
+            const char* result = DoMatch(s, p);
+            if (result == nullptr)
+                capture[l].length = CapUnfinished;
+            return result;
+        }
+
+        int CaptureToClose() const
+        {
+            for (int l = level - 1; l >= 0; --l)
+            {
+                if (capture[l].length == CapUnfinished)
+                    return l;
+            }
+            Error("无效的模式捕获");
+        }
+
+        const char* MatchCapture(const char* s, int l) const
+        {
+            l -= '1';
+            if (l < 0 || l >= level || capture[l].length == CapUnfinished)
+                Error("无效的捕获索引 %" + std::to_string(l + 1));
+            size_t length = static_cast<size_t>(capture[l].length);
+            if (static_cast<size_t>(srcEnd - s) >= length && std::memcmp(capture[l].init, s, length) == 0)
+                return s + length;
+            return nullptr;
+        }
+
+        const char* DoMatch(const char* s, const char* p)
+        {
+            if (depth-- == 0)
+                Error("模式过于复杂");
+            while (p != patternEnd)
+            {
+                switch (*p)
+                {
+                case '(':
+                    if (p + 1 < patternEnd && *(p + 1) == ')')
+                        s = StartCapture(s, p + 2, CapPosition);
+                    else
+                        s = StartCapture(s, p + 1, CapUnfinished);
+                    ++depth;
+                    return s;
+                case ')':
+                    s = EndCapture(s, p + 1);
+                    ++depth;
+                    return s;
+                case '$':
+                    if (p + 1 == patternEnd)
+                    {
+                        ++depth;
+                        return s == srcEnd ? s : nullptr;
+                    }
+                    break;
+                case '%':
+                    if (p + 1 == patternEnd)
+                        break;  // 由 ClassEnd 报告错误
+                    if (*(p + 1) == 'b')
+                    {
+                        s = MatchBalance(s, p + 2);
+                        if (s != nullptr)
+                        {
+                            p += 4;
+                            continue;
+                        }
+                        ++depth;
+                        return nullptr;
+                    }
+                    if (*(p + 1) == 'f')
+                    {
+                        p += 2;
+                        if (p >= patternEnd || *p != '[')
+                            Error("'%f' 之后缺少 '['");
+                        const char* ep = ClassEnd(p);
+                        unsigned char previous = s == srcInit ? '\0' : static_cast<unsigned char>(*(s - 1));
+                        unsigned char current = s < srcEnd ? static_cast<unsigned char>(*s) : '\0';
+                        if (!MatchClassSet(previous, p, ep - 1) && MatchClassSet(current, p, ep - 1))
+                        {
+                            p = ep;
+                            continue;
+                        }
+                        ++depth;
+                        return nullptr;
+                    }
+                    if (std::isdigit(static_cast<unsigned char>(*(p + 1))))
+                    {
+                        s = MatchCapture(s, static_cast<unsigned char>(*(p + 1)));
+                        if (s != nullptr)
+                        {
+                            p += 2;
+                            continue;
+                        }
+                        ++depth;
+                        return nullptr;
+                    }
+                    break;
+                default:
+                    break;
+                }
+
+                // 单个字符类，可能带量词
+                const char* ep = ClassEnd(p);
+                char quantifier = ep < patternEnd ? *ep : '\0';
+                if (!SingleMatch(s, p, ep))
+                {
+                    if (quantifier == '*' || quantifier == '?' || quantifier == '-')
+                    {
+                        p = ep + 1;
+                        continue;
+                    }
+                    s = nullptr;
+                }
+                else
+                {
+                    switch (quantifier)
+                    {
+                    case '?':
+                    {
+                        const char* result = DoMatch(s + 1, ep + 1);
+                        if (result == nullptr)
+                        {
+                            p = ep + 1;
+                            continue;
+                        }
+                        s = result;
+                        break;
+                    }
+                    case '+':
+                        s = MaxExpand(s + 1, p, ep);
+                        break;
+                    case '*':
+                        s = MaxExpand(s, p, ep);
+                        break;
+                    case '-':
+                        s = MinExpand(s, p, ep);
+                        break;
+                    default:
+                        ++s;
+                        p = ep;
+                        continue;
+                    }
+                }
+                ++depth;
+                return s;
+            }
+            ++depth;
+            return s;
+        }
+    };
+
+    // 原生 string 库。字符串参数直接使用堆上字符串对象的内容，不复制；
+    // 结果在复用的缓冲区中拼好后一次创建为字符串对象
+    class StringLibrary : public NativeLibrary
+    {
+    public:
+        using NativeLibrary::NativeLibrary;
+
+        // 创建 string 库表
+        Table* Open()
+        {
+            Table* lib = heap.NewTable(0, 16);
+            auto add = [&](std::string_view name, Value::function fn) { AddFunction(lib, name, std::move(fn)); };
+            auto addMultiple = [&](std::string_view name, Value::multiFunction fn) { AddFunction(lib, name, std::move(fn)); };
+            add("len", [this](std::span<const Value> args) { return Len(args); });
+            add("sub", [this](std::span<const Value> args) { return Sub(args); });
+            add("upper", [this](std::span<const Value> args) { return MapCase(args, "upper", StringKernels::ToUpper); });
+            add("lower", [this](std::span<const Value> args) { return MapCase(args, "lower", StringKernels::ToLower); });
+            add("rep", [this](std::span<const Value> args) { return Rep(args); });
+            addMultiple("byte", [this](std::span<const Value> args, Results& results) { Byte(args, results); });
+            add("char", [this](std::span<const Value> args) { return Char(args); });
+            addMultiple("find", [this](std::span<const Value> args, Results& results) { Find(args, true, results); });
+            addMultiple("match", [this](std::span<const Value> args, Results& results) { Find(args, false, results); });
+            add("gmatch", [this](std::span<const Value> args) { return GMatch(args); });
+            addMultiple("gsub", [this](std::span<const Value> args, Results& results) { GSub(args, results); });
+            add("format", [this](std::span<const Value> args) { return Format(args); });
+            return lib;
+        }
+
+    private:
+        // 模式中的特殊字符；不含这些字符的模式按普通子串查找
+        static constexpr std::string_view Specials = "^$*+?.([%-";
+
+        // 起始位置：负数从末尾倒数，结果在 [1, +inf) 内
+        static size_t StartPosition(int64_t pos, size_t length)
+        {
+            if (pos > 0)
+                return static_cast<size_t>(pos);
+            if (pos == 0 || pos < -static_cast<int64_t>(length))
+                return 1;
+            return length + static_cast<size_t>(pos) + 1;
+        }
+
+        // 结束位置：负数从末尾倒数，结果在 [0, length] 内
+        static size_t EndPosition(int64_t pos, size_t length)
+        {
+            if (pos > static_cast<int64_t>(length))
+                return length;
+            if (pos >= 0)
+                return static_cast<size_t>(pos);
+            if (pos < -static_cast<int64_t>(length))
+                return 0;
+            return length + static_cast<size_t>(pos) + 1;
+        }
+
+        // 参数本身是字符串对象时直接返回，避免再次查找驻留表
+        Value MakeString(std::span<const Value> args, size_t arg, std::string_view text)
+        {
+            if (auto* str = std::get_if<String*>(&args[arg].value); str != nullptr && (*str)->length == text.size())
+                return args[arg];
+            return Value(heap.NewString(text));
+        }
+
+        Value Len(std::span<const Value> args)
+        {
+            char scratch[NumberBufferSize];
+            return Value(static_cast<double>(CheckString(args, 0, "len", scratch).size()));
+        }
+
+        Value Sub(std::span<const Value> args)
+        {
+            char scratch[NumberBufferSize];
+            std::string_view s = CheckString(args, 0, "sub", scratch);
+            size_t start = StartPosition(CheckInteger(args, 1, "sub"), s.size());
+            size_t end = EndPosition(OptInteger(args, 2, "sub", -1), s.size());
+            if (start > end)
+                return Value(heap.NewString(""));
+            return MakeString(args, 0, s.substr(start - 1, end - start + 1));
+        }
+
+        template <typename Kernel>
+        Value MapCase(std::span<const Value> args, const char* name, Kernel kernel)
+        {
+            char scratch[NumberBufferSize];
+            std::string_view s = CheckString(args, 0, name, scratch);
+            buffer.resize(s.size());
+            kernel(s, buffer.data());
+            return Value(heap.NewString(buffer));
+        }
+
+        Value Rep(std::span<const Value> args)
+        {
+            char scratch[NumberBufferSize];
+            char sepScratch[NumberBufferSize];
+            std::string_view s = CheckString(args, 0, "rep", scratch);
+            int64_t n = CheckInteger(args, 1, "rep");
+            std::string_view sep = args.size() > 2 && !args[2].IsNil() ? CheckString(args, 2, "rep", sepScratch) : std::string_view();
+            if (n <= 0)
+                return Value(heap.NewString(""));
+            uint64_t total = (s.size() + sep.size()) * static_cast<uint64_t>(n) - sep.size();
+            if ((s.size() + sep.size()) != 0 && (total / static_cast<uint64_t>(n) > s.size() + sep.size() || total > UINT32_MAX))
+                throw std::runtime_error("结果字符串过长");
+            buffer.clear();
+            buffer.reserve(total);
+            for (int64_t i = 0; i < n; ++i)
+            {
+                if (i > 0)
+                    buffer.append(sep);
+                buffer.append(s);
+            }
+            return Value(heap.NewString(buffer));
+        }
+
+        // 返回 [i, j] 内各个字节的值
+        void Byte(std::span<const Value> args, Results& results)
+        {
+            char scratch[NumberBufferSize];
+            std::string_view s = CheckString(args, 0, "byte", scratch);
+            int64_t i = OptInteger(args, 1, "byte", 1);
+            size_t start = StartPosition(i, s.size());
+            size_t end = EndPosition(OptInteger(args, 2, "byte", i), s.size());
+            for (size_t k = start; k <= end; ++k)
+                results.Push(Value(static_cast<double>(static_cast<unsigned char>(s[k - 1]))));
+        }
+
+        Value Char(std::span<const Value> args)
+        {
+            buffer.resize(args.size());
+            for (size_t i = 0; i < args.size(); ++i)
+            {
+                int64_t c = CheckInteger(args, i, "char");
+                if (static_cast<uint64_t>(c) > UINT8_MAX)
+                    ArgError(i, "char", "值超出范围");
+                buffer[i] = static_cast<char>(c);
+            }
+            return Value(heap.NewString(buffer));
+        }
+
+        // 依次返回各个捕获，没有捕获时返回整个匹配
+        void PushCaptures(const PatternMatcher& matcher, const char* s, const char* e, Results& results)
+        {
+            int n = std::max(matcher.Level(), 1);
+            for (int i = 0; i < n; ++i)
+                results.Push(matcher.Capture(heap, i, s, e));
+        }
+
+        // find 返回匹配的起止位置与各个捕获；match 返回各个捕获（没有捕获时为整个匹配）；没有匹配时返回 nil
+        void Find(std::span<const Value> args, bool find, Results& results)
+        {
+            const char* name = find ? "find" : "match";
+            char scratch[NumberBufferSize];
+            char patternScratch[NumberBufferSize];
+            std::string_view s = CheckString(args, 0, name, scratch);
+            std::string_view pattern = CheckString(args, 1, name, patternScratch);
+            size_t init = StartPosition(OptInteger(args, 2, name, 1), s.size());
+            if (init > s.size() + 1)
+            {
+                results.Push(Value());
+                return;
+            }
+
+            bool plain = find && args.size() > 3 && !args[3].IsFalsy();
+            if (find && (plain || StringKernels::FindAnyOf(pattern, Specials) == StringKernels::NotFound))
+            {
+                size_t pos = StringKernels::Find(s.substr(init - 1), pattern);
+                if (pos == StringKernels::NotFound)
+                {
+                    results.Push(Value());
+                    return;
+                }
+                results.Push(Value(static_cast<double>(pos + init)));
+                results.Push(Value(static_cast<double>(pos + init + pattern.size() - 1)));
+                return;
+            }
+
+            PatternMatcher matcher(s, pattern);
+            const char* p = pattern.data();
+            bool anchor = !pattern.empty() && *p == '^';
+            if (anchor)
+                ++p;
+            const char* s1 = s.data() + init - 1;
+            do
+            {
+                const char* e = matcher.Match(s1, p);
+                if (e != nullptr)
+                {
+                    if (find)
+                    {
+                        results.Push(Value(static_cast<double>(s1 - s.data() + 1)));
+                        results.Push(Value(static_cast<double>(e - s.data())));
+                        if (matcher.Level() == 0)
+                            return;
+                    }
+                    PushCaptures(matcher, s1, e, results);
+                    return;
+                }
+            } while (s1++ < matcher.SourceEnd() && !anchor);
+            results.Push(Value());
+        }
+
+        // 返回迭代函数，每次调用返回下一个匹配的各个捕获（没有捕获时为整个匹配），结束时返回 nil
+        Value GMatch(std::span<const Value> args)
+        {
+            char scratch[NumberBufferSize];
+            char patternScratch[NumberBufferSize];
+            std::string_view s = CheckString(args, 0, "gmatch", scratch);
+            std::string_view pattern = CheckString(args, 1, "gmatch", patternScratch);
+            size_t init = StartPosition(OptInteger(args, 2, "gmatch", 1), s.size());
+            String* subject = heap.NewString(s);
+            String* patternString = heap.NewString(pattern);
+
+            size_t position = std::min(init - 1, s.size() + 1);
+            size_t lastMatch = SIZE_MAX;
+            Function* iterator = heap.NewFunction(Value::multiFunction());
+            // 迭代函数持有的字符串作为其上值，随迭代函数一起存活
+            iterator->upvalues[0] = Value(subject);
+            iterator->upvalues[1] = Value(patternString);
+            iterator->multiple = [this, subject, patternString, position, lastMatch](std::span<const Value>, Results& results) mutable {
+                std::string_view text = subject->View();
+                PatternMatcher matcher(text, patternString->View());
+                for (const char* src = text.data() + position; src <= matcher.SourceEnd(); ++src)
+                {
+                    const char* e = matcher.Match(src, patternString->Data());
+                    if (e != nullptr && static_cast<size_t>(e - text.data()) != lastMatch)
+                    {
+                        position = lastMatch = static_cast<size_t>(e - text.data());
+                        PushCaptures(matcher, src, e, results);
+                        return;
+                    }
+                }
+                position = text.size() + 1;
+                results.Push(Value());
+            };
+            return Value(iterator);
+        }
+
+        // 返回替换后的字符串与替换次数
+        void GSub(std::span<const Value> args, Results& results)
+        {
+            char scratch[NumberBufferSize];
+            char patternScratch[NumberBufferSize];
+            std::string_view s = CheckString(args, 0, "gsub", scratch);
+            std::string_view pattern = CheckString(args, 1, "gsub", patternScratch);
+            if (args.size() < 3)
+                TypeError(args, 2, "gsub", "string/function/table");
+            // 替换函数可能使栈扩容，args 在此之后不再使用
+            const Value repl = args[2];
+            ValueType replType = repl.Type();
+            if (replType != ValueType::Number && replType != ValueType::String && replType != ValueType::Table &&
+                replType != ValueType::Function && replType != ValueType::Closure)
+                TypeError(args, 2, "gsub", "string/function/table");
+            int64_t maxReplacements = OptInteger(args, 3, "gsub", static_cast<int64_t>(s.size()) + 1);
+            char replScratch[NumberBufferSize];
+            std::string_view replText = replType == ValueType::Number || replType == ValueType::String
+                ? repl.ToStringView(replScratch) : std::string_view();
+
+            // 替换函数可能再次调用 gsub，结果使用独立的缓冲区
+            HeapString result{ HeapAllocator<char>(heap.GetMemory()) };
+            result.reserve(s.size());
+            PatternMatcher matcher(s, pattern);
+            const char* p = pattern.data();
+            bool anchor = !pattern.empty() && *p == '^';
+            if (anchor)
+                ++p;
+            const char* src = s.data();
+            const char* lastMatch = nullptr;
+            int64_t count = 0;
+            while (count < maxReplacements)
+            {
+                const char* e = matcher.Match(src, p);
+                if (e != nullptr && e != lastMatch)
+                {
+                    ++count;
+                    AddReplacement(matcher, result, src, e, repl, replText);
+                    src = lastMatch = e;
+                }
+                else if (src < matcher.SourceEnd())
+                {
+                    result.push_back(*src++);
+                }
+                else
+                {
+                    break;
+                }
+                if (anchor)
+                    break;
+            }
+            result.append(src, matcher.SourceEnd());
+            results.Push(Value(heap.NewString(result)));
+            results.Push(Value(static_cast<double>(count)));
+        }
+
+        void AddReplacement(PatternMatcher& matcher, HeapString& result, const char* s, const char* e, const Value& repl, std::string_view replText)
+        {
+            Value value;
+            switch (repl.Type())
+            {
+            case ValueType::Number:
+            case ValueType::String:
+            {
+                // %0 为整个匹配，%1-%9 为各个捕获，%% 为 '%'
+                for (size_t i = 0; i < replText.size(); ++i)
+                {
+                    char c = replText[i];
+                    if (c != '%')
+                    {
+                        result.push_back(c);
+                        continue;
+                    }
+                    if (++i == replText.size())
+                        throw std::runtime_error("替换字符串中 '%' 的用法无效");
+                    c = replText[i];
+                    if (c == '%')
+                    {
+                        result.push_back('%');
+                    }
+                    else if (c >= '0' && c <= '9')
+                    {
+                        if (c == '0')
+                        {
+                            result.append(s, e);
+                        }
+                        else if (matcher.IsPositionCapture(c - '1'))
+                        {
+                            char scratch[NumberBufferSize];
+                            result.append(matcher.Capture(heap, c - '1', s, e).ToStringView(scratch));
+                        }
+                        else
+                        {
+                            result.append(matcher.CaptureText(c - '1', s, e));
+                        }
+                    }
+                    else
+                    {
+                        throw std::runtime_error("替换字符串中 '%' 的用法无效");
+                    }
+                }
+                return;
+            }
+            case ValueType::Table:
+                value = (*std::get_if<Table*>(&repl.value))->Get(matcher.Capture(heap, 0, s, e));
+                break;
+            default:
+            {
+                Value captures[PatternMatcher::MaxCaptures];
+                int n = std::max(matcher.Level(), 1);
+                for (int i = 0; i < n; ++i)
+                    captures[i] = matcher.Capture(heap, i, s, e);
+                value = call(repl, std::span<const Value>(captures, n));
+                break;
+            }
+            }
+
+            // 结果为 nil 或 false 时保留原文
+            if (value.IsFalsy())
+            {
+                result.append(s, e);
+                return;
+            }
+            if (!value.IsNumber() && !std::holds_alternative<String*>(value.value))
+                throw std::runtime_error(std::string("替换值无效（为 ") + value.TypeName() + "）");
+            char scratch[NumberBufferSize];
+            result.append(value.ToStringView(scratch));
+        }
+
+        Value Format(std::span<const Value> args)
+        {
+            char scratch[NumberBufferSize];
+            std::string_view format = CheckString(args, 0, "format", scratch);
+            buffer.clear();
+            size_t arg = 0;
+            for (size_t i = 0; i < format.size(); ++i)
+            {
+                char c = format[i];
+                if (c != '%')
+                {
+                    buffer.push_back(c);
+                    continue;
+                }
+                if (++i == format.size())
+                    throw std::runtime_error("格式 '%' 无效（位于末尾）");
+                if (format[i] == '%')
+                {
+                    buffer.push_back('%');
+                    continue;
+                }
+
+                // 标志、宽度（最多两位）与精度（最多两位）
+                size_t specStart = i;
+                while (i < format.size() && std::strchr("-+ #0", format[i]) != nullptr && i - specStart < 5)
+                    ++i;
+                for (int digits = 0; i < format.size() && std::isdigit(static_cast<unsigned char>(format[i])); ++digits, ++i)
+                {
+                    if (digits == 2)
+                        throw std::runtime_error("格式无效（宽度或精度过长）");
+                }
+                bool hasPrecision = false;
+                if (i < format.size() && format[i] == '.')
+                {
+                    hasPrecision = true;
+                    ++i;
+                    for (int digits = 0; i < format.size() && std::isdigit(static_cast<unsigned char>(format[i])); ++digits, ++i)
+                    {
+                        if (digits == 2)
+                            throw std::runtime_error("格式无效（宽度或精度过长）");
+                    }
+                }
+                if (i == format.size())
+                    throw std::runtime_error("格式无效（缺少转换说明符）");
+                char conversion = format[i];
+                std::string spec = "%" + std::string(format.substr(specStart, i - specStart));
+
+                ++arg;
+                char out[512];
+                int written = 0;
+                switch (conversion)
+                {
+                case 'c':
+                    buffer.push_back(static_cast<char>(CheckInteger(args, arg, "format")));
+                    continue;
+                case 'd':
+                case 'i':
+                    spec += "lld";
+                    written = std::snprintf(out, sizeof(out), spec.c_str(), static_cast<long long>(CheckInteger(args, arg, "format")));
+                    break;
+                case 'o':
+                case 'u':
+                case 'x':
+                case 'X':
+                    spec += "ll";
+                    spec += conversion;
+                    written = std::snprintf(out, sizeof(out), spec.c_str(), static_cast<unsigned long long>(CheckInteger(args, arg, "format")));
+                    break;
+                case 'a':
+                case 'A':
+                case 'e':
+                case 'E':
+                case 'f':
+                case 'F':
+                case 'g':
+                case 'G':
+                {
+                    spec += conversion;
+                    double number = CheckNumber(args, arg, "format");
+                    written = std::snprintf(out, sizeof(out), spec.c_str(), number);
+                    break;
+                }
+                case 'q':
+                    if (spec.size() > 1)
+                        throw std::runtime_error("格式 '%q' 不能带修饰");
+                    AddQuoted(args, arg);
+                    continue;
+                case 's':
+                {
+                    if (arg >= args.size())
+                        TypeError(args, arg, "format", "value");
+                    char valueScratch[NumberBufferSize];
+                    std::string_view text = args[arg].ToStringView(valueScratch);
+                    if (spec.size() == 1 || (!hasPrecision && text.size() >= 100))
+                    {
+                        // 没有修饰（或字符串较长而宽度不起作用）时整个追加，不经过 snprintf
+                        buffer.append(text);
+                        continue;
+                    }
+                    if (text.find('\0') != std::string_view::npos)
+                        ArgError(arg, "format", "字符串含有 '\\0'");
+                    spec += 's';
+                    std::string copy(text);
+                    written = std::snprintf(out, sizeof(out), spec.c_str(), copy.c_str());
+                    break;
+                }
+                default:
+                    throw std::runtime_error("格式 '" + spec + conversion + "' 中的转换无效");
+                }
+                buffer.append(out, std::min<size_t>(static_cast<size_t>(std::max(written, 0)), sizeof(out) - 1));
+            }
+            return Value(heap.NewString(buffer));
+        }
+
+        // %q：可被 Lua 重新读入的字面量
+        void AddQuoted(std::span<const Value> args, size_t arg)
+        {
+            if (arg >= args.size())
+                TypeError(args, arg, "format", "value");
+            const Value& value = args[arg];
+            switch (value.Type())
+            {
+            case ValueType::String:
+            {
+                std::string_view text = (*std::get_if<String*>(&value.value))->View();
+                buffer.push_back('"');
+                for (size_t i = 0; i < text.size(); ++i)
+                {
+                    unsigned char c = static_cast<unsigned char>(text[i]);
+                    if (c == '"' || c == '\\' || c == '\n')
+                    {
+                        buffer.push_back('\\');
+                        buffer.push_back(static_cast<char>(c));
+                    }
+                    else if (std::iscntrl(c))
+                    {
+                        char escape[8];
+                        // 下一个字符是数字时必须写满三位，避免与其连在一起
+                        bool nextIsDigit = i + 1 < text.size() && std::isdigit(static_cast<unsigned char>(text[i + 1]));
+                        int n = std::snprintf(escape, sizeof(escape), nextIsDigit ? "\\%03d" : "\\%d", c);
+                        buffer.append(escape, n);
+                    }
+                    else
+                    {
+                        buffer.push_back(static_cast<char>(c));
+                    }
+                }
+                buffer.push_back('"');
+                return;
+            }
+            case ValueType::Number:
+            {
+                double d = *std::get_if<double>(&value.value);
+                char out[64];
+                int n;
+                int64_t integer;
+                if (NumberToInteger(d, integer))
+                    n = std::snprintf(out, sizeof(out), "%lld", static_cast<long long>(integer));
+                else if (d == HUGE_VAL)
+                    n = std::snprintf(out, sizeof(out), "1e9999");
+                else if (d == -HUGE_VAL)
+                    n = std::snprintf(out, sizeof(out), "-1e9999");
+                else if (d != d)
+                    n = std::snprintf(out, sizeof(out), "(0/0)");
+                else
+                    n = std::snprintf(out, sizeof(out), "%a", d);   // 十六进制浮点数，读回时不损失精度
+                buffer.append(out, n);
+                return;
+            }
+            case ValueType::Nil:
+            case ValueType::Boolean:
+            {
+                char valueScratch[NumberBufferSize];
+                buffer.append(value.ToStringView(valueScratch));
+                return;
+            }
+            default:
+                ArgError(arg, "format", "值没有字面量形式");
+            }
+        }
+    };
+}
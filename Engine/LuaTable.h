@@ -0,0 +1,600 @@
+﻿#pragma once
+
+#include "LuaState.h"
+#include "LuaMemory.h"
+
+#include <bit>
+#include <cmath>
+#include <cstring>
+
+namespace Engine
+{
+    // 元方法事件，同时是 Table::flags 中的位序号
+    enum class MetaEvent : uint8_t
+    {
+        Index, NewIndex, Gc, Len, Eq,
+        Add, Sub, Mul, Mod, Pow, Div, Idiv,
+        BAnd, BOr, BXor, Shl, Shr,
+        Unm, BNot, Lt, Le, Concat, Call, Close,
+    };
+
+    inline constexpr size_t MetaEventCount = static_cast<size_t>(MetaEvent::Close) + 1;
+
+    inline const char* MetaEventName(MetaEvent event)
+    {
+        static constexpr const char* names[MetaEventCount] = {
+            "__index", "__newindex", "__gc", "__len", "__eq",
+            "__add", "__sub", "__mul", "__mod", "__pow", "__div", "__idiv",
+            "__band", "__bor", "__bxor", "__shl", "__shr",
+            "__unm", "__bnot", "__lt", "__le", "__concat", "__call", "__close",
+        };
+        return names[static_cast<size_t>(event)];
+    }
+
+    // Lua 表：数组部分存放键 1..arraySize，其余键存放在开放寻址（线性探测）的哈希部分。
+    // 哈希部分的容量为 2 的幂，装载因子不超过 3/4；删除只把值置为 nil（死键），
+    // 死键的位置在同一条探测链上再次插入时复用，扩容重建时丢弃。
+    // 与 Lua 5.4 相同，重建时按整数键的分布决定数组部分的大小（computesizes）。
+    struct Table : GCObject
+    {
+        struct Node
+        {
+            Value key;      // nil 表示空位
+            Value value;    // 键非 nil 而值为 nil 表示死键
+        };
+
+        Value* array = nullptr;
+        uint32_t arraySize = 0;
+        uint32_t nodeCapacity = 0;  // 0 或 2 的幂
+        uint32_t nodeUsed = 0;      // 已占用的位置数（含死键）
+        Node* nodes = nullptr;
+        GCObject* gclist = nullptr; // 回收时的灰色链表
+        Table* metatable = nullptr;
+        uint32_t flags = 0;         // 作为元表时：第 i 位为 1 表示已确认没有第 i 个元方法（MetaEvent），写入字符串键时清零
+        bool watched = false;       // 位于某条被内联缓存的 __index 链上，修改时须使缓存失效（由虚拟机检查）
+        bool finalize = false;      // 已登记为带 __gc 的对象，等待回收时调用终结器
+
+        // 取值，键不存在时返回 nil
+        const Value& Get(const Value& key) const
+        {
+            switch (key.value.index())
+            {
+            case 2: // number
+            {
+                double d = *std::get_if<double>(&key.value);
+                int64_t i;
+                if (ToInteger(d, i))
+                    return GetInt(i);
+                break;
+            }
+            case 3: // String*
+                return GetStr(*std::get_if<String*>(&key.value));
+            case 0: // nil
+                return Nil();
+            default:
+                break;
+            }
+            const Node* node = Find(key);
+            return node ? node->value : Nil();
+        }
+
+        const Value& GetInt(int64_t key) const
+        {
+            if (static_cast<uint64_t>(key) - 1 < arraySize)
+                return array[key - 1];
+            const Node* node = Find(Value(static_cast<double>(key)));
+            return node ? node->value : Nil();
+        }
+
+        // 字符串已驻留，探测时只比较指针
+        const Value& GetStr(String* key) const
+        {
+            if (nodeCapacity == 0)
+                return Nil();
+            uint32_t mask = nodeCapacity - 1;
+            for (uint32_t i = static_cast<uint32_t>(key->hash) & mask;; i = (i + 1) & mask)
+            {
+                const Node& node = nodes[i];
+                const auto* str = std::get_if<String*>(&node.key.value);
+                if (str != nullptr && *str == key)
+                    return node.value;
+                if (node.key.IsNil())
+                    return Nil();
+            }
+        }
+
+        // 作为元表时取元方法，没有时返回 nullptr。没有的元方法记入 flags，
+        // 之后同一事件只需一次位测试（算术、比较、索引未命中等常见路径上的开销）
+        const Value* GetMetamethod(MetaEvent event, String* name)
+        {
+            const uint32_t bit = 1u << static_cast<uint32_t>(event);
+            if (flags & bit)
+                return nullptr;
+            const Value& handler = GetStr(name);
+            if (handler.IsNil())
+            {
+                flags |= bit;
+                return nullptr;
+            }
+            return &handler;
+        }
+
+        static constexpr uint32_t NoSlot = UINT32_MAX;
+
+        // 字符串键在哈希部分的位置，不存在时返回 NoSlot（供指令的内联缓存使用）
+        uint32_t SlotOf(String* key) const
+        {
+            if (nodeCapacity == 0)
+                return NoSlot;
+            uint32_t mask = nodeCapacity - 1;
+            for (uint32_t i = static_cast<uint32_t>(key->hash) & mask;; i = (i + 1) & mask)
+            {
+                const Node& node = nodes[i];
+                const auto* str = std::get_if<String*>(&node.key.value);
+                if (str != nullptr && *str == key)
+                    return i;
+                if (node.key.IsNil())
+                    return NoSlot;
+            }
+        }
+
+        // 缓存的位置上是否仍是 key
+        bool SlotHolds(uint32_t slot, String* key) const
+        {
+            if (slot >= nodeCapacity)
+                return false;
+            const auto* str = std::get_if<String*>(&nodes[slot].key.value);
+            return str != nullptr && *str == key;
+        }
+
+        // 直接写入 SlotOf 找到的位置（供指令的内联缓存使用）
+        void SetSlot(uint32_t slot, const Value& value)
+        {
+            nodes[slot].value = value;
+            flags = 0;
+        }
+
+        // 赋值；值为 nil 时相当于删除。键为 nil 或 NaN 时抛出异常
+        void Set(Memory& memory, const Value& key, const Value& value)
+        {
+            if (key.IsNumber())
+            {
+                double d = *std::get_if<double>(&key.value);
+                int64_t i;
+                if (ToInteger(d, i))
+                {
+                    SetInt(memory, i, value);
+                    return;
+                }
+                if (std::isnan(d))
+                    throw std::runtime_error("表索引为 NaN");
+            }
+            else if (key.IsNil())
+            {
+                throw std::runtime_error("表索引为 nil");
+            }
+            SetNode(memory, key, value);
+        }
+
+        void SetInt(Memory& memory, int64_t key, const Value& value)
+        {
+            if (static_cast<uint64_t>(key) - 1 < arraySize)
+            {
+                array[key - 1] = value;
+                return;
+            }
+            // 紧接数组部分末尾追加时直接扩大数组部分，顺序填充的数组不必经过哈希部分
+            if (key == static_cast<int64_t>(arraySize) + 1 && !value.IsNil())
+            {
+                Value copy = value;     // value 可能引用本表数组部分中的元素，扩容前先复制
+                GrowArray(memory, arraySize < 4 ? 4 : arraySize * 2);
+                array[key - 1] = copy;
+                return;
+            }
+            SetNode(memory, Value(static_cast<double>(key)), value);
+        }
+
+        void SetStr(Memory& memory, String* key, const Value& value)
+        {
+            flags = 0;
+            if (nodeCapacity != 0)
+            {
+                uint32_t mask = nodeCapacity - 1;
+                for (uint32_t i = static_cast<uint32_t>(key->hash) & mask;; i = (i + 1) & mask)
+                {
+                    Node& node = nodes[i];
+                    const auto* str = std::get_if<String*>(&node.key.value);
+                    if (str != nullptr && *str == key)
+                    {
+                        node.value = value;
+                        return;
+                    }
+                    if (node.key.IsNil())
+                        break;
+                }
+            }
+            SetNode(memory, Value(key), value);
+        }
+
+        // 预留数组部分与哈希部分的容量（表构造器据此一次分配到位）
+        void Reserve(Memory& memory, uint32_t arrayCount, uint32_t hashCount)
+        {
+            if (arrayCount > arraySize)
+                GrowArray(memory, arrayCount);
+            if (hashCount > 0 && (nodeUsed + hashCount) > nodeCapacity / 4 * 3)
+                Rehash(memory, arraySize, HashCapacityFor(LiveNodes() + hashCount));
+        }
+
+        // 取长度运算符 # 的结果：返回任意一个边界 n（t[n] 非 nil 且 t[n + 1] 为 nil）
+        uint64_t Length() const
+        {
+            if (arraySize > 0 && array[arraySize - 1].IsNil())
+            {
+                // 数组部分末尾为 nil：二分查找数组内的边界
+                uint32_t lo = 0, hi = arraySize;
+                while (hi - lo > 1)
+                {
+                    uint32_t mid = (lo + hi) / 2;
+                    if (array[mid - 1].IsNil())
+                        hi = mid;
+                    else
+                        lo = mid;
+                }
+                return lo;
+            }
+            if (nodeCapacity == 0 || GetInt(static_cast<int64_t>(arraySize) + 1).IsNil())
+                return arraySize;
+
+            // 边界在哈希部分：先倍增找到一个 nil，再二分
+            uint64_t lo = arraySize + 1, hi = lo * 2;
+            while (!GetInt(static_cast<int64_t>(hi)).IsNil())
+            {
+                lo = hi;
+                if (hi > (UINT64_MAX >> 2))
+                {
+                    // 异常构造的表：退化为线性查找
+                    uint64_t n = 1;
+                    while (!GetInt(static_cast<int64_t>(n)).IsNil())
+                        ++n;
+                    return n - 1;
+                }
+                hi *= 2;
+            }
+            while (hi - lo > 1)
+            {
+                uint64_t mid = (lo + hi) / 2;
+                if (GetInt(static_cast<int64_t>(mid)).IsNil())
+                    hi = mid;
+                else
+                    lo = mid;
+            }
+            return lo;
+        }
+
+        // 遍历：key 为 nil 时取第一项，否则取 key 之后的一项；遍历结束返回 false。
+        // 遍历过程中只允许修改或清除已有的键
+        bool Next(Value& key, Value& value) const
+        {
+            uint32_t index = 0;
+            if (!key.IsNil())
+                index = IndexOf(key) + 1;
+            for (; index < arraySize; ++index)
+            {
+                if (!array[index].IsNil())
+                {
+                    key = Value(static_cast<double>(index + 1));
+                    value = array[index];
+                    return true;
+                }
+            }
+            for (index -= arraySize; index < nodeCapacity; ++index)
+            {
+                if (!nodes[index].value.IsNil())
+                {
+                    key = nodes[index].key;
+                    value = nodes[index].value;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // 释放数组部分与哈希部分，由 Heap 在回收表时调用
+        void Free(Memory& memory)
+        {
+            memory.Free(array, arraySize * sizeof(Value));
+            memory.Free(nodes, nodeCapacity * sizeof(Node));
+            array = nullptr;
+            nodes = nullptr;
+            arraySize = nodeCapacity = nodeUsed = 0;
+        }
+
+        // 可精确表示为 64 位整数的数字按整数键处理，t[1] 与 t[1.0] 是同一个键
+        static bool ToInteger(double d, int64_t& result)
+        {
+            return NumberToInteger(d, result);
+        }
+
+    private:
+        static const Value& Nil()
+        {
+            static const Value nil;
+            return nil;
+        }
+
+        static size_t HashOf(const Value& key)
+        {
+            switch (key.value.index())
+            {
+            case 1: // bool
+                return *std::get_if<bool>(&key.value) ? 1 : 2;
+            case 2: // number
+            {
+                double d = *std::get_if<double>(&key.value);
+                int64_t i;
+                if (ToInteger(d, i))
+                    return static_cast<size_t>(i) * 0x9E3779B97F4A7C15ull >> 16;
+                uint64_t bits = std::bit_cast<uint64_t>(d);
+                return static_cast<size_t>((bits ^ (bits >> 29)) * 0x9E3779B97F4A7C15ull >> 16);
+            }
+            case 3: // String*
+                return (*std::get_if<String*>(&key.value))->hash;
+            default: // 函数与表按地址
+            {
+                const void* p = std::visit([](const auto& v) -> const void* {
+                    if constexpr (std::is_pointer_v<std::decay_t<decltype(v)>>)
+                        return v;
+                    else
+                        return nullptr;
+                }, key.value);
+                return (reinterpret_cast<uintptr_t>(p) >> 4) * 0x9E3779B97F4A7C15ull >> 16;
+            }
+            }
+        }
+
+        const Node* Find(const Value& key) const
+        {
+            if (nodeCapacity == 0)
+                return nullptr;
+            uint32_t mask = nodeCapacity - 1;
+            for (uint32_t i = static_cast<uint32_t>(HashOf(key)) & mask;; i = (i + 1) & mask)
+            {
+                const Node& node = nodes[i];
+                if (node.key.IsNil())
+                    return nullptr;
+                if (node.key == key)
+                    return &node;
+            }
+        }
+
+        // 键在遍历顺序中的位置：数组部分在前，哈希部分在后
+        uint32_t IndexOf(const Value& key) const
+        {
+            int64_t i;
+            if (key.IsNumber() && ToInteger(*std::get_if<double>(&key.value), i) &&
+                static_cast<uint64_t>(i) - 1 < arraySize)
+            {
+                return static_cast<uint32_t>(i - 1);
+            }
+            Value normalized = key;
+            if (key.IsNumber() && ToInteger(*std::get_if<double>(&key.value), i))
+                normalized = Value(static_cast<double>(i));
+            const Node* node = Find(normalized);
+            if (node == nullptr)
+                throw std::runtime_error("传给 'next' 的键无效");
+            return arraySize + static_cast<uint32_t>(node - nodes);
+        }
+
+        // 插入或修改哈希部分中的键（整数键已规范化为整数值的 double）
+        void SetNode(Memory& memory, const Value& key, const Value& value)
+        {
+            flags = 0;
+            if (nodeCapacity != 0)
+            {
+                uint32_t mask = nodeCapacity - 1;
+                Node* dead = nullptr;
+                for (uint32_t i = static_cast<uint32_t>(HashOf(key)) & mask;; i = (i + 1) & mask)
+                {
+                    Node& node = nodes[i];
+                    if (node.key.IsNil())
+                    {
+                        if (value.IsNil())
+                            return;
+                        if (dead != nullptr)
+                        {
+                            // 复用探测链上的第一个死键
+                            dead->key = key;
+                            dead->value = value;
+                            return;
+                        }
+                        if (nodeUsed + 1 <= nodeCapacity / 4 * 3)
+                        {
+                            node.key = key;
+                            node.value = value;
+                            nodeUsed++;
+                            return;
+                        }
+                        break;
+                    }
+                    if (node.key == key)
+                    {
+                        node.value = value;
+                        return;
+                    }
+                    if (dead == nullptr && node.value.IsNil())
+                        dead = &node;
+                }
+            }
+            if (value.IsNil())
+                return;
+
+            // 哈希部分已满：按包括新键在内的全部键重新划分数组部分与哈希部分。
+            // 键和值可能引用本表中的元素，重建前先复制
+            Value keyCopy = key;
+            Value valueCopy = value;
+            Resize(memory, keyCopy);
+            int64_t i;
+            if (keyCopy.IsNumber() && ToInteger(*std::get_if<double>(&keyCopy.value), i))
+                SetInt(memory, i, valueCopy);
+            else
+                SetNode(memory, keyCopy, valueCopy);
+        }
+
+        uint32_t LiveNodes() const
+        {
+            uint32_t count = 0;
+            for (uint32_t i = 0; i < nodeCapacity; ++i)
+            {
+                if (!nodes[i].value.IsNil())
+                    count++;
+            }
+            return count;
+        }
+
+        static uint32_t HashCapacityFor(uint32_t count)
+        {
+            if (count == 0)
+                return 0;
+            uint32_t capacity = 4;
+            while (capacity / 4 * 3 < count)
+                capacity *= 2;
+            return capacity;
+        }
+
+        static void CountIntegerKey(const Value& key, uint32_t (&nums)[32], uint32_t& total)
+        {
+            int64_t i;
+            if (key.IsNumber() && ToInteger(*std::get_if<double>(&key.value), i) && i >= 1 && i <= (int64_t(1) << 30))
+            {
+                nums[std::bit_width(static_cast<uint64_t>(i - 1))]++;
+                total++;
+            }
+        }
+
+        // 与 Lua 5.4 的 computesizes 相同：取最大的 2^n，使 1..2^n 中超过一半的位置被使用
+        static uint32_t ComputeArraySize(const uint32_t (&nums)[32], uint32_t& inArray)
+        {
+            uint32_t count = 0, optimal = 0;
+            inArray = 0;
+            for (uint32_t i = 0, twoToI = 1; i < 31; ++i, twoToI *= 2)
+            {
+                count += nums[i];
+                if (count > twoToI / 2)
+                {
+                    optimal = twoToI;
+                    inArray = count;
+                }
+            }
+            return optimal;
+        }
+
+        void Resize(Memory& memory, const Value& extraKey)
+        {
+            uint32_t nums[32] = {};
+            uint32_t integerKeys = 0;
+            uint32_t total = 1;
+            for (uint32_t i = 0; i < arraySize; ++i)
+            {
+                if (!array[i].IsNil())
+                {
+                    nums[std::bit_width(static_cast<uint64_t>(i))]++;
+                    integerKeys++;
+                    total++;
+                }
+            }
+            for (uint32_t i = 0; i < nodeCapacity; ++i)
+            {
+                if (!nodes[i].value.IsNil())
+                {
+                    CountIntegerKey(nodes[i].key, nums, integerKeys);
+                    total++;
+                }
+            }
+            CountIntegerKey(extraKey, nums, integerKeys);
+
+            uint32_t inArray;
+            uint32_t newArraySize = ComputeArraySize(nums, inArray);
+            Rehash(memory, std::max(newArraySize, arraySize), HashCapacityFor(total - inArray));
+        }
+
+        // 扩大数组部分，并把哈希部分中落入新范围的整数键迁移过去
+        void GrowArray(Memory& memory, uint32_t size)
+        {
+            uint32_t old = arraySize;
+            array = static_cast<Value*>(memory.Reallocate(array, old * sizeof(Value), size * sizeof(Value)));
+            for (uint32_t i = old; i < size; ++i)
+                new (&array[i]) Value();
+            arraySize = size;
+            for (uint32_t i = 0; i < nodeCapacity; ++i)
+            {
+                Node& node = nodes[i];
+                int64_t k;
+                if (!node.value.IsNil() && node.key.IsNumber() &&
+                    ToInteger(*std::get_if<double>(&node.key.value), k) && k > old && k <= size)
+                {
+                    array[k - 1] = node.value;
+                    node.value = Value();   // 留下死键，保持探测链完整
+                }
+            }
+        }
+
+        void Rehash(Memory& memory, uint32_t newArraySize, uint32_t newCapacity)
+        {
+            Node* oldNodes = nodes;
+            uint32_t oldCapacity = nodeCapacity;
+            Node* fresh = nullptr;
+            if (newCapacity > 0)
+            {
+                fresh = static_cast<Node*>(memory.Allocate(newCapacity * sizeof(Node)));
+                for (uint32_t i = 0; i < newCapacity; ++i)
+                    new (&fresh[i]) Node();
+            }
+            if (newArraySize > arraySize)
+            {
+                try
+                {
+                    array = static_cast<Value*>(memory.Reallocate(array, arraySize * sizeof(Value), newArraySize * sizeof(Value)));
+                }
+                catch (...)
+                {
+                    memory.Free(fresh, newCapacity * sizeof(Node));
+                    throw;
+                }
+                for (uint32_t i = arraySize; i < newArraySize; ++i)
+                    new (&array[i]) Value();
+                arraySize = newArraySize;
+            }
+
+            nodes = fresh;
+            nodeCapacity = newCapacity;
+            nodeUsed = 0;
+            for (uint32_t i = 0; i < oldCapacity; ++i)
+            {
+                const Node& node = oldNodes[i];
+                if (node.value.IsNil())
+                    continue;
+                int64_t k;
+                if (node.key.IsNumber() && ToInteger(*std::get_if<double>(&node.key.value), k) &&
+                    static_cast<uint64_t>(k) - 1 < arraySize)
+                {
+                    array[k - 1] = node.value;
+                    continue;
+                }
+                Insert(node.key, node.value);
+            }
+            memory.Free(oldNodes, oldCapacity * sizeof(Node));
+        }
+
+        // 重建时插入：调用方保证容量足够且键不存在
+        void Insert(const Value& key, const Value& value)
+        {
+            uint32_t mask = nodeCapacity - 1;
+            uint32_t i = static_cast<uint32_t>(HashOf(key)) & mask;
+            while (!nodes[i].key.IsNil())
+                i = (i + 1) & mask;
+            nodes[i].key = key;
+            nodes[i].value = value;
+            nodeUsed++;
+        }
+    };
+}
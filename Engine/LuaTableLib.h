@@ -0,0 +1,456 @@
+﻿#pragma once
+
+#include "LuaLibrary.h"
+#include "LuaTable.h"
+
+#include <algorithm>
+#include <bit>
+#include <vector>
+
+namespace Engine
+{
+    // 内省排序：快速排序，递归过深时改用堆排序，小区间用插入排序。
+    // Seq 提供 Get(i) 与 Swap(i, j)，下标从 0 开始；元素只通过交换移动，
+    // 排序过程中每个元素始终留在序列里（比较函数触发回收时不会丢失元素）。
+    // 与 Lua 的 auxsort 相同，分区越界说明比较函数不满足严格弱序，此时报错而不是越界访问
+    template <typename Seq, typename Less>
+    class IntroSort
+    {
+    public:
+        static constexpr size_t InsertionThreshold = 12;
+
+        IntroSort(Seq& seq, Less& less) : seq(seq), less(less) { }
+
+        void Sort(size_t n)
+        {
+            if (n > 1)
+                Sort(0, n - 1, 2 * static_cast<int>(std::bit_width(n)));
+        }
+
+    private:
+        Seq& seq;
+        Less& less;
+
+        [[noreturn]] static void InvalidOrder()
+        {
+            throw std::runtime_error("排序的比较函数无效");
+        }
+
+        bool LessAt(size_t i, size_t j)
+        {
+            return less(seq.Get(i), seq.Get(j));
+        }
+
+        // 排序闭区间 [lo, up]
+        void Sort(size_t lo, size_t up, int depth)
+        {
+            while (up - lo >= InsertionThreshold)
+            {
+                if (depth-- == 0)
+                {
+                    HeapSort(lo, up);
+                    return;
+                }
+                // 三数取中保证 p 落在 (lo, up) 内；递归处理较短的一侧，较长的一侧继续循环
+                size_t p = Partition(lo, up);
+                if (p - lo < up - p)
+                {
+                    Sort(lo, p - 1, depth);
+                    lo = p + 1;
+                }
+                else
+                {
+                    Sort(p + 1, up, depth);
+                    up = p - 1;
+                }
+            }
+            InsertionSort(lo, up);
+        }
+
+        size_t Partition(size_t lo, size_t up)
+        {
+            size_t mid = lo + (up - lo) / 2;
+            if (LessAt(up, lo))
+                seq.Swap(lo, up);
+            if (LessAt(mid, lo))
+                seq.Swap(mid, lo);
+            else if (LessAt(up, mid))
+                seq.Swap(mid, up);
+            // a[lo] <= P <= a[up]，主元放到 up - 1，两端作为哨兵
+            seq.Swap(mid, up - 1);
+            auto pivot = seq.Get(up - 1);
+            size_t i = lo;
+            size_t j = up - 1;
+            while (true)
+            {
+                while (less(seq.Get(++i), pivot))
+                {
+                    if (i == up - 1)
+                        InvalidOrder();
+                }
+                while (less(pivot, seq.Get(--j)))
+                {
+                    if (j < i)
+                        InvalidOrder();
+                }
+                if (j < i)
+                    break;
+                seq.Swap(i, j);
+            }
+            seq.Swap(up - 1, i);
+            return i;
+        }
+
+        void InsertionSort(size_t lo, size_t up)
+        {
+            for (size_t i = lo + 1; i <= up; ++i)
+            {
+                for (size_t j = i; j > lo && LessAt(j, j - 1); --j)
+                    seq.Swap(j, j - 1);
+            }
+        }
+
+        void HeapSort(size_t lo, size_t up)
+        {
+            size_t n = up - lo + 1;
+            for (size_t i = n / 2; i-- > 0;)
+                SiftDown(lo, i, n);
+            for (size_t end = n - 1; end > 0; --end)
+            {
+                seq.Swap(lo, lo + end);
+                SiftDown(lo, 0, end);
+            }
+        }
+
+        void SiftDown(size_t lo, size_t root, size_t n)
+        {
+            while (true)
+            {
+                size_t child = 2 * root + 1;
+                if (child >= n)
+                    return;
+                if (child + 1 < n && LessAt(lo + child, lo + child + 1))
+                    ++child;
+                if (!LessAt(lo + root, lo + child))
+                    return;
+                seq.Swap(lo + root, lo + child);
+                root = child;
+            }
+        }
+    };
+
+    // 原生 table 库。元素都在数组部分时直接操作数组，否则按整数键逐个读写
+    class TableLibrary : public NativeLibrary
+    {
+    public:
+        // 没有比较函数时 sort 使用的 < 运算，由 VM 提供
+        using LessThan = std::function<bool(const Value&, const Value&)>;
+
+        TableLibrary(Heap& heap, Caller call, LessThan lessThan)
+            : NativeLibrary(heap, std::move(call)), lessThan(std::move(lessThan)),
+              numbers(HeapAllocator<double>(heap.GetMemory())), strings(HeapAllocator<String*>(heap.GetMemory()))
+        { }
+
+        // 创建 table 库表
+        Table* Open()
+        {
+            Table* lib = heap.NewTable(0, 8);
+            auto add = [&](std::string_view name, Value::function fn) { AddFunction(lib, name, std::move(fn)); };
+            add("insert", [this](std::span<const Value> args) { return Insert(args); });
+            add("remove", [this](std::span<const Value> args) { return Remove(args); });
+            add("move", [this](std::span<const Value> args) { return Move(args); });
+            add("concat", [this](std::span<const Value> args) { return Concat(args); });
+            add("sort", [this](std::span<const Value> args) { return Sort(args); });
+            add("pack", [this](std::span<const Value> args) { return Pack(args); });
+            AddFunction(lib, "unpack", [this](std::span<const Value> args, Results& results) { Unpack(args, results); });
+            return lib;
+        }
+
+    private:
+        LessThan lessThan;
+        std::vector<double, HeapAllocator<double>> numbers;     // sort 快速路径的键
+        std::vector<String*, HeapAllocator<String*>> strings;
+
+        // 整数键 [first, last] 都在数组部分时返回 first 对应的元素
+        static Value* ArrayRange(Table* table, int64_t first, int64_t last)
+        {
+            if (first >= 1 && first <= last && static_cast<uint64_t>(last) <= table->arraySize)
+                return table->array + (first - 1);
+            return nullptr;
+        }
+
+        // table.insert(t, v) 追加到末尾；table.insert(t, pos, v) 插入到 pos，其后的元素后移
+        Value Insert(std::span<const Value> args)
+        {
+            Table* table = CheckTable(args, 0, "insert");
+            Memory& memory = heap.GetMemory();
+            int64_t e = static_cast<int64_t>(table->Length()) + 1;
+            switch (args.size())
+            {
+            case 2:
+                table->SetInt(memory, e, args[1]);
+                return Value();
+            case 3:
+            {
+                int64_t pos = CheckInteger(args, 1, "insert");
+                if (static_cast<uint64_t>(pos) - 1 >= static_cast<uint64_t>(e))
+                    ArgError(1, "insert", "位置超出范围");
+                const Value value = args[2];
+                if (pos < e)
+                {
+                    // 先写入新的末尾元素（可能扩大数组部分），再整体后移 [pos, e - 2]
+                    table->SetInt(memory, e, table->GetInt(e - 1));
+                    if (Value* array = ArrayRange(table, pos, e - 1))
+                    {
+                        std::move_backward(array, array + (e - 1 - pos), array + (e - pos));
+                    }
+                    else
+                    {
+                        for (int64_t i = e - 1; i > pos; --i)
+                            table->SetInt(memory, i, table->GetInt(i - 1));
+                    }
+                }
+                table->SetInt(memory, pos, value);
+                return Value();
+            }
+            default:
+                throw std::runtime_error("'insert' 的参数个数错误");
+            }
+        }
+
+        // 移除并返回 t[pos]（默认为最后一个元素），其后的元素前移
+        Value Remove(std::span<const Value> args)
+        {
+            Table* table = CheckTable(args, 0, "remove");
+            Memory& memory = heap.GetMemory();
+            int64_t size = static_cast<int64_t>(table->Length());
+            int64_t pos = OptInteger(args, 1, "remove", size);
+            // 与 Lua 相同，pos 可以是 size + 1；表为空时还可以是 0
+            if (args.size() > 1 && pos != size && static_cast<uint64_t>(pos) - 1 > static_cast<uint64_t>(size))
+                ArgError(1, "remove", "位置超出范围");
+            Value result = table->GetInt(pos);
+            if (Value* array = ArrayRange(table, pos, size))
+            {
+                std::move(array + 1, array + (size - pos + 1), array);
+                pos = size;
+            }
+            for (; pos < size; ++pos)
+                table->SetInt(memory, pos, table->GetInt(pos + 1));
+            table->SetInt(memory, pos, Value());
+            return result;
+        }
+
+        // table.move(a1, f, e, t [, a2])：a2[t..] = a1[f..e]，返回 a2
+        Value Move(std::span<const Value> args)
+        {
+            Table* source = CheckTable(args, 0, "move");
+            int64_t f = CheckInteger(args, 1, "move");
+            int64_t e = CheckInteger(args, 2, "move");
+            int64_t t = CheckInteger(args, 3, "move");
+            Table* target = args.size() > 4 && !args[4].IsNil() ? CheckTable(args, 4, "move") : source;
+            if (e < f)
+                return Value(target);
+            if (f <= 0 && e >= INT64_MAX + f)
+                ArgError(2, "move", "要移动的元素过多");
+            int64_t count = e - f;  // 元素个数减一
+            if (t > INT64_MAX - count)
+                ArgError(3, "move", "目标位置回绕");
+
+            Memory& memory = heap.GetMemory();
+            Value* from = ArrayRange(source, f, e);
+            Value* to = ArrayRange(target, t, t + count);
+            bool forward = t > e || t <= f || source != target;
+            if (from != nullptr && to != nullptr)
+            {
+                if (forward)
+                    std::copy(from, from + count + 1, to);
+                else
+                    std::copy_backward(from, from + count + 1, to + count + 1);
+            }
+            else if (forward)
+            {
+                for (int64_t i = 0; i <= count; ++i)
+                    target->SetInt(memory, t + i, source->GetInt(f + i));
+            }
+            else
+            {
+                for (int64_t i = count; i >= 0; --i)
+                    target->SetInt(memory, t + i, source->GetInt(f + i));
+            }
+            return Value(target);
+        }
+
+        // table.pack(...)：全部参数依次存入新表，字段 n 为参数个数
+        Value Pack(std::span<const Value> args)
+        {
+            Memory& memory = heap.GetMemory();
+            Table* table = heap.NewTable(static_cast<uint32_t>(args.size()), 1);
+            for (size_t i = 0; i < args.size(); ++i)
+                table->SetInt(memory, static_cast<int64_t>(i) + 1, args[i]);
+            table->SetStr(memory, heap.NewString("n"), Value(static_cast<double>(args.size())));
+            return Value(table);
+        }
+
+        // table.unpack(t [, i [, j]])：依次返回 t[i..j]，结果直接压在调用方的栈上
+        void Unpack(std::span<const Value> args, Results& results)
+        {
+            Table* table = CheckTable(args, 0, "unpack");
+            int64_t i = OptInteger(args, 1, "unpack", 1);
+            int64_t j = args.size() > 2 && !args[2].IsNil() ? CheckInteger(args, 2, "unpack") : static_cast<int64_t>(table->Length());
+            if (i > j)
+                return;
+            if (static_cast<uint64_t>(j) - static_cast<uint64_t>(i) >= UINT32_MAX)
+                throw std::runtime_error("'unpack' 返回的值过多");
+            for (int64_t k = i;; ++k)
+            {
+                results.Push(table->GetInt(k));
+                if (k == j)
+                    break;
+            }
+        }
+
+        // table.concat(t [, sep [, i [, j]]])。先算出结果的总长度，在缓冲区中一次预留后拼接
+        Value Concat(std::span<const Value> args)
+        {
+            Table* table = CheckTable(args, 0, "concat");
+            char sepScratch[NumberBufferSize];
+            std::string_view sep = args.size() > 1 && !args[1].IsNil() ? CheckString(args, 1, "concat", sepScratch) : std::string_view();
+            int64_t i = OptInteger(args, 2, "concat", 1);
+            int64_t j = args.size() > 3 && !args[3].IsNil() ? CheckInteger(args, 3, "concat") : static_cast<int64_t>(table->Length());
+            if (i > j)
+                return Value(heap.NewString(""));
+
+            char scratch[NumberBufferSize];
+            size_t total = 0;
+            for (int64_t k = i;; ++k)
+            {
+                total += Element(table, k, scratch).size();
+                if (k == j)
+                    break;
+                total += sep.size();
+            }
+            if (total > UINT32_MAX)
+                throw std::runtime_error("结果字符串过长");
+
+            buffer.clear();
+            buffer.reserve(total);
+            for (int64_t k = i;; ++k)
+            {
+                buffer.append(Element(table, k, scratch));
+                if (k == j)
+                    break;
+                buffer.append(sep);
+            }
+            return Value(heap.NewString(buffer));
+        }
+
+        static std::string_view Element(const Table* table, int64_t k, char (&scratch)[NumberBufferSize])
+        {
+            const Value& value = table->GetInt(k);
+            if (auto* str = std::get_if<String*>(&value.value))
+                return (*str)->View();
+            if (value.IsNumber())
+                return value.ToStringView(scratch);
+            throw std::runtime_error("'concat' 的表中索引 " + std::to_string(k) + " 处的值无效（为 " + value.TypeName() + "）");
+        }
+
+        // 连续存放的同类型键，快速路径使用
+        template <typename T>
+        struct RawSeq
+        {
+            T* data;
+            const T& Get(size_t i) const { return data[i]; }
+            void Swap(size_t i, size_t j) { std::swap(data[i], data[j]); }
+        };
+
+        // 按整数键读写表，比较函数可能修改表，每次访问都重新查找
+        struct TableSeq
+        {
+            Table* table;
+            Memory& memory;
+            Value Get(size_t i) const { return table->GetInt(static_cast<int64_t>(i) + 1); }
+            void Swap(size_t i, size_t j)
+            {
+                Value a = Get(i);
+                Value b = Get(j);
+                table->SetInt(memory, static_cast<int64_t>(i) + 1, b);
+                table->SetInt(memory, static_cast<int64_t>(j) + 1, a);
+            }
+        };
+
+        // 没有比较函数且元素全为数字或全为字符串时，把键取到连续的缓冲区中排序后写回，
+        // 不经过 Value 的类型分派；否则按整数键原地排序，逐次调用比较函数或 < 运算
+        Value Sort(std::span<const Value> args)
+        {
+            Table* table = CheckTable(args, 0, "sort");
+            uint64_t length = table->Length();
+            if (length >= INT32_MAX)
+                ArgError(0, "sort", "数组过大");
+            size_t n = static_cast<size_t>(length);
+            bool hasComparator = args.size() > 1 && !args[1].IsNil();
+            if (hasComparator && args[1].Type() != ValueType::Function && args[1].Type() != ValueType::Closure)
+                TypeError(args, 1, "sort", "function");
+            if (n < 2)
+                return Value();
+
+            if (!hasComparator && n <= table->arraySize && SortArray(table->array, n))
+                return Value();
+
+            TableSeq seq{ table, heap.GetMemory() };
+            if (hasComparator)
+            {
+                // 比较函数的参数在调用期间位于 VM 栈上，主元不会在比较过程中被回收
+                const Value comparator = args[1];
+                auto less = [&](const Value& a, const Value& b) {
+                    Value pair[2] = { a, b };
+                    return !call(comparator, pair).IsFalsy();
+                };
+                IntroSort<TableSeq, decltype(less)>(seq, less).Sort(n);
+            }
+            else
+            {
+                IntroSort<TableSeq, const LessThan>(seq, lessThan).Sort(n);
+            }
+            return Value();
+        }
+
+        bool SortArray(Value* array, size_t n)
+        {
+            if (array[0].IsNumber())
+            {
+                numbers.clear();
+                for (size_t i = 0; i < n; ++i)
+                {
+                    const double* number = std::get_if<double>(&array[i].value);
+                    if (number == nullptr)
+                        return false;
+                    numbers.push_back(*number);
+                }
+                RawSeq<double> seq{ numbers.data() };
+                auto less = [](double a, double b) { return a < b; };
+                IntroSort<RawSeq<double>, decltype(less)>(seq, less).Sort(n);
+                for (size_t i = 0; i < n; ++i)
+                    array[i] = Value(numbers[i]);
+                return true;
+            }
+            if (std::holds_alternative<String*>(array[0].value))
+            {
+                strings.clear();
+                for (size_t i = 0; i < n; ++i)
+                {
+                    auto* str = std::get_if<String*>(&array[i].value);
+                    if (str == nullptr)
+                        return false;
+                    strings.push_back(*str);
+                }
+                RawSeq<String*> seq{ strings.data() };
+                auto less = [](const String* a, const String* b) { return a->View() < b->View(); };
+                IntroSort<RawSeq<String*>, decltype(less)>(seq, less).Sort(n);
+                for (size_t i = 0; i < n; ++i)
+                    array[i] = Value(strings[i]);
+                return true;
+            }
+            return false;
+        }
+    };
+}
@@ -1,85 +1,3028 @@
 ﻿#pragma once
 
 #include "LuaState.h"
+#include "LuaHeap.h"
 #include "LuaParser.h"
+#include "LuaOutput.h"
+#include "LuaStringLib.h"
+#include "LuaTableLib.h"
+#include "LuaSnapshot.h"
+#include "LuaStats.h"
+#include "LuaReload.h"
+#include "LuaFFI.h"
+
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
 
 namespace Engine
 {
+    // 指令特化的统计，按特化指令的操作码索引
+    struct QuickeningStats
+    {
+        std::array<uint64_t, OpCodeCount> specialized{};    // 泛型指令被改写为该特化指令的次数
+        std::array<uint64_t, OpCodeCount> hits{};           // 守卫成立、按特化路径执行的次数
+        std::array<uint64_t, OpCodeCount> misses{};         // 守卫失败、改写回泛型指令的次数
+
+        double HitRate(OpCode op) const
+        {
+            uint64_t total = hits[static_cast<size_t>(op)] + misses[static_cast<size_t>(op)];
+            return total == 0 ? 0.0 : static_cast<double>(hits[static_cast<size_t>(op)]) / static_cast<double>(total);
+        }
+    };
+
+    // 当前代码块中函数的编译情况（不含主代码块）
+    struct LazyStats
+    {
+        uint32_t functions = 0;     // 函数总数，尚未编译的函数体中定义的函数也计入
+        uint32_t compiled = 0;      // 已编译的函数：加载时立即编译的，加上首次调用时编译的
+        uint32_t lazyCompiled = 0;  // 其中首次调用时才编译的
+
+        uint32_t NeverCompiled() const { return functions - compiled; }
+    };
+
+    // Execute / Resume 的结果
+    enum class ExecuteStatus
+    {
+        Finished,   // 执行完毕
+        Yielded,    // 预算耗尽或收到中断请求后挂起，可以之后 Resume
+    };
+
+    // 预算耗尽或收到中断请求时的处理方式
+    enum class BudgetAction
+    {
+        Error,      // 抛出 RuntimeError，脚本的帧全部清理（与普通运行期错误相同）
+        Yield,      // 挂起并返回宿主，保留全部帧与执行位置
+    };
+
+    // 最近一次因预算或中断而停止的原因
+    enum class StopReason
+    {
+        None,
+        Budget,
+        Interrupt,
+    };
+
+    // 寄存器式虚拟机。每个脚本函数调用占用栈上一段连续的寄存器（帧），
+    // 脚本函数之间的调用只压入一个 CallFrame，不占用 C++ 调用栈；
+    // 只有原生函数经由 VM::Call 回调脚本时才会嵌套执行 Run
     class VM
     {
     public:
-        explicit VM(const std::string& lua)
-            : fileStream(lua), parser(fileStream)
+        static constexpr size_t InitialStackSize = 256;
+        static constexpr size_t MaxStackSize = 1000000;    // 栈槽数上限，超出时报告栈溢出
+        static constexpr size_t MaxFrames = 200000;        // 调用深度上限
+        static constexpr size_t MaxNesting = 200;          // 原生函数与脚本互相调用的嵌套层数上限
+        static constexpr uint8_t QuickenThreshold = 8;     // 泛型指令连续观察到同一种情形多少次后特化
+        static constexpr size_t MaxTagLoop = 2000;         // __index、__newindex、__call 链的最大长度
+        static constexpr uint32_t InterruptCheckInterval = 1024;  // 不限预算时每隔多少个检查点查看一次中断请求
+
+        // 不加载脚本，之后通过 LoadBuffer / DoString / ExecuteStream 执行代码。
+        // VM 的全部内存（字符串、表、函数与闭包、字节码、栈、输出缓冲区）
+        // 都经由 alloc 分配，默认使用 realloc / free
+        explicit VM(AllocFunction alloc = DefaultAlloc, void* userData = nullptr)
+            : heap(alloc, userData)
+        {
+            Init();
+        }
+
+        explicit VM(const std::string& lua, AllocFunction alloc = DefaultAlloc, void* userData = nullptr)
+            : heap(alloc, userData)
         {
+            Init();
+            std::ifstream fileStream(lua);
             if (!fileStream.is_open())
                 throw std::runtime_error("无法打开脚本文件：" + lua);
-            context = parser.Parse();
-            sp = 0;
+            Parser parser(fileStream, heap, lua, chunk, options);
+            parser.ParseChunk();
         }
 
-        void Execute()
+        // print 等内置函数持有指向本 VM 的指针，不允许拷贝
+        VM(const VM&) = delete;
+        VM& operator=(const VM&) = delete;
+
+        // 与 Lua 关闭状态时相同，析构前依次调用全部尚未执行的 __gc
+        ~VM()
         {
             try
             {
-                for(size_t ip = 0; ip < context.Operations.size(); ++ip)
-                {
-                    const auto& op = context.Operations[ip];
-                    std::cout << "Executing op " << (int)op.opCode << ", sp=" << sp << std::endl;
-                    switch (op.opCode)
-                    {
-                    case OpCode::Exit:
+                heap.FinalizeAll();
+                RunFinalizers();
+            }
+            catch (...)
+            {
+            }
+            try
+            {
+                output.Flush();
+            }
+            catch (...)
+            {
+            }
+        }
+
+        // 之后的编译使用的优化选项（已加载的代码块不受影响）
+        void SetCompileOptions(const CompileOptions& compileOptions)
+        {
+            options = compileOptions;
+        }
+
+        const CompileOptions& GetCompileOptions() const { return options; }
+
+        // 指令特化（默认开启）：执行中把观察到稳定操作数类型的泛型指令原地改写为特化指令
+        // （两个数字的算术与比较、带内联缓存的字段与全局变量读写、区分原生函数与脚本函数的调用），
+        // 类型变化时由守卫改写回泛型指令。关闭时当前代码块中已特化的指令全部还原
+        void SetQuickening(bool enabled)
+        {
+            quickening = enabled;
+            if (!enabled)
+                Dequicken(*chunk);
+        }
+
+        bool QuickeningEnabled() const { return quickening; }
+
+        // 各特化指令的改写、命中与失败次数
+        const QuickeningStats& GetQuickeningStats() const { return quickStats; }
+
+        void ResetQuickeningStats() { quickStats = {}; }
+
+        // 执行统计：各操作码（含特化指令）的执行次数、脚本与原生函数的调用次数、内存分配、
+        // 回收次数与停顿时间、字符串驻留的命中次数，以及开启硬件计数器后 Execute 期间的硬件计数
+        ExecutionStats Stats() const
+        {
+            ExecutionStats stats;
+            stats.instructions = executed;
+            stats.luaCalls = luaCalls;
+            stats.nativeCalls = nativeCalls;
+            stats.memory = heap.GetMemory().Stats();
+            stats.heap = heap.Stats();
+            stats.hardware = hardware;
+            return stats;
+        }
+
+        void ResetStats()
+        {
+            executed = {};
+            luaCalls = 0;
+            nativeCalls = 0;
+            hardware = {};
+            hardware.available = perf != nullptr && perf->Available();
+            heap.ResetStats();
+        }
+
+        // 开启后每次 Execute 都用 perf_event_open 统计周期数、指令数、分支预测失败与缓存未命中（只计用户态）。
+        // 仅 Linux 可用，内核不允许（如 perf_event_paranoid 过高）时 Stats().hardware.available 为 false
+        void SetHardwareCounters(bool enabled)
+        {
+            if (!enabled)
+                perf.reset();
+            else if (perf == nullptr)
+                perf = std::make_unique<PerfCounters>();
+            hardware.available = perf != nullptr && perf->Available();
+        }
+
+        // 当前加载的主函数原型
+        const Proto& Chunk() const { return *chunk; }
+
+        // 当前代码块中的函数有多少已经编译、多少从未编译（延迟编译时从未调用过的函数）
+        LazyStats GetLazyStats() const
+        {
+            LazyStats stats;
+            CountFunctions(*chunk, stats);
+            stats.functions--;
+            stats.compiled--;
+            return stats;
+        }
+
+        // 从内存编译一段脚本，替换当前加载的代码块；不读磁盘，也不复制源码。
+        // 字节码、常量与行号写入 VM 已有的主函数原型，编译失败时代码块被清空。
+        // 开启延迟编译（CompileOptions::lazyCompilation）时保留一份源码，函数体在首次调用时从中编译
+        void LoadBuffer(std::string_view source, std::string_view chunkName = "string")
+        {
+            CheckNotSuspended();
+            MemoryBuffer buffer(source);
+            std::istream input(&buffer);
+            Parser parser(input, heap, chunkName, chunk, options);
+            parser.UseScratch(parserScratch);
+            if (options.lazyCompilation)
+                parser.DeferFunctions(heap.NewString(source));
+            chunkOptions = options;
+            try
+            {
+                parser.ParseChunk();
+            }
+            catch (...)
+            {
+                ClearChunk();
+                throw;
+            }
+        }
+
+        // 从内存加载并立即执行一段脚本
+        ExecuteStatus DoString(std::string_view source, std::string_view chunkName = "string")
+        {
+            LoadBuffer(source, chunkName);
+            return Execute();
+        }
+
+        // 热重载：按函数比较新源码与已加载的代码块，只重新编译并替换改变了的函数。
+        // 新源码只编译主代码块，其余函数体先做预扫描，与已加载的函数体源码相同的不再编译（见 ProtoDiff）。
+        // 现有闭包改为执行新的函数原型（上值原样沿用），全局变量、表与上值都保持不变，主代码块不重新执行；
+        // 未改变的函数保留原型，已特化的指令与内联缓存不需要重新预热。之后 Execute 执行的是新的主代码块。
+        // 编译失败时抛出异常，已加载的代码块不受影响。只能在没有脚本执行或挂起时调用
+        ReloadResult Reload(std::string_view source, std::string_view chunkName = "string")
+        {
+            CheckIdle("热重载");
+            CompileOptions reloadOptions = options;
+            reloadOptions.lazyCompilation = true;
+            MemoryBuffer buffer(source);
+            std::istream input(&buffer);
+            Proto* fresh = heap.NewProto();
+            Parser parser(input, heap, chunkName, fresh, reloadOptions);
+            parser.DeferFunctions(heap.NewString(source));
+            parser.ParseChunk();
+
+            // 编译选项与加载时不同时，源码相同的函数编译结果也可能不同
+            CompileOptions loadedOptions = chunkOptions;
+            loadedOptions.lazyCompilation = true;
+            ProtoDiff diff(heap, reloadOptions, loadedOptions == reloadOptions);
+            Proto* merged = diff.Merge(chunk, fresh);
+            // 没有开启延迟编译时，换上的新函数同样立即编译
+            if (!options.lazyCompilation)
+                CompileTree(*merged, options);
+            diff.Commit();
+            chunkOptions = options;
+            if (merged == fresh)
+            {
+                // mainClosure 固定引用 chunk，主代码块改变时把新内容换进 chunk
+                diff.Replaced().erase(chunk);
+                SwapContents(*chunk, *fresh);
+            }
+
+            ReloadResult& result = diff.Result();
+            if (!diff.Replaced().empty())
+            {
+                heap.ForEachObject([&](GCObject* object) {
+                    if (object->type != ObjectType::Closure)
                         return;
-                    case OpCode::LoadConst:
+                    auto* closure = static_cast<Closure*>(object);
+                    auto found = diff.Replaced().find(closure->proto);
+                    if (found == diff.Replaced().end())
+                        return;
+                    if (ProtoDiff::SameUpvalues(*closure->proto, *found->second))
                     {
-                        uint32_t constIdx = op.args[0];
-                        context.stack[sp] = context.Constants[constIdx];
-                        sp++;
-                        break;
+                        closure->proto = found->second;
+                        result.closuresUpdated++;
                     }
-                    case OpCode::LoadGlobal:
+                    else
                     {
-                        uint32_t globalIdx = op.args[0];
-                        auto key = static_cast<std::string>(context.Constants[globalIdx]);
-                        auto fun = context.Globals[key];
-                        context.stack[sp] = fun;
-                        sp++;
-                        break;
+                        result.closuresSkipped++;
                     }
-                    case OpCode::Call:
+                    });
+            }
+            // 被替换的旧原型与未采用的新原型都成了垃圾，反复重载时不让它们堆积
+            if (heap.NeedsCollection())
+                CollectGarbage();
+            return result;
+        }
+
+        // 将虚拟机恢复到干净的初始状态：卸载代码块、清空栈并关闭全部上值，
+        // 脚本创建的全局变量被清除，内置函数与宿主注册的函数恢复原值；
+        // 内置库表（string、table、ffi）与字符串元表的字段及元表也恢复原样（只恢复库表自身的字段），
+        // 一个请求对库的修改不会带进下一个请求。
+        // 栈、主函数原型的缓冲区与全局变量表的节点都原样保留（被清除的全局变量留下死键，
+        // 同名变量再次赋值时直接复用），因此同一个 VM 上反复 Reset + DoString 处理不定义函数、
+        // 不创建表的请求脚本时，VM 自身不再产生新的内存分配。脚本中的函数原型、闭包与表
+        // 仍在每次执行时新建，由垃圾回收释放。
+        void Reset()
+        {
+            DiscardExecution();
+
+            Memory& memory = heap.GetMemory();
+            RestoreFields(memory, globals, baseline);
+            bool librariesChanged = false;
+            Value lib, copy;
+            while (libraries->Next(lib, copy))
+            {
+                Table* table = *std::get_if<Table*>(&lib.value);
+                const Table* original = *std::get_if<Table*>(&copy.value);
+                librariesChanged |= RestoreFields(memory, table, original);
+                if (table->metatable != original->metatable)
+                {
+                    table->metatable = original->metatable;
+                    librariesChanged = true;
+                }
+            }
+            // 恢复时没有经过 NoteWrite，改动过的库表可能在 __index 链的内联缓存中
+            if (librariesChanged)
+                ++metaEpoch;
+        }
+
+        // 执行当前加载的代码块。设置了预算且按 Yield 处理时可能在执行完之前返回 Yielded
+        ExecuteStatus Execute()
+        {
+            if (suspended)
+                throw std::runtime_error("脚本已挂起，须先 Resume 或 Reset");
+            if (chunk->code.empty())
+            {
+                AutoFlush();
+                return ExecuteStatus::Finished;
+            }
+            interruptRequested.store(false, std::memory_order_relaxed);
+            return RunSlice([this] {
+                EnsureStack(1);
+                stack[0] = Value(mainClosure);
+                PushFrame(mainClosure, 0);
+            });
+        }
+
+        // 从挂起的位置继续执行，预算重新计算；可以再次挂起
+        ExecuteStatus Resume()
+        {
+            if (!suspended)
+                throw std::runtime_error("没有挂起的脚本");
+            suspended = false;
+            ++metamethodCalls;  // 挂起期间宿主可能修改了任何值，循环中外提的读取须重新进行
+            interruptRequested.store(false, std::memory_order_relaxed);
+            return RunSlice([] {});
+        }
+
+        bool Suspended() const { return suspended; }
+
+        // 执行预算：每次 Execute / Resume（以及不在执行中时宿主的每次 Call）最多经过 checkpoints 个检查点（向后跳转与函数调用，
+        // 循环的每一轮与每次调用各计一次），用尽后按 action 报错或挂起；0 表示不限制。
+        // 计数只在检查点递减，直线执行的指令不受影响，因此预算是执行量的近似上界而不是精确的指令数。
+        // 原生函数回调脚本（如 table.sort 的比较函数）期间不能挂起，推迟到回到最外层后的第一个检查点；
+        // 流式执行与宿主直接 Call 时无法挂起，一律按 Error 处理
+        void SetBudget(uint64_t checkpoints, BudgetAction action = BudgetAction::Error)
+        {
+            budget = checkpoints;
+            budgetAction = action;
+        }
+
+        // 请求中断正在进行的执行（可以从其他线程调用），在下一次查看中断请求时按预算的 action 报错或挂起。
+        // 不限预算时最多经过 InterruptCheckInterval 个检查点才会查看；每次 Execute / Resume 开始时清除请求
+        void Interrupt()
+        {
+            interruptRequested.store(true, std::memory_order_relaxed);
+            ticks.store(1, std::memory_order_relaxed);
+        }
+
+        // 最近一次因预算耗尽或中断而报错或挂起的原因
+        StopReason LastStop() const { return lastStop; }
+
+        // 调用脚本函数或原生函数，返回其返回值；可在原生函数内部回调脚本。
+        // 注意：回调可能使栈扩容，原生函数收到的 args 视图在调用 VM::Call 之后不再有效
+        Value Call(const Value& function, std::span<const Value> args = {})
+        {
+            const size_t savedTop = top;
+            const size_t entry = frames.size();
+            const size_t func = top;
+            if (nesting == 0)
+            {
+                budgetLeft = budget;
+                pendingStop = StopReason::None;
+                RefillTicks();
+            }
+
+            // 参数可能就在本 VM 的栈上（原生函数转发自己的参数），扩容前先记下位置
+            const Value* data = args.data();
+            bool onStack = !args.empty() && data >= stack.data() && data < stack.data() + stack.size();
+            size_t offset = onStack ? static_cast<size_t>(data - stack.data()) : 0;
+            EnsureStack(func + 1 + args.size());
+            if (onStack)
+                data = stack.data() + offset;
+            stack[func] = function;
+            std::copy(data, data + args.size(), stack.begin() + func + 1);
+            uint32_t argCount = static_cast<uint32_t>(args.size());
+
+            Value result;
+            try
+            {
+                // 不是函数的值按 __call 元方法调用
+                for (size_t loop = 0;; ++loop)
+                {
+                    const Value& callee = stack[func];
+                    if (auto* native = std::get_if<Function*>(&callee.value))
                     {
-                        uint32_t funcIdx = op.args[0];
-                        uint32_t argCount = op.args[1];
-                        std::vector<Value> args;
-                        for (uint32_t i = 0; i < argCount; ++i)
-                        {
-                            args.push_back(context.stack[i + 1]);
-                        }
-                        Value result = context.stack[0].Call(args);
-                        // 清空栈，重新开始
-                        for (size_t i = 0; i < context.stack.size(); ++i) {
-                            context.stack[i] = Value{};
-                        }
-                        sp = 0; // 重置栈指针到0
+                        if (CallNative(*native, func, argCount) > 0)
+                            result = stack[func];
                         break;
                     }
-                    default:
-                        throw std::runtime_error("未知的操作码");
+                    if (auto* closure = std::get_if<Closure*>(&callee.value))
+                    {
+                        PrepareCall(*closure, func, argCount);
+                        result = Invoke(entry);
+                        break;
                     }
+                    const Value* handler = Metamethod(callee, MetaEvent::Call);
+                    if (handler == nullptr || loop >= MaxTagLoop)
+                        throw std::runtime_error(std::string("尝试调用 ") + callee.TypeName() + " 值");
+                    PrependCallee(func, argCount, Value(*handler));
                 }
             }
-            catch (const std::exception& e)
+            catch (...)
             {
-                throw std::runtime_error("执行错误：" + std::string(e.what()));
+                frames.resize(entry);
+                top = savedTop;
+                throw;
             }
+            top = savedTop;
+            return result;
+        }
+
+        // 流式执行：每解析出 batchSize 条顶层语句就立即编译执行，执行完即丢弃这批语句的字节码与常量。
+        // 第一条语句无需等待整个输入读完即可得到结果，内存占用只与单批语句的大小有关。
+        // 一批语句解析完就执行，不预读之后的输入；以表达式结尾的语句（如函数调用）可能在下一行继续，
+        // 要读到下一个 token 才能确定结束，以 ';' 或 end 等关键字结尾的语句不必等待后续输入。
+        // input 可以是文件、std::cin，或基于 socket 等自定义 streambuf 的任意输入流；
+        // 全局变量与顶层 local 变量在批次之间保留，出错时抛出异常并停止读取。
+        void ExecuteStream(std::istream& input, std::string_view chunkName = "stdin", size_t batchSize = 1)
+        {
+            CheckNotSuspended();
+            // 每批直接编译到 VM 的主函数原型中，批次之间只清空不释放
+            Parser parser(input, heap, chunkName, chunk, options);
+            streamingParser = &parser;
+            try
+            {
+                while (parser.ParseBatch(batchSize))
+                {
+                    Execute();
+                }
+            }
+            catch (...)
+            {
+                // 已经有错误在传播，关闭顶层待关闭变量时的错误不再报告
+                try
+                {
+                    EndStream();
+                }
+                catch (...)
+                {
+                }
+                throw;
+            }
+            EndStream();
+        }
+
+        // 注册宿主函数到全局变量表，脚本中可直接按名字调用；Reset 后依然保留
+        void Register(std::string_view name, Value::function func)
+        {
+            Function* fn = heap.NewFunction(std::move(func));
+            natives->SetStr(heap.GetMemory(), heap.NewString(name), Value(fn));
+            SetBuiltin(name, Value(fn));
+        }
+
+        // 注册返回多个值的宿主函数，结果通过 Results::Push 依次压入
+        void Register(std::string_view name, Value::multiFunction func)
+        {
+            Function* fn = heap.NewFunction(std::move(func));
+            natives->SetStr(heap.GetMemory(), heap.NewString(name), Value(fn));
+            SetBuiltin(name, Value(fn));
+        }
+
+        // 打开 ffi 库（见 FFILibrary）：脚本可以声明并直接调用进程或共享库中的 C 函数、读写任意内存，
+        // 因此默认不打开，只应对受信任的脚本调用。打开后 Reset 依然保留；
+        // 引用了 ffi 对象的状态无法保存快照（其中的元方法不是注册的原生函数）
+        void OpenFFI()
+        {
+            if (ffi)
+                return;
+            ffi = std::make_unique<FFILibrary>(heap, [this](const Value& fn, std::span<const Value> args) { return Call(fn, args); });
+            OpenLibrary("ffi", ffi->Open());
+            SaveLibraryBaseline();
+        }
+
+        // 堆快照：把执行初始化脚本后的整个状态（全局变量、字符串、表、闭包与函数原型）保存为
+        // 与地址无关的紧凑二进制映像，之后在新的 VM 上直接加载，不必重新执行初始化脚本。
+        // 原生函数按注册名保存（"print"、"string.upper" 与 Register 时的名字），加载时绑定到本 VM 中同名的函数。
+        // 只能在脚本执行结束后调用；当前加载的代码块不保存
+        void SaveSnapshot(std::ostream& out)
+        {
+            CheckIdle("保存快照");
+            CompilePending();
+            SnapshotWriter writer(out, natives);
+            writer.Write({ globals, baseline, stringMeta });
+        }
+
+        void SaveSnapshotFile(const std::string& path)
+        {
+            std::ofstream file(path, std::ios::binary);
+            if (!file.is_open())
+                throw std::runtime_error("无法写入快照文件：" + path);
+            SaveSnapshot(file);
+        }
+
+        // 加载快照，替换当前的全部状态：卸载代码块、清空栈，全局变量与 Reset 时恢复的全局变量都取自快照。
+        // 快照引用的宿主函数须在加载前以相同名字 Register；本 VM 注册过而快照中没有的函数加载后依然可用。
+        // 格式错误时抛出异常，VM 保持原来的状态；原来的对象不再可达，在之后的回收中释放（带 __gc 的照常终结）
+        void LoadSnapshot(std::string_view image)
+        {
+            CheckIdle("加载快照");
+            SnapshotReader reader(image, heap, natives);
+            Snapshot::Roots roots = reader.Read();
+            DiscardExecution();
+
+            Memory& memory = heap.GetMemory();
+            Value key, value;
+            while (baseline->Next(key, value))
+            {
+                if (roots.baseline->Get(key).IsNil())
+                {
+                    roots.baseline->Set(memory, key, value);
+                    if (roots.globals->Get(key).IsNil())
+                        roots.globals->Set(memory, key, value);
+                }
+            }
+            globals = roots.globals;
+            baseline = roots.baseline;
+            stringMeta = roots.stringMeta;
+            // 快照中的库表（含初始化脚本对它们的修改）即之后 Reset 恢复的样子
+            SaveLibraryBaseline();
+            ++metaEpoch;
+        }
+
+        // 映射快照文件并加载，不复制文件内容
+        void LoadSnapshotFile(const std::string& path)
+        {
+            MappedFile file(path);
+            LoadSnapshot(file.View());
+        }
+
+        // 读取全局变量
+        Value GetGlobal(std::string_view name)
+        {
+            return globals->GetStr(heap.NewString(name));
+        }
+
+        // 设置内存占用上限（字节），0 表示不限制。
+        // 脚本执行中超出上限时抛出 RuntimeError（"内存不足"），VM 之后仍可继续使用
+        void SetMemoryLimit(size_t bytes)
+        {
+            heap.SetLimit(bytes);
+        }
+
+        // 当前占用、峰值、累计分配量与上限
+        const MemoryStats& MemoryUsage() const
+        {
+            return heap.GetMemory().Stats();
+        }
+
+        // 立即进行一次完整的垃圾回收，之后调用本次不可达的对象的 __gc
+        void CollectGarbage()
+        {
+            heap.Collect([this] { MarkRoots(); });
+            ++metaEpoch;    // 内联缓存引用的表可能已被释放
+            RunFinalizers();
         }
-    private:
-        std::ifstream fileStream; // 必须在Parser之前声明，保证初始化顺序
-        Parser parser;
-        ProgramContext context;
 
-        size_t sp;
+        // 设置脚本输出（print）的去向；sink 由调用方持有，需在 VM 使用期间保持有效。
+        // 默认输出到 std::cout
+        void SetOutput(OutputSink& sink)
+        {
+            output.SetSink(sink);
+        }
+
+        // 设置输出缓冲区大小，0 表示不缓冲
+        void SetOutputBuffering(size_t capacity)
+        {
+            output.SetCapacity(capacity);
+        }
+
+        // 开启时（默认）每次 Execute 结束（包括出错）都会刷新输出；
+        // 关闭后只在缓冲区写满或显式调用 Flush 时输出
+        void SetAutoFlush(bool enabled)
+        {
+            autoFlush = enabled;
+        }
+
+        // 将缓冲的输出全部写到 sink
+        void Flush()
+        {
+            output.Flush();
+        }
 
     private:
+        // 调用帧；原生函数的帧只用于错误回溯
+        struct CallFrame
+        {
+            Closure* closure;   // 原生函数为 nullptr
+            size_t func;        // 被调函数所在的栈槽，返回值写回此处
+            size_t base;        // 第一个寄存器（参数）所在的栈槽
+            uint32_t pc;        // 调用其他函数或出错时保存的下一条指令位置
+            size_t top;         // 帧的上界，回收时 [0, top) 以外的栈槽视为空
+            uint32_t varargs = 0;   // 多余参数的个数，位于 [base - varargs, base)
+        };
+
+        // 出错信息中变量的来源
+        enum class NameKind
+        {
+            None,
+            Global,
+            Local,
+            Field,
+            Method,
+            Upvalue,
+            Constant,
+        };
+
+        static OutputSink& StandardOutput()
+        {
+            static StreamSink sink(std::cout);
+            return sink;
+        }
+
+        Heap heap;                                                  // 须最先构造、最后析构
+        Table* globals = nullptr;
+        Table* baseline = nullptr;                                  // Reset 时恢复的全局变量
+        Table* libraries = nullptr;                                 // 库表 -> 其字段的副本（副本的元表即库表原来的元表），Reset 时恢复
+        Table* natives = nullptr;                                   // 原生函数的注册名 -> 函数，快照按名字保存与绑定原生函数
+        Proto* chunk = nullptr;                                     // 当前加载的代码块，编译时原地覆盖
+        Closure* mainClosure = nullptr;                             // 执行 chunk 使用的闭包（主函数没有上值）
+        std::vector<Value, HeapAllocator<Value>> stack{ heap.GetMemory() };
+        std::vector<CallFrame, HeapAllocator<CallFrame>> frames{ heap.GetMemory() };
+        Upvalue* openUpvalues = nullptr;                            // 按栈槽从高到低排列
+        size_t top = 0;                                             // 当前帧的上界
+        size_t nesting = 0;                                         // 嵌套执行的 Run 层数
+        HeapString concatBuffer{ HeapAllocator<char>(heap.GetMemory()) };
+        OutputBuffer output{ StandardOutput(), heap.GetMemory() };  // print 的输出缓冲区
+        StringLibrary strings{ heap, [this](const Value& fn, std::span<const Value> args) { return Call(fn, args); } };
+        TableLibrary tables{ heap, [this](const Value& fn, std::span<const Value> args) { return Call(fn, args); },
+                             [this](const Value& x, const Value& y) { return LessThan(x, y, false); } };
+        std::unique_ptr<FFILibrary> ffi;                            // OpenFFI 之后有效
+        Table* stringMeta = nullptr;                                // 全部字符串共享的元表，__index 为 string 库（s:upper() 即 string.upper(s)）
+        std::array<String*, MetaEventCount> metaNames{};            // 各元方法的名字，驻留并固定
+        String* metatableKey = nullptr;                             // "__metatable"
+        std::vector<size_t, HeapAllocator<size_t>> tbcList{ heap.GetMemory() };    // 待关闭变量所在的栈槽，从低到高
+        uint64_t metamethodCalls = 0;                               // 调用元方法（及恢复挂起的脚本）的次数，见 OpCode::MetaTest
+        uint64_t metaEpoch = 0;                                     // 受监视的表被修改或发生回收时递增，使 __index 链的内联缓存失效
+        bool finalizing = false;                                    // 正在执行 __gc
+        CompileOptions options;
+        CompileOptions chunkOptions;                                // 加载当前代码块时的编译选项，延迟编译的函数按它编译
+        Parser::Scratch parserScratch{ heap.GetMemory() };          // LoadBuffer 在多次编译之间复用的语法分析临时表
+        bool quickening = true;
+        QuickeningStats quickStats;
+        std::array<uint64_t, OpCodeCount> executed{};               // 各操作码的执行次数
+        uint64_t luaCalls = 0;
+        uint64_t nativeCalls = 0;
+        HardwareCounters hardware;                                  // Execute 期间累计的硬件计数
+        std::unique_ptr<PerfCounters> perf;                         // 开启硬件计数器时有效
+        uint64_t budget = 0;                                        // 每次 Execute / Resume 的检查点预算，0 表示不限
+        BudgetAction budgetAction = BudgetAction::Error;
+        uint64_t budgetLeft = 0;                                    // 本次执行剩余的预算（不含当前一段）
+        uint32_t slice = 0;                                         // 当前一段的检查点数
+        std::atomic<uint32_t> ticks{ InterruptCheckInterval };      // 当前一段剩余的检查点数，减到 0 时进入 Preempt
+        std::atomic<bool> interruptRequested{ false };
+        StopReason pendingStop = StopReason::None;                  // 需要挂起但暂时不能挂起（原生函数回调脚本中）
+        StopReason lastStop = StopReason::None;
+        size_t yieldLevel = 0;                                      // 可以挂起的 Run 嵌套层数，0 表示不能挂起
+        bool suspended = false;
+        bool autoFlush = true;
+        const Parser* streamingParser = nullptr;                    // ExecuteStream 期间正在使用的解析器
+
+        void Init()
+        {
+            globals = heap.NewTable();
+            baseline = heap.NewTable();
+            natives = heap.NewTable();
+            chunk = heap.NewProto();
+            mainClosure = heap.NewClosure(chunk, 0);
+            stack.resize(InitialStackSize);
+            for (size_t i = 0; i < MetaEventCount; ++i)
+            {
+                metaNames[i] = heap.NewString(MetaEventName(static_cast<MetaEvent>(i)));
+                metaNames[i]->fixed = true;
+            }
+            metatableKey = heap.NewString("__metatable");
+            metatableKey->fixed = true;
+            RegisterBuiltins();
+            SaveLibraryBaseline();
+        }
+
+        void ClearChunk()
+        {
+            chunk->Clear();
+        }
+
+        // 交换两个函数原型的编译结果与调试信息
+        static void SwapContents(Proto& a, Proto& b)
+        {
+            std::swap(a.code, b.code);
+            std::swap(a.constants, b.constants);
+            std::swap(a.protos, b.protos);
+            std::swap(a.upvalues, b.upvalues);
+            std::swap(a.locals, b.locals);
+            std::swap(a.inlines, b.inlines);
+            std::swap(a.lineInfo, b.lineInfo);
+            std::swap(a.indexCaches, b.indexCaches);
+            std::swap(a.freeIndexCaches, b.freeIndexCaches);
+            std::swap(a.lazyConstants, b.lazyConstants);
+            std::swap(a.lazy, b.lazy);
+            std::swap(a.source, b.source);
+            std::swap(a.name, b.name);
+            std::swap(a.numParams, b.numParams);
+            std::swap(a.vararg, b.vararg);
+            std::swap(a.maxStack, b.maxStack);
+            std::swap(a.lineDefined, b.lineDefined);
+        }
+
+        // 卸载代码块，清空栈与调用帧并关闭全部上值（不调用 __close）
+        void DiscardExecution()
+        {
+            suspended = false;
+            pendingStop = StopReason::None;
+            ClearChunk();
+            CloseUpvalues(0);
+            tbcList.clear();
+            std::fill(stack.begin(), stack.end(), Value());
+            frames.clear();
+            top = 0;
+            nesting = 0;
+        }
+
+        void CheckNotSuspended() const
+        {
+            if (suspended)
+                throw std::runtime_error("脚本已挂起，须先 Resume 或 Reset");
+        }
+
+        // Execute / Resume 共用：重新计算预算，执行到结束、出错或挂起
+        template <typename Prepare>
+        ExecuteStatus RunSlice(Prepare&& prepare)
+        {
+            budgetLeft = budget;
+            pendingStop = StopReason::None;
+            RefillTicks();
+            // 流式执行的各批之间要继续解析输入，不能挂起
+            yieldLevel = streamingParser == nullptr ? 1 : 0;
+            if (perf != nullptr)
+                perf->Start();
+            try
+            {
+                prepare();
+                Invoke(0);
+            }
+            catch (...)
+            {
+                yieldLevel = 0;
+                if (perf != nullptr)
+                    perf->Stop(hardware);
+                AutoFlush();
+                throw;
+            }
+            yieldLevel = 0;
+            if (perf != nullptr)
+                perf->Stop(hardware);
+            AutoFlush();
+            return suspended ? ExecuteStatus::Yielded : ExecuteStatus::Finished;
+        }
+
+        void RefillTicks()
+        {
+            slice = budget == 0 ? InterruptCheckInterval : static_cast<uint32_t>(std::min<uint64_t>(InterruptCheckInterval, budgetLeft));
+            ticks.store(std::max<uint32_t>(slice, 1), std::memory_order_relaxed);
+        }
+
+        // 检查点计数减到 0：扣除这一段的预算，查看中断请求与剩余预算。
+        // 应当停止时按 Error 抛出异常；按 Yield 返回 true，由 Run 保存执行位置后返回。
+        // 不在可以挂起的层（原生函数回调脚本中）时推迟到之后每个检查点再试
+        bool Preempt()
+        {
+            if (pendingStop == StopReason::None)
+            {
+                if (budget != 0)
+                    budgetLeft -= std::min<uint64_t>(slice, budgetLeft);
+                if (interruptRequested.exchange(false, std::memory_order_relaxed))
+                {
+                    pendingStop = StopReason::Interrupt;
+                }
+                else if (budget != 0 && budgetLeft == 0)
+                {
+                    pendingStop = StopReason::Budget;
+                }
+                else
+                {
+                    RefillTicks();
+                    return false;
+                }
+            }
+            if (budgetAction == BudgetAction::Error || yieldLevel == 0)
+            {
+                lastStop = pendingStop;
+                pendingStop = StopReason::None;
+                RefillTicks();  // 剩余预算为 0，清理帧时调用的 __close 也会在第一个检查点停止
+                throw std::runtime_error(lastStop == StopReason::Interrupt ? "执行被中断" : "超出执行预算");
+            }
+            if (nesting != yieldLevel)
+            {
+                ticks.store(1, std::memory_order_relaxed);
+                return false;
+            }
+            lastStop = pendingStop;
+            pendingStop = StopReason::None;
+            suspended = true;
+            return true;
+        }
+
+        // 快照只能在没有脚本执行时保存或加载
+        void CheckIdle(const char* action) const
+        {
+            if (!frames.empty() || streamingParser != nullptr)
+                throw std::runtime_error(std::string("脚本执行期间不能") + action);
+        }
 
+        // 按 compileOptions 编译 proto 及其子函数中尚未编译的延迟编译函数
+        void CompileTree(Proto& proto, const CompileOptions& compileOptions)
+        {
+            if (proto.Pending())
+                Parser::CompileLazy(heap, proto, compileOptions);
+            for (Proto* child : proto.protos)
+                CompileTree(*child, compileOptions);
+        }
+
+        // 编译堆中全部尚未编译的函数（快照只保存字节码）；编译出的子函数可能仍延迟编译，直到没有为止
+        void CompilePending()
+        {
+            std::vector<Proto*> pending;
+            do
+            {
+                pending.clear();
+                heap.ForEachObject([&](GCObject* object) {
+                    if (object->type == ObjectType::Proto && static_cast<Proto*>(object)->Pending())
+                        pending.push_back(static_cast<Proto*>(object));
+                    });
+                for (Proto* proto : pending)
+                    Parser::CompileLazy(heap, *proto, chunkOptions);
+            } while (!pending.empty());
+        }
+
+        static void CountFunctions(const Proto& proto, LazyStats& stats)
+        {
+            stats.functions++;
+            if (proto.Pending())
+            {
+                stats.functions += proto.lazy.innerFunctions;
+                return;
+            }
+            stats.compiled++;
+            if (proto.lazy.deferred)
+                stats.lazyCompiled++;
+            for (const Proto* child : proto.protos)
+                CountFunctions(*child, stats);
+        }
+
+        static void Dequicken(Proto& proto)
+        {
+            for (Operation& op : proto.code)
+            {
+                op.opCode = GenericOp(op.opCode);
+                op.counter = 0;
+            }
+            proto.indexCaches.clear();
+            proto.freeIndexCaches.clear();
+            for (Proto* child : proto.protos)
+                Dequicken(*child);
+        }
+
+        void AutoFlush()
+        {
+            if (autoFlush)
+                output.Flush();
+        }
+
+        // 流式执行中顶层变量的上值与待关闭变量在各批之间保持打开，全部执行完（或出错）后才关闭
+        void EndStream()
+        {
+            size_t live = LiveTop();
+            streamingParser = nullptr;
+            CloseUpvalues(0);
+            if (tbcList.empty())
+                return;
+            // 顶层变量仍在栈上，__close 在它们之上执行
+            top = live;
+            try
+            {
+                CloseVariables(0, nullptr);
+            }
+            catch (...)
+            {
+                tbcList.clear();
+                top = 0;
+                AutoFlush();
+                throw;
+            }
+            top = 0;
+            AutoFlush();
+        }
+
+        // 栈上仍在使用的槽数：流式执行时两批之间主函数的帧已经弹出，但顶层局部变量仍保存在它的寄存器中
+        size_t LiveTop() const
+        {
+            size_t live = top;
+            if (streamingParser != nullptr)
+                live = std::max(live, 1 + streamingParser->PinnedCount());
+            return live;
+        }
+
+        // 保证栈至少有 size 个槽；扩容后打开的上值改为指向新的位置
+        void EnsureStack(size_t size)
+        {
+            if (size <= stack.size())
+                return;
+            if (size > MaxStackSize)
+                throw std::runtime_error("栈溢出");
+            Value* old = stack.data();
+            stack.resize(std::min(std::max(size, stack.size() * 2), MaxStackSize));
+            if (stack.data() != old)
+            {
+                for (Upvalue* upvalue = openUpvalues; upvalue != nullptr; upvalue = upvalue->openNext)
+                    upvalue->v = stack.data() + upvalue->level;
+            }
+        }
+
+        // args 为实参个数；可变参数函数有多余参数时，帧从全部实参之上开始，多余参数留在原处
+        void PushFrame(Closure* closure, size_t func, uint32_t args = 0)
+        {
+            if (frames.size() >= MaxFrames)
+                throw std::runtime_error("栈溢出");
+            Proto* proto = closure->proto;
+            if (proto->Pending()) [[unlikely]]
+                Parser::CompileLazy(heap, *proto, chunkOptions);
+            uint32_t varargs = proto->vararg && args > proto->numParams ? args - proto->numParams : 0;
+            size_t base = func + 1 + (varargs > 0 ? args : 0);
+            size_t frameTop = base + proto->maxStack;
+            EnsureStack(frameTop);
+            frames.push_back({ closure, func, base, 0, frameTop, varargs });
+            top = frameTop;
+            ++luaCalls;
+        }
+
+        // 调用脚本函数：缺少的参数补 nil，然后压入新帧。
+        // 有多余参数时把固定参数复制到帧中，原位置清空，多余参数不必移动
+        void PrepareCall(Closure* closure, size_t func, uint32_t argCount)
+        {
+            PushFrame(closure, func, argCount);
+            const CallFrame& frame = frames.back();
+            uint32_t numParams = closure->proto->numParams;
+            Value* args = stack.data() + func + 1;
+            if (frame.varargs > 0)
+            {
+                Value* params = stack.data() + frame.base;
+                for (uint32_t i = 0; i < numParams; ++i)
+                {
+                    params[i] = args[i];
+                    args[i] = Value();
+                }
+                return;
+            }
+            for (uint32_t i = argCount; i < numParams; ++i)
+                args[i] = Value();
+        }
+
+        // 原生函数的结果直接压在栈上，不经过临时容器
+        class StackResults final : public Results
+        {
+        public:
+            StackResults(VM& vm, size_t first)
+                : vm(vm), first(first)
+            { }
+
+            void Push(const Value& value) override
+            {
+                size_t slot = first + count;
+                if (slot >= vm.stack.size())
+                {
+                    // value 可能就在栈上，扩容前先复制
+                    Value copy = value;
+                    vm.EnsureStack(slot + 1);
+                    vm.stack[slot] = copy;
+                }
+                else
+                {
+                    vm.stack[slot] = value;
+                }
+                ++count;
+                // 结果计入帧的上界，原生函数再调用其他函数时不会覆盖，回收时也不会遗漏
+                vm.frames.back().top = slot + 1;
+                vm.top = slot + 1;
+            }
+
+        private:
+            VM& vm;
+            size_t first;
+        };
+
+        // 调用者需要 wanted 个结果时不足的补 nil；wanted 为 MultipleValues 时保留全部，以 top 标记末尾
+        void AdjustResults(size_t func, uint32_t count, uint32_t wanted)
+        {
+            if (wanted == MultipleValues)
+            {
+                top = func + count;
+                return;
+            }
+            for (uint32_t i = count; i < wanted; ++i)
+                stack[func + i] = Value();
+            top = frames.back().top;
+        }
+
+        // 调用原生函数，结果写到 [func, func + 结果个数)，返回结果个数
+        uint32_t CallNative(Function* function, size_t func, uint32_t argCount)
+        {
+            if (!function->native && !function->multiple)
+                throw std::runtime_error("尝试调用空函数");
+            size_t base = func + 1;
+            // 多返回值函数预留与参数等量的结果空间，转发参数（如 select）时不会扩容
+            EnsureStack(base + (function->native ? argCount : argCount * 2));
+            frames.push_back({ nullptr, func, base, 0, base + argCount });
+            top = base + argCount;
+            ++nativeCalls;
+            // 参数直接以栈上的视图传给原生函数，不复制
+            std::span<const Value> args(stack.data() + base, argCount);
+            uint32_t count = 1;
+            if (function->native)
+            {
+                Value result = function->native(args);
+                stack[func] = result;
+            }
+            else
+            {
+                // 结果压在参数之上，返回后再移到 func 处
+                StackResults results(*this, base + argCount);
+                function->multiple(args, results);
+                count = results.Count();
+                std::copy_n(stack.begin() + base + argCount, count, stack.begin() + func);
+            }
+            frames.pop_back();
+            top = frames.empty() ? 0 : frames.back().top;
+            return count;
+        }
+
+        // 执行栈顶的帧直到帧数回到 entry；出错时清理 entry 以上的帧并转换为 RuntimeError
+        Value Invoke(size_t entry)
+        {
+            try
+            {
+                if (nesting >= MaxNesting)
+                    throw std::runtime_error("C 栈溢出");
+                ++nesting;
+                Value result;
+                try
+                {
+                    result = Run(entry);
+                }
+                catch (...)
+                {
+                    --nesting;
+                    throw;
+                }
+                --nesting;
+                return result;
+            }
+            catch (const RuntimeError& e)
+            {
+                // 内层已生成错误信息，外层只需清理自己的帧
+                Unwind(entry, e.Message());
+                throw;
+            }
+            catch (const std::exception& e)
+            {
+                RuntimeError error(Where() + e.what(), Traceback());
+                Unwind(entry, error.Message());
+                throw error;
+            }
+        }
+
+        // 出错时清理 entry 以上的帧：关闭上值，以错误信息为第二个参数调用这些帧中待关闭变量的 __close。
+        // __close 中再出错只忽略，向外传播的仍是原来的错误
+        void Unwind(size_t entry, const std::string& message)
+        {
+            if (entry < frames.size())
+            {
+                size_t level = frames[entry].func;
+                CloseUpvalues(level);
+                if (!tbcList.empty() && tbcList.back() >= level)
+                {
+                    top = std::max(top, frames.back().top);
+                    while (!tbcList.empty() && tbcList.back() >= level)
+                    {
+                        try
+                        {
+                            CloseVariables(level, &message);
+                        }
+                        catch (...)
+                        {
+                        }
+                    }
+                }
+            }
+            frames.resize(entry);
+            top = frames.empty() ? 0 : frames.back().top;
+        }
+
+        // 从高到低依次调用栈槽不低于 level 的待关闭变量的 __close(值, 错误)，error 为空时第二个参数为 nil。
+        // 调用前先从列表中移除，出错时其余的变量由外层的 Unwind 继续关闭
+        void CloseVariables(size_t level, const std::string* error)
+        {
+            while (!tbcList.empty() && tbcList.back() >= level)
+            {
+                size_t slot = tbcList.back();
+                tbcList.pop_back();
+                Value object = stack[slot];
+                const Value* handler = Metamethod(object, MetaEvent::Close);
+                Value fn = handler != nullptr ? *handler : Value();
+                CallMetamethod(fn, object, error != nullptr ? Value(heap.NewString(*error)) : Value());
+            }
+        }
+
+        // 依次调用已不可达的对象的 __gc。与 Lua 相同，终结器中的错误被忽略；
+        // 终结器中触发的回收只登记新的待终结对象，由这里的循环继续处理
+        void RunFinalizers()
+        {
+            if (finalizing)
+                return;
+            finalizing = true;
+            const size_t savedTop = top;
+            top = LiveTop();
+            while (Table* object = heap.NextFinalizer())
+            {
+                const Value* handler = Metamethod(Value(object), MetaEvent::Gc);
+                if (handler == nullptr)
+                    continue;
+                Value fn = *handler;
+                try
+                {
+                    CallMetamethod(fn, Value(object));
+                }
+                catch (const std::exception&)
+                {
+                }
+            }
+            top = savedTop;
+            finalizing = false;
+        }
+
+        // 以 args 为参数调用元方法，返回其第一个返回值
+        template <typename... Args>
+        Value CallMetamethod(const Value& handler, const Args&... args)
+        {
+            ++metamethodCalls;
+            const std::array<Value, sizeof...(Args)> values{ args... };
+            return Call(handler, values);
+        }
+
+        // __call：被调用的值连同参数后移一格，元方法放在 func 处，被调用的值成为第一个参数
+        void PrependCallee(size_t func, uint32_t& argCount, const Value& handler)
+        {
+            EnsureStack(func + argCount + 2);
+            Value* slots = stack.data() + func;
+            std::move_backward(slots, slots + argCount + 1, slots + argCount + 2);
+            slots[0] = handler;
+            ++argCount;
+        }
+
+        // 栈槽 level 的打开上值，不存在时新建
+        Upvalue* FindUpvalue(size_t level)
+        {
+            Upvalue** link = &openUpvalues;
+            while (*link != nullptr && (*link)->level > level)
+                link = &(*link)->openNext;
+            if (*link != nullptr && (*link)->level == level)
+                return *link;
+            Upvalue* upvalue = heap.NewUpvalue(stack.data() + level, level);
+            upvalue->openNext = *link;
+            *link = upvalue;
+            return upvalue;
+        }
+
+        // 关闭栈槽不低于 level 的全部上值
+        void CloseUpvalues(size_t level)
+        {
+            while (openUpvalues != nullptr && openUpvalues->level >= level)
+            {
+                Upvalue* upvalue = openUpvalues;
+                upvalue->closed = *upvalue->v;
+                upvalue->v = &upvalue->closed;
+                openUpvalues = upvalue->openNext;
+            }
+        }
+
+        // 只关闭栈槽 level 的上值（块尾离开作用域的被捕获变量）
+        void CloseUpvalue(size_t level)
+        {
+            Upvalue** link = &openUpvalues;
+            while (*link != nullptr && (*link)->level > level)
+                link = &(*link)->openNext;
+            if (*link != nullptr && (*link)->level == level)
+            {
+                Upvalue* upvalue = *link;
+                upvalue->closed = *upvalue->v;
+                upvalue->v = &upvalue->closed;
+                *link = upvalue->openNext;
+            }
+        }
+
+        // 解释执行。局部保存当前帧的指令、常量与寄存器指针，
+        // 调用、返回以及可能使栈扩容的操作之后重新读取
+        Value Run(size_t entry)
+        {
+            Memory& memory = heap.GetMemory();
+            size_t frameIndex = frames.size() - 1;
+            Closure* closure = frames[frameIndex].closure;
+            Operation* code = closure->proto->code.data();
+            const Value* k = closure->proto->constants.data();
+            Value* base = stack.data() + frames[frameIndex].base;
+            Operation* pc = code + frames[frameIndex].pc;
+
+            auto reload = [&] {
+                frameIndex = frames.size() - 1;
+                const CallFrame& frame = frames[frameIndex];
+                closure = frame.closure;
+                code = closure->proto->code.data();
+                k = closure->proto->constants.data();
+                base = stack.data() + frame.base;
+                pc = code + frame.pc;
+            };
+            auto savePc = [&] {
+                frames[frameIndex].pc = static_cast<uint32_t>(pc - code);
+            };
+            // 预算检查点，在向后跳转（包括跳回自身的空循环）与函数调用处调用；返回 true 时须保存执行位置后从 Run 返回（挂起）。
+            // 计数器只用普通的读写（不用原子的读-改-写），与 Interrupt 的竞争至多使中断推迟到这一段结束。
+            // jump 为经过检查点的跳转指令（pc 已是跳转目标）：Preempt 按 Error 抛出时执行位置记在跳转指令之后，
+            // 报告它所在的行；函数调用处为 nullptr，报告当前位置（已进入被调函数时为其定义所在的行）
+            auto checkpoint = [&](const Operation* jump = nullptr) {
+                uint32_t left = ticks.load(std::memory_order_relaxed) - 1;
+                ticks.store(left, std::memory_order_relaxed);
+                if (left != 0)
+                    return false;
+                Operation* target = pc;
+                if (jump != nullptr)
+                    pc = code + (jump - code) + 1;
+                bool stop = Preempt();
+                pc = target;
+                return stop;
+            };
+            auto rk = [&](uint32_t operand) -> const Value& {
+                return (operand & ConstantBit) ? k[operand & ~ConstantBit] : base[operand];
+            };
+            auto collect = [&] {
+                if (heap.NeedsCollection())
+                {
+                    savePc();
+                    CollectGarbage();
+                    reload();   // 终结器可能使栈扩容
+                }
+            };
+
+            // 元方法：操作数先复制出来，调用前保存执行位置，返回后重新读取（栈可能已经扩容）。
+            // 二元运算先取左操作数的元方法，没有时取右操作数的；找到时结果写入 R[A]
+            auto binaryMeta = [&](const Operation& op, MetaEvent event) {
+                Value x = rk(op.args[1]);
+                Value y = rk(op.args[2]);
+                const Value* handler = Metamethod(x, event);
+                if (handler == nullptr)
+                    handler = Metamethod(y, event);
+                if (handler == nullptr)
+                    return false;
+                Value fn = *handler;
+                savePc();
+                Value result = CallMetamethod(fn, x, y);
+                reload();
+                base[op.args[0]] = result;
+                return true;
+            };
+            auto unaryMeta = [&](const Operation& op, MetaEvent event) {
+                Value x = base[op.args[1]];
+                const Value* handler = Metamethod(x, event);
+                if (handler == nullptr)
+                    return false;
+                Value fn = *handler;
+                savePc();
+                Value result = CallMetamethod(fn, x, x);
+                reload();
+                base[op.args[0]] = result;
+                return true;
+            };
+            auto arith = [&](const Operation& op, MetaEvent event, auto f) {
+                const Value& x = rk(op.args[1]);
+                const Value& y = rk(op.args[2]);
+                const double* l = std::get_if<double>(&x.value);
+                const double* r = std::get_if<double>(&y.value);
+                if (l != nullptr && r != nullptr)
+                {
+                    base[op.args[0]] = f(*l, *r);
+                    return;
+                }
+                double lhs, rhs;
+                if (ToArithmetic(x, lhs) && ToArithmetic(y, rhs))
+                {
+                    base[op.args[0]] = f(lhs, rhs);
+                    return;
+                }
+                if (!binaryMeta(op, event))
+                    ArithError(x, op.args[1], y, op.args[2], pc - 1);
+            };
+            auto bitwise = [&](const Operation& op, MetaEvent event, auto f) {
+                const Value& x = rk(op.args[1]);
+                const Value& y = rk(op.args[2]);
+                int64_t lhs, rhs;
+                if (ToBitwise(x, lhs) && ToBitwise(y, rhs))
+                {
+                    base[op.args[0]] = static_cast<double>(f(lhs, rhs));
+                    return;
+                }
+                if (!binaryMeta(op, event))
+                    BitError(x, op.args[1], y, op.args[2], pc - 1);
+            };
+            auto compare = [&](const Operation& op, bool orEqual) {
+                bool result;
+                if (!CompareRaw(rk(op.args[1]), rk(op.args[2]), orEqual, result))
+                {
+                    Value x = rk(op.args[1]);
+                    Value y = rk(op.args[2]);
+                    savePc();
+                    result = LessThan(x, y, orEqual);
+                    reload();
+                }
+                base[op.args[0]] = Value(result);
+            };
+            // 比较并跳转用到的比较，结果不写入寄存器；两个数字或两个字符串以外的情形可能调用元方法
+            auto equal = [&](const Value& x, const Value& y) {
+                if (x == y)
+                    return true;
+                auto* l = std::get_if<Table*>(&x.value);
+                auto* r = std::get_if<Table*>(&y.value);
+                if (l == nullptr || r == nullptr || ((*l)->metatable == nullptr && (*r)->metatable == nullptr))
+                    return false;
+                Value lhs = x;
+                Value rhs = y;
+                const Value* handler = Metamethod(lhs, MetaEvent::Eq);
+                if (handler == nullptr)
+                    handler = Metamethod(rhs, MetaEvent::Eq);
+                if (handler == nullptr)
+                    return false;
+                Value fn = *handler;
+                savePc();
+                bool result = !CallMetamethod(fn, lhs, rhs).IsFalsy();
+                reload();
+                return result;
+            };
+            auto less = [&](const Value& x, const Value& y, bool orEqual) {
+                bool result;
+                if (CompareRaw(x, y, orEqual, result))
+                    return result;
+                Value lhs = x;
+                Value rhs = y;
+                savePc();
+                result = LessThan(lhs, rhs, orEqual);
+                reload();
+                return result;
+            };
+            // R[reg] 与立即数比较（swapped 时立即数在左）；R[reg] 是数字时不必构造 Value
+            auto lessImmediate = [&](uint32_t reg, uint32_t operand, bool orEqual, bool swapped) {
+                const double y = static_cast<double>(static_cast<int32_t>(operand));
+                if (const double* x = std::get_if<double>(&base[reg].value))
+                    return swapped ? (orEqual ? y <= *x : y < *x) : (orEqual ? *x <= y : *x < y);
+                return swapped ? less(Value(y), base[reg], orEqual) : less(base[reg], Value(y), orEqual);
+            };
+            auto equalImmediate = [&](uint32_t reg, uint32_t operand) {
+                const double* x = std::get_if<double>(&base[reg].value);
+                return x != nullptr && *x == static_cast<double>(static_cast<int32_t>(operand));
+            };
+            // 条件成立时跳到 target；向后跳转（包括跳回自身）经过检查点，返回 true 时须保存执行位置后挂起
+            auto branch = [&](bool taken, uint32_t target, const Operation& op) {
+                if (!taken)
+                    return false;
+                pc = code + target;
+                return pc <= &op && checkpoint(&op);
+            };
+
+            // 按 __index / __newindex 的完整语义读写，object 为 R[operand]
+            auto index = [&](uint32_t target, const Value& object, const Value& key, uint32_t operand) {
+                Value receiver = object;
+                Value field = key;
+                savePc();
+                Value result = Index(receiver, field, operand, pc - 1);
+                reload();
+                base[target] = result;
+            };
+            auto newIndex = [&](const Value& object, const Value& key, const Value& value, uint32_t operand) {
+                Value receiver = object;
+                Value field = key;
+                Value assigned = value;
+                savePc();
+                NewIndex(receiver, field, assigned, operand, pc - 1);
+                reload();
+                collect();
+            };
+
+            // 指令特化：泛型指令连续 QuickenThreshold 次观察到同一种可特化的情形（tag 相同）后原地改写，
+            // 特化指令守卫失败时改写回泛型指令并重新执行
+            auto observe = [&](Operation& op, uint32_t tag, OpCode specialized) {
+                if (op.cache != tag)
+                {
+                    op.cache = static_cast<uint16_t>(tag);
+                    op.counter = 0;
+                }
+                if (++op.counter >= QuickenThreshold)
+                {
+                    op.opCode = specialized;
+                    op.counter = 0;
+                    ++quickStats.specialized[static_cast<size_t>(specialized)];
+                }
+            };
+            auto deopt = [&](Operation& op) {
+                ++quickStats.misses[static_cast<size_t>(op.opCode)];
+                op.opCode = GenericOp(op.opCode);
+                op.counter = 0;
+                --pc;
+            };
+            auto hit = [&](const Operation& op) {
+                ++quickStats.hits[static_cast<size_t>(op.opCode)];
+            };
+            auto observeNumbers = [&](Operation& op, OpCode specialized) {
+                if (quickening)
+                {
+                    if (rk(op.args[1]).IsNumber() && rk(op.args[2]).IsNumber())
+                        observe(op, 0, specialized);
+                    else
+                        op.counter = 0;
+                }
+            };
+            auto numbers = [&](const Operation& op, auto f) {
+                const double* l = std::get_if<double>(&rk(op.args[1]).value);
+                const double* r = std::get_if<double>(&rk(op.args[2]).value);
+                if (l == nullptr || r == nullptr)
+                    return false;
+                hit(op);
+                base[op.args[0]] = f(*l, *r);
+                return true;
+            };
+            // 字段读写：记下键所在的哈希位置，位置稳定时改写为带内联缓存的指令
+            auto observeSlot = [&](Operation& op, uint32_t slot, OpCode specialized) {
+                if (slot < ChainTag)
+                    observe(op, slot, specialized);
+                else
+                    op.counter = 0;
+            };
+            // 键不在自身中、沿全部为表的 __index 链能找到时观察（tag 为 ChainTag），
+            // 改写时为指令分配一个链缓存，cache 字段改为缓存的下标
+            auto observeChain = [&](Operation& op, const Value& object, String* key, OpCode specialized) {
+                IndexCache entry;
+                if (!ResolveChain(MetatableOf(object), key, entry))
+                {
+                    op.counter = 0;
+                    return;
+                }
+                observe(op, ChainTag, specialized);
+                if (op.opCode == specialized && !AllocIndexCache(*closure->proto, entry, op.cache))
+                    op.opCode = GenericOp(specialized);
+            };
+            // 链缓存的守卫：元表与缓存时相同且键不在自身中；受监视的表被修改过时重新解析
+            auto chainLookup = [&](const Operation& op, const Value& object, String* key) -> const Value* {
+                Table* metatable;
+                if (auto* table = std::get_if<Table*>(&object.value))
+                {
+                    if (!(*table)->GetStr(key).IsNil())
+                        return nullptr;
+                    metatable = (*table)->metatable;
+                }
+                else if (std::holds_alternative<String*>(object.value))
+                {
+                    metatable = stringMeta;
+                }
+                else
+                {
+                    return nullptr;
+                }
+                IndexCache& entry = closure->proto->indexCaches[op.cache];
+                if (entry.metatable != metatable)
+                    return nullptr;
+                if ((entry.epoch != metaEpoch || !entry.holder->SlotHolds(entry.slot, key)) &&
+                    !ResolveChain(metatable, key, entry))
+                {
+                    return nullptr;
+                }
+                return &entry.holder->nodes[entry.slot].value;
+            };
+            auto chainDeopt = [&](Operation& op) {
+                closure->proto->freeIndexCaches.push_back(op.cache);
+                deopt(op);
+            };
+
+            try
+            {
+                while (true)
+                {
+                    Operation& op = *pc++;
+                    ++executed[static_cast<size_t>(op.opCode)];
+                    const uint32_t a = op.args[0];
+                    const uint32_t b = op.args[1];
+                    const uint32_t c = op.args[2];
+                    switch (op.opCode)
+                    {
+                    case OpCode::Move:
+                        base[a] = base[b];
+                        break;
+                    case OpCode::LoadK:
+                        base[a] = k[b];
+                        break;
+                    case OpCode::LoadNil:
+                        base[a] = Value();
+                        break;
+                    case OpCode::LoadBool:
+                        base[a] = Value(b != 0);
+                        break;
+                    case OpCode::GetUpval:
+                        base[a] = *closure->Upvalues()[b]->v;
+                        break;
+                    case OpCode::SetUpval:
+                        *closure->Upvalues()[a]->v = rk(b);
+                        break;
+                    case OpCode::GetGlobal:
+                    {
+                        String* key = *std::get_if<String*>(&k[b].value);
+                        if (!quickening)
+                        {
+                            base[a] = globals->GetStr(key);
+                            break;
+                        }
+                        uint32_t slot = globals->SlotOf(key);
+                        observeSlot(op, slot, OpCode::GetGlobalCached);
+                        base[a] = slot != Table::NoSlot ? globals->nodes[slot].value : Value();
+                        break;
+                    }
+                    case OpCode::GetGlobalCached:
+                        if (!globals->SlotHolds(op.cache, *std::get_if<String*>(&k[b].value)))
+                        {
+                            deopt(op);
+                            break;
+                        }
+                        hit(op);
+                        base[a] = globals->nodes[op.cache].value;
+                        break;
+                    case OpCode::SetGlobal:
+                        globals->SetStr(memory, *std::get_if<String*>(&k[a].value), rk(b));
+                        collect();
+                        break;
+                    case OpCode::GetField:
+                    {
+                        const Value& object = base[b];
+                        String* key = *std::get_if<String*>(&k[c].value);
+                        if (auto* table = std::get_if<Table*>(&object.value))
+                        {
+                            Table* t = *table;
+                            if (!quickening)
+                            {
+                                const Value& value = t->GetStr(key);
+                                if (!value.IsNil() || t->metatable == nullptr)
+                                {
+                                    base[a] = value;
+                                    break;
+                                }
+                            }
+                            else
+                            {
+                                uint32_t slot = t->SlotOf(key);
+                                if (t->metatable == nullptr || (slot != Table::NoSlot && !t->nodes[slot].value.IsNil()))
+                                {
+                                    observeSlot(op, slot, OpCode::GetFieldCached);
+                                    base[a] = slot != Table::NoSlot ? t->nodes[slot].value : Value();
+                                    break;
+                                }
+                            }
+                        }
+                        // 键不在表中而表有元表，或者索引的不是表
+                        if (quickening)
+                            observeChain(op, object, key, OpCode::GetFieldMeta);
+                        index(a, object, Value(key), b);
+                        break;
+                    }
+                    case OpCode::GetFieldCached:
+                    {
+                        auto* table = std::get_if<Table*>(&base[b].value);
+                        if (table == nullptr || !(*table)->SlotHolds(op.cache, *std::get_if<String*>(&k[c].value)))
+                        {
+                            deopt(op);
+                            break;
+                        }
+                        const Value& value = (*table)->nodes[op.cache].value;
+                        if (value.IsNil() && (*table)->metatable != nullptr)
+                        {
+                            deopt(op);
+                            break;
+                        }
+                        hit(op);
+                        base[a] = value;
+                        break;
+                    }
+                    case OpCode::GetFieldMeta:
+                    {
+                        const Value* value = chainLookup(op, base[b], *std::get_if<String*>(&k[c].value));
+                        if (value == nullptr)
+                        {
+                            chainDeopt(op);
+                            break;
+                        }
+                        hit(op);
+                        base[a] = *value;
+                        break;
+                    }
+                    case OpCode::SetField:
+                    {
+                        const Value& object = base[a];
+                        String* key = *std::get_if<String*>(&k[b].value);
+                        if (auto* table = std::get_if<Table*>(&object.value))
+                        {
+                            Table* t = *table;
+                            uint32_t slot = quickening ? t->SlotOf(key) : Table::NoSlot;
+                            if (slot != Table::NoSlot && (t->metatable == nullptr || !t->nodes[slot].value.IsNil()))
+                            {
+                                observeSlot(op, slot, OpCode::SetFieldCached);
+                                NoteWrite(t);
+                                t->SetSlot(slot, rk(c));
+                                break;
+                            }
+                            op.counter = 0;
+                            if (t->metatable == nullptr || !t->GetStr(key).IsNil() || Metamethod(object, MetaEvent::NewIndex) == nullptr)
+                            {
+                                NoteWrite(t);
+                                t->SetStr(memory, key, rk(c));
+                                collect();
+                                break;
+                            }
+                        }
+                        newIndex(object, Value(key), rk(c), a);
+                        break;
+                    }
+                    case OpCode::SetFieldCached:
+                    {
+                        auto* table = std::get_if<Table*>(&base[a].value);
+                        if (table == nullptr || !(*table)->SlotHolds(op.cache, *std::get_if<String*>(&k[b].value)))
+                        {
+                            deopt(op);
+                            break;
+                        }
+                        Table* t = *table;
+                        if (t->metatable != nullptr && t->nodes[op.cache].value.IsNil())
+                        {
+                            deopt(op);
+                            break;
+                        }
+                        hit(op);
+                        NoteWrite(t);
+                        t->SetSlot(op.cache, rk(c));
+                        break;
+                    }
+                    case OpCode::GetIndex:
+                    {
+                        const Value& object = base[b];
+                        if (auto* table = std::get_if<Table*>(&object.value))
+                        {
+                            const Value& value = (*table)->Get(rk(c));
+                            if (!value.IsNil() || (*table)->metatable == nullptr)
+                            {
+                                base[a] = value;
+                                break;
+                            }
+                        }
+                        index(a, object, rk(c), b);
+                        break;
+                    }
+                    case OpCode::SetIndex:
+                    {
+                        const Value& object = base[a];
+                        if (auto* table = std::get_if<Table*>(&object.value))
+                        {
+                            Table* t = *table;
+                            if (t->metatable == nullptr || !t->Get(rk(b)).IsNil() || Metamethod(object, MetaEvent::NewIndex) == nullptr)
+                            {
+                                NoteWrite(t);
+                                t->Set(memory, rk(b), rk(c));
+                                collect();
+                                break;
+                            }
+                        }
+                        newIndex(object, rk(b), rk(c), a);
+                        break;
+                    }
+                    case OpCode::NewTable:
+                        base[a] = Value(heap.NewTable(b, c));
+                        collect();
+                        break;
+                    case OpCode::SetList:
+                    {
+                        Table* table = *std::get_if<Table*>(&base[a].value);
+                        uint32_t count = b & MultipleValues ? static_cast<uint32_t>(top - (frames[frameIndex].base + a + 1)) : b;
+                        for (uint32_t i = 1; i <= count; ++i)
+                            table->SetInt(memory, static_cast<int64_t>(c) + i, base[a + i]);
+                        top = frames[frameIndex].top;
+                        collect();
+                        break;
+                    }
+                    case OpCode::Self:
+                    {
+                        Value object = base[b];
+                        if (auto* table = std::get_if<Table*>(&object.value))
+                        {
+                            const Value& method = (*table)->Get(rk(c));
+                            if (!method.IsNil() || (*table)->metatable == nullptr)
+                            {
+                                base[a] = method;
+                                base[a + 1] = object;
+                                break;
+                            }
+                        }
+                        // 方法来自元表（类的方法表、字符串的 string 库）
+                        if (quickening && IsConstantString(closure->proto, c))
+                            observeChain(op, object, *std::get_if<String*>(&rk(c).value), OpCode::SelfMeta);
+                        index(a, object, rk(c), b);
+                        base[a + 1] = object;
+                        break;
+                    }
+                    case OpCode::SelfMeta:
+                    {
+                        const Value* method = chainLookup(op, base[b], *std::get_if<String*>(&k[c & ~ConstantBit].value));
+                        if (method == nullptr)
+                        {
+                            chainDeopt(op);
+                            break;
+                        }
+                        hit(op);
+                        base[a + 1] = base[b];
+                        base[a] = *method;
+                        break;
+                    }
+
+                    case OpCode::Add:
+                        observeNumbers(op, OpCode::AddNum);
+                        arith(op, MetaEvent::Add, [](double x, double y) { return x + y; });
+                        break;
+                    case OpCode::AddNum:
+                        if (!numbers(op, [](double x, double y) { return x + y; }))
+                            deopt(op);
+                        break;
+                    case OpCode::Sub:
+                        observeNumbers(op, OpCode::SubNum);
+                        arith(op, MetaEvent::Sub, [](double x, double y) { return x - y; });
+                        break;
+                    case OpCode::SubNum:
+                        if (!numbers(op, [](double x, double y) { return x - y; }))
+                            deopt(op);
+                        break;
+                    case OpCode::Mul:
+                        observeNumbers(op, OpCode::MulNum);
+                        arith(op, MetaEvent::Mul, [](double x, double y) { return x * y; });
+                        break;
+                    case OpCode::MulNum:
+                        if (!numbers(op, [](double x, double y) { return x * y; }))
+                            deopt(op);
+                        break;
+                    case OpCode::Div:
+                        observeNumbers(op, OpCode::DivNum);
+                        arith(op, MetaEvent::Div, [](double x, double y) { return x / y; });
+                        break;
+                    case OpCode::DivNum:
+                        if (!numbers(op, [](double x, double y) { return x / y; }))
+                            deopt(op);
+                        break;
+                    case OpCode::Mod:
+                        arith(op, MetaEvent::Mod, [](double x, double y) { return NumberMod(x, y); });
+                        break;
+                    case OpCode::Pow:
+                        arith(op, MetaEvent::Pow, [](double x, double y) { return std::pow(x, y); });
+                        break;
+                    case OpCode::Idiv:
+                        arith(op, MetaEvent::Idiv, [](double x, double y) { return NumberIdiv(x, y); });
+                        break;
+                    case OpCode::BAnd:
+                        bitwise(op, MetaEvent::BAnd, [](int64_t x, int64_t y) { return x & y; });
+                        break;
+                    case OpCode::BOr:
+                        bitwise(op, MetaEvent::BOr, [](int64_t x, int64_t y) { return x | y; });
+                        break;
+                    case OpCode::BXor:
+                        bitwise(op, MetaEvent::BXor, [](int64_t x, int64_t y) { return x ^ y; });
+                        break;
+                    case OpCode::Shl:
+                        bitwise(op, MetaEvent::Shl, [](int64_t x, int64_t y) { return ShiftLeft(x, y); });
+                        break;
+                    case OpCode::Shr:
+                        bitwise(op, MetaEvent::Shr, [](int64_t x, int64_t y) { return ShiftLeft(x, y == INT64_MIN ? 64 : -y); });
+                        break;
+                    case OpCode::Concat:
+                    {
+                        const Value& x = rk(b);
+                        const Value& y = rk(c);
+                        bool xText = x.IsNumber() || std::holds_alternative<String*>(x.value);
+                        bool yText = y.IsNumber() || std::holds_alternative<String*>(y.value);
+                        if (!xText || !yText)
+                        {
+                            if (binaryMeta(op, MetaEvent::Concat))
+                                break;
+                            OperandError("拼接 ", "", xText ? y : x, xText ? c : b, pc - 1);
+                        }
+                        char scratch[NumberBufferSize];
+                        concatBuffer.clear();
+                        concatBuffer.append(x.ToStringView(scratch));
+                        concatBuffer.append(y.ToStringView(scratch));
+                        base[a] = Value(heap.NewString(concatBuffer));
+                        collect();
+                        break;
+                    }
+                    case OpCode::Eq:
+                    {
+                        const Value& x = rk(b);
+                        const Value& y = rk(c);
+                        if (x == y)
+                        {
+                            base[a] = Value(true);
+                            break;
+                        }
+                        // 只有两个不同的表才查找 __eq
+                        auto* l = std::get_if<Table*>(&x.value);
+                        auto* r = std::get_if<Table*>(&y.value);
+                        if (l == nullptr || r == nullptr || ((*l)->metatable == nullptr && (*r)->metatable == nullptr) ||
+                            !binaryMeta(op, MetaEvent::Eq))
+                        {
+                            base[a] = Value(false);
+                            break;
+                        }
+                        base[a] = Value(!base[a].IsFalsy());
+                        break;
+                    }
+                    case OpCode::Lt:
+                        observeNumbers(op, OpCode::LtNum);
+                        compare(op, false);
+                        break;
+                    case OpCode::LtNum:
+                        if (!numbers(op, [](double x, double y) { return Value(x < y); }))
+                            deopt(op);
+                        break;
+                    case OpCode::Le:
+                        observeNumbers(op, OpCode::LeNum);
+                        compare(op, true);
+                        break;
+                    case OpCode::LeNum:
+                        if (!numbers(op, [](double x, double y) { return Value(x <= y); }))
+                            deopt(op);
+                        break;
+
+                    case OpCode::Unm:
+                    {
+                        const Value& x = base[b];
+                        double d;
+                        if (ToArithmetic(x, d))
+                            base[a] = -d;
+                        else if (!unaryMeta(op, MetaEvent::Unm))
+                            ArithError(x, b, x, b, pc - 1);
+                        break;
+                    }
+                    case OpCode::Not:
+                        base[a] = Value(base[b].IsFalsy());
+                        break;
+                    case OpCode::Len:
+                    {
+                        const Value& x = base[b];
+                        if (auto* str = std::get_if<String*>(&x.value))
+                        {
+                            base[a] = static_cast<double>((*str)->length);
+                            break;
+                        }
+                        // 表先查 __len，没有元表的表不必查找
+                        auto* table = std::get_if<Table*>(&x.value);
+                        if ((table == nullptr || (*table)->metatable != nullptr) && unaryMeta(op, MetaEvent::Len))
+                            break;
+                        if (table == nullptr)
+                            OperandError("获取 ", "的长度", x, b, pc - 1);
+                        base[a] = static_cast<double>((*table)->Length());
+                        break;
+                    }
+                    case OpCode::BNot:
+                    {
+                        const Value& x = base[b];
+                        int64_t i;
+                        if (ToBitwise(x, i))
+                            base[a] = static_cast<double>(~i);
+                        else if (!unaryMeta(op, MetaEvent::BNot))
+                            BitError(x, b, x, b, pc - 1);
+                        break;
+                    }
+
+                    case OpCode::Jmp:
+                        pc = code + a;
+                        if (pc <= &op && checkpoint(&op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::Test:
+                        if (!base[a].IsFalsy() == (c != 0))
+                        {
+                            pc = code + b;
+                            if (pc <= &op && checkpoint(&op))
+                            {
+                                savePc();
+                                return Value();
+                            }
+                        }
+                        break;
+                    case OpCode::MetaMark:
+                        base[a] = static_cast<double>(metamethodCalls);
+                        break;
+                    case OpCode::MetaTest:
+                        // 只向前跳转，不是检查点
+                        if (const double* mark = std::get_if<double>(&base[a].value); mark != nullptr && *mark == static_cast<double>(metamethodCalls))
+                            pc = code + b;
+                        break;
+                    case OpCode::EqJmp:
+                        if (branch(equal(rk(a), rk(b)), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::NeJmp:
+                        if (branch(!equal(rk(a), rk(b)), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::LtJmp:
+                        if (branch(less(rk(a), rk(b), false), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::NotLtJmp:
+                        if (branch(!less(rk(a), rk(b), false), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::LeJmp:
+                        if (branch(less(rk(a), rk(b), true), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::NotLeJmp:
+                        if (branch(!less(rk(a), rk(b), true), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::EqJmpI:
+                        if (branch(equalImmediate(a, b), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::NeJmpI:
+                        if (branch(!equalImmediate(a, b), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::LtJmpI:
+                        if (branch(lessImmediate(a, b, false, false), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::NotLtJmpI:
+                        if (branch(!lessImmediate(a, b, false, false), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::LeJmpI:
+                        if (branch(lessImmediate(a, b, true, false), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::NotLeJmpI:
+                        if (branch(!lessImmediate(a, b, true, false), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::GtJmpI:
+                        if (branch(lessImmediate(a, b, false, true), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::NotGtJmpI:
+                        if (branch(!lessImmediate(a, b, false, true), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::GeJmpI:
+                        if (branch(lessImmediate(a, b, true, true), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::NotGeJmpI:
+                        if (branch(!lessImmediate(a, b, true, true), c, op))
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    case OpCode::Call:
+                    {
+                        size_t func = frames[frameIndex].base + a;
+                        uint32_t argCount = b & MultipleValues ? static_cast<uint32_t>(top - func - 1) : b;
+                        savePc();
+                        // 不是函数的值按 __call 元方法调用，只在直接调用函数时观察
+                        for (size_t loop = 0;; ++loop)
+                        {
+                            const Value& callee = base[a];
+                            if (auto* target = std::get_if<Closure*>(&callee.value))
+                            {
+                                if (quickening && loop == 0)
+                                    observe(op, 0, OpCode::CallLua);
+                                PrepareCall(*target, func, argCount);
+                                reload();
+                                if (checkpoint())
+                                {
+                                    savePc();
+                                    return Value();
+                                }
+                                break;
+                            }
+                            if (auto* native = std::get_if<Function*>(&callee.value))
+                            {
+                                if (quickening && loop == 0)
+                                    observe(op, 1, OpCode::CallNative);
+                                uint32_t count = CallNative(*native, func, argCount);
+                                reload();
+                                AdjustResults(func, count, c);
+                                collect();
+                                if (checkpoint())
+                                {
+                                    savePc();
+                                    return Value();
+                                }
+                                break;
+                            }
+                            const Value* handler = Metamethod(callee, MetaEvent::Call);
+                            if (handler == nullptr || loop >= MaxTagLoop)
+                            {
+                                if (loop == 0)
+                                    OperandError("调用 ", "", callee, a, pc - 1);
+                                throw std::runtime_error(std::string("尝试调用 ") + callee.TypeName() + " 值");
+                            }
+                            PrependCallee(func, argCount, Value(*handler));
+                            base = stack.data() + frames[frameIndex].base;
+                        }
+                        break;
+                    }
+                    case OpCode::CallLua:
+                    {
+                        auto* target = std::get_if<Closure*>(&base[a].value);
+                        if (target == nullptr)
+                        {
+                            deopt(op);
+                            break;
+                        }
+                        hit(op);
+                        savePc();
+                        size_t func = frames[frameIndex].base + a;
+                        PrepareCall(*target, func, b & MultipleValues ? static_cast<uint32_t>(top - func - 1) : b);
+                        reload();
+                        if (checkpoint())
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    }
+                    case OpCode::CallNative:
+                    {
+                        auto* native = std::get_if<Function*>(&base[a].value);
+                        if (native == nullptr)
+                        {
+                            deopt(op);
+                            break;
+                        }
+                        hit(op);
+                        savePc();
+                        size_t func = frames[frameIndex].base + a;
+                        uint32_t count = CallNative(*native, func, b & MultipleValues ? static_cast<uint32_t>(top - func - 1) : b);
+                        reload();
+                        AdjustResults(func, count, c);
+                        collect();
+                        if (checkpoint())
+                        {
+                            savePc();
+                            return Value();
+                        }
+                        break;
+                    }
+                    case OpCode::Return:
+                    {
+                        const CallFrame& frame = frames[frameIndex];
+                        const size_t func = frame.func;
+                        const size_t frameBase = frame.base;
+                        const size_t first = frameBase + a;
+                        const uint32_t count = b & MultipleValues ? static_cast<uint32_t>(top - first) : b;
+                        const bool keepOpen = streamingParser != nullptr && frameIndex == 0;
+                        if (openUpvalues != nullptr && openUpvalues->level >= frameBase && !keepOpen)
+                        {
+                            CloseUpvalues(frameBase);
+                        }
+                        if (!tbcList.empty() && tbcList.back() >= frameBase && !keepOpen)
+                        {
+                            // 返回值留在原处，__close 在其上方执行，不会覆盖也不会被回收
+                            top = std::max(frame.top, first + count);
+                            savePc();
+                            CloseVariables(frameBase, nullptr);
+                            reload();
+                        }
+                        frames.pop_back();
+                        Value* slots = stack.data();
+                        if (frames.size() == entry)
+                        {
+                            Value result = count > 0 ? slots[first] : Value();
+                            slots[func] = result;
+                            top = frames.empty() ? 0 : frames.back().top;
+                            return result;
+                        }
+                        // 调用者的 Call 指令给出需要的结果个数
+                        reload();
+                        const uint32_t wanted = pc[-1].args[2];
+                        std::copy_n(slots + first, std::min(count, wanted), slots + func);
+                        AdjustResults(func, count, wanted);
+                        break;
+                    }
+                    case OpCode::ForPrep:
+                    {
+                        const double* init = std::get_if<double>(&base[a].value);
+                        const double* limit = std::get_if<double>(&base[a + 1].value);
+                        const double* step = std::get_if<double>(&base[a + 2].value);
+                        if (init == nullptr)
+                            throw std::runtime_error("'for' 的初始值必须是数字");
+                        if (limit == nullptr)
+                            throw std::runtime_error("'for' 的终值必须是数字");
+                        if (step == nullptr)
+                            throw std::runtime_error("'for' 的步长必须是数字");
+                        if (*step == 0)
+                            throw std::runtime_error("'for' 的步长为 0");
+                        if (*step > 0 ? *init <= *limit : *init >= *limit)
+                            base[a + 3] = *init;
+                        else
+                            pc = code + b;
+                        break;
+                    }
+                    case OpCode::ForLoop:
+                    {
+                        double step = *std::get_if<double>(&base[a + 2].value);
+                        double index = *std::get_if<double>(&base[a].value) + step;
+                        double limit = *std::get_if<double>(&base[a + 1].value);
+                        if (step > 0 ? index <= limit : index >= limit)
+                        {
+                            base[a] = index;
+                            base[a + 3] = index;
+                            pc = code + b;
+                            if (checkpoint(&op))
+                            {
+                                savePc();
+                                return Value();
+                            }
+                        }
+                        break;
+                    }
+                    case OpCode::TForLoop:
+                        if (!base[a + 3].IsNil())
+                        {
+                            base[a + 2] = base[a + 3];
+                            pc = code + b;
+                            if (checkpoint(&op))
+                            {
+                                savePc();
+                                return Value();
+                            }
+                        }
+                        break;
+                    case OpCode::Closure:
+                    {
+                        Proto* proto = closure->proto->protos[b];
+                        Closure* created = heap.NewClosure(proto, static_cast<uint32_t>(proto->upvalues.size()));
+                        size_t frameBase = frames[frameIndex].base;
+                        for (size_t i = 0; i < proto->upvalues.size(); ++i)
+                        {
+                            const UpvalueDesc& desc = proto->upvalues[i];
+                            created->Upvalues()[i] = desc.inStack
+                                ? FindUpvalue(frameBase + desc.index)
+                                : closure->Upvalues()[desc.index];
+                        }
+                        base[a] = Value(created);
+                        collect();
+                        break;
+                    }
+                    case OpCode::Close:
+                    {
+                        size_t level = frames[frameIndex].base + a;
+                        CloseUpvalue(level);
+                        if (!tbcList.empty() && tbcList.back() == level)
+                        {
+                            savePc();
+                            CloseVariables(level, nullptr);
+                            reload();
+                        }
+                        break;
+                    }
+                    case OpCode::Tbc:
+                    {
+                        // 与 Lua 相同，nil 与 false 不需要关闭
+                        const Value& value = base[a];
+                        if (value.IsFalsy())
+                            break;
+                        if (Metamethod(value, MetaEvent::Close) == nullptr)
+                        {
+                            String* name = closure->proto->LocalName(a, static_cast<uint32_t>(pc - 1 - code));
+                            throw std::runtime_error("变量 '" + std::string(name != nullptr ? name->View() : "?") +
+                                "' 的值不可关闭（没有 __close 元方法）");
+                        }
+                        tbcList.push_back(frames[frameIndex].base + a);
+                        break;
+                    }
+                    case OpCode::VarArg:
+                    {
+                        const CallFrame& frame = frames[frameIndex];
+                        const size_t from = frame.base - frame.varargs;
+                        if (b == MultipleValues)
+                        {
+                            const size_t to = frame.base + a;
+                            EnsureStack(to + frame.varargs);
+                            std::copy_n(stack.begin() + from, frame.varargs, stack.begin() + to);
+                            top = to + frame.varargs;
+                            base = stack.data() + frame.base;
+                            break;
+                        }
+                        for (uint32_t i = 0; i < b; ++i)
+                            base[a + i] = i < frame.varargs ? stack[from + i] : Value();
+                        break;
+                    }
+                    }
+                }
+            }
+            catch (...)
+            {
+                // 错误发生在本帧（而不是其调用的原生函数中）时记下出错的位置
+                if (frames.size() == frameIndex + 1)
+                    savePc();
+                throw;
+            }
+        }
+
+        // 算术运算的操作数：数字，或可以转换为数字的字符串
+        static bool ToArithmetic(const Value& value, double& result)
+        {
+            if (const double* d = std::get_if<double>(&value.value))
+            {
+                result = *d;
+                return true;
+            }
+            auto* str = std::get_if<String*>(&value.value);
+            return str != nullptr && StringToNumber((*str)->View(), result);
+        }
+
+        // 位运算的操作数：有精确整数表示的数字（或可转换为这样的数字的字符串）
+        static bool ToBitwise(const Value& value, int64_t& result)
+        {
+            double d;
+            return ToArithmetic(value, d) && NumberToInteger(d, result);
+        }
+
+        // 两个数字或两个字符串的比较；其他情形返回 false，由调用方查找元方法
+        static bool CompareRaw(const Value& x, const Value& y, bool orEqual, bool& result)
+        {
+            const double* l = std::get_if<double>(&x.value);
+            const double* r = std::get_if<double>(&y.value);
+            if (l != nullptr && r != nullptr)
+            {
+                result = orEqual ? *l <= *r : *l < *r;
+                return true;
+            }
+            auto* ls = std::get_if<String*>(&x.value);
+            auto* rs = std::get_if<String*>(&y.value);
+            if (ls != nullptr && rs != nullptr)
+            {
+                result = orEqual ? (*ls)->View() <= (*rs)->View() : (*ls)->View() < (*rs)->View();
+                return true;
+            }
+            return false;
+        }
+
+        // x < y（orEqual 时 x <= y），其他类型的值按 __lt / __le 比较。可能调用脚本函数
+        bool LessThan(const Value& x, const Value& y, bool orEqual)
+        {
+            bool result;
+            if (CompareRaw(x, y, orEqual, result))
+                return result;
+            const MetaEvent event = orEqual ? MetaEvent::Le : MetaEvent::Lt;
+            const Value* handler = Metamethod(x, event);
+            if (handler == nullptr)
+                handler = Metamethod(y, event);
+            if (handler != nullptr)
+            {
+                Value fn = *handler;
+                return !CallMetamethod(fn, x, y).IsFalsy();
+            }
+            if (x.Type() == y.Type())
+                throw std::runtime_error(std::string("尝试比较两个 ") + x.TypeName() + " 值");
+            throw std::runtime_error(std::string("尝试比较 ") + x.TypeName() + " 与 " + y.TypeName());
+        }
+
+        // 值的元表：表各自设置，字符串共享 stringMeta，其他类型没有元表
+        Table* MetatableOf(const Value& value) const
+        {
+            if (auto* table = std::get_if<Table*>(&value.value))
+                return (*table)->metatable;
+            if (std::holds_alternative<String*>(value.value))
+                return stringMeta;
+            return nullptr;
+        }
+
+        const Value* Metamethod(const Value& value, MetaEvent event)
+        {
+            Table* metatable = MetatableOf(value);
+            return metatable != nullptr ? metatable->GetMetamethod(event, metaNames[static_cast<size_t>(event)]) : nullptr;
+        }
+
+        static bool IsFunction(const Value& value)
+        {
+            return std::holds_alternative<Closure*>(value.value) || std::holds_alternative<Function*>(value.value);
+        }
+
+        // 修改表之前调用：表位于某条被缓存的 __index 链上时使全部链缓存失效。
+        // 受监视的表通常是类的方法表与元表，很少在运行中修改
+        void NoteWrite(Table* table)
+        {
+            if (table->watched)
+                ++metaEpoch;
+        }
+
+        // object[key]：键不在表中时沿 __index 查找（函数则调用，否则继续索引它），
+        // 非表值按其元表查找。可能调用脚本函数，参数按值传入
+        Value Index(Value object, Value key, uint32_t operand, const Operation* at)
+        {
+            for (size_t loop = 0; loop < MaxTagLoop; ++loop)
+            {
+                const Value* handler;
+                if (auto* table = std::get_if<Table*>(&object.value))
+                {
+                    const Value& value = (*table)->Get(key);
+                    if (!value.IsNil() || (handler = Metamethod(object, MetaEvent::Index)) == nullptr)
+                        return value;
+                }
+                else if ((handler = Metamethod(object, MetaEvent::Index)) == nullptr)
+                {
+                    IndexError(object, operand, at, loop == 0);
+                }
+                if (IsFunction(*handler))
+                {
+                    Value fn = *handler;
+                    return CallMetamethod(fn, object, key);
+                }
+                object = *handler;
+            }
+            throw std::runtime_error("'__index' 链过长，可能存在循环");
+        }
+
+        // object[key] = value：键不在表中时沿 __newindex 赋值
+        void NewIndex(Value object, Value key, Value value, uint32_t operand, const Operation* at)
+        {
+            for (size_t loop = 0; loop < MaxTagLoop; ++loop)
+            {
+                const Value* handler;
+                if (auto* table = std::get_if<Table*>(&object.value))
+                {
+                    Table* t = *table;
+                    if (t->metatable == nullptr || !t->Get(key).IsNil() ||
+                        (handler = Metamethod(object, MetaEvent::NewIndex)) == nullptr)
+                    {
+                        NoteWrite(t);
+                        t->Set(heap.GetMemory(), key, value);
+                        return;
+                    }
+                }
+                else if ((handler = Metamethod(object, MetaEvent::NewIndex)) == nullptr)
+                {
+                    IndexError(object, operand, at, loop == 0);
+                }
+                if (IsFunction(*handler))
+                {
+                    Value fn = *handler;
+                    CallMetamethod(fn, object, key, value);
+                    return;
+                }
+                object = *handler;
+            }
+            throw std::runtime_error("'__newindex' 链过长，可能存在循环");
+        }
+
+        // ChainTag：observe 中表示"经 __index 链找到"的 tag，哈希位置须小于它
+        static constexpr uint32_t ChainTag = UINT16_MAX;
+
+        // 沿 __index 链解析字符串键（键已确认不在值自身中）：链上全部是表且找到非 nil 的值时填写缓存，
+        // 并把经过的元表与表标为受监视，它们之后被修改时缓存失效
+        bool ResolveChain(Table* metatable, String* key, IndexCache& entry)
+        {
+            String* indexName = metaNames[static_cast<size_t>(MetaEvent::Index)];
+            Table* current = metatable;
+            for (size_t loop = 0; current != nullptr && loop < MaxTagLoop; ++loop)
+            {
+                const Value* handler = current->GetMetamethod(MetaEvent::Index, indexName);
+                if (handler == nullptr)
+                    return false;
+                auto* next = std::get_if<Table*>(&handler->value);
+                if (next == nullptr)
+                    return false;
+                Table* holder = *next;
+                current->watched = true;
+                holder->watched = true;
+                uint32_t slot = holder->SlotOf(key);
+                if (slot != Table::NoSlot && !holder->nodes[slot].value.IsNil())
+                {
+                    entry = { metatable, holder, slot, metaEpoch };
+                    return true;
+                }
+                current = holder->metatable;
+            }
+            return false;
+        }
+
+        // 为 GetFieldMeta / SelfMeta 分配链缓存，优先复用空出的；个数超出 cache 字段的范围时返回 false
+        static bool AllocIndexCache(Proto& proto, const IndexCache& entry, uint16_t& index)
+        {
+            if (!proto.freeIndexCaches.empty())
+            {
+                index = proto.freeIndexCaches.back();
+                proto.freeIndexCaches.pop_back();
+            }
+            else if (proto.indexCaches.size() < ChainTag)
+            {
+                index = static_cast<uint16_t>(proto.indexCaches.size());
+                proto.indexCaches.push_back(entry);
+            }
+            else
+            {
+                return false;
+            }
+            proto.indexCaches[index] = entry;
+            return true;
+        }
+
+        // 根集合：全局变量、内置函数、当前代码块、栈上 [0, top) 的值、打开的上值，
+        // 以及流式执行中解析器持有的字符串与 ffi 库的元表。栈上 top 以上的槽是已结束的调用留下的，回收前清空
+        void MarkRoots()
+        {
+            heap.Mark(globals);
+            heap.Mark(baseline);
+            heap.Mark(libraries);
+            heap.Mark(natives);
+            heap.Mark(stringMeta);
+            heap.Mark(chunk);
+            heap.Mark(mainClosure);
+            size_t live = LiveTop();
+            for (size_t i = 0; i < live; ++i)
+            {
+                heap.Mark(stack[i]);
+            }
+            std::fill(stack.begin() + std::min(live, stack.size()), stack.end(), Value());
+            for (const CallFrame& frame : frames)
+            {
+                heap.Mark(frame.closure);
+            }
+            for (Upvalue* upvalue = openUpvalues; upvalue != nullptr; upvalue = upvalue->openNext)
+            {
+                heap.Mark(upvalue);
+            }
+            if (streamingParser != nullptr)
+                streamingParser->MarkRoots(heap);
+            if (ffi)
+                ffi->MarkRoots(heap);
+        }
+
+        // 记下内置库表（baseline 中的表）与字符串元表当前的字段与元表，Reset 时按此恢复
+        void SaveLibraryBaseline()
+        {
+            Memory& memory = heap.GetMemory();
+            libraries = heap.NewTable();
+            auto save = [&](Table* lib) {
+                Table* copy = heap.NewTable();
+                Value key, value;
+                while (lib->Next(key, value))
+                    copy->Set(memory, key, value);
+                copy->metatable = lib->metatable;
+                libraries->Set(memory, Value(lib), Value(copy));
+            };
+            Value key, value;
+            while (baseline->Next(key, value))
+            {
+                if (auto* lib = std::get_if<Table*>(&value.value))
+                    save(*lib);
+            }
+            save(stringMeta);
+        }
+
+        // 把 table 的字段恢复为 original 中的值，original 中没有的字段置为 nil（留下死键，同名字段再次赋值时直接复用）。
+        // 有字段被改动时返回 true
+        static bool RestoreFields(Memory& memory, Table* table, const Table* original)
+        {
+            bool changed = false;
+            Value key, value;
+            while (table->Next(key, value))
+            {
+                const Value& expected = original->Get(key);
+                if (expected != value)
+                {
+                    table->Set(memory, key, expected);
+                    changed = true;
+                }
+            }
+            key = Value();
+            while (original->Next(key, value))
+            {
+                if (table->Get(key) != value)
+                {
+                    table->Set(memory, key, value);
+                    changed = true;
+                }
+            }
+            return changed;
+        }
+
+        void SetBuiltin(std::string_view name, const Value& value)
+        {
+            String* key = heap.NewString(name);
+            baseline->SetStr(heap.GetMemory(), key, value);
+            globals->SetStr(heap.GetMemory(), key, value);
+        }
+
+        // 注册库表，库中的函数以 "库名.函数名" 登记到 natives
+        void OpenLibrary(std::string_view name, Table* lib)
+        {
+            Memory& memory = heap.GetMemory();
+            Value key, value;
+            while (lib->Next(key, value))
+            {
+                auto* fn = std::get_if<Function*>(&value.value);
+                auto* field = std::get_if<String*>(&key.value);
+                if (fn != nullptr && field != nullptr)
+                    natives->SetStr(memory, heap.NewString(std::string(name) + "." + std::string((*field)->View())), value);
+            }
+            SetBuiltin(name, Value(lib));
+        }
+
+        void RegisterBuiltins()
+        {
+            // 与 Lua 一致：各参数按 tostring 规则转换，以制表符分隔，末尾换行
+            Value::function print_func = [this](std::span<const Value> args) -> Value
+                {
+                char scratch[NumberBufferSize];
+                for (size_t i = 0; i < args.size(); ++i) {
+                    if (i > 0)
+                        output.Write("\t");
+                    output.Write(args[i].ToStringView(scratch));
+                }
+                output.Write("\n");
+                return Value{}; // 返回空值（std::monostate）
+                };
+            Register("print", print_func);
+
+            Value::function tostring_func = [this](std::span<const Value> args) -> Value
+                {
+                char scratch[NumberBufferSize];
+                return Value(heap.NewString(args.empty() ? "nil" : args[0].ToStringView(scratch)));
+                };
+            Register("tostring", tostring_func);
+
+            Table* stringLib = strings.Open();
+            OpenLibrary("string", stringLib);
+            stringMeta = heap.NewTable();
+            stringMeta->SetStr(heap.GetMemory(), metaNames[static_cast<size_t>(MetaEvent::Index)], Value(stringLib));
+            OpenLibrary("table", tables.Open());
+
+            // 元表与绕过元方法的原始访问
+            Value::function setmetatable_func = [this](std::span<const Value> args) -> Value
+                {
+                Table* table = NativeLibrary::CheckTable(args, 0, "setmetatable");
+                Table* metatable = nullptr;
+                if (args.size() >= 2 && std::holds_alternative<Table*>(args[1].value))
+                    metatable = *std::get_if<Table*>(&args[1].value);
+                else if (args.size() < 2 || !args[1].IsNil())
+                    NativeLibrary::TypeError(args, 1, "setmetatable", "nil 或 table");
+                if (table->metatable != nullptr && !table->metatable->GetStr(metatableKey).IsNil())
+                    throw std::runtime_error("无法修改受保护的元表");
+                NoteWrite(table);
+                table->metatable = metatable;
+                // 与 Lua 相同，设置元表时已有 __gc 的对象才会被终结
+                if (metatable != nullptr && Metamethod(args[0], MetaEvent::Gc) != nullptr)
+                    heap.RegisterFinalizer(table);
+                return args[0];
+                };
+            Register("setmetatable", setmetatable_func);
+
+            Value::function getmetatable_func = [this](std::span<const Value> args) -> Value
+                {
+                if (args.empty())
+                    NativeLibrary::ArgError(0, "getmetatable", "需要一个值");
+                Table* metatable = MetatableOf(args[0]);
+                if (metatable == nullptr)
+                    return Value();
+                const Value& field = metatable->GetStr(metatableKey);
+                return field.IsNil() ? Value(metatable) : field;
+                };
+            Register("getmetatable", getmetatable_func);
+
+            Value::function rawget_func = [](std::span<const Value> args) -> Value
+                {
+                Table* table = NativeLibrary::CheckTable(args, 0, "rawget");
+                return args.size() >= 2 ? table->Get(args[1]) : Value();
+                };
+            Register("rawget", rawget_func);
+
+            Value::function rawset_func = [this](std::span<const Value> args) -> Value
+                {
+                Table* table = NativeLibrary::CheckTable(args, 0, "rawset");
+                NoteWrite(table);
+                table->Set(heap.GetMemory(), args.size() >= 2 ? args[1] : Value(), args.size() >= 3 ? args[2] : Value());
+                return args[0];
+                };
+            Register("rawset", rawset_func);
+
+            Value::function rawequal_func = [](std::span<const Value> args) -> Value
+                {
+                if (args.size() < 2)
+                    NativeLibrary::ArgError(args.size(), "rawequal", "需要一个值");
+                return Value(args[0] == args[1]);
+                };
+            Register("rawequal", rawequal_func);
+
+            Value::function rawlen_func = [](std::span<const Value> args) -> Value
+                {
+                if (!args.empty())
+                {
+                    if (auto* table = std::get_if<Table*>(&args[0].value))
+                        return Value(static_cast<double>((*table)->Length()));
+                    if (auto* str = std::get_if<String*>(&args[0].value))
+                        return Value(static_cast<double>((*str)->length));
+                }
+                NativeLibrary::ArgError(0, "rawlen", "需要 table 或 string");
+                };
+            Register("rawlen", rawlen_func);
+
+            // select('#', ...) 返回其余参数的个数；select(n, ...) 返回第 n 个及之后的参数，n 为负数时从末尾数起
+            Value::multiFunction select_func = [](std::span<const Value> args, Results& results)
+                {
+                const int64_t rest = static_cast<int64_t>(args.size()) - 1;
+                if (!args.empty())
+                {
+                    auto* str = std::get_if<String*>(&args[0].value);
+                    if (str != nullptr && (*str)->View() == "#")
+                    {
+                        results.Push(Value(static_cast<double>(rest)));
+                        return;
+                    }
+                }
+                int64_t n = NativeLibrary::CheckInteger(args, 0, "select");
+                if (n < 0)
+                    n += rest + 1;
+                if (n < 1)
+                    NativeLibrary::ArgError(0, "select", "索引超出范围");
+                for (int64_t i = n; i <= rest; ++i)
+                    results.Push(args[static_cast<size_t>(i)]);
+                };
+            Register("select", select_func);
+
+            // next(t [, k])：返回 k 之后的一项的键与值（k 为 nil 时为第一项），遍历结束时返回 nil
+            Value::multiFunction next_func = [](std::span<const Value> args, Results& results)
+                {
+                Table* table = NativeLibrary::CheckTable(args, 0, "next");
+                Value key = args.size() >= 2 ? args[1] : Value();
+                Value value;
+                if (!table->Next(key, value))
+                {
+                    results.Push(Value());
+                    return;
+                }
+                results.Push(key);
+                results.Push(value);
+                };
+            Register("next", next_func);
+
+            // pairs(t) 返回 next, t, nil，供泛型 for 遍历全部键值对（不查看 __pairs 元方法）
+            const Value next = natives->GetStr(heap.NewString("next"));
+            Value::multiFunction pairs_func = [next](std::span<const Value> args, Results& results)
+                {
+                NativeLibrary::CheckTable(args, 0, "pairs");
+                Value table = args[0];
+                results.Push(next);
+                results.Push(table);
+                results.Push(Value());
+                };
+            Register("pairs", pairs_func);
+
+            // ipairs(t) 返回迭代函数, t, 0：依次得到 1, t[1]、2, t[2]……直到遇到 nil（按原始访问取值）。
+            // 迭代函数以不会与全局变量冲突的名字登记到 natives，随之存活并能保存到快照中
+            Value::multiFunction ipairs_next = [](std::span<const Value> args, Results& results)
+                {
+                Table* table = NativeLibrary::CheckTable(args, 0, "ipairs");
+                int64_t i = NativeLibrary::CheckInteger(args, 1, "ipairs") + 1;
+                const Value& value = table->GetInt(i);
+                if (value.IsNil())
+                {
+                    results.Push(Value());
+                    return;
+                }
+                Value element = value;
+                results.Push(Value(static_cast<double>(i)));
+                results.Push(element);
+                };
+            const Value iterator(heap.NewFunction(std::move(ipairs_next)));
+            natives->SetStr(heap.GetMemory(), heap.NewString("(ipairs iterator)"), iterator);
+            Value::multiFunction ipairs_func = [iterator](std::span<const Value> args, Results& results)
+                {
+                NativeLibrary::CheckTable(args, 0, "ipairs");
+                Value table = args[0];
+                results.Push(iterator);
+                results.Push(table);
+                results.Push(Value(0.0));
+                };
+            Register("ipairs", ipairs_func);
+        }
+
+        // 以下函数只在出错时调用，执行期不维护任何调试信息
+
+        // 操作数类型错误："尝试<before><类型> 值<after> (变量说明)"
+        [[noreturn]] void OperandError(const char* before, const char* after, const Value& value, uint32_t operand, const Operation* at) const
+        {
+            const Proto* proto = frames.back().closure->proto;
+            uint32_t pc = static_cast<uint32_t>(at - proto->code.data());
+            throw std::runtime_error(std::string("尝试") + before + value.TypeName() + " 值" + after + VarInfo(proto, pc, operand));
+        }
+
+        // 算术运算与位运算没有元方法时：报告第一个不能转换的操作数
+        [[noreturn]] void ArithError(const Value& x, uint32_t xOperand, const Value& y, uint32_t yOperand, const Operation* at) const
+        {
+            double d;
+            if (!ToArithmetic(x, d))
+                OperandError("对 ", "进行算术运算", x, xOperand, at);
+            OperandError("对 ", "进行算术运算", y, yOperand, at);
+        }
+
+        [[noreturn]] void BitError(const Value& x, uint32_t xOperand, const Value& y, uint32_t yOperand, const Operation* at) const
+        {
+            double d;
+            if (!ToArithmetic(x, d))
+                OperandError("对 ", "进行位运算", x, xOperand, at);
+            if (!ToArithmetic(y, d))
+                OperandError("对 ", "进行位运算", y, yOperand, at);
+            throw std::runtime_error("数字没有整数表示");
+        }
+
+        // 索引非表值且没有 __index / __newindex；沿链索引到的值不在寄存器中，不附带变量说明
+        [[noreturn]] void IndexError(const Value& object, uint32_t operand, const Operation* at, bool direct) const
+        {
+            if (direct)
+                OperandError("索引 ", "", object, operand, at);
+            throw std::runtime_error(std::string("尝试索引 ") + object.TypeName() + " 值");
+        }
+
+        // 第 pc 条指令处寄存器 reg 中的值的来源：局部变量名，或向前找到写入它的指令
+        static NameKind FindName(const Proto* proto, uint32_t pc, uint32_t reg, String*& name)
+        {
+            name = proto->LocalName(reg, pc);
+            if (name != nullptr)
+                return NameKind::Local;
+
+            for (uint32_t i = pc; i-- > 0;)
+            {
+                const Operation& op = proto->code[i];
+                if (!Writes(op, reg))
+                    continue;
+                switch (GenericOp(op.opCode))
+                {
+                case OpCode::GetGlobal:
+                    name = *std::get_if<String*>(&proto->constants[op.args[1]].value);
+                    return NameKind::Global;
+                case OpCode::GetField:
+                    name = *std::get_if<String*>(&proto->constants[op.args[2]].value);
+                    return NameKind::Field;
+                case OpCode::GetUpval:
+                    name = proto->upvalues[op.args[1]].name;
+                    return NameKind::Upvalue;
+                case OpCode::Self:
+                    if (reg != op.args[0] || !IsConstantString(proto, op.args[2]))
+                        return NameKind::None;
+                    name = *std::get_if<String*>(&proto->constants[op.args[2] & ~ConstantBit].value);
+                    return NameKind::Method;
+                case OpCode::LoadK:
+                    if (!IsConstantString(proto, op.args[1] | ConstantBit))
+                        return NameKind::None;
+                    name = *std::get_if<String*>(&proto->constants[op.args[1]].value);
+                    return NameKind::Constant;
+                case OpCode::Move:
+                    name = proto->LocalName(op.args[1], i);
+                    return name != nullptr ? NameKind::Local : NameKind::None;
+                default:
+                    return NameKind::None;
+                }
+            }
+            return NameKind::None;
+        }
+
+        static bool IsConstantString(const Proto* proto, uint32_t operand)
+        {
+            return (operand & ConstantBit) != 0 &&
+                std::holds_alternative<String*>(proto->constants[operand & ~ConstantBit].value);
+        }
+
+        // 指令是否写入寄存器 reg
+        static bool Writes(const Operation& op, uint32_t reg)
+        {
+            const uint32_t a = op.args[0];
+            switch (GenericOp(op.opCode))
+            {
+            case OpCode::SetUpval:
+            case OpCode::SetGlobal:
+            case OpCode::SetField:
+            case OpCode::SetIndex:
+            case OpCode::SetList:
+            case OpCode::Jmp:
+            case OpCode::Test:
+            case OpCode::MetaTest:
+            case OpCode::Return:
+            case OpCode::Close:
+            case OpCode::Tbc:
+                return false;
+            case OpCode::Self:
+                return reg == a || reg == a + 1;
+            case OpCode::Call:
+                return reg >= a;
+            case OpCode::VarArg:
+                return op.args[1] == MultipleValues ? reg >= a : reg >= a && reg < a + op.args[1];
+            case OpCode::ForPrep:
+                return reg == a + 3;
+            case OpCode::ForLoop:
+                return reg == a || reg == a + 3;
+            case OpCode::TForLoop:
+                return reg == a + 2;
+            default:
+                return !IsCompareJump(op.opCode) && reg == a;
+            }
+        }
+
+        // 错误信息中的变量说明，如 " (全局变量 'x')"
+        static std::string VarInfo(const Proto* proto, uint32_t pc, uint32_t operand)
+        {
+            String* name = nullptr;
+            NameKind kind;
+            if (operand & ConstantBit)
+            {
+                if (!IsConstantString(proto, operand))
+                    return "";
+                name = *std::get_if<String*>(&proto->constants[operand & ~ConstantBit].value);
+                kind = NameKind::Constant;
+            }
+            else
+            {
+                kind = FindName(proto, pc, operand, name);
+            }
+
+            const char* description = nullptr;
+            switch (kind)
+            {
+            case NameKind::Global:   description = "全局变量"; break;
+            case NameKind::Local:    description = "局部变量"; break;
+            case NameKind::Field:    description = "字段"; break;
+            case NameKind::Method:   description = "方法"; break;
+            case NameKind::Upvalue:  description = "上值"; break;
+            case NameKind::Constant: description = "常量"; break;
+            case NameKind::None:     return "";
+            }
+            return std::string(" (") + description + " '" + std::string(name->View()) + "')";
+        }
+
+        static std::string SourceName(const Proto* proto)
+        {
+            return proto->source != nullptr ? std::string(proto->source->View()) : "?";
+        }
+
+        // 帧当前执行到的行号；刚进入、还没有执行指令的函数取其定义所在的行
+        static int CurrentLine(const CallFrame& frame)
+        {
+            return frame.pc > 0 ? frame.closure->proto->lineInfo.GetLine(frame.pc - 1) : frame.closure->proto->lineDefined;
+        }
+
+        // "chunk:行: " 位置前缀，取最内层的脚本函数帧（原生函数出错时即调用它的位置）
+        std::string Where() const
+        {
+            for (size_t i = frames.size(); i-- > 0;)
+            {
+                if (frames[i].closure == nullptr)
+                    continue;
+                int line = CurrentLine(frames[i]);
+                return SourceName(frames[i].closure->proto) + ":" + (line > 0 ? std::to_string(line) : "?") + ": ";
+            }
+            return "";
+        }
+
+        // 第 i 帧的函数在调用处的名字，如 "function 'print'"、"local 'f'"；未知时返回空串
+        std::string FunctionName(size_t i) const
+        {
+            if (i == 0 || frames[i - 1].closure == nullptr || frames[i - 1].pc == 0)
+                return "";
+            const CallFrame& caller = frames[i - 1];
+            const Proto* proto = caller.closure->proto;
+            const Operation& call = proto->code[caller.pc - 1];
+            if (GenericOp(call.opCode) != OpCode::Call)
+                return "";
+            String* name = nullptr;
+            switch (FindName(proto, caller.pc - 1, call.args[0], name))
+            {
+            case NameKind::Global:  return "function '" + std::string(name->View()) + "'";
+            case NameKind::Local:   return "local '" + std::string(name->View()) + "'";
+            case NameKind::Field:   return "field '" + std::string(name->View()) + "'";
+            case NameKind::Method:  return "method '" + std::string(name->View()) + "'";
+            case NameKind::Upvalue: return "upvalue '" + std::string(name->View()) + "'";
+            default:                return "";
+            }
+        }
+
+        // 与 Lua 相同格式的调用栈回溯，最内层在前；层数过多时只保留最内的 10 层与最外的 11 层
+        std::string Traceback() const
+        {
+            constexpr size_t InnerLevels = 10;
+            constexpr size_t OuterLevels = 11;
+            std::string traceback = "stack traceback:";
+            for (size_t i = frames.size(); i-- > 0;)
+            {
+                size_t level = frames.size() - 1 - i;
+                if (level == InnerLevels && frames.size() > InnerLevels + OuterLevels)
+                {
+                    size_t skipped = frames.size() - InnerLevels - OuterLevels;
+                    traceback += "\n\t...\t(skipping " + std::to_string(skipped) + " levels)";
+                    i -= skipped - 1;
+                    continue;
+                }
+                const CallFrame& frame = frames[i];
+                std::string name = FunctionName(i);
+                if (frame.closure == nullptr)
+                {
+                    traceback += "\n\t[C]: in " + (name.empty() ? std::string("?") : name);
+                    continue;
+                }
+                const Proto* proto = frame.closure->proto;
+                int line = CurrentLine(frame);
+                auto location = [&]() {
+                    return "\n\t" + SourceName(proto) + ":" + (line > 0 ? std::to_string(line) : "?") + ": in ";
+                };
+                // 停在内联展开的函数体中时先补出被内联的调用层（内层的展开记录在后），本帧的行号取最外层展开的调用处
+                for (size_t k = proto->inlines.size(); frame.pc > 0 && k-- > 0;)
+                {
+                    const InlineInfo& info = proto->inlines[k];
+                    if (frame.pc - 1 < info.startPc || frame.pc - 1 >= info.endPc)
+                        continue;
+                    traceback += location() + (info.upvalue ? "upvalue '" : "local '") + std::string(info.name->View()) + "'";
+                    line = info.line;
+                }
+                traceback += location();
+                if (proto->lineDefined == 0)
+                    traceback += "main chunk";
+                else if (!name.empty())
+                    traceback += name;
+                else
+                    traceback += "function <" + SourceName(proto) + ":" + std::to_string(proto->lineDefined) + ">";
+            }
+            return traceback;
+        }
     };
-}
\ No newline at end of file
+}
@@ -1,12 +1,14 @@
 ﻿#include <iostream>
+#ifdef _WIN32
 #include <Windows.h>
+#endif
 #include "LuaVM.h"
-int main()
+int main(int argc, char* argv[])
 {
     //system("chcp 65001");
     try {
         std::cout << "Creating VM..." << std::endl;
-        Engine::VM vm("../Example/comprehensive_test.lua");
+        Engine::VM vm(argc > 1 ? argv[1] : "../Example/comprehensive_test.lua");
         std::cout << "Executing..." << std::endl;
         vm.Execute();
         std::cout << "Done!" << std::endl;
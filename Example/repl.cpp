@@ -0,0 +1,105 @@
+﻿// 交互式解释器与流式执行入口，基于 VM::ExecuteStream
+//   repl                  交互模式：逐行输入，语句不完整时以 ">>" 提示继续输入
+//   repl -                从标准输入流式执行（适用于管道）
+//   repl <script.lua>     流式执行脚本文件
+//   --batch=<n>           每批解析并执行的语句数（默认 1）
+//   --stats               结束后把执行统计（含可用时的硬件计数器）以 JSON 输出到标准错误
+//   --ffi                 打开 ffi 库，允许脚本调用 C 函数（只用于受信任的脚本）
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "LuaVM.h"
+
+static int RunInteractive(Engine::VM& vm)
+{
+    std::string chunk;
+    std::string line;
+    std::cout << "> " << std::flush;
+    while (std::getline(std::cin, line))
+    {
+        chunk += line;
+        chunk += '\n';
+
+        // 一次输入作为一整批编译后再执行：语句不完整时不会执行其中已写完的部分
+        std::istringstream input(chunk);
+        try
+        {
+            vm.ExecuteStream(input, "stdin", SIZE_MAX);
+            chunk.clear();
+        }
+        catch (const Engine::SyntaxError& e)
+        {
+            if (!e.Incomplete())
+            {
+                std::cout << e.what() << std::endl;
+                chunk.clear();
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << e.what() << std::endl;
+            chunk.clear();
+        }
+        std::cout << (chunk.empty() ? "> " : ">> ") << std::flush;
+    }
+    std::cout << std::endl;
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t batchSize = 1;
+    bool stats = false;
+    bool ffi = false;
+    std::string script;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.rfind("--batch=", 0) == 0)
+            batchSize = std::max<size_t>(1, std::strtoull(arg.c_str() + 8, nullptr, 10));
+        else if (arg == "--stats")
+            stats = true;
+        else if (arg == "--ffi")
+            ffi = true;
+        else
+            script = arg;
+    }
+
+    Engine::VM vm;
+    vm.SetHardwareCounters(stats);
+    if (ffi)
+        vm.OpenFFI();
+    int status = 0;
+    try
+    {
+        if (script.empty())
+        {
+            status = RunInteractive(vm);
+        }
+        else if (script == "-")
+        {
+            vm.ExecuteStream(std::cin, "stdin", batchSize);
+        }
+        else
+        {
+            std::ifstream file(script);
+            if (!file.is_open())
+            {
+                std::cerr << "无法打开脚本文件：" << script << std::endl;
+                return 1;
+            }
+            vm.ExecuteStream(file, script, batchSize);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        status = 1;
+    }
+    if (stats)
+        std::cerr << vm.Stats().ToJson() << std::endl;
+    return status;
+}
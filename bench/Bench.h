@@ -0,0 +1,612 @@
+﻿#pragma once
+
+// 极简基准测试框架
+// 接口与命令行参数取 Google Benchmark 的子集（State、range-for 计时循环、--benchmark_* 参数、
+// JSON 输出格式），因此结果可以直接交给 Google Benchmark 的 compare.py 等工具做回归对比。
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace Bench
+{
+    class State
+    {
+    public:
+        State(uint64_t maxIterations, std::vector<int64_t> arguments)
+            : maxIterations(maxIterations), arguments(std::move(arguments))
+        { }
+
+        // for (auto _ : state) 计时循环。循环变量的类型标记为 [[maybe_unused]]，
+        // 与 Google Benchmark 相同，-Wall -Wextra 下不会对每个计时循环报告未使用的变量
+        struct [[maybe_unused]] Value
+        { };
+
+        struct Iterator
+        {
+            State* parent;
+            uint64_t remaining;
+
+            bool operator!=(const Iterator&)
+            {
+                if (remaining != 0)
+                    return true;
+                parent->StopTimer();
+                return false;
+            }
+            Iterator& operator++()
+            {
+                --remaining;
+                return *this;
+            }
+            Value operator*() const { return {}; }
+        };
+
+        Iterator begin()
+        {
+            StartTimer();
+            return { this, errorOccurred ? 0 : maxIterations };
+        }
+        Iterator end() { return { this, 0 }; }
+
+        void PauseTiming() { StopTimer(); }
+        void ResumeTiming() { StartTimer(); }
+
+        int64_t range(size_t index = 0) const { return arguments.at(index); }
+        uint64_t iterations() const { return maxIterations; }
+
+        void SetBytesProcessed(int64_t bytes) { bytesProcessed = bytes; }
+        void SetItemsProcessed(int64_t items) { itemsProcessed = items; }
+        void SetLabel(std::string text) { label = std::move(text); }
+
+        // 标记本次测试失败（例如脚本无法编译），结果中会带上错误信息而不是耗时
+        void SkipWithError(std::string message)
+        {
+            errorOccurred = true;
+            errorMessage = std::move(message);
+        }
+
+        // 自定义计数器，按原值输出
+        std::vector<std::pair<std::string, double>> counters;
+
+    private:
+        friend class Runner;
+
+        void StartTimer()
+        {
+            if (running)
+                return;
+            running = true;
+            wallStart = std::chrono::steady_clock::now();
+            cpuStart = std::clock();
+        }
+
+        void StopTimer()
+        {
+            if (!running)
+                return;
+            running = false;
+            realSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+            cpuSeconds += static_cast<double>(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+        }
+
+        uint64_t maxIterations;
+        std::vector<int64_t> arguments;
+
+        bool running = false;
+        std::chrono::steady_clock::time_point wallStart;
+        std::clock_t cpuStart = 0;
+        double realSeconds = 0;
+        double cpuSeconds = 0;
+
+        int64_t bytesProcessed = 0;
+        int64_t itemsProcessed = 0;
+        std::string label;
+        bool errorOccurred = false;
+        std::string errorMessage;
+    };
+
+    using Function = std::function<void(State&)>;
+
+    class Benchmark
+    {
+    public:
+        Benchmark(std::string name, Function func)
+            : name(std::move(name)), func(std::move(func))
+        { }
+
+        // 追加一组参数，每组参数单独成为一个测试实例 name/arg
+        Benchmark* Arg(int64_t value)
+        {
+            argumentSets.push_back({ value });
+            return this;
+        }
+
+        Benchmark* Args(std::vector<int64_t> values)
+        {
+            argumentSets.push_back(std::move(values));
+            return this;
+        }
+
+        // 固定迭代次数，跳过自动标定（适合单次就很耗时的整程序测试）
+        Benchmark* Iterations(uint64_t count)
+        {
+            fixedIterations = count;
+            return this;
+        }
+
+        std::string name;
+        Function func;
+        std::vector<std::vector<int64_t>> argumentSets;
+        uint64_t fixedIterations = 0;
+    };
+
+    inline std::vector<std::unique_ptr<Benchmark>>& Registry()
+    {
+        static std::vector<std::unique_ptr<Benchmark>> benchmarks;
+        return benchmarks;
+    }
+
+    inline Benchmark* Register(std::string name, Function func)
+    {
+        Registry().push_back(std::make_unique<Benchmark>(std::move(name), std::move(func)));
+        return Registry().back().get();
+    }
+
+    struct Result
+    {
+        std::string name;
+        std::string runName;
+        std::string runType = "iteration";
+        std::string aggregateName;
+        int repetitions = 1;
+        int repetitionIndex = 0;
+        uint64_t iterations = 0;
+        double realTime = 0;    // 每次迭代纳秒
+        double cpuTime = 0;     // 每次迭代纳秒
+        double bytesPerSecond = 0;
+        double itemsPerSecond = 0;
+        std::string label;
+        bool errorOccurred = false;
+        std::string errorMessage;
+        std::vector<std::pair<std::string, double>> counters;
+    };
+
+    inline std::string JsonEscape(const std::string& text)
+    {
+        std::string out;
+        out.reserve(text.size() + 2);
+        for (unsigned char c : text)
+        {
+            switch (c)
+            {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20)
+                {
+                    char buf[8];
+                    std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                }
+                else
+                {
+                    out += static_cast<char>(c);
+                }
+                break;
+            }
+        }
+        return out;
+    }
+
+    inline std::string JsonNumber(double value)
+    {
+        if (!std::isfinite(value))
+            return "0";
+        char buf[64];
+        std::snprintf(buf, sizeof(buf), "%.17g", value);
+        return buf;
+    }
+
+    class Runner
+    {
+    public:
+        int Main(int argc, char* argv[])
+        {
+            executable = argc > 0 ? argv[0] : "";
+            for (int i = 1; i < argc; ++i)
+            {
+                if (!ParseFlag(argv[i]))
+                {
+                    std::cerr << "未知参数: " << argv[i] << std::endl;
+                    PrintUsage();
+                    return 1;
+                }
+            }
+
+            std::regex pattern;
+            try
+            {
+                pattern = std::regex(filter);
+            }
+            catch (const std::regex_error&)
+            {
+                std::cerr << "无效的过滤表达式: " << filter << std::endl;
+                return 1;
+            }
+
+            std::vector<std::pair<std::string, std::pair<Benchmark*, std::vector<int64_t>>>> instances;
+            for (const auto& bench : Registry())
+            {
+                if (bench->argumentSets.empty())
+                {
+                    instances.push_back({ bench->name, { bench.get(), {} } });
+                    continue;
+                }
+                for (const auto& args : bench->argumentSets)
+                {
+                    std::string name = bench->name;
+                    for (int64_t arg : args)
+                        name += "/" + std::to_string(arg);
+                    instances.push_back({ name, { bench.get(), args } });
+                }
+            }
+
+            if (listOnly)
+            {
+                for (const auto& [name, _] : instances)
+                {
+                    if (std::regex_search(name, pattern))
+                        std::cout << name << std::endl;
+                }
+                return 0;
+            }
+
+            std::vector<Result> results;
+            if (format == "console")
+                PrintConsoleHeader();
+            for (const auto& [name, instance] : instances)
+            {
+                if (!std::regex_search(name, pattern))
+                    continue;
+
+                std::vector<Result> runs;
+                for (int rep = 0; rep < repetitions; ++rep)
+                {
+                    Result result = RunOne(name, *instance.first, instance.second);
+                    result.repetitions = repetitions;
+                    result.repetitionIndex = rep;
+                    runs.push_back(result);
+                    results.push_back(result);
+                    if (format == "console")
+                        PrintConsoleRow(result);
+                    if (result.errorOccurred)
+                        break;
+                }
+
+                if (repetitions > 1 && !runs.back().errorOccurred)
+                {
+                    for (auto& aggregate : Aggregate(name, runs))
+                    {
+                        if (format == "console")
+                            PrintConsoleRow(aggregate);
+                        results.push_back(std::move(aggregate));
+                    }
+                }
+            }
+
+            if (format == "json")
+                WriteJson(std::cout, results);
+
+            if (!outPath.empty())
+            {
+                std::ofstream out(outPath);
+                if (!out)
+                {
+                    std::cerr << "无法写入结果文件: " << outPath << std::endl;
+                    return 1;
+                }
+                if (outFormat == "json")
+                    WriteJson(out, results);
+                else
+                    WriteConsole(out, results);
+            }
+            return 0;
+        }
+
+    private:
+        bool ParseFlag(const std::string& arg)
+        {
+            auto value = [&](const std::string& flag, std::string& target) {
+                std::string prefix = "--" + flag + "=";
+                if (arg.rfind(prefix, 0) != 0)
+                    return false;
+                target = arg.substr(prefix.size());
+                return true;
+            };
+
+            std::string text;
+            if (value("benchmark_filter", filter))
+                return true;
+            if (value("benchmark_out", outPath))
+                return true;
+            if (value("benchmark_out_format", outFormat))
+                return outFormat == "json" || outFormat == "console";
+            if (value("benchmark_format", format))
+                return format == "json" || format == "console";
+            if (value("benchmark_min_time", text))
+            {
+                if (!text.empty() && text.back() == 's')
+                    text.pop_back();
+                minTime = std::stod(text);
+                return minTime > 0;
+            }
+            if (value("benchmark_repetitions", text))
+            {
+                repetitions = std::max(1, std::stoi(text));
+                return true;
+            }
+            if (arg == "--benchmark_list_tests" || arg == "--benchmark_list_tests=true")
+            {
+                listOnly = true;
+                return true;
+            }
+            return false;
+        }
+
+        void PrintUsage() const
+        {
+            std::cerr << "用法: " << executable << "\n"
+                << "  [--benchmark_filter=<正则>]\n"
+                << "  [--benchmark_min_time=<秒>]\n"
+                << "  [--benchmark_repetitions=<次数>]\n"
+                << "  [--benchmark_format=console|json]\n"
+                << "  [--benchmark_out=<文件>] [--benchmark_out_format=json|console]\n"
+                << "  [--benchmark_list_tests]" << std::endl;
+        }
+
+        Result RunOne(const std::string& name, Benchmark& bench, const std::vector<int64_t>& args)
+        {
+            uint64_t iterations = bench.fixedIterations ? bench.fixedIterations : 1;
+            while (true)
+            {
+                State state(iterations, args);
+                try
+                {
+                    bench.func(state);
+                }
+                catch (const std::exception& e)
+                {
+                    state.SkipWithError(e.what());
+                }
+                state.StopTimer();
+
+                bool done = state.errorOccurred || bench.fixedIterations != 0 ||
+                    state.realSeconds >= minTime || iterations >= 1000000000ull;
+                if (done)
+                    return MakeResult(name, state, iterations);
+
+                // 按已测得的耗时预测达到最短测试时间所需的迭代次数（与 Google Benchmark 的策略一致）
+                double multiplier = state.realSeconds <= minTime / 10 ? 10.0 : minTime * 1.4 / state.realSeconds;
+                iterations = std::max<uint64_t>(iterations + 1, static_cast<uint64_t>(iterations * multiplier));
+            }
+        }
+
+        Result MakeResult(const std::string& name, const State& state, uint64_t iterations) const
+        {
+            Result result;
+            result.name = name;
+            result.runName = name;
+            result.iterations = iterations;
+            result.label = state.label;
+            result.errorOccurred = state.errorOccurred;
+            result.errorMessage = state.errorMessage;
+            result.counters = state.counters;
+            if (state.errorOccurred)
+                return result;
+
+            result.realTime = state.realSeconds * 1e9 / iterations;
+            result.cpuTime = state.cpuSeconds * 1e9 / iterations;
+            if (state.realSeconds > 0)
+            {
+                result.bytesPerSecond = state.bytesProcessed / state.realSeconds;
+                result.itemsPerSecond = state.itemsProcessed / state.realSeconds;
+            }
+            return result;
+        }
+
+        static std::vector<Result> Aggregate(const std::string& name, const std::vector<Result>& runs)
+        {
+            auto summarize = [&](const std::string& kind, auto reduce) {
+                Result result = runs.front();
+                result.name = name + "_" + kind;
+                result.runType = "aggregate";
+                result.aggregateName = kind;
+                result.realTime = reduce([](const Result& r) { return r.realTime; });
+                result.cpuTime = reduce([](const Result& r) { return r.cpuTime; });
+                result.bytesPerSecond = reduce([](const Result& r) { return r.bytesPerSecond; });
+                result.itemsPerSecond = reduce([](const Result& r) { return r.itemsPerSecond; });
+                return result;
+            };
+
+            auto mean = [&](auto field) {
+                double sum = 0;
+                for (const auto& run : runs)
+                    sum += field(run);
+                return sum / runs.size();
+            };
+            auto median = [&](auto field) {
+                std::vector<double> values;
+                for (const auto& run : runs)
+                    values.push_back(field(run));
+                std::sort(values.begin(), values.end());
+                size_t mid = values.size() / 2;
+                return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+            };
+            auto stddev = [&](auto field) {
+                double avg = mean(field);
+                double sum = 0;
+                for (const auto& run : runs)
+                    sum += (field(run) - avg) * (field(run) - avg);
+                return std::sqrt(sum / (runs.size() - 1));
+            };
+
+            return { summarize("mean", mean), summarize("median", median), summarize("stddev", stddev) };
+        }
+
+        static void PrintConsoleHeader()
+        {
+            char line[160];
+            std::snprintf(line, sizeof(line), "%-48s %15s %15s %12s", "Benchmark", "Time", "CPU", "Iterations");
+            std::cout << line << "\n" << std::string(93, '-') << std::endl;
+        }
+
+        static std::string FormatRow(const Result& result)
+        {
+            char line[256];
+            if (result.errorOccurred)
+            {
+                std::snprintf(line, sizeof(line), "%-48s ERROR OCCURRED: ", result.name.c_str());
+                return line + result.errorMessage;
+            }
+
+            std::snprintf(line, sizeof(line), "%-48s %12.0f ns %12.0f ns %12llu",
+                result.name.c_str(), result.realTime, result.cpuTime,
+                static_cast<unsigned long long>(result.iterations));
+            std::string row = line;
+            if (result.bytesPerSecond > 0)
+            {
+                std::snprintf(line, sizeof(line), " %.2fMB/s", result.bytesPerSecond / (1024.0 * 1024.0));
+                row += line;
+            }
+            if (result.itemsPerSecond > 0)
+            {
+                std::snprintf(line, sizeof(line), " items/s=%.4g", result.itemsPerSecond);
+                row += line;
+            }
+            for (const auto& [counter, value] : result.counters)
+            {
+                std::snprintf(line, sizeof(line), " %s=%.6g", counter.c_str(), value);
+                row += line;
+            }
+            if (!result.label.empty())
+                row += " " + result.label;
+            return row;
+        }
+
+        static void PrintConsoleRow(const Result& result)
+        {
+            std::cout << FormatRow(result) << std::endl;
+        }
+
+        static void WriteConsole(std::ostream& out, const std::vector<Result>& results)
+        {
+            for (const auto& result : results)
+                out << FormatRow(result) << "\n";
+        }
+
+        void WriteJson(std::ostream& out, const std::vector<Result>& results) const
+        {
+            char date[64];
+            std::time_t now = std::time(nullptr);
+            std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+
+            out << "{\n  \"context\": {\n"
+                << "    \"date\": \"" << date << "\",\n"
+                << "    \"executable\": \"" << JsonEscape(executable) << "\",\n"
+                << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+#ifdef NDEBUG
+                << "    \"library_build_type\": \"release\"\n"
+#else
+                << "    \"library_build_type\": \"debug\"\n"
+#endif
+                << "  },\n  \"benchmarks\": [";
+
+            for (size_t i = 0; i < results.size(); ++i)
+            {
+                const Result& r = results[i];
+                out << (i ? ",\n" : "\n") << "    {\n"
+                    << "      \"name\": \"" << JsonEscape(r.name) << "\",\n"
+                    << "      \"run_name\": \"" << JsonEscape(r.runName) << "\",\n"
+                    << "      \"run_type\": \"" << r.runType << "\",\n";
+                if (!r.aggregateName.empty())
+                    out << "      \"aggregate_name\": \"" << r.aggregateName << "\",\n";
+                out << "      \"repetitions\": " << r.repetitions << ",\n"
+                    << "      \"repetition_index\": " << r.repetitionIndex << ",\n";
+                if (r.errorOccurred)
+                {
+                    out << "      \"error_occurred\": true,\n"
+                        << "      \"error_message\": \"" << JsonEscape(r.errorMessage) << "\"\n    }";
+                    continue;
+                }
+                out << "      \"iterations\": " << r.iterations << ",\n"
+                    << "      \"real_time\": " << JsonNumber(r.realTime) << ",\n"
+                    << "      \"cpu_time\": " << JsonNumber(r.cpuTime) << ",\n"
+                    << "      \"time_unit\": \"ns\"";
+                if (r.bytesPerSecond > 0)
+                    out << ",\n      \"bytes_per_second\": " << JsonNumber(r.bytesPerSecond);
+                if (r.itemsPerSecond > 0)
+                    out << ",\n      \"items_per_second\": " << JsonNumber(r.itemsPerSecond);
+                for (const auto& [counter, value] : r.counters)
+                    out << ",\n      \"" << JsonEscape(counter) << "\": " << JsonNumber(value);
+                if (!r.label.empty())
+                    out << ",\n      \"label\": \"" << JsonEscape(r.label) << "\"";
+                out << "\n    }";
+            }
+            out << "\n  ]\n}\n";
+        }
+
+        std::string executable;
+        std::string filter = ".";
+        std::string format = "console";
+        std::string outPath;
+        std::string outFormat = "json";
+        double minTime = 0.5;
+        int repetitions = 1;
+        bool listOnly = false;
+    };
+
+    // 保证返回值不会被优化掉
+    template <typename T>
+    inline void DoNotOptimize(T const& value)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        asm volatile("" : : "r,m"(value) : "memory");
+#else
+        static volatile const void* sink;
+        sink = &value;
+#endif
+    }
+
+    inline int Main(int argc, char* argv[])
+    {
+        Runner runner;
+        return runner.Main(argc, argv);
+    }
+}
+
+#define CPPLUA_BENCH_CONCAT_IMPL(a, b) a##b
+#define CPPLUA_BENCH_CONCAT(a, b) CPPLUA_BENCH_CONCAT_IMPL(a, b)
+
+// 注册基准测试：BENCHMARK(函数名)->Arg(...)
+#define BENCHMARK(func) \
+    static ::Bench::Benchmark* CPPLUA_BENCH_CONCAT(benchRegistration_, __LINE__) = ::Bench::Register(#func, func)
+
+#define BENCHMARK_MAIN() \
+    int main(int argc, char* argv[]) { return ::Bench::Main(argc, argv); }
@@ -0,0 +1,24 @@
+// 词法分析吞吐量（MB/s）
+#include "BenchSupport.h"
+#include "LuaLex.h"
+
+#include <sstream>
+
+static void LexTokens(Bench::State& state)
+{
+    const std::string source = Bench::GenerateLexSource(static_cast<size_t>(state.range(0)));
+    int64_t tokens = 0;
+    Engine::Heap heap;
+    for (auto _ : state)
+    {
+        std::istringstream input(source);
+        Engine::Lex lexer(input, heap);
+        while (lexer.NextToken().token != Engine::TokenType::Eof)
+            ++tokens;
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(source.size() * state.iterations()));
+    state.SetItemsProcessed(tokens);
+}
+BENCHMARK(LexTokens)->Arg(64 << 10)->Arg(1 << 20);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,62 @@
+// 输出路径：数字格式化与 print 的缓冲输出
+#include "BenchSupport.h"
+#include "LuaVM.h"
+
+#include <cstdio>
+#include <fstream>
+
+static const double samples[] = { 42, 3.14, -0.001, 1e100, 123456789.125, 2.5e-8, 7, 65536 };
+
+static void FormatNumber(Bench::State& state)
+{
+    char buffer[Engine::NumberBufferSize];
+    size_t bytes = 0;
+    for (auto _ : state)
+    {
+        for (double value : samples)
+            bytes += Engine::FormatNumber(value, buffer);
+        Bench::DoNotOptimize(buffer);
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(bytes));
+    state.SetItemsProcessed(static_cast<int64_t>(std::size(samples) * state.iterations()));
+}
+BENCHMARK(FormatNumber);
+
+// 对照：snprintf("%.14g")
+static void FormatNumberSnprintf(Bench::State& state)
+{
+    char buffer[Engine::NumberBufferSize];
+    for (auto _ : state)
+    {
+        for (double value : samples)
+            std::snprintf(buffer, sizeof(buffer), "%.14g", value);
+        Bench::DoNotOptimize(buffer);
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(std::size(samples) * state.iterations()));
+}
+BENCHMARK(FormatNumberSnprintf);
+
+static std::string PrintScript(size_t lines)
+{
+    std::string source;
+    for (size_t i = 0; i < lines; ++i)
+        source += i % 2 ? "print(3.14159)\n" : "print(\"log line\")\n";
+    return source;
+}
+
+// print 写入 /dev/null 文件，参数为缓冲区大小（0 表示逐次写出）
+static void PrintToFile(Bench::State& state)
+{
+    std::ofstream devnull("/dev/null");
+    Engine::StreamSink sink(devnull);
+    Engine::VM vm;
+    vm.SetOutput(sink);
+    vm.SetOutputBuffering(static_cast<size_t>(state.range(0)));
+    vm.LoadBuffer(PrintScript(1000), "print");
+    for (auto _ : state)
+        vm.Execute();
+    state.SetItemsProcessed(static_cast<int64_t>(1000 * state.iterations()));
+}
+BENCHMARK(PrintToFile)->Arg(0)->Arg(Engine::OutputBuffer::DefaultCapacity);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,50 @@
+// 语法分析吞吐量（语句/秒），以及大型函数库立即编译与延迟编译的加载时间
+#include "BenchSupport.h"
+#include "LuaParser.h"
+#include "LuaVM.h"
+
+#include <sstream>
+
+static void ParseStatements(Bench::State& state)
+{
+    const size_t statements = static_cast<size_t>(state.range(0));
+    const std::string source = Bench::GenerateParserSource(statements);
+    Engine::Heap heap;
+    // 与 VM 相同，每次编译都覆盖同一个主函数原型
+    Engine::Proto* target = heap.NewProto();
+    for (auto _ : state)
+    {
+        std::istringstream input(source);
+        Engine::Parser parser(input, heap, "bench", target);
+        Bench::DoNotOptimize(parser.Parse()->code.size());
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(source.size() * state.iterations()));
+    state.SetItemsProcessed(static_cast<int64_t>(statements * state.iterations()));
+}
+BENCHMARK(ParseStatements)->Arg(1000)->Arg(10000);
+
+// 参数：库中的函数个数、是否延迟编译、库的种类（0 为较大的函数，1 为小函数）。每次迭代加载整个库并调用其中 5 个函数。
+// 小函数的库中只有 local 函数及调用它的函数立即编译，全局函数、方法与匿名函数都延迟编译
+static void LoadLibrary(Bench::State& state)
+{
+    const size_t functions = static_cast<size_t>(state.range(0));
+    const std::string source = state.range(2) == 0 ? Bench::GenerateLibrarySource(functions, 5)
+                                                   : Bench::GenerateSmallFunctionLibrary(functions, 5);
+    Engine::VM vm;
+    Engine::CompileOptions options;
+    options.lazyCompilation = state.range(1) != 0;
+    vm.SetCompileOptions(options);
+    for (auto _ : state)
+    {
+        vm.LoadBuffer(source, "library");
+        vm.Execute();
+    }
+    const Engine::LazyStats stats = vm.GetLazyStats();
+    state.counters.emplace_back("functions", static_cast<double>(stats.functions));
+    state.counters.emplace_back("never_compiled", static_cast<double>(stats.NeverCompiled()));
+    state.SetBytesProcessed(static_cast<int64_t>(source.size() * state.iterations()));
+}
+BENCHMARK(LoadLibrary)->Args({ 500, 0, 0 })->Args({ 500, 1, 0 })->Args({ 5000, 0, 0 })->Args({ 5000, 1, 0 })
+    ->Args({ 5000, 0, 1 })->Args({ 5000, 1, 1 });
+
+BENCHMARK_MAIN();
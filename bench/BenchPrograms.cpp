@@ -0,0 +1,197 @@
+// 经典整程序基准：fib、nbody、spectral-norm、字符串拼接、排序、元表方法调用；
+// Passes/<程序>/<配置> 分别开启各个优化遍，对比执行时间与生成的指令数、寄存器数；
+// Passes/metamethods/<配置> 检查各优化遍在元方法有副作用时结果不变；
+// Quickening/<程序>/<off|on> 对比指令特化关闭与开启时的执行时间。
+// 脚本位于 bench/scripts，均为标准 Lua，可用官方解释器对照结果；
+// 引擎尚不支持的语法会以 error_occurred 记录在结果中，而不会中断其余测试。
+#include "BenchSupport.h"
+#include "LuaVM.h"
+
+#include <fstream>
+#include <sstream>
+#include <string_view>
+
+static void RunProgram(Bench::State& state, const std::string& script)
+{
+    const std::string path = Bench::ScriptPath(script);
+    Engine::NullSink discard;
+    for (auto _ : state)
+    {
+        Engine::VM vm(path);
+        vm.SetOutput(discard);
+        vm.Execute();
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+
+// 各优化遍单独开启时的效果，none 为全部关闭的基线
+struct PassConfig
+{
+    const char* name;
+    Engine::CompileOptions options;
+};
+
+static const PassConfig passConfigs[] = {
+    { "none",      { false, false, false, false } },
+    { "constprop", { true, false, false, false } },
+    { "inline",    { false, true, false, false } },
+    { "licm",      { false, false, true, false } },
+    { "regalloc",  { false, false, false, true } },
+    { "all",       {} },
+};
+
+// 函数原型及其嵌套函数的指令总数
+static size_t CountInstructions(const Engine::Proto& proto)
+{
+    size_t count = proto.code.size();
+    for (const Engine::Proto* child : proto.protos)
+        count += CountInstructions(*child);
+    return count;
+}
+
+// 只编译一次，计时部分只包含执行
+static void RunPasses(Bench::State& state, const std::string& script, const Engine::CompileOptions& options)
+{
+    std::ifstream file(Bench::ScriptPath(script));
+    std::stringstream source;
+    source << file.rdbuf();
+
+    Engine::NullSink discard;
+    Engine::VM vm;
+    vm.SetOutput(discard);
+    vm.SetCompileOptions(options);
+    vm.LoadBuffer(source.str(), script);
+    for (auto _ : state)
+        vm.Execute();
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+    state.counters.emplace_back("instructions", static_cast<double>(CountInstructions(vm.Chunk())));
+    state.counters.emplace_back("registers", static_cast<double>(vm.Chunk().maxStack));
+}
+
+// 循环中的读取与元方法：__index 函数每次读取都被调用，__add 修改循环中读取的全局变量，
+// 各优化遍开启时结果须与全部关闭时相同（s = 1 + 2 + 3，t 每轮加上递增后的 g）
+static void RunMetamethodLoops(Bench::State& state, const Engine::CompileOptions& options)
+{
+    const std::string source =
+        "local cnt = 0\n"
+        "local p = setmetatable({}, { __index = function() cnt = cnt + 1 return cnt end })\n"
+        "local s = 0\n"
+        "for i = 1, 3 do s = s + p.q end\n"
+        "g = 10\n"
+        "local o = setmetatable({}, { __add = function(a, b) g = g + 1 return b end })\n"
+        "local t = 0\n"
+        "for i = 1, 3 do t = o + t + g end\n"
+        "ok = s == 6 and t == 36\n";
+    Engine::VM vm;
+    vm.SetCompileOptions(options);
+    vm.LoadBuffer(source, "metamethods");
+    int64_t correct = 0;
+    for (auto _ : state)
+    {
+        vm.Execute();
+        correct += !vm.GetGlobal("ok").IsFalsy();
+    }
+    if (correct != static_cast<int64_t>(state.iterations()))
+        state.SkipWithError("循环中的读取没有反映元方法的副作用");
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+
+// 出错时的调用栈回溯：inner 与 outer 被内联时仍须与全部优化关闭时一样列出各层调用与变量名
+static void RunInlinedError(Bench::State& state, const Engine::CompileOptions& options)
+{
+    const std::string source =
+        "local function inner(x) return x.field end\n"
+        "local function outer() return inner(nil) end\n"
+        "outer()\n";
+    const std::string expected =
+        "errors:1: 尝试索引 nil 值 (局部变量 'x')\n"
+        "stack traceback:\n"
+        "\terrors:1: in upvalue 'inner'\n"
+        "\terrors:2: in local 'outer'\n"
+        "\terrors:3: in main chunk";
+    Engine::VM vm;
+    vm.SetCompileOptions(options);
+    vm.LoadBuffer(source, "errors");
+    int64_t correct = 0;
+    for (auto _ : state)
+    {
+        try
+        {
+            vm.Execute();
+        }
+        catch (const std::exception& e)
+        {
+            correct += std::string_view(e.what()).ends_with(expected);
+        }
+    }
+    if (correct != static_cast<int64_t>(state.iterations()))
+        state.SkipWithError("内联后的错误信息缺少被内联的调用层或变量名");
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+
+// 指令特化的效果：关闭与开启对比执行时间，开启时同时报告特化指令的命中率
+static void RunQuickening(Bench::State& state, const std::string& script, bool quickening)
+{
+    std::ifstream file(Bench::ScriptPath(script));
+    std::stringstream source;
+    source << file.rdbuf();
+
+    Engine::NullSink discard;
+    Engine::VM vm;
+    vm.SetOutput(discard);
+    vm.SetQuickening(quickening);
+    vm.LoadBuffer(source.str(), script);
+    for (auto _ : state)
+        vm.Execute();
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+
+    const Engine::QuickeningStats& stats = vm.GetQuickeningStats();
+    uint64_t hits = 0, misses = 0, specialized = 0;
+    for (size_t i = 0; i < Engine::OpCodeCount; ++i)
+    {
+        hits += stats.hits[i];
+        misses += stats.misses[i];
+        specialized += stats.specialized[i];
+    }
+    state.counters.emplace_back("specialized", static_cast<double>(specialized));
+    state.counters.emplace_back("hit_rate", hits + misses == 0 ? 0.0 : static_cast<double>(hits) / static_cast<double>(hits + misses));
+}
+
+static const bool programsRegistered = [] {
+    for (const char* name : { "fib", "nbody", "spectral_norm", "string_build", "sort", "oop", "branches", "multireturn" })
+    {
+        Bench::Register(std::string("Program/") + name, [name](Bench::State& state) {
+            RunProgram(state, std::string(name) + ".lua");
+        });
+    }
+    for (const char* name : { "nbody", "spectral_norm", "invariant", "fib", "branches", "multireturn" })
+    {
+        for (const PassConfig& config : passConfigs)
+        {
+            Bench::Register(std::string("Passes/") + name + "/" + config.name, [name, &config](Bench::State& state) {
+                RunPasses(state, std::string(name) + ".lua", config.options);
+            });
+        }
+    }
+    for (const PassConfig& config : passConfigs)
+    {
+        Bench::Register(std::string("Passes/metamethods/") + config.name, [&config](Bench::State& state) {
+            RunMetamethodLoops(state, config.options);
+        });
+        Bench::Register(std::string("Passes/errors/") + config.name, [&config](Bench::State& state) {
+            RunInlinedError(state, config.options);
+        });
+    }
+    for (const char* name : { "nbody", "spectral_norm", "invariant", "fib", "oop", "branches", "multireturn" })
+    {
+        for (bool quickening : { false, true })
+        {
+            Bench::Register(std::string("Quickening/") + name + (quickening ? "/on" : "/off"), [name, quickening](Bench::State& state) {
+                RunQuickening(state, std::string(name) + ".lua", quickening);
+            });
+        }
+    }
+    return true;
+}();
+
+BENCHMARK_MAIN();
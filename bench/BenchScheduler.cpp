@@ -0,0 +1,68 @@
+// 调度器：大量短脚本在工作线程池上的吞吐量与尾延迟
+#include "BenchSupport.h"
+#include "LuaScheduler.h"
+
+#include <string>
+
+// 典型的短请求脚本：一次小循环加少量字符串与表操作
+static const char* const ShortScript =
+    "local t = {}\n"
+    "for i = 1, 200 do t[i] = i * 2 end\n"
+    "local s = 0\n"
+    "for i = 1, #t do s = s + t[i] end\n"
+    "result = string.rep(\"x\", 8) .. s\n";
+
+// 长脚本：混在短请求中，用来观察不分时间片时的队头阻塞
+static const char* const LongScript =
+    "local s = 0\n"
+    "for i = 1, 200000 do s = s + i % 7 end\n";
+
+static void AddLatencyCounters(Bench::State& state, const Engine::SchedulerStats& stats)
+{
+    state.counters.emplace_back("p50_us", static_cast<double>(stats.p50.count()) / 1000.0);
+    state.counters.emplace_back("p99_us", static_cast<double>(stats.p99.count()) / 1000.0);
+    state.counters.emplace_back("max_us", static_cast<double>(stats.max.count()) / 1000.0);
+    state.counters.emplace_back("steals", static_cast<double>(stats.steals) / static_cast<double>(state.iterations()));
+}
+
+// 参数：工作线程数。每次迭代提交 2000 个短脚本并等待全部完成
+static void SchedulerThroughput(Bench::State& state)
+{
+    constexpr size_t tasks = 2000;
+    Engine::NullSink sink;
+    Engine::Scheduler scheduler(static_cast<size_t>(state.range(0)), 0, [&](Engine::VM& vm) { vm.SetOutput(sink); });
+    // 预热：每个线程先建好自己的 VM
+    for (size_t i = 0; i < scheduler.WorkerCount() * 4; ++i)
+        scheduler.Submit(ShortScript);
+    scheduler.ResetStats();
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < tasks; ++i)
+            scheduler.Submit(ShortScript);
+        scheduler.Wait();
+    }
+    AddLatencyCounters(state, scheduler.Stats());
+    state.SetItemsProcessed(static_cast<int64_t>(tasks * state.iterations()));
+}
+BENCHMARK(SchedulerThroughput)->Arg(1)->Arg(2)->Arg(4)->Arg(8);
+
+// 参数：工作线程数、时间片（检查点数，0 为不分片）。每 100 个短脚本中混入一个长脚本
+static void SchedulerMixed(Bench::State& state)
+{
+    constexpr size_t tasks = 2000;
+    Engine::NullSink sink;
+    Engine::Scheduler scheduler(static_cast<size_t>(state.range(0)), static_cast<uint64_t>(state.range(1)),
+        [&](Engine::VM& vm) { vm.SetOutput(sink); });
+    scheduler.ResetStats();
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < tasks; ++i)
+            scheduler.Submit(i % 100 == 0 ? LongScript : ShortScript);
+        scheduler.Wait();
+    }
+    AddLatencyCounters(state, scheduler.Stats());
+    state.SetItemsProcessed(static_cast<int64_t>(tasks * state.iterations()));
+}
+BENCHMARK(SchedulerMixed)->Args({ 4, 0 })->Args({ 4, 1000 });
+
+BENCHMARK_MAIN();
@@ -0,0 +1,159 @@
+// string 库：向量化的查找与大小写转换对比逐字节的朴素实现，以及脚本中的字符串操作
+#include "BenchSupport.h"
+#include "LuaVM.h"
+
+#include <algorithm>
+#include <cctype>
+
+// 不含 needle 的文本，needle 只出现在末尾，查找需要扫描全文
+static std::string SearchText(size_t bytes, std::string_view needle)
+{
+    std::string text;
+    text.reserve(bytes + needle.size());
+    const char* words[] = { "lorem ", "ipsum ", "dolor ", "sit ", "amet, ", "consectetur ", "adipiscing ", "elit. " };
+    for (size_t i = 0; text.size() < bytes; ++i)
+        text += words[(i * 7) % 8];
+    text += needle;
+    return text;
+}
+
+// 朴素实现：逐个位置逐字节比较
+static size_t NaiveFind(std::string_view text, std::string_view needle)
+{
+    if (needle.size() > text.size())
+        return std::string_view::npos;
+    for (size_t i = 0; i + needle.size() <= text.size(); ++i)
+    {
+        size_t j = 0;
+        while (j < needle.size() && text[i + j] == needle[j])
+            ++j;
+        if (j == needle.size())
+            return i;
+    }
+    return std::string_view::npos;
+}
+
+static void NaiveUpper(std::string_view text, char* out)
+{
+    for (size_t i = 0; i < text.size(); ++i)
+        out[i] = static_cast<char>(std::toupper(static_cast<unsigned char>(text[i])));
+}
+
+static size_t NaiveFindAnyOf(std::string_view text, std::string_view set)
+{
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        if (set.find(text[i]) != std::string_view::npos)
+            return i;
+    }
+    return std::string_view::npos;
+}
+
+static void FindNaive(Bench::State& state)
+{
+    const std::string text = SearchText(static_cast<size_t>(state.range(0)), "needle");
+    for (auto _ : state)
+        Bench::DoNotOptimize(NaiveFind(text, "needle"));
+    state.SetBytesProcessed(static_cast<int64_t>(text.size() * state.iterations()));
+}
+BENCHMARK(FindNaive)->Arg(4 << 10)->Arg(1 << 20);
+
+static void FindVectorized(Bench::State& state)
+{
+    const std::string text = SearchText(static_cast<size_t>(state.range(0)), "needle");
+    for (auto _ : state)
+        Bench::DoNotOptimize(Engine::StringKernels::Find(text, "needle"));
+    state.SetBytesProcessed(static_cast<int64_t>(text.size() * state.iterations()));
+}
+BENCHMARK(FindVectorized)->Arg(4 << 10)->Arg(1 << 20);
+
+// 模式中是否含有特殊字符：string.find 据此选择普通查找还是模式匹配。
+// 文本中去掉了特殊字符 '.'，只有末尾的 '%' 命中
+static std::string PatternText(size_t bytes)
+{
+    std::string text = SearchText(bytes, "%");
+    std::replace(text.begin(), text.end(), '.', ' ');
+    return text;
+}
+
+static void ScanSpecialsNaive(Bench::State& state)
+{
+    const std::string text = PatternText(static_cast<size_t>(state.range(0)));
+    for (auto _ : state)
+        Bench::DoNotOptimize(NaiveFindAnyOf(text, "^$*+?.([%-"));
+    state.SetBytesProcessed(static_cast<int64_t>(text.size() * state.iterations()));
+}
+BENCHMARK(ScanSpecialsNaive)->Arg(4 << 10);
+
+static void ScanSpecialsVectorized(Bench::State& state)
+{
+    const std::string text = PatternText(static_cast<size_t>(state.range(0)));
+    for (auto _ : state)
+        Bench::DoNotOptimize(Engine::StringKernels::FindAnyOf(text, "^$*+?.([%-"));
+    state.SetBytesProcessed(static_cast<int64_t>(text.size() * state.iterations()));
+}
+BENCHMARK(ScanSpecialsVectorized)->Arg(4 << 10);
+
+static void UpperNaive(Bench::State& state)
+{
+    const std::string text = SearchText(static_cast<size_t>(state.range(0)), "");
+    std::string out(text.size(), '\0');
+    for (auto _ : state)
+    {
+        NaiveUpper(text, out.data());
+        Bench::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(text.size() * state.iterations()));
+}
+BENCHMARK(UpperNaive)->Arg(4 << 10)->Arg(1 << 20);
+
+static void UpperVectorized(Bench::State& state)
+{
+    const std::string text = SearchText(static_cast<size_t>(state.range(0)), "");
+    std::string out(text.size(), '\0');
+    for (auto _ : state)
+    {
+        Engine::StringKernels::ToUpper(text, out.data());
+        Bench::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(text.size() * state.iterations()));
+}
+BENCHMARK(UpperVectorized)->Arg(4 << 10)->Arg(1 << 20);
+
+// 脚本层面：每次执行对同一段文本调用一次库函数，计入解释器与字符串对象创建的开销
+static void RunScript(Bench::State& state, const std::string& call)
+{
+    Engine::VM vm;
+    const std::string text = SearchText(static_cast<size_t>(state.range(0)), "needle");
+    vm.DoString("text = \"" + text + "\"", "setup");
+    vm.LoadBuffer("local r = " + call, "bench");
+    for (auto _ : state)
+        vm.Execute();
+    state.SetBytesProcessed(static_cast<int64_t>(text.size() * state.iterations()));
+}
+
+static void ScriptFind(Bench::State& state)
+{
+    RunScript(state, "string.find(text, \"needle\")");
+}
+BENCHMARK(ScriptFind)->Arg(64 << 10);
+
+static void ScriptUpper(Bench::State& state)
+{
+    RunScript(state, "text:upper()");
+}
+BENCHMARK(ScriptUpper)->Arg(64 << 10);
+
+static void ScriptMatch(Bench::State& state)
+{
+    RunScript(state, "string.match(text, \"(n%a+)$\")");
+}
+BENCHMARK(ScriptMatch)->Arg(64 << 10);
+
+static void ScriptGsub(Bench::State& state)
+{
+    RunScript(state, "string.gsub(text, \"%a+\", \"<%0>\")");
+}
+BENCHMARK(ScriptGsub)->Arg(64 << 10);
+
+BENCHMARK_MAIN();
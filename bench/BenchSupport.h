@@ -0,0 +1,137 @@
+﻿#pragma once
+
+// 各基准测试共用的辅助工具：脚本路径与生成测试源码
+
+#include "Bench.h"
+
+#include <string>
+
+#ifndef CPPLUA_BENCH_SCRIPTS
+#define CPPLUA_BENCH_SCRIPTS "bench/scripts"
+#endif
+
+namespace Bench
+{
+    // bench/scripts 下的脚本路径
+    inline std::string ScriptPath(const std::string& name)
+    {
+        return std::string(CPPLUA_BENCH_SCRIPTS) + "/" + name;
+    }
+
+    // 生成覆盖各类 token 的词法测试源码，大小约为 targetBytes
+    inline std::string GenerateLexSource(size_t targetBytes)
+    {
+        static const char* lines[] = {
+            "local alpha_value = 12345 + beta * 3.25e2 // 7 % 4\n",
+            "print(\"hello, world\\n\", name_with_underscore, 0.5)\n",
+            "if a == b and c ~= d or not e then x = x .. \"tail\" end\n",
+            "for i = 1, 100 do t[i] = i ^ 2 >= 10 and i << 1 | i >> 2 & 3 end\n",
+            "local function f(...) return #arg, { key = value; [1] = true } end\n",
+            "while false do repeat goto skip until nil end ::skip::\n",
+            "local doc = [[raw \\n \"text\"]] .. [==[with ]] inside]==] --[[ long comment ]] t[ [[k]] ] = 1\n",
+        };
+
+        std::string source;
+        source.reserve(targetBytes + 128);
+        size_t i = 0;
+        while (source.size() < targetBytes)
+        {
+            source += lines[i % std::size(lines)];
+            ++i;
+        }
+        return source;
+    }
+
+    // 生成当前解析器支持的语句（函数调用、local 声明、赋值），共 statements 条
+    inline std::string GenerateParserSource(size_t statements)
+    {
+        std::string source;
+        source.reserve(statements * 24);
+        for (size_t i = 0; i < statements; ++i)
+        {
+            switch (i % 4)
+            {
+            case 0: source += "print(\"statement\")\n"; break;
+            case 1: source += "local v" + std::to_string(i % 97) + " = " + std::to_string(i) + "\n"; break;
+            case 2: source += "g" + std::to_string(i % 89) + " = 3.5\n"; break;
+            case 3: source += "print(true);\n"; break;
+            }
+        }
+        return source;
+    }
+
+    // 生成大型函数库：functions 个全局函数（循环、分支、表与字符串操作，部分函数内定义闭包），
+    // 最后一行调用其中的 calls 个。用于比较立即编译与延迟编译的加载时间
+    inline std::string GenerateLibrarySource(size_t functions, size_t calls)
+    {
+        std::string source = "local lib = {}\nlocal scale = 3\nlocal cache = {}\n";
+        source.reserve(functions * 320);
+        for (size_t i = 0; i < functions; ++i)
+        {
+            const std::string name = "lib.f" + std::to_string(i);
+            source += "function " + name + "(n, t)\n";
+            source += "    local sum, count = 0, 0\n";
+            source += "    for i = 1, n do\n";
+            source += "        if i % " + std::to_string(i % 5 + 2) + " == 0 and t ~= nil then\n";
+            source += "            sum = sum + (t[i] or i) * scale\n";
+            source += "        elseif i > " + std::to_string(i % 7 + 10) + " then\n";
+            source += "            count = count + 1\n";
+            source += "        else\n";
+            source += "            cache[i] = tostring(i) .. \"_" + std::to_string(i) + "\"\n";
+            source += "        end\n";
+            source += "    end\n";
+            if (i % 4 == 0)
+                source += "    local function step(x) local y = x * 2 while y > 100 do y = y // 2 end return y + count end\n"
+                          "    sum = sum + step(sum)\n";
+            source += "    return sum + count\n";
+            source += "end\n";
+        }
+        source += "local total = 0\n";
+        for (size_t i = 0; i < calls; ++i)
+            source += "total = total + lib.f" + std::to_string(i * functions / calls) + "(20, cache)\n";
+        source += "return total\n";
+        return source;
+    }
+
+    // 小函数组成的库：字段访问器、方法、存入表中的匿名函数与全局函数，都小到可以内联，但只有 local 函数会被内联。
+    // 每 10 个函数中有一个 local 函数，以及一个调用它的匿名函数；加载后调用 calls 个匿名函数
+    inline std::string GenerateSmallFunctionLibrary(size_t functions, size_t calls)
+    {
+        std::string source = "local lib = {}\nlocal Point = { x = 1 }\n";
+        source.reserve(functions * 64);
+        for (size_t i = 0; i < functions; ++i)
+        {
+            const std::string n = std::to_string(i);
+            switch (i % 10)
+            {
+            case 0:
+                source += "local function scale" + n + "(x) local y = x * 2 return y + " + n + " end\n";
+                break;
+            case 1:
+                source += "lib.c" + n + " = function(x) return scale" + std::to_string(i - 1) + "(x) + 1 end\n";
+                break;
+            case 2: case 3: case 4:
+                source += "function lib.get" + n + "(t) return t.v" + n + " end\n";
+                break;
+            case 5: case 6:
+                source += "function Point:m" + n + "() return self.x + " + n + " end\n";
+                break;
+            case 7: case 8:
+                source += "lib.h" + n + " = function(a, b) return a * b + " + n + " end\n";
+                break;
+            default:
+                source += "function g" + n + "() return " + n + " end\n";
+                break;
+            }
+        }
+        source += "local total = 0\n";
+        for (size_t i = 0; i < calls; ++i)
+        {
+            const size_t index = i * functions / calls / 10 * 10 + 7;
+            if (index < functions)
+                source += "total = total + lib.h" + std::to_string(index) + "(2, 3)\n";
+        }
+        source += "return total\n";
+        return source;
+    }
+}
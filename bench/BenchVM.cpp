@@ -0,0 +1,346 @@
+// 解释器分派循环与宿主函数调用开销
+#include "BenchSupport.h"
+#include "LuaVM.h"
+
+#include <atomic>
+#include <sstream>
+#include <string_view>
+#include <thread>
+
+static Engine::Value Noop(std::span<const Engine::Value>)
+{
+    return Engine::Value{};
+}
+
+// 由宿主函数调用组成的脚本，每条语句编译为 GetGlobal、LoadK、Call 三条指令
+static std::string CallScript(size_t calls)
+{
+    std::string source;
+    for (size_t i = 0; i < calls; ++i)
+        source += "noop(" + std::to_string(i % 10) + ")\n";
+    return source;
+}
+
+// 只有算术、Move 与比较跳转的循环，不调用宿主函数。每轮循环体 10 条指令：
+// Add、Move、Sub、比较跳转、交换 a 与 b 的 4 条 Move、i 的自增与回到循环开头的比较跳转
+static std::string ArithmeticScript(size_t rounds)
+{
+    return "local a, b, c = 0, 1, 0\n"
+        "local i = 0\n"
+        "while i < " + std::to_string(rounds) + " do\n"
+        "    c = a + b\n"
+        "    a = b\n"
+        "    b = c - a\n"
+        "    if a > b then a, b = b, a end\n"
+        "    i = i + 1\n"
+        "end\n";
+}
+
+static void Dispatch(Bench::State& state)
+{
+    const size_t rounds = static_cast<size_t>(state.range(0));
+    Engine::VM vm;
+    vm.LoadBuffer(ArithmeticScript(rounds), "dispatch");
+    for (auto _ : state)
+        vm.Execute();
+    // 每次执行的指令数：每轮 10 条，外加循环前的 4 条 LoadK、进入循环的比较与末尾的 Return
+    state.SetItemsProcessed(static_cast<int64_t>((rounds * 10 + 6) * state.iterations()));
+}
+BENCHMARK(Dispatch)->Arg(1000);
+
+// 宿主直接通过 Value::Call 调用原生函数
+static void HostCallDirect(Bench::State& state)
+{
+    Engine::Heap heap;
+    Engine::Value func(heap.NewFunction(Noop));
+    Engine::Value args[] = { Engine::Value(1) };
+    for (auto _ : state)
+        Bench::DoNotOptimize(func.Call(args));
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(HostCallDirect);
+
+// 脚本调用宿主注册的原生函数
+static void HostCallFromScript(Bench::State& state)
+{
+    const size_t calls = static_cast<size_t>(state.range(0));
+    Engine::VM vm;
+    vm.Register("noop", Noop);
+    vm.LoadBuffer(CallScript(calls), "hostcall");
+    for (auto _ : state)
+        vm.Execute();
+    state.SetItemsProcessed(static_cast<int64_t>(calls * state.iterations()));
+}
+BENCHMARK(HostCallFromScript)->Arg(1000);
+
+// 脚本经 ffi 直接调用 C 函数（labs），与上面的宿主函数调用对照。
+// 声明按常见写法放在长字符串中，并与不能调用的可变参数函数一起声明
+static void FFICallFromScript(Bench::State& state)
+{
+    const size_t calls = static_cast<size_t>(state.range(0));
+    std::string source =
+        "ffi.cdef[[\n"
+        "    long labs(long x);\n"
+        "    int snprintf(char* s, size_t n, const char* format, ...);\n"
+        "]]\n"
+        "local labs = ffi.C.labs\n";
+    for (size_t i = 0; i < calls; ++i)
+        source += "labs(-" + std::to_string(i % 10) + ")\n";
+    Engine::VM vm;
+    vm.OpenFFI();
+    vm.LoadBuffer(source, "fficall");
+    for (auto _ : state)
+        vm.Execute();
+    state.SetItemsProcessed(static_cast<int64_t>(calls * state.iterations()));
+}
+BENCHMARK(FFICallFromScript)->Arg(1000);
+
+// 请求处理模型：同一个 VM 上 Reset 后用 DoString 执行一段内存中的短脚本。
+// 脚本不定义函数、不创建表，预热后每个请求的分配次数（allocs/request）应为 0；
+// 定义函数或创建表的脚本每次仍会分配原型、闭包与表
+static void DoStringRequest(Bench::State& state)
+{
+    const std::string source = "noop(\"request\")\nlocal status = 200\nnoop(status)\nnoop(true)\n";
+    Engine::VM vm;
+    vm.Register("noop", Noop);
+    vm.DoString(source, "request");
+    const size_t allocations = vm.MemoryUsage().allocations;
+    for (auto _ : state)
+    {
+        vm.Reset();
+        vm.DoString(source, "request");
+    }
+    state.counters.emplace_back("allocs/request",
+        static_cast<double>(vm.MemoryUsage().allocations - allocations) / static_cast<double>(state.iterations()));
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(DoStringRequest);
+
+// 请求隔离：一个请求修改库表与字符串元表，Reset 后下一个请求看到的须是原样的库
+static void ResetIsolation(Bench::State& state)
+{
+    const std::string poison =
+        "string.upper = function() return 'pwned' end\n"
+        "table.secret = 42\n"
+        "getmetatable('').__index = { len = function() return -1 end }\n"
+        "setmetatable(table, { __index = function() return 1 end })\n";
+    const std::string check =
+        "ok = string.upper('a') == 'A' and table.secret == nil and ('abc'):len() == 3 and\n"
+        "    getmetatable(table) == nil and rawequal(getmetatable('').__index, string)\n";
+    Engine::VM vm;
+    int64_t restored = 0;
+    for (auto _ : state)
+    {
+        vm.Reset();
+        vm.DoString(poison, "poison");
+        vm.Reset();
+        vm.DoString(check, "check");
+        restored += !vm.GetGlobal("ok").IsFalsy();
+    }
+    if (restored != static_cast<int64_t>(state.iterations()))
+        state.SkipWithError("Reset 之后库表仍保留上一个请求的修改");
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(ResetIsolation);
+
+// 对照：每个请求都新建 VM
+static void NewVMRequest(Bench::State& state)
+{
+    const std::string source = "noop(\"request\")\nlocal status = 200\nnoop(status)\nnoop(true)\n";
+    for (auto _ : state)
+    {
+        Engine::VM vm;
+        vm.Register("noop", Noop);
+        vm.DoString(source, "request");
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(NewVMRequest);
+
+// 流式执行：逐批解析并执行，参数为每批语句数
+static void ExecuteStream(Bench::State& state)
+{
+    const std::string source = CallScript(10000);
+    Engine::VM vm;
+    vm.Register("noop", Noop);
+    for (auto _ : state)
+    {
+        std::istringstream input(source);
+        vm.ExecuteStream(input, "bench", static_cast<size_t>(state.range(0)));
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(10000 * state.iterations()));
+}
+BENCHMARK(ExecuteStream)->Arg(1)->Arg(64);
+
+// 启动时的初始化脚本：构建较大的全局表与若干函数
+static const char* const InitScript =
+    "config = {}\n"
+    "for i = 1, 20000 do config[\"key\" .. i] = i * 3 end\n"
+    "names = {}\n"
+    "for i = 1, 20000 do names[i] = string.rep(\"n\", 4) .. i end\n"
+    "local hits = 0\n"
+    "function lookup(k) hits = hits + 1 return config[k] end\n"
+    "function count() return hits end\n";
+
+// 冷启动：新建 VM 并执行初始化脚本
+static void WarmStartInit(Bench::State& state)
+{
+    for (auto _ : state)
+    {
+        Engine::VM vm;
+        vm.Register("noop", Noop);
+        vm.DoString(InitScript, "init");
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(WarmStartInit);
+
+// 热启动：新建 VM 并加载初始化后保存的快照
+static void WarmStartSnapshot(Bench::State& state)
+{
+    std::ostringstream image;
+    {
+        Engine::VM vm;
+        vm.Register("noop", Noop);
+        vm.DoString(InitScript, "init");
+        vm.SaveSnapshot(image);
+    }
+    const std::string bytes = image.str();
+    for (auto _ : state)
+    {
+        Engine::VM vm;
+        vm.Register("noop", Noop);
+        vm.LoadSnapshot(bytes);
+    }
+    state.counters.emplace_back("image_bytes", static_cast<double>(bytes.size()));
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(WarmStartSnapshot);
+
+// 执行预算的开销：0 为不设预算，1 为足够大的预算（超出时报错），2 为每 1000 个检查点让出一次再 Resume
+static const char* const LoopScript =
+    "local sum = 0\n"
+    "local function add(a, b) return a + b end\n"
+    "for i = 1, 100000 do sum = add(sum, i) end\n";
+
+static void Budget(Bench::State& state)
+{
+    const int64_t mode = state.range(0);
+    Engine::VM vm;
+    vm.LoadBuffer(LoopScript, "budget");
+    if (mode == 1)
+        vm.SetBudget(UINT64_MAX / 2);
+    else if (mode == 2)
+        vm.SetBudget(1000, Engine::BudgetAction::Yield);
+    int64_t slices = 0;
+    for (auto _ : state)
+    {
+        for (auto status = vm.Execute(); status == Engine::ExecuteStatus::Yielded; status = vm.Resume())
+            ++slices;
+    }
+    state.counters.emplace_back("slices_per_run", static_cast<double>(slices) / static_cast<double>(state.iterations()));
+    state.SetItemsProcessed(static_cast<int64_t>(100000 * state.iterations()));
+}
+BENCHMARK(Budget)->Arg(0)->Arg(1)->Arg(2);
+
+// 失控的空循环：循环体为空时只剩一条跳回自身的跳转，同样必须在检查点停下。
+// 0 为预算耗尽时报错（错误信息须指出循环所在的第 1 行），1 为预算耗尽时挂起，2 为其他线程调用 Interrupt；
+// 每次迭代测量从开始执行到停下的时间
+static const char* const EmptyLoopScripts[] = {
+    "while true do end\n",
+    "while 1 do end\n",
+    "local x = 0 while x do end\n",
+    "repeat until false\n",
+    "::a:: goto a\n",
+    "local i = #{} while i < 1 do end\n",
+    "local a = #{} repeat until a > 1\n",
+};
+
+static void EmptyLoop(Bench::State& state)
+{
+    const int64_t mode = state.range(0);
+    Engine::VM vm;
+    if (mode == 0)
+        vm.SetBudget(100000);
+    else
+        vm.SetBudget(mode == 1 ? 100000 : 0, Engine::BudgetAction::Yield);
+    std::atomic<bool> done{ false };
+    std::thread interrupter;
+    if (mode == 2)
+    {
+        interrupter = std::thread([&] {
+            while (!done.load(std::memory_order_relaxed))
+            {
+                vm.Interrupt();
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        });
+    }
+    size_t round = 0;
+    int64_t stopped = 0;
+    for (auto _ : state)
+    {
+        vm.Reset();
+        vm.LoadBuffer(EmptyLoopScripts[round++ % std::size(EmptyLoopScripts)], "loop");
+        try
+        {
+            stopped += vm.Execute() == Engine::ExecuteStatus::Yielded;
+        }
+        catch (const std::exception& e)
+        {
+            stopped += std::string_view(e.what()).find("loop:1:") != std::string_view::npos;
+        }
+    }
+    done.store(true, std::memory_order_relaxed);
+    if (interrupter.joinable())
+        interrupter.join();
+    if (stopped != static_cast<int64_t>(state.iterations()))
+        state.SkipWithError("空循环没有在检查点停下，或错误信息中的行号不对");
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(EmptyLoop)->Arg(0)->Arg(1)->Arg(2);
+
+// 热重载：200 个函数的脚本中改动第一个函数，改动同时增加一行，其后的函数都下移一行
+static std::string ModuleScript(size_t functions, int variant)
+{
+    std::string source = "state = { hits = 0 }\n";
+    for (size_t i = 0; i < functions; ++i)
+    {
+        std::string body = "state.hits = state.hits + 1 local s = 0 for k = 1, x do s = s + k * " +
+            std::to_string(i == 0 ? variant + 2 : 2) + (i == 0 && variant != 0 ? "\n" : "") + " end return s";
+        source += "function handler" + std::to_string(i) + "(x) " + body + " end\n";
+    }
+    return source;
+}
+
+// 现有做法：新建 VM 重新执行整个脚本（运行时状态全部丢失）
+static void ReloadNewVM(Bench::State& state)
+{
+    const std::string sources[] = { ModuleScript(200, 0), ModuleScript(200, 1) };
+    size_t round = 0;
+    for (auto _ : state)
+    {
+        Engine::VM vm;
+        vm.DoString(sources[round++ & 1], "module");
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(ReloadNewVM);
+
+// VM::Reload：只重新编译并替换改动的函数，源码未变的函数体只做预扫描，全局变量与表保持不变
+static void ReloadIncremental(Bench::State& state)
+{
+    const std::string sources[] = { ModuleScript(200, 0), ModuleScript(200, 1) };
+    Engine::VM vm;
+    vm.DoString(sources[0], "module");
+    size_t round = 1;
+    Engine::ReloadResult result;
+    for (auto _ : state)
+        result = vm.Reload(sources[round++ & 1], "module");
+    state.counters.emplace_back("changed", static_cast<double>(result.changed));
+    state.counters.emplace_back("unchanged", static_cast<double>(result.unchanged));
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(ReloadIncremental);
+
+BENCHMARK_MAIN();
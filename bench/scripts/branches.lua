@@ -0,0 +1,30 @@
+-- 分支密集的循环：if/elseif、and/or、repeat 与 break
+local limit = 1000000
+local small, middle, large = 0, 0, 0
+
+for i = 1, limit do
+    local x = i % 100
+    if x < 10 then
+        small = small + 1
+    elseif x >= 10 and x < 90 then
+        middle = middle + 1
+    else
+        large = large + (x > 95 and 2 or 1)
+    end
+end
+
+local n, steps = 27, 0
+repeat
+    if n % 2 == 0 then n = n // 2 else n = 3 * n + 1 end
+    steps = steps + 1
+until n == 1
+
+local found = 0
+for i = 1, limit do
+    if i * i > limit then
+        found = i
+        break
+    end
+end
+
+print(small, middle, large, steps, found)
@@ -0,0 +1,9 @@
+-- 递归斐波那契：函数调用与整数运算
+local function fib(n)
+    if n < 2 then
+        return n
+    end
+    return fib(n - 1) + fib(n - 2)
+end
+
+print(fib(24))
@@ -0,0 +1,10 @@
+-- 循环不变量：循环体内反复读取全局表的字段
+config = { scale = 3, offset = 1 }
+limit = 1000000
+
+local sum = 0
+for i = 1, limit do
+    sum = sum + i * config.scale + config.offset
+end
+
+print(sum)
@@ -0,0 +1,39 @@
+-- 多返回值与可变参数密集的调用：多值返回、转发、select、table.unpack 与 string.find
+local function divmod(a, b)
+    return a // b, a % b
+end
+
+local function minmax(...)
+    local lo, hi = ..., ...
+    for i = 2, select('#', ...) do
+        local v = select(i, ...)
+        if v < lo then lo = v end
+        if v > hi then hi = v end
+    end
+    return lo, hi
+end
+
+local function forward(...)
+    return ...
+end
+
+local limit = 200000
+local quotients, remainders, spread, packed, found = 0, 0, 0, 0, 0
+local values = { 7, 3, 9, 1, 5 }
+
+for i = 1, limit do
+    local q, r = forward(divmod(i, 7))
+    quotients = quotients + q
+    remainders = remainders + r
+
+    local lo, hi = minmax(i % 13, i % 7, i % 5, 3)
+    spread = spread + (hi - lo)
+
+    local t = { forward(table.unpack(values)) }
+    packed = packed + #t
+
+    local s, e = string.find("multiple results", "res", 1, true)
+    found = found + e - s
+end
+
+print(quotients, remainders, spread, packed, found)
@@ -0,0 +1,32 @@
+-- 元表：三层 __index 继承链上的方法调用、__add 运算符与 __len
+local Base = {}
+Base.__index = Base
+function Base:value() return self.v end
+
+local Mid = setmetatable({}, { __index = Base })
+Mid.__index = Mid
+function Mid:add(n) self.v = self.v + n end
+
+local Leaf = setmetatable({}, { __index = Mid })
+Leaf.__index = Leaf
+function Leaf:inc() self:add(1) end
+
+local Vec = {}
+Vec.__index = Vec
+Vec.__add = function(a, b) return setmetatable({ x = a.x + b.x, y = a.y + b.y }, Vec) end
+Vec.__len = function(v) return v.x * v.x + v.y * v.y end
+
+local o = setmetatable({ v = 0 }, Leaf)
+local s = 0
+for i = 1, 500000 do
+    o:inc()
+    s = s + o:value()
+end
+
+local acc = setmetatable({ x = 0, y = 0 }, Vec)
+local step = setmetatable({ x = 1, y = 2 }, Vec)
+for i = 1, 100000 do
+    acc = acc + step
+end
+
+print(s, #acc)
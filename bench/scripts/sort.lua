@@ -0,0 +1,34 @@
+-- table 库：数字与字符串的快速路径排序、带比较函数的排序，以及 insert / remove / concat
+local N = 20000
+
+local seed = 42
+local function random(n)
+    seed = (seed * 1103515245 + 12345) % 2147483648
+    return seed % n
+end
+
+local numbers = {}
+local words = {}
+for i = 1, N do
+    numbers[i] = random(1000000)
+    words[i] = "w" .. random(1000000)
+end
+table.sort(numbers)
+table.sort(words)
+
+local records = {}
+for i = 1, N do
+    records[i] = { key = random(1000000), index = i }
+end
+table.sort(records, function(a, b) return a.key < b.key end)
+
+local queue = {}
+for i = 1, 1000 do
+    table.insert(queue, 1, i)
+end
+local removed = 0
+for i = 1, 500 do
+    removed = removed + table.remove(queue, 1)
+end
+
+print(numbers[1], numbers[N], words[1], records[1].key, records[N].key, removed, #table.concat(queue, ","))
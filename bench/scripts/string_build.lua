@@ -0,0 +1,15 @@
+-- 字符串拼接：逐次 .. 拼接与 table.concat 一次性拼接
+local N = 20000
+
+local s = ""
+for i = 1, 2000 do
+    s = s .. "x"
+end
+
+local parts = {}
+for i = 1, N do
+    parts[#parts + 1] = "item" .. i
+end
+local joined = table.concat(parts, ",")
+
+print(#s, #joined)